@@ -17,7 +17,6 @@
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
 #include <jansson.h>
-#include <jpeglib.h>
 #include <math.h>
 #include <mcheck.h>
 #include <netdb.h>
@@ -36,6 +35,7 @@
 #include <string.h>
 #include <syslog.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -59,9 +59,6 @@
 //! TCP Port of the aforementioned redis server
 #define REMOTE_SERVER_REDIS_PORT 6379
 
-//! The redis store needs some debugging:  Ignore it for now.
-#define IS_IGNORE_REDIS_STORE
-
 //! Save our pid so we can autokill stuff later.
 #define PID_FILE_NAME "/var/run/is.pid"
 #define PID_DEV_FILE_NAME "/var/run/is-dev.pid"
@@ -69,17 +66,137 @@
 //! Prefix procedure names with the file name and a space for debug output.
 #define FILEID __FILE__ " "
 
-//! Keep about this many images in memory.
-#define N_IMAGE_BUFFERS 4096
+//! The image buffer cache is split into this many independently locked shards.
+#define IS_CACHE_SHARDS 16
+
+//! Initial number of hash buckets in each cache shard (a power of 2).  Shards grow as needed.
+#define IS_CACHE_INITIAL_BUCKETS 64
+
+//! Most threads that may be looking in the image buffer cache of one process at once (see isEpochEnter in isData.c).
+#define IS_EPOCH_SLOTS 256
+
+//! Default memory budget in bytes for raw (full frame) image buffers.
+//! Override with the environment variable IS_RAW_CACHE_BYTES.
+#define IS_RAW_CACHE_BYTES (8LL * 1024 * 1024 * 1024)
+
+//! Default memory budget in bytes for reduced image buffers.
+//! Override with the environment variable IS_REDUCED_CACHE_BYTES.
+#define IS_REDUCED_CACHE_BYTES (2LL * 1024 * 1024 * 1024)
+
+//! Default memory budget in bytes for the buffers shared (via /dev/shm) by all the supervisors of an ESAF.
+//! Override with the environment variable IS_SHM_CACHE_BYTES.
+#define IS_SHM_CACHE_BYTES (4LL * 1024 * 1024 * 1024)
+
+//! Number of buffers the shared cache index can describe.
+#define IS_SHM_SLOTS 4096
+
+//! Longest image buffer key that can go in the shared cache.
+#define IS_SHM_KEY_LENGTH 512
+
+//! A shared buffer not used for this many seconds may be evicted even if a (presumably dead) process still claims it.
+#define IS_SHM_STALE_SECONDS 600
 
 //! Each user/esaf combination gets this many threads.
 #define N_WORKER_THREADS 16
 
+//! Highest level of the max pooled image pyramid (level n is 2^n times smaller than the raw image).
+#define IS_PYRAMID_LEVELS 8
+
+//! Width and height of the tiles returned by "tile" jobs.
+#define IS_TILE_SIZE 256
+
+//! Default width of the thumbnails of "filmstrip" jobs.
+#define IS_FILMSTRIP_THUMB 128
+
+//! Widest thumbnail a "filmstrip" job may ask for.
+#define IS_FILMSTRIP_MAX_THUMB 1024
+
+//! Most frames a single "filmstrip" job may ask for.
+#define IS_FILMSTRIP_MAX_FRAMES 1000
+
+//! Most pixels in the montage of a single "filmstrip" job.
+#define IS_FILMSTRIP_MAX_PIXELS (64*1024*1024)
+
+//! Most jobs a single "batch" job may carry.
+#define IS_BATCH_MAX_JOBS 64
+
+//! Most threads in a supervisor's compute pool (see isPool.c).
+#define IS_POOL_MAX_THREADS 16
+
+//! Number of threads per supervisor for work that waits on files and redis, such as the jobs of a batch (see isPoolRunIO).
+#define IS_IO_POOL_THREADS 8
+
+//! Number of reduction geometries (beam center, window, output size) to keep bin tables for.
+#define IS_GEOMETRY_CACHE_ENTRIES 16
+
+//! Number of tile geometries (see isTile.c) to keep bin tables for: a screen full of tiles and then some.
+#define IS_TILE_GEOMETRY_CACHE_ENTRIES 64
+
+//! Number of decoded bad pixel masks (one per data set) to keep around.
+#define IS_MASK_CACHE_ENTRIES 8
+
+//! Number of HDF5 master files (with their data files) to keep open.
+#define IS_H5_FILE_CACHE_ENTRIES 8
+
+//! Reductions are split into bands of at least this many output rows to run on the compute pool.
+#define IS_REDUCE_BAND_ROWS 32
+
+//! Streamed reductions (see isOpenRawRows) hold about this many bytes of raw rows at a time.
+#define IS_STREAM_BLOCK_BYTES (1024*1024)
+
+//! Number of low priority threads reducing frames we expect to be asked for.
+#define IS_PREFETCH_THREADS 2
+
+//! Reduce this many frames ahead of a user stepping through a data set.
+#define IS_PREFETCH_DEPTH 4
+
+//! Number of consecutive single frame steps before we start prefetching.
+#define IS_PREFETCH_MIN_STEPS 1
+
+//! Number of files per supervisor whose browsing we keep track of.
+#define IS_PREFETCH_TRACKERS 8
+
+//! Never let the prefetch queue get longer than this.
+#define IS_PREFETCH_MAX_QUEUED 64
+
+//! Nice value for the prefetch threads.
+#define IS_PREFETCH_NICE 10
+
+//! While interactive jobs are running the prefetch threads check back this often (microseconds).
+#define IS_PREFETCH_IDLE_US 5000
+
 //! Keep images in redis for this long.
 #define IS_REDIS_TTL 300
 
-//! There is some overhead for jpegs, this should allow enough overhead for output buffer allocation purposes.
-#define MIN_JPEG_BUFFER 2048
+//! Number of fields in the redis hash holding a reduced image (see isRedisEncode).
+#define IS_REDIS_N_FIELDS 6
+
+//! Whoever is reducing an image for redis gives up their claim after this many milliseconds (in case they died).
+#define IS_REDIS_LEASE_MS 10000
+
+//! Check back with redis at least this often (seconds) while waiting for someone else's image.
+#define IS_REDIS_WAIT_SECONDS 1
+
+//! Stop waiting for someone else's image after this many seconds and reduce it ourselves.
+#define IS_REDIS_MAX_WAIT_SECONDS 15
+
+//! Default jpeg quality (the "quality" job parameter, 1 to 100).
+#define IS_JPEG_QUALITY 90
+
+//! Widest (and tallest) image a jpeg can hold.
+#define IS_JPEG_MAX_SIDE 65535
+
+//! Memory (bytes) in idle scratch and output buffers to keep around for the next image (see isBufPool.c).
+#define IS_BUF_POOL_BYTES (256*1024*1024)
+
+//! Jpegs with at least this many pixels are compressed in strips using the compute pool.
+#define IS_JPEG_STRIP_PIXELS (1024*1024)
+
+//! Pixels are mapped to gray through a lookup table only when there are at least this many per table entry (see isJpegMap).
+#define IS_JPEG_LUT_RATIO 4
+
+//! Memory (bytes) for finished jpeg responses kept around for users asking for them again.
+#define IS_JPEG_CACHE_BYTES (64*1024*1024)
 
 //! Default size (width) of the spot finder image
 #define IS_DEFAULT_SPOT_IMAGE_WIDTH 384
@@ -102,6 +219,18 @@
 //!
 #define IS_OUTPUT_IMAGE_BINS 16
 
+//! Histogram bins per power of two above 2^IS_HIST_SUB_BITS (values below that get a bin each)
+#define IS_HIST_SUB_BITS 4
+
+//! Number of bins in a reduced image's intensity histogram (enough for 32 bit pixels)
+#define IS_HIST_BINS ((33 - IS_HIST_SUB_BITS) << IS_HIST_SUB_BITS)
+
+//! Default auto-contrast: this percentile of the reduced pixels (and below) are white
+#define IS_AUTO_WHITE_PERCENTILE 20.0
+
+//! Default auto-contrast: this percentile of the reduced pixels (and above) are black
+#define IS_AUTO_BLACK_PERCENTILE 99.5
+
 /** The access we've determined by fstat as the uid/gid that will be
  ** trying to read the file.
  */
@@ -112,6 +241,16 @@ typedef enum {NOACCESS, READABLE, WRITABLE} image_access_type;
  */
 typedef enum {UNKNOWN, BLANK, HDF5, RAYONIX, RAYONIX_BS} image_file_type;
 
+/** Image buffers are charged against one of these memory budgets.
+ */
+typedef enum {RAW_IMAGE_BUFFER, REDUCED_IMAGE_BUFFER, N_IMAGE_BUFFER_CLASSES} image_buffer_class;
+
+/** How the pixels in each box are pooled into one reduced pixel (the
+ ** "reduce" job parameter).  REDUCE_SUM images are 32 bit whatever
+ ** the depth of the raw image.
+ */
+typedef enum {REDUCE_MAX, REDUCE_MEAN, REDUCE_SUM, REDUCE_MEDIAN, N_REDUCE_MODES} reduce_mode_type;
+
 /** Definition of an ice ring                                                                           */
 typedef struct ice_ring_struct {
   double high;  //!< Inner part of ice ring in Å
@@ -144,13 +283,73 @@ typedef struct bin_struct {
   double sum2;                          //!< sum squared of pixel values
 } bin_t;
 
+//! The shared cache index (see isShm.c)
+typedef struct isShmIndexStruct isShmIndex_t;
+
+//! The prefetch queue (see isPrefetch.c)
+typedef struct isPrefetchStruct isPrefetch_t;
+
+//! The compute pool (see isPool.c)
+typedef struct isPoolStruct isPool_t;
+
+//! A finished jpeg response (see isJpeg.c)
+typedef struct isJpegOutStruct isJpegOut_t;
+
+//! An open HDF5 master file (see isH5.c)
+typedef struct isH5FileStruct isH5File_t;
+
+//! Bin of each pixel of a reduced image (see isReduceImage.c)
+typedef struct isGeometryStruct isGeometry_t;
+
+/** A run of bad pixels in one row of a mask
+ */
+typedef struct isMaskRunStruct {
+  int col;                              //!< First bad pixel
+  int len;                              //!< Number of bad pixels
+} isMaskRun_t;
+
+/** Bad pixel mask shared by all the frames of a data set (see isMask.c)
+ */
+typedef struct isMaskStruct {
+  struct isMaskStruct *next;            //!< Next mask in the mask cache
+  char *key;                            //!< Cache key (NULL when not cached)
+  int refs;                             //!< Number of frames (and caches) using us (use __atomic builtins)
+  int width;                            //!< Width of the image
+  int height;                           //!< Height of the image
+  int words;                            //!< 64 bit words per row of bits
+  uint64_t *bits;                       //!< One bit per pixel, set for bad pixels
+  int *row_runs;                        //!< Runs of row r are runs[row_runs[r]] up to runs[row_runs[r+1]]
+  isMaskRun_t *runs;                    //!< Runs of bad pixels, row by row
+  int n_runs;                           //!< Number of runs
+  size_t bytes;                         //!< Memory we use
+} isMask_t;
+
+/** Reads a raw frame a block of rows at a time (see isOpenRawRows)
+ */
+typedef struct isRowReaderStruct {
+  int width;                            //!< Width of the frame
+  int height;                           //!< Height of the frame
+  int depth;                            //!< Bytes per pixel
+  int chunk_rows;                       //!< Rows that are cheapest read together (0 if it does not matter)
+  int (*read)(struct isRowReaderStruct *rr, int row0, int row1, void *buf);   //!< Read rows row0 up to row1 into buf.  Returns 0 on success.  Rows are read in order.
+  void (*close)(struct isRowReaderStruct *rr);                                 //!< Done reading
+  void *state;                          //!< Whatever the reader needs
+} isRowReader_t;
+
 /** Filled by isWorker via isData (etc) routines.                                                */
 typedef struct isImageBufStruct {
-  struct isImageBufStruct *next;        //!< The next item in our list of buffers
+  struct isImageBufStruct *hnext;       //!< Next buffer in our hash bucket
+  struct isImageBufStruct *lru_prev;    //!< Buffer nearer the head of the clock list of the same class in our shard
+  struct isImageBufStruct *lru_next;    //!< Buffer nearer the tail (the eviction hand) of the clock list
   const char *key;                      //!< The string that uniquely idenitifies this entry: This is the gid/file path
-  pthread_rwlock_t buflock;             //!< keep our threads from colliding on a specific buffer
-  int in_use;                           //!< Flag to make sure we don't remove this buffer before we can lock it.  Protect with contex mutex
-  redisReply *rr;                       //!< non-NULL when buf points to rr->str
+  unsigned int hash;                    //!< Hash of key: selects the shard and the bucket
+  image_buffer_class buf_class;         //!< Which memory budget we are charged against
+  size_t cost;                          //!< Bytes currently charged against our budget
+  int cached;                           //!< Non-zero while we can be found in the cache.  Change with the shard mutex
+  pthread_rwlock_t buflock;             //!< Write locked while the buffer is being filled
+  int ready;                            //!< Non-zero once the buffer has been filled (use __atomic builtins)
+  int refs;                             //!< Number of threads using this buffer, -1 once it is being destroyed (use __atomic builtins)
+  int referenced;                       //!< Set on each cache hit, cleared as the eviction hand passes (use __atomic builtins)
   json_t *meta;                         //!< Our meta data
   int buf_size;                         //!< Size of our buffer in bytes (had better = buf_width * buf_height * buf_depth
   int buf_width;                        //!< width of the current buffer (may differ from that found in meta)
@@ -158,25 +357,86 @@ typedef struct isImageBufStruct {
   int buf_depth;                        //!< depth of the current buffer (may differ from that found in meta)
   void *extra;                          //!< Whatever the extra stuff this detector requires
   int frame;                            //!< the frame number
-  void *bad_pixel_map;                  //!< If defined assumed uint32_t of same size and shape as buf
+  isMask_t *mask;                       //!< Bad pixels (or NULL).  We hold a reference.
   void (*destroy_extra)(void *);        //!< Function to destroy the extra stuff
   void *buf;                            //!< Our buffer
   bin_t bins[IS_OUTPUT_IMAGE_BINS+1];   //!< stats for our spot finder
+  uint32_t hist[IS_HIST_BINS];          //!< log scale intensity histogram (reduced images, see isHistValue)
   double beam_center_x;                 //!< beam_center_x scaled to current image
   double beam_center_y;                 //!< beam_center_x scaled to current image
   double min_dist2;                     //!< square of the minimum possible distance from a pixel to the beam center
   double max_dist2;                     //!< square of the maximum possible distance from a pixel to the beam center
+  void *shm_map;                        //!< non-NULL when buf points into this (read only) shared memory mapping
+  size_t shm_map_size;                  //!< size of shm_map
+  int shm_slot;                         //!< our slot in the shared cache index
+  unsigned int shm_generation;          //!< generation of our shared buffer
+  int redis_lease;                      //!< non-zero when we have promised redis we'll fill this buffer
+  pthread_mutex_t pyramid_mutex;        //!< Protects the pyramid
+  void *pyramid[IS_PYRAMID_LEVELS+1];   //!< Max pooled reductions of buf (level 0 is unused: that's buf itself)
+  int pyramid_width[IS_PYRAMID_LEVELS+1];       //!< Width of each pyramid level
+  int pyramid_height[IS_PYRAMID_LEVELS+1];      //!< Height of each pyramid level
+  size_t pyramid_bytes;                 //!< Memory used by the pyramid
 } isImageBufType;
 
+/** Hash table of one cache shard.  Replaced (not resized) when the
+ ** shard grows so that lock free readers always see a consistent
+ ** bucket count.
+ */
+typedef struct isImageBufTableStruct {
+  unsigned int n_buckets;                                       //!< Number of buckets (a power of 2)
+  isImageBufType *buckets[];                                    //!< Chained through hnext
+} isImageBufTable_t;
+
+/** One slice of the image buffer cache.  Each shard has its own lock,
+ ** hash table, and clock lists so that inserts and evictions in one
+ ** shard do not hold up the others.  Lookups take no lock at all.
+ */
+typedef struct isImageBufShardStruct {
+  pthread_mutex_t mutex;                                        //!< Serializes changes to everything here and to the list pointers of our buffers
+  isImageBufTable_t *table;                                     //!< Hash table (use __atomic builtins to read without the mutex)
+  int n_buffers;                                                //!< Number of buffers in our hash table
+  isImageBufType *lru_head[N_IMAGE_BUFFER_CLASSES];             //!< Head of the clock list of each class (newest or just given a second chance)
+  isImageBufType *lru_tail[N_IMAGE_BUFFER_CLASSES];             //!< Tail of the clock list of each class (where the eviction hand is)
+  size_t bytes[N_IMAGE_BUFFER_CLASSES];                         //!< Bytes charged against each budget by this shard
+} isImageBufShard_t;
+
+/** Memory waiting for the threads that might still be looking at it
+ ** to move on (see isEpochRetire in isData.c)
+ */
+typedef struct isRetiredStruct {
+  struct isRetiredStruct *next;         //!< Next in the retired list
+  uint64_t epoch;                       //!< Epoch at the time we were retired
+  isImageBufType *imb;                  //!< Image buffer to destroy, or
+  void *mem;                            //!< memory to free
+} isRetired_t;
+
 /** Managed by isSupervisor (in isWorker.c)                                                             */
 typedef struct isWorkerContextStruct {
-  isImageBufType *first;                //!< The first image buffer in our linked list
   const char *key;                      //!< same as the process list key but accessible to the threads: this is the redis key for the job list
-  int n_buffers;                        //!< The number of buffers in the list (so we know when to remake the hash table
-  int max_buffers;                      //!< Maximum number of buffers allowed in the hash table
-  pthread_mutex_t ctxMutex;             //!< Lock access to the image buffers
+  uint64_t serial;                      //!< Tells us from contexts made before us (at the same address, perhaps)
+  isImageBufShard_t shards[IS_CACHE_SHARDS];            //!< Our image buffer cache
+  size_t shard_budget[N_IMAGE_BUFFER_CLASSES];          //!< Memory budget for each class in each shard
+  uint64_t epoch;                       //!< Current reclamation epoch (use __atomic builtins)
+  uint64_t epoch_active[IS_EPOCH_SLOTS];                //!< Epoch each thread is looking at the cache in, 0 when it isn't
+  int epoch_owned[IS_EPOCH_SLOTS];      //!< Non-zero when a thread has the epoch_active slot (use __atomic builtins)
+  int n_epoch_slots;                    //!< One past the highest epoch_active slot ever handed out
+  pthread_mutex_t retireMutex;          //!< Protects retired
+  isRetired_t *retired;                 //!< Buffers and tables waiting to be freed
+  isShmIndex_t *shm;                    //!< Buffers shared with the other supervisors of our ESAF (NULL if unavailable)
+  isPrefetch_t *prefetch;               //!< Frames we expect to be asked for next
+  isPool_t *pool;                       //!< Threads to help with big computations
+  isPool_t *ioPool;                     //!< Threads to help with work that waits on files and redis
+  pthread_mutex_t geometryMutex;        //!< Protects geometry and tileGeometry
+  isGeometry_t *geometry;               //!< Recently used reduction geometries, most recent first
+  isGeometry_t *tileGeometry;           //!< Recently used tile geometries, most recent first
+  pthread_mutex_t maskMutex;            //!< Protects masks
+  isMask_t *masks;                      //!< Recently decoded bad pixel masks, most recent first
+  pthread_mutex_t jpegMutex;            //!< Protects jpegs
+  isJpegOut_t *jpegs;                   //!< Recently sent jpeg responses, most recent first
+  pthread_mutex_t h5Mutex;              //!< Protects h5files
+  isH5File_t *h5files;                  //!< Open HDF5 master files, most recently used first
+  int interactive;                      //!< Number of user jobs being worked on right now (use __atomic builtins)
   pthread_mutex_t metaMutex;            //!< control access to json functions, particularly dumps
-  struct hsearch_data bufTable;         //!< Hash table to find the correct buffer quickly
   void *zctx;                           //!< zmq context to transmit data hither and yon
   void *router;                         //!< zmq socket to talk to our parent process
   void *dealer;                         //!< zmq socket to talk to our threads
@@ -256,28 +516,81 @@ struct h5_json_property {
 
 extern char *file_name_component(const char *parent_id, const char *path);
 extern double get_double_from_json_object(const char *cid,  const json_t *j, const char *key);
+extern char *isMaskKey(const char *fn);
+extern char *isRawEncode(isImageBufType *imb, int delta, int use_lz4, int *lenp);
+extern const char *isKernelsInit();
+extern const char *isReduceModeName(reduce_mode_type mode);
 extern image_access_type isFindFile(const char *fn);
 extern image_file_type isFileType(const char *fn);
 extern int get_integer_from_json_object(const char *cid, json_t *j, char *key);
 extern int isEsafAllowed(json_t *isAuth, int esaf);
+extern int isJpegCheck(isWorkerContext_t *wctx, const unsigned char *pixels, int width, int height, int gray, int subsamp, int n);
+extern int isJpegMap(isImageBufType *imb, uint32_t wval, uint32_t bval, unsigned char *gp);
+extern int isKernelsCheck();
+extern int isHistPercentile(json_t *meta, double pct, uint32_t *valuep);
 extern int isH5GetData(isWorkerContext_t *wctx, const char *fn, isImageBufType **imbp);
+extern int isH5OpenRows(isWorkerContext_t *wctx, const char *fn, isImageBufType *imb, isRowReader_t *rr);
 extern int isNProcesses();
+extern int isOpenRawRows(isWorkerContext_t *wctx, json_t *job, isImageBufType *raw, isRowReader_t *rr);
+extern int isRedisDecode(isWorkerContext_t *wctx, isImageBufType *imb, char **vals, size_t *lens);
+extern int isRedisEncode(isWorkerContext_t *wctx, isImageBufType *imb, char **vals, size_t *lens);
+extern int isRedisGet(isWorkerContext_t *wctx, redisContext *rc, isImageBufType *imb);
+extern int isShmGet(isWorkerContext_t *wctx, isImageBufType *imb);
+extern int isShmHas(isWorkerContext_t *wctx, const char *key, unsigned int hash);
+extern int isGeometryCheck(isWorkerContext_t *wctx, isImageBufType *src, int x, int y, int winWidth, int winHeight, int dstWidth, int dstHeight, int *hitp);
+extern int isPoolSize(isWorkerContext_t *wctx);
+extern int isPrefetchQueued(isWorkerContext_t *wctx, int *frames, int max);
+extern int isPyramidCheck(isWorkerContext_t *wctx, isImageBufType *src, int x, int y, int winWidth, int winHeight, int dstWidth, int dstHeight, int *levelp);
+extern int isPyramidChooseLevel(int xa, int ya);
+extern uint32_t isHistValue(int bin);
+extern size_t isBufPoolIdleBytes();
+extern size_t isBufSize(void *buf);
 extern int isRayonixGetData(isWorkerContext_t *wctx, const char *fn, isImageBufType **imbp);
+extern int isRayonixOpenRows(isWorkerContext_t *wctx, const char *fn, isImageBufType *imb, isRowReader_t *rr);
+extern int isReduceCheck(isWorkerContext_t *wctx, isImageBufType *src, isMask_t *mask, int x, int y, int winWidth, int winHeight, int dstWidth, int dstHeight, reduce_mode_type mode);
+extern int isStreamCheck(isWorkerContext_t *wctx, isImageBufType *src, isMask_t *mask, int x, int y, int winWidth, int winHeight, int dstWidth, int dstHeight, reduce_mode_type mode, int chunk_rows);
+extern int isReduceRegionStream(isWorkerContext_t *wctx, redisContext *rc, isImageBufType *raw, isRowReader_t *rr, isImageBufType *rtn, int x, int y, int winWidth, int winHeight, int dstWidth, int dstHeight, reduce_mode_type mode);
 extern int is_h5_error_handler(hid_t estack_id, void *dummy);
 extern int verifyIsAuth( char *isAuth, char *isAuthSig_str);
-extern isImageBufType *isGetImageBufFromKey(isWorkerContext_t *ibctx, redisContext *rc, char *key);
+extern isImageBufType *isGetImageBufFromKey(isWorkerContext_t *ibctx, redisContext *rc, char *key, image_buffer_class buf_class);
 extern isImageBufType *isGetRawImageBuf(isWorkerContext_t *ibctx, redisContext *rc, json_t *job);
 extern isImageBufType *isReduceImage(isWorkerContext_t *ibctx, redisContext *rc, json_t *job);
+extern isImageBufType *isTileImage(isWorkerContext_t *wctx, redisContext *rc, json_t *job);
+extern isMask_t *isMaskCacheGet(isWorkerContext_t *wctx, const char *key);
+extern isMask_t *isMaskCachePut(isWorkerContext_t *wctx, const char *key, isMask_t *m);
+extern isMask_t *isMaskFromBits(int width, int height, const uint64_t *bits);
+extern isMask_t *isMaskFromMap(int width, int height, const uint32_t *map);
+extern isMask_t *isMaskRef(isMask_t *m);
 extern isProcessListType *isFindProcess(const char *pid, int esaf);
 extern isProcessListType *isRun(void *zctx, redisContext *rc, json_t *isAuth, int esaf, int dev_mode);
-extern isWorkerContext_t  *isDataInit(const char *key);
+extern isShmIndex_t *isShmInit(const char *index_name);
+extern isWorkerContext_t  *isDataInit(const char *key, const char *shm_name);
 extern json_t *isH5GetMeta(isWorkerContext_t *wctx, const char *fn);
 extern json_t *isRayonixGetMeta(isWorkerContext_t *wctx, const char *fn);
+extern json_t *isReduceStats(isWorkerContext_t *wctx, isImageBufType *src, int dstWidth, int dstHeight);
+extern redisContext *isPoolRedis();
+extern reduce_mode_type isReduceMode(const char *name);
+extern void *isBufGet(size_t size);
+extern void *isBufShrink(void *buf, size_t size);
 extern void destroyImageBuffer(isWorkerContext_t *wctx, isImageBufType *p);
+extern void isBufPoolDrain();
+extern void isBufPut(void *buf);
+extern void isBufZmqFree(void *data, void *hint);
+extern void isAbandonImageBuf(isWorkerContext_t *wctx, isImageBufType *imb);
+extern void isCacheAccount(isWorkerContext_t *wctx, isImageBufType *imb);
+extern void isCloseRawRows(isWorkerContext_t *wctx, isImageBufType *raw, isRowReader_t *rr);
 extern void isDataDestroy(isWorkerContext_t *c);
+extern void isBatch(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job);
+extern void isFilmstrip(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job);
 extern void isIndex( isWorkerContext_t *ibctx, isThreadContextType *tcp, json_t *job);
+extern void isGeometryDestroy(isWorkerContext_t *wctx);
 extern void isInit(int dev_mode);
 extern void isJpeg( isWorkerContext_t *ibctx, isThreadContextType *tcp, json_t *job);
+extern void isJpegCacheDestroy(isWorkerContext_t *wctx);
+extern void isJpegBlank(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job);
+extern void isJpegContrast(isWorkerContext_t *wctx, json_t *job, json_t *meta, int32_t *wvalp, int32_t *bvalp);
+extern void isJpegRender(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, isImageBufType *imb);
+extern void isJpegSendImage(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, json_t *meta, const unsigned char *pixels, int width, int height, int gray);
 extern void isLogging_alert(char *fmt, ...);
 extern void isLogging_crit(char *fmt, ...);
 extern void isLogging_debug(char *fmt, ...);
@@ -287,11 +600,40 @@ extern void isLogging_info(char *fmt, ...);
 extern void isLogging_init();
 extern void isLogging_notice(char *fmt, ...);
 extern void isLogging_warning(char *fmt, ...);
+extern void isH5FileCacheDestroy(isWorkerContext_t *wctx);
+extern void isMaskCacheDestroy(isWorkerContext_t *wctx);
+extern void isMaskRelease(isMask_t *m);
+extern void (*isMaxRow16)(const uint16_t *row, const uint64_t *bits, const int *n0, const int *n1, int n, uint32_t *out, int *nsatp);
+extern void (*isMaxRow32)(const uint32_t *row, const uint64_t *bits, const int *n0, const int *n1, int n, uint32_t *out, int *nsatp);
+extern void (*isMedian9)(uint32_t *s, int stride, uint32_t *out, int n);
+extern void (*isSumRow16)(const uint16_t *row, const uint64_t *bits, const int *n0, const int *n1, int n, uint64_t *sum, int *ngood, int *nsat);
+extern void (*isSumRow32)(const uint32_t *row, const uint64_t *bits, const int *n0, const int *n1, int n, uint64_t *sum, int *ngood, int *nsat);
+extern void isPoolDestroy(isWorkerContext_t *wctx);
+extern void isPoolInit(isWorkerContext_t *wctx);
+extern void isPoolRun(isWorkerContext_t *wctx, int n, void (*fn)(void *, int), void *arg);
+extern void isPoolRunIO(isWorkerContext_t *wctx, int n, void (*fn)(void *, int), void *arg);
+extern void isPoolSetSerial(int serial);
+extern void isPyramidDestroy(isImageBufType *imb);
+extern void isPyramidGetLevel(isWorkerContext_t *wctx, isImageBufType *raw, int level, isImageBufType *view);
+extern void isPrefetchDestroy(isWorkerContext_t *wctx);
+extern void isPrefetchInit(isWorkerContext_t *wctx, int n_threads);
+extern void isPrefetchNote(isWorkerContext_t *wctx, json_t *job, json_t *meta);
 extern void isProcessListInit();
+extern void isRedisAbandon(isWorkerContext_t *wctx, redisContext *rc, isImageBufType *imb);
+extern void isRedisPut(isWorkerContext_t *wctx, redisContext *rc, isImageBufType *imb);
+extern void isReduceRegion(isWorkerContext_t *wctx, redisContext *rc, isImageBufType *raw, isImageBufType *rtn, int x, int y, int winWidth, int winHeight, int dstWidth, int dstHeight, reduce_mode_type mode);
+extern void isPublishImageBuf(isWorkerContext_t *wctx, isImageBufType *imb);
+extern void isReleaseImageBuf(isWorkerContext_t *wctx, isImageBufType *imb);
+extern void isShmDestroy(isShmIndex_t *shm);
+extern void isShmPut(isWorkerContext_t *wctx, isImageBufType *imb);
+extern void isShmRelease(isWorkerContext_t *wctx, int slot, unsigned int generation);
+extern void isShmUnlink(isShmIndex_t *shm);
+extern void isRaw(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job);
 extern void isSpots( isWorkerContext_t *ibctx, isThreadContextType *tcp, json_t *job);
+extern void isTile(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job);
+extern void isWorkerDispatch(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job);
 extern void isSubProcess(const char *cid, isSubProcess_type *spt, pthread_mutex_t *mutex);
 extern void isSupervisor(const char *key);
-extern void isWriteImageBufToRedis(isWorkerContext_t *wctx, isImageBufType *imb, redisContext *rc);
 extern void is_zmq_error_reply(zmq_msg_t *msgs, int n_msgs, void *err_dealer, char *fmt, ...);
 extern void is_zmq_free_fn(void *data, void *hint);
 extern void set_json_object_float_array( const char *cid, json_t *j, const char *key, float *values, int n);
@@ -0,0 +1,295 @@
+/*! @file isBatch.c
+ *  @copyright 2018 by Northwestern University All Rights Reserved
+ *  @author Keith Brister
+ *  @brief Several jobs in one request
+ *
+ *  Each client socket has just one request in flight at a time so a
+ *  page that needs meta data, a jpeg, and spots pays three full round
+ *  trips.  A "batch" job carries an array of ordinary jobs which we
+ *  work on at the same time, then send back every reply in one
+ *  multipart message.  The jobs wait on files and redis, so they run
+ *  on the threads that are allowed to (see isPoolRunIO), each with its
+ *  own redis connection.  The big computations inside them still use
+ *  the compute pool, as they would on their own.  Only the quick job
+ *  types in isBatchJobTypes may be batched: an index or filmstrip job
+ *  would hold up all the others.
+ *
+ *  Each job replies just as it would have on its own but into an
+ *  inproc PAIR socket of its own rather than to the client.  Once
+ *  they are all done we forward the parts, zero copy, in order:
+ *
+ *  @li An empty error message
+ *  @li The batch job
+ *  @li For each job: {"index": i, "parts": k} followed by the k parts of its reply (its error message, job, ...)
+ */
+#include "is.h"
+
+/** The jobs of one batch
+ */
+typedef struct isBatchStruct {
+  isWorkerContext_t *wctx;              //!< Our worker context
+  pthread_t caller;                     //!< The worker thread that got the batch
+  redisContext *rc;                     //!< The caller's redis connection
+  json_t *jobs;                         //!< The jobs
+  char endpoint[64];                    //!< Prefix of our inproc endpoints: job i replies to endpoint-i
+} isBatch_t;
+
+//! The job types a batch may contain
+static const char *isBatchJobTypes[] = {"jpeg", "raw", "spots", "tile", NULL};
+
+/** Can a job of this type go in a batch?
+ */
+static int isBatchAllowed(const char *job_type) {
+  int i;
+
+  for (i=0; job_type != NULL && isBatchJobTypes[i] != NULL; i++) {
+    if (strcasecmp(job_type, isBatchJobTypes[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** Do one job of a batch (isPoolRunIO callback)
+ **
+ ** @param voidp  Our batch
+ **
+ ** @param i      The job to do
+ */
+static void isBatchJob(void *voidp, int i) {
+  static const char *id = FILEID "isBatchJob";
+  isThreadContextType tc;
+  isBatch_t *b;
+  char endpoint[96];
+  const char *job_type;
+  json_t *job;
+  int err;
+
+  b = voidp;
+
+  tc.rep = zmq_socket(b->wctx->zctx, ZMQ_PAIR);
+  if (tc.rep == NULL) {
+    isLogging_err("%s: failed to create zmq socket: %s\n", id, zmq_strerror(errno));
+    return;
+  }
+
+  snprintf(endpoint, sizeof(endpoint)-1, "%s-%d", b->endpoint, i);
+  endpoint[sizeof(endpoint)-1] = 0;
+
+  err = zmq_connect(tc.rep, endpoint);
+  if (err == -1) {
+    isLogging_err("%s: Failed to connect to %s: %s\n", id, endpoint, zmq_strerror(errno));
+    zmq_close(tc.rep);
+    return;
+  }
+
+  pthread_mutex_lock(&b->wctx->metaMutex);
+  job      = json_array_get(b->jobs, i);
+  job_type = json_string_value(json_object_get(job, "type"));
+  pthread_mutex_unlock(&b->wctx->metaMutex);
+
+  // The caller lends a hand with its own connection
+  tc.rc = pthread_equal(pthread_self(), b->caller) ? b->rc : isPoolRedis();
+  if (!json_is_object(job)) {
+    is_zmq_error_reply(NULL, 0, tc.rep, "%s: Batch job %d is not an object", id, i);
+  } else if (!isBatchAllowed(job_type)) {
+    is_zmq_error_reply(NULL, 0, tc.rep, "%s: Job type '%s' may not be batched", id, job_type == NULL ? "" : job_type);
+  } else {
+    isWorkerDispatch(b->wctx, &tc, job);
+  }
+
+  zmq_close(tc.rep);
+}
+
+/** Send one part of our reply
+ **
+ ** @returns 0 on success, -1 on failure
+ */
+static int isBatchSend(void *rep, zmq_msg_t *msg, int more) {
+  static const char *id = FILEID "isBatchSend";
+  int err;
+
+  err = zmq_msg_send(msg, rep, more ? ZMQ_SNDMORE : 0);
+  if (err == -1) {
+    isLogging_err("%s: Could not send reply: %s\n", id, zmq_strerror(errno));
+    zmq_msg_close(msg);
+    return -1;
+  }
+  return 0;
+}
+
+/** Do several jobs at once and send back all their replies together
+ **
+ ** @param wctx Worker context
+ **
+ ** @param tcp Thread data
+ **   @li @c tcp->rep  ZMQ Response socket into which the throw our response.
+ **
+ ** @param job             {Object}     - Description of what is requested
+ ** @param job.jobs        {Array}      - The jobs (jpeg, raw, spots, or tile), at most IS_BATCH_MAX_JOBS
+ ** @param job.tag         {String}     - ID for us to know what to do with the result
+ ** @param job.type        {String}     - "BATCH"
+ */
+void isBatch(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
+  static const char *id = FILEID "isBatch";
+  isBatch_t b;
+  void **pairs;
+  zmq_msg_t *parts;
+  zmq_msg_t *more;
+  zmq_msg_t msg;
+  char endpoint[96];
+  char *job_str;
+  char *header;
+  int max_parts;
+  int n_parts;
+  int failed;
+  int err;
+  int n;
+  int i;
+  int k;
+
+  memset(&b, 0, sizeof(b));
+  b.wctx   = wctx;
+  b.caller = pthread_self();
+  b.rc     = tcp->rc;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  b.jobs  = json_object_get(job, "jobs");
+  n       = json_array_size(b.jobs);
+  job_str = json_dumps(job, JSON_SORT_KEYS | JSON_INDENT(0) | JSON_COMPACT);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (!json_is_array(b.jobs) || n > IS_BATCH_MAX_JOBS) {
+    isLogging_err("%s: Need an array of at most %d jobs\n", id, IS_BATCH_MAX_JOBS);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Need an array of at most %d jobs", id, IS_BATCH_MAX_JOBS);
+    free(job_str);
+    return;
+  }
+
+  //
+  // Our address is unique while we're here
+  //
+  snprintf(b.endpoint, sizeof(b.endpoint)-1, "inproc://is-batch-%p", (void *)&b);
+  b.endpoint[sizeof(b.endpoint)-1] = 0;
+
+  pairs = calloc(n > 0 ? n : 1, sizeof(*pairs));
+  if (pairs == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  for (i=0; i<n; i++) {
+    snprintf(endpoint, sizeof(endpoint)-1, "%s-%d", b.endpoint, i);
+    endpoint[sizeof(endpoint)-1] = 0;
+
+    pairs[i] = zmq_socket(wctx->zctx, ZMQ_PAIR);
+    if (pairs[i] == NULL) {
+      isLogging_err("%s: failed to create zmq socket: %s\n", id, zmq_strerror(errno));
+      exit (-1);
+    }
+
+    err = zmq_bind(pairs[i], endpoint);
+    if (err == -1) {
+      isLogging_err("%s: Failed to bind %s: %s\n", id, endpoint, zmq_strerror(errno));
+      exit (-1);
+    }
+  }
+
+  isPoolRunIO(wctx, n, isBatchJob, &b);
+
+  //
+  // Error message and our job
+  //
+  zmq_msg_init(&msg);
+  failed = isBatchSend(tcp->rep, &msg, 1);
+
+  job_str = job_str == NULL ? strdup("") : job_str;
+  if (job_str == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  zmq_msg_init_data(&msg, job_str, strlen(job_str), is_zmq_free_fn, NULL);
+  if (failed) {
+    zmq_msg_close(&msg);
+  } else {
+    failed = isBatchSend(tcp->rep, &msg, n > 0);
+  }
+
+  //
+  // Each job's reply is already waiting for us.  We collect them in order.
+  //
+  max_parts = 8;
+  parts = calloc(max_parts, sizeof(*parts));
+  if (parts == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  for (i=0; i<n; i++) {
+    n_parts = 0;
+    while (1) {
+      if (n_parts == max_parts) {
+        // zmq messages may only be moved with zmq_msg_move
+        more = calloc(2 * max_parts, sizeof(*more));
+        if (more == NULL) {
+          isLogging_crit("%s: Out of memory\n", id);
+          exit (-1);
+        }
+        for (k=0; k<n_parts; k++) {
+          zmq_msg_init(&more[k]);
+          zmq_msg_move(&more[k], &parts[k]);
+          zmq_msg_close(&parts[k]);
+        }
+        free(parts);
+        parts = more;
+        max_parts *= 2;
+      }
+
+      zmq_msg_init(&parts[n_parts]);
+      err = zmq_msg_recv(&parts[n_parts], pairs[i], ZMQ_DONTWAIT);
+      if (err == -1) {
+        zmq_msg_close(&parts[n_parts]);
+        break;
+      }
+      n_parts++;
+      if (!zmq_msg_more(&parts[n_parts-1])) {
+        break;
+      }
+    }
+
+    if (n_parts == 0) {
+      // The job could not even get started
+      header = strdup("job failed");
+      if (header == NULL) {
+        isLogging_crit("%s: Out of memory\n", id);
+        exit (-1);
+      }
+      zmq_msg_init_data(&parts[n_parts++], header, strlen(header), is_zmq_free_fn, NULL);
+    }
+
+    if (asprintf(&header, "{\"index\":%d,\"parts\":%d}", i, n_parts) < 0) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+    zmq_msg_init_data(&msg, header, strlen(header), is_zmq_free_fn, NULL);
+
+    if (failed) {
+      zmq_msg_close(&msg);
+    } else {
+      failed = isBatchSend(tcp->rep, &msg, 1);
+    }
+
+    for (k=0; k<n_parts; k++) {
+      if (failed) {
+        zmq_msg_close(&parts[k]);
+      } else {
+        failed = isBatchSend(tcp->rep, &parts[k], i < n-1 || k < n_parts-1);
+      }
+    }
+
+    zmq_close(pairs[i]);
+  }
+
+  free(parts);
+  free(pairs);
+}
@@ -0,0 +1,250 @@
+/*! @file isBufPool.c
+ *  @copyright 2018 by Northwestern University All Rights Reserved
+ *  @author Keith Brister
+ *  @brief Recycled scratch and output buffers
+ *
+ *  Rendering and sending an image needs a few large buffers that are
+ *  only used for a moment: the 8 bit rendering, the worst case jpeg
+ *  output, the pixels of a raw job.  Getting fresh ones from malloc
+ *  every time means the kernel has to find and zero new pages for
+ *  every image.  Instead we keep the buffers we are done with in a
+ *  pool and hand them out again.
+ *
+ *  There are eight size classes between each power of two and the
+ *  next so a buffer is never more than an eighth bigger than asked
+ *  for.  Buffers that end up holding less than they were made for (a
+ *  jpeg in its worst case buffer) can be cut down to size with
+ *  isBufShrink and go back to the biggest class they still fill.  The
+ *  pool keeps up to IS_BUF_POOL_BYTES of memory (every byte malloc
+ *  gave us, not what was asked for) in idle buffers.
+ *
+ *  Buffers handed to zmq come back to the pool through isBufZmqFree,
+ *  which may be called from zmq's own threads.  The pool is shared by
+ *  all the threads of the process.
+ */
+#include "is.h"
+
+//! Smallest size class is 2^IS_BUF_POOL_MIN_SHIFT bytes.  Smaller buffers are not pooled.
+#define IS_BUF_POOL_MIN_SHIFT 12
+
+//! Largest size class is 2^IS_BUF_POOL_MAX_SHIFT bytes.  Anything bigger is not pooled.
+#define IS_BUF_POOL_MAX_SHIFT 31
+
+//! Size classes from 2^IS_BUF_POOL_MIN_SHIFT through 2^IS_BUF_POOL_MAX_SHIFT, eight to each power of two
+#define IS_BUF_POOL_CLASSES ((IS_BUF_POOL_MAX_SHIFT - IS_BUF_POOL_MIN_SHIFT) * 8 + 1)
+
+//! Pooled buffers start this far into their allocation, after the header
+#define IS_BUF_POOL_HEADER 64
+
+/** What we keep in front of each buffer
+ */
+typedef struct isBufHeaderStruct {
+  struct isBufHeaderStruct *next;       //!< Next idle buffer of this size class
+  size_t bytes;                         //!< Room in the buffer (not counting this header)
+} isBufHeader_t;
+
+//! Protects the pool
+static pthread_mutex_t isBufPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+//! Idle buffers of each size class
+static isBufHeader_t *isBufPoolIdle[IS_BUF_POOL_CLASSES];
+
+//! Memory held by idle buffers, headers and all
+static size_t isBufPoolBytes = 0;
+
+/** Bytes a buffer of size class c holds
+ */
+static size_t isBufClassSize(int c) {
+  return (size_t)(8 + c % 8) << (IS_BUF_POOL_MIN_SHIFT - 3 + c / 8);
+}
+
+/** Smallest size class with room for size bytes
+ **
+ ** @returns the class or -1 if size is too big to pool
+ */
+static int isBufClassUp(size_t size) {
+  int shift;
+
+  if (size <= ((size_t)1 << IS_BUF_POOL_MIN_SHIFT)) {
+    return 0;
+  }
+  if (size > ((size_t)1 << IS_BUF_POOL_MAX_SHIFT)) {
+    return -1;
+  }
+
+  // 2^shift <= size - 1 < 2^(shift+1)
+  shift = 63 - __builtin_clzll(size - 1);
+  return (shift - IS_BUF_POOL_MIN_SHIFT) * 8 + (int)((size - 1) >> (shift - 3)) - 7;
+}
+
+/** Biggest size class a buffer of bytes bytes fills
+ **
+ ** @returns the class or -1 if the buffer is too small or too big to pool
+ */
+static int isBufClassDown(size_t bytes) {
+  int shift;
+
+  if (bytes < ((size_t)1 << IS_BUF_POOL_MIN_SHIFT) || bytes > ((size_t)1 << IS_BUF_POOL_MAX_SHIFT)) {
+    return -1;
+  }
+
+  // 2^shift <= bytes < 2^(shift+1)
+  shift = 63 - __builtin_clzll(bytes);
+  return (shift - IS_BUF_POOL_MIN_SHIFT) * 8 + (int)(bytes >> (shift - 3)) - 8;
+}
+
+/** Get a buffer with room for at least size bytes.  The contents are
+ ** whatever the last user left there.
+ **
+ ** @param size  Bytes needed
+ **
+ ** @returns the buffer (give it back with isBufPut or isBufZmqFree)
+ */
+void *isBufGet(size_t size) {
+  static const char *id = FILEID "isBufGet";
+  isBufHeader_t *h;
+  size_t bytes;
+  int c;
+
+  c = isBufClassUp(size);
+
+  h = NULL;
+  bytes = size;
+  if (c >= 0) {
+    bytes = isBufClassSize(c);
+
+    pthread_mutex_lock(&isBufPoolMutex);
+    h = isBufPoolIdle[c];
+    if (h != NULL) {
+      isBufPoolIdle[c] = h->next;
+      isBufPoolBytes -= IS_BUF_POOL_HEADER + h->bytes;
+    }
+    pthread_mutex_unlock(&isBufPoolMutex);
+  }
+
+  if (h == NULL) {
+    h = malloc(IS_BUF_POOL_HEADER + bytes);
+    if (h == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+    h->bytes = bytes;
+  }
+
+  h->next = NULL;
+  return (char *)h + IS_BUF_POOL_HEADER;
+}
+
+/** Give back the end of a buffer we only need the first size bytes
+ ** of.  The C library shrinks the allocation in place (or remaps
+ ** it) so nothing is copied.
+ **
+ ** @param buf   A buffer from isBufGet
+ **
+ ** @param size  Bytes to keep
+ **
+ ** @returns the buffer, now size bytes (it may have moved)
+ */
+void *isBufShrink(void *buf, size_t size) {
+  static const char *id = FILEID "isBufShrink";
+  isBufHeader_t *h;
+
+  h = (isBufHeader_t *)((char *)buf - IS_BUF_POOL_HEADER);
+  if (size >= h->bytes) {
+    return buf;
+  }
+
+  h = realloc(h, IS_BUF_POOL_HEADER + size);
+  if (h == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  h->bytes = size;
+  return (char *)h + IS_BUF_POOL_HEADER;
+}
+
+/** Room in a buffer from isBufGet (at least what was asked for).
+ ** Used by isConvertTest.
+ **
+ ** @param buf  The buffer
+ **
+ ** @returns the number of bytes the buffer holds
+ */
+size_t isBufSize(void *buf) {
+  return ((isBufHeader_t *)((char *)buf - IS_BUF_POOL_HEADER))->bytes;
+}
+
+/** Memory held by idle buffers.  Used by isConvertTest.
+ **
+ ** @returns the bytes malloc gave us for the idle buffers, headers and all
+ */
+size_t isBufPoolIdleBytes() {
+  size_t rtn;
+
+  pthread_mutex_lock(&isBufPoolMutex);
+  rtn = isBufPoolBytes;
+  pthread_mutex_unlock(&isBufPoolMutex);
+  return rtn;
+}
+
+/** Free every idle buffer.  Used by isConvertTest.
+ */
+void isBufPoolDrain() {
+  isBufHeader_t *h;
+  int c;
+
+  pthread_mutex_lock(&isBufPoolMutex);
+  for (c=0; c<IS_BUF_POOL_CLASSES; c++) {
+    while ((h = isBufPoolIdle[c]) != NULL) {
+      isBufPoolIdle[c] = h->next;
+      free(h);
+    }
+  }
+  isBufPoolBytes = 0;
+  pthread_mutex_unlock(&isBufPoolMutex);
+}
+
+/** Give a buffer from isBufGet back.  It goes to the pool, in the
+ ** biggest size class it fills, unless the pool already holds
+ ** IS_BUF_POOL_BYTES in idle buffers.
+ **
+ ** @param buf  The buffer (NULL is fine)
+ */
+void isBufPut(void *buf) {
+  isBufHeader_t *h;
+  size_t size;
+  int c;
+
+  if (buf == NULL) {
+    return;
+  }
+
+  h = (isBufHeader_t *)((char *)buf - IS_BUF_POOL_HEADER);
+  c = isBufClassDown(h->bytes);
+  if (c < 0) {
+    free(h);
+    return;
+  }
+
+  size = IS_BUF_POOL_HEADER + h->bytes;
+  pthread_mutex_lock(&isBufPoolMutex);
+  if (isBufPoolBytes + size <= IS_BUF_POOL_BYTES) {
+    h->next = isBufPoolIdle[c];
+    isBufPoolIdle[c] = h;
+    isBufPoolBytes += size;
+    h = NULL;
+  }
+  pthread_mutex_unlock(&isBufPoolMutex);
+
+  free(h);
+}
+
+/** zmq is done sending a buffer from isBufGet
+ **
+ ** @param data  The buffer
+ **
+ ** @param hint  Unused
+ */
+void isBufZmqFree(void *data, void *hint) {
+  isBufPut(data);
+}
@@ -1,16 +1,2397 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <dirent.h>
 #include <hdf5.h>
 #include <jansson.h>
+#include <lz4.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "is.h"
 
 void usage() {
-  fprintf(stderr, "isConvertTest <h5_file>\n\n");
+  fprintf(stderr, "isConvertTest <h5_file>\n");
+  fprintf(stderr, "isConvertTest -t\n\n");
+}
+
+/**
+ * Make up an image with some saturated pixels and (when asked) a
+ * mask with some bad ones.
+ */
+void make_test_image(isImageBufType *imb, int width, int height, int depth, int with_mask) {
+  uint32_t *map;
+
+  memset(imb, 0, sizeof(*imb));
+  imb->buf_width  = width;
+  imb->buf_height = height;
+  imb->buf_depth  = depth;
+  imb->buf_size   = width * height * depth;
+  imb->buf        = malloc(imb->buf_size);
+  map             = calloc(width * height, sizeof(uint32_t));
+  if (imb->buf == NULL || map == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  srand(width + depth * 2 + with_mask);
+  for (int i=0; i < width * height; i++) {
+    uint32_t v = rand() % 1000;
+    if (rand() % 100 == 0) {
+      v = depth == 2 ? 0xffff : 0xffffffff;
+    }
+    if (depth == 2) {
+      ((uint16_t *)imb->buf)[i] = v;
+    } else {
+      ((uint32_t *)imb->buf)[i] = v;
+    }
+    map[i] = rand() % 50 == 0;
+  }
+  imb->mask = with_mask ? isMaskFromMap(width, height, map) : NULL;
+  free(map);
+
+  imb->meta = json_object();
+  json_object_set_new(imb->meta, "fn",    json_string("isConvertTest.h5"));
+  json_object_set_new(imb->meta, "frame", json_integer(7));
+  json_object_set_new(imb->meta, "mean",  json_real(123.5));
+}
+
+/**
+ * Do two images have the same size, pixels, and meta data?
+ *
+ * Returns NULL if so, otherwise what differs.
+ */
+const char *compare_images(isImageBufType *a, isImageBufType *b) {
+  char *a_meta;
+  char *b_meta;
+  int same_meta;
+
+  if (a->buf_width != b->buf_width || a->buf_height != b->buf_height || a->buf_depth != b->buf_depth || a->buf_size != b->buf_size) {
+    return "size";
+  }
+  if (memcmp(a->buf, b->buf, a->buf_size) != 0) {
+    return "pixels";
+  }
+
+  a_meta = json_dumps(a->meta, JSON_SORT_KEYS | JSON_COMPACT);
+  b_meta = json_dumps(b->meta, JSON_SORT_KEYS | JSON_COMPACT);
+  same_meta = a_meta != NULL && b_meta != NULL && strcmp(a_meta, b_meta) == 0;
+  free(a_meta);
+  free(b_meta);
+  if (!same_meta) {
+    return "meta data";
+  }
+  return NULL;
+}
+
+/**
+ * Reduce a made up image a few different ways in each mode and check
+ * the results against the reference kernels (see isReduceCheck).
+ * kernels names the row kernels in use (see isKernelsInit).
+ *
+ * Returns the number of failed cases.
+ */
+int test_reduce(isWorkerContext_t *wctx, const char *kernels, int depth, int with_mask) {
+  // x, y, winWidth, winHeight, dstWidth, dstHeight
+  static const int cases[][6] = {
+    {   0,   0, 1030, 1030,  512,  512 },   // 2x2 boxes
+    {   0,   0, 1030, 1030,  206,  206 },   // 5x5 boxes
+    {   0,   0, 1030,  950,  147,  158 },   // 7x6 boxes
+    {   0,   0, 1030, 1030, 1030, 1030 },   // nearest
+    {   0,   0, 1030, 1030,  800,  600 },   // nearest, scaled
+    { -20, -30,  300,  300,   33,   33 },   // off the top left
+    { 900, 800,  300,  300,   64,   64 },   // off the bottom right
+    {   0,   0, 1030, 1030,   64,   64 },   // 16x16 boxes (16 bit sums need 32 bits)
+  };
+  isImageBufType src;
+  int failed;
+  int diffs;
+
+  make_test_image(&src, 1030, 1030, depth, with_mask);
+
+  failed = 0;
+  for (int mode=0; mode < N_REDUCE_MODES; mode++) {
+    for (int i=0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+      diffs = isReduceCheck(wctx, &src, src.mask, cases[i][0], cases[i][1], cases[i][2], cases[i][3], cases[i][4], cases[i][5], mode);
+      printf("%s: reduce %s %d bit%s (%d,%d) %dx%d to %dx%d with %s kernels and %d pool threads\n",
+	     diffs ? "FAILED" : "ok", isReduceModeName(mode), depth * 8, with_mask ? " masked" : "",
+	     cases[i][0], cases[i][1], cases[i][2], cases[i][3], cases[i][4], cases[i][5], kernels, isPoolSize(wctx) - 1);
+      failed += diffs != 0;
+    }
+  }
+
+  isMaskRelease(src.mask);
+  json_decref(src.meta);
+  free(src.buf);
+  return failed;
+}
+
+/**
+ * Reduce windows of a made up image in max mode from the pyramid
+ * level isReduceRegion would pick and directly (see isPyramidCheck).
+ * With power of two ratios and windows on the level's pixel
+ * boundaries the boxes cover exactly the same raw pixels so the
+ * results must match.  Other ratios only need to leave each box at
+ * least 2x2 pixels on the level picked.
+ *
+ * Returns the number of failed cases.
+ */
+int test_pyramid(isWorkerContext_t *wctx, int depth, int with_mask) {
+  // x, y, winWidth, winHeight, dstWidth, dstHeight
+  static const int exact[][6] = {
+    {   0,   0, 1030, 1030,  515,  515 },   // 2x2 boxes: level 0
+    {   0,   0, 1024, 1024,  256,  256 },   // 4x4 boxes: level 1
+    {   0,   0, 1024, 1024,  128,  128 },   // 8x8 boxes: level 2
+    {   0,   0, 1024, 1024,   64,   32 },   // 16x32 boxes: level 3
+    { 512, 256,  512,  512,   16,   16 },   // 32x32 boxes: level 4, off the bottom right
+    { -64, -64,  512,  512,   32,   32 },   // off the top left
+  };
+  static const int inexact[][6] = {
+    {   0,   0, 1030, 1030,  174,  174 },   // 5.9x5.9 boxes (as from 4150 to 700)
+    {   0,   0, 1030, 1030,  100,  100 },
+    { 100, 100,  700,  700,   33,   33 },
+  };
+  isImageBufType src;
+  int failed;
+  int diffs;
+  int level;
+  int ratio;
+
+  make_test_image(&src, 1030, 1030, depth, with_mask);
+  src.key = "isConvertTest";
+  pthread_mutex_init(&src.pyramid_mutex, NULL);
+
+  failed = 0;
+  for (int i=0; i < sizeof(exact)/sizeof(exact[0]); i++) {
+    diffs = isPyramidCheck(wctx, &src, exact[i][0], exact[i][1], exact[i][2], exact[i][3], exact[i][4], exact[i][5], &level);
+    printf("%s: pyramid level %d matches raw for %d bit%s (%d,%d) %dx%d to %dx%d\n",
+           diffs ? "FAILED" : "ok", level, depth * 8, with_mask ? " masked" : "",
+           exact[i][0], exact[i][1], exact[i][2], exact[i][3], exact[i][4], exact[i][5]);
+    failed += diffs != 0;
+  }
+
+  for (int i=0; i < sizeof(inexact)/sizeof(inexact[0]); i++) {
+    isPyramidCheck(wctx, &src, inexact[i][0], inexact[i][1], inexact[i][2], inexact[i][3], inexact[i][4], inexact[i][5], &level);
+    ratio = (inexact[i][2] >> level) / inexact[i][4];
+    printf("%s: pyramid level %d boxes are %d pixels across for %d bit%s (%d,%d) %dx%d to %dx%d\n",
+           ratio >= 2 ? "ok" : "FAILED", level, ratio, depth * 8, with_mask ? " masked" : "",
+           inexact[i][0], inexact[i][1], inexact[i][2], inexact[i][3], inexact[i][4], inexact[i][5]);
+    failed += ratio < 2;
+  }
+
+  isPyramidDestroy(&src);
+  pthread_mutex_destroy(&src.pyramid_mutex);
+  isMaskRelease(src.mask);
+  json_decref(src.meta);
+  free(src.buf);
+  return failed;
+}
+
+/**
+ * Reduce a made up image (bigger than IS_STREAM_BLOCK_BYTES) in each
+ * mode from the full buffer and streamed through a row reader with
+ * chunks of a few different sizes (see isStreamCheck).  The results
+ * must be identical.
+ *
+ * Returns the number of failed cases.
+ */
+int test_stream(isWorkerContext_t *wctx, int depth, int with_mask) {
+  // x, y, winWidth, winHeight, dstWidth, dstHeight
+  static const int cases[][6] = {
+    {   0,   0, 1030, 1030,  206,  206 },   // 5x5 boxes
+    { 900, 800,  300,  300,   64,   64 },   // off the bottom right
+    {   0,   0, 1030, 1030, 1030, 1030 },   // nearest
+  };
+  static const int chunks[] = { 0, 1, 7, 64 };
+  isImageBufType src;
+  int failed;
+  int diffs;
+
+  make_test_image(&src, 1030, 1030, depth, with_mask);
+
+  failed = 0;
+  for (int mode=0; mode < N_REDUCE_MODES; mode++) {
+    for (int i=0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+      diffs = 0;
+      for (int c=0; c < sizeof(chunks)/sizeof(chunks[0]); c++) {
+        diffs += isStreamCheck(wctx, &src, src.mask, cases[i][0], cases[i][1], cases[i][2], cases[i][3], cases[i][4], cases[i][5], mode, chunks[c]) != 0;
+      }
+      printf("%s: stream %s %d bit%s (%d,%d) %dx%d to %dx%d matches the full read with %d pool threads\n",
+             diffs ? "FAILED" : "ok", isReduceModeName(mode), depth * 8, with_mask ? " masked" : "",
+             cases[i][0], cases[i][1], cases[i][2], cases[i][3], cases[i][4], cases[i][5], isPoolSize(wctx) - 1);
+      failed += diffs != 0;
+    }
+  }
+
+  isMaskRelease(src.mask);
+  json_decref(src.meta);
+  free(src.buf);
+  return failed;
+}
+
+/**
+ * Get the bin tables of a view and of every tile of three levels
+ * from the geometry cache, twice (see isGeometryCheck).  Cache hits
+ * must give the same tables as a fresh build, the second time round
+ * must all be hits, and the tiles, being more than
+ * IS_GEOMETRY_CACHE_ENTRIES, must not push the view out.
+ *
+ * Returns the number of failures.
+ */
+int test_geometry(isWorkerContext_t *wctx) {
+  isImageBufType src;
+  int failed;
+  int diffs;
+  int hits;
+  int hit;
+  int n;
+
+  make_test_image(&src, 1030, 1030, 2, 0);
+  json_object_set_new(src.meta, "beam_center_x", json_real(515.3));
+  json_object_set_new(src.meta, "beam_center_y", json_real(498.7));
+
+  failed = 0;
+  for (int pass=0; pass < 2; pass++) {
+    diffs = isGeometryCheck(wctx, &src, 0, 0, 1030, 1030, 512, 512, &hit);
+    printf("%s: geometry of a view %s matches a fresh build\n", diffs == 0 && hit == pass ? "ok" : "FAILED", hit ? "from the cache" : "made");
+    failed += diffs != 0 || hit != pass;
+
+    n     = 0;
+    hits  = 0;
+    diffs = 0;
+    for (int level=0; level < 3; level++) {
+      int span = IS_TILE_SIZE << level;
+      for (int ty=0; ty * span < src.buf_height; ty++) {
+        for (int tx=0; tx * span < src.buf_width; tx++) {
+          diffs += isGeometryCheck(wctx, &src, tx * span, ty * span, span, span, IS_TILE_SIZE, IS_TILE_SIZE, &hit);
+          hits  += hit;
+          n++;
+        }
+      }
+    }
+    printf("%s: geometry of %d tiles (%d from the cache) match fresh builds\n", diffs == 0 && hits == pass * n ? "ok" : "FAILED", n, hits);
+    failed += diffs != 0 || hits != pass * n;
+  }
+
+  diffs = isGeometryCheck(wctx, &src, 0, 0, 1030, 1030, 512, 512, &hit);
+  printf("%s: geometry of a view stays cached with %d tiles\n", diffs == 0 && hit ? "ok" : "FAILED", n);
+  failed += diffs != 0 || !hit;
+
+  isGeometryDestroy(wctx);
+  json_decref(src.meta);
+  free(src.buf);
+  return failed;
+}
+
+/**
+ * Reduce a view at a beam center through the bin table cache (see
+ * test_bin_tables).
+ *
+ * Returns 1 if the table differs from a fresh build or was (or
+ * wasn't) cached when it should (or shouldn't) have been, otherwise 0.
+ */
+int bin_table_check(isWorkerContext_t *wctx, isImageBufType *src, double beam_center_x, double beam_center_y, int size, int cached) {
+  int diffs;
+  int hit;
+
+  json_object_set_new(src->meta, "beam_center_x", json_real(beam_center_x));
+  json_object_set_new(src->meta, "beam_center_y", json_real(beam_center_y));
+  diffs = isGeometryCheck(wctx, src, 0, 0, src->buf_width, src->buf_height, size, size, &hit);
+  return diffs != 0 || hit != cached;
+}
+
+/**
+ * The bin tables of views (other than tiles) are kept, most recently
+ * used first, for IS_GEOMETRY_CACHE_ENTRIES geometries keyed on the
+ * beam center as well as the window and size: moving the beam
+ * center needs a new table, and the least recently used table is the
+ * one to go.
+ *
+ * Returns the number of failures.
+ */
+int test_bin_tables(isWorkerContext_t *wctx) {
+  isImageBufType src;
+  int failed;
+  int wrong;
+
+  make_test_image(&src, 1030, 1030, 2, 0);
+
+  failed = 0;
+  wrong  = bin_table_check(wctx, &src, 515.3, 498.7, 512, 0);
+  wrong += bin_table_check(wctx, &src, 515.3, 498.7, 512, 1);
+  printf("%s: bin table is made once for a view and then reused\n", wrong ? "FAILED" : "ok");
+  failed += wrong != 0;
+
+  wrong  = bin_table_check(wctx, &src, 200.0, 800.5, 512, 0);
+  wrong += bin_table_check(wctx, &src, 515.3, 498.7, 512, 1);
+  printf("%s: bin table is made again when the beam center moves\n", wrong ? "FAILED" : "ok");
+  failed += wrong != 0;
+
+  // Room for all but one of the two above
+  wrong = 0;
+  for (int i=0; i < IS_GEOMETRY_CACHE_ENTRIES - 1; i++) {
+    wrong += bin_table_check(wctx, &src, 515.3, 498.7, 100 + i, 0);
+  }
+  wrong += bin_table_check(wctx, &src, 515.3, 498.7, 512, 1);
+  wrong += bin_table_check(wctx, &src, 200.0, 800.5, 512, 0);
+  printf("%s: bin table cache throws out the least recently used of %d tables\n", wrong ? "FAILED" : "ok", IS_GEOMETRY_CACHE_ENTRIES);
+  failed += wrong != 0;
+
+  isGeometryDestroy(wctx);
+  json_decref(src.meta);
+  free(src.buf);
+  return failed;
+}
+
+/**
+ * Does a mask mark just the pixels a map does, in its bitset and in
+ * its runs?
+ *
+ * Returns the number of pixels (or runs) that are wrong.
+ */
+int mask_diffs(isMask_t *m, int width, int height, const uint32_t *map) {
+  int wrong;
+  int bad;
+
+  wrong = 0;
+  for (int row=0; row < height; row++) {
+    for (int col=0; col < width; col++) {
+      bad = 0;
+      for (int r=m->row_runs[row]; r < m->row_runs[row+1]; r++) {
+        bad += col >= m->runs[r].col && col < m->runs[r].col + m->runs[r].len;
+      }
+      wrong += bad != (map[row * width + col] != 0);
+      wrong += (int)((m->bits[(size_t)row * m->words + (col >> 6)] >> (col & 63)) & 1) != (map[row * width + col] != 0);
+    }
+    for (int r=m->row_runs[row]; r < m->row_runs[row+1]; r++) {
+      // Runs are as long as they can be
+      wrong += m->runs[r].col > 0 && map[row * width + m->runs[r].col - 1] != 0;
+      wrong += m->runs[r].col + m->runs[r].len < width && map[row * width + m->runs[r].col + m->runs[r].len] != 0;
+    }
+  }
+  return wrong;
+}
+
+/**
+ * Decode a bad pixel map with runs that cross 64 bit words and reach
+ * the ends of rows into a mask, then share it through the mask
+ * cache: a second decoding of the same master file gives way to the
+ * first, every frame gets the same mask, and a mask pushed out of
+ * the cache lives on for the frames still holding it.
+ *
+ * Returns the number of failures.
+ */
+int test_mask(isWorkerContext_t *wctx) {
+  static const int width  = 130;
+  static const int height = 20;
+  isMask_t *frames[3];
+  isMask_t *held;
+  isMask_t *m;
+  uint32_t *map;
+  char key[32];
+  int failed;
+  int wrong;
+
+  map = calloc(width * height, sizeof(uint32_t));
+  if (map == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  for (int col=60; col < 70; col++) {
+    map[3 * width + col] = 1;
+  }
+  for (int col=0; col < width; col++) {
+    map[5 * width + col] = col % 3 == 0 ? 0x10 : 0;
+  }
+  map[7 * width]             = 1;
+  map[7 * width + width - 1] = 0x80000000;
+  for (int row=10; row < height; row++) {
+    map[row * width + 127] = map[row * width + 128] = 4;
+  }
+
+  failed = 0;
+  m = isMaskFromMap(width, height, map);
+  wrong = mask_diffs(m, width, height, map);
+  wrong += m->row_runs[1] - m->row_runs[0] != 0 || m->row_runs[4] - m->row_runs[3] != 1 || m->row_runs[8] - m->row_runs[7] != 2;
+  printf("%s: mask bits and runs mark just the bad pixels (%d wrong)\n", wrong ? "FAILED" : "ok", wrong);
+  failed += wrong != 0;
+
+  held = isMaskFromBits(width, height, m->bits);
+  wrong = mask_diffs(held, width, height, map) != 0 || held->n_runs != m->n_runs;
+  printf("%s: mask made from another's bits is the same mask\n", wrong ? "FAILED" : "ok");
+  failed += wrong;
+
+  // Two threads decoded the same master file: the second gives way
+  frames[0] = isMaskCachePut(wctx, "isConvertTest.h5@1", m);
+  frames[1] = isMaskCachePut(wctx, "isConvertTest.h5@1", held);
+  frames[2] = isMaskCacheGet(wctx, "isConvertTest.h5@1");
+  wrong = frames[0] != m || frames[1] != m || frames[2] != m || m->refs != 4;
+  printf("%s: mask cache shares one mask among the frames of a data set (%d references)\n", wrong ? "FAILED" : "ok", m->refs);
+  failed += wrong;
+
+  // Push it out while the frames still hold it
+  for (int i=0; i < IS_MASK_CACHE_ENTRIES; i++) {
+    snprintf(key, sizeof(key), "isConvertTest-%d.h5@1", i);
+    isMaskRelease(isMaskCachePut(wctx, key, isMaskFromMap(width, height, map)));
+  }
+  held = isMaskCacheGet(wctx, "isConvertTest.h5@1");
+  wrong = held != NULL || m->refs != 3 || mask_diffs(m, width, height, map) != 0;
+  printf("%s: mask pushed out of the cache stays with the frames using it\n", wrong ? "FAILED" : "ok");
+  failed += wrong;
+  isMaskRelease(held);
+
+  for (int i=0; i < 3; i++) {
+    isMaskRelease(frames[i]);
+  }
+  isMaskCacheDestroy(wctx);
+  free(map);
+  return failed;
+}
+
+/**
+ * Write a made up data file the way the detector does: nframes 16 bit
+ * frames in /entry/data/data with the frame numbers as attributes.
+ * Every pixel of frame f is f * 100 + generation.
+ *
+ * Returns 0 on success.
+ */
+int write_h5_data(const char *fn, int width, int height, int nframes, int generation) {
+  hsize_t dims[3];
+  uint16_t *buf;
+  hid_t file, lcpl, space, dset, aspace, attr;
+  int frame_nr;
+  int err;
+
+  buf = malloc((size_t)nframes * width * height * sizeof(uint16_t));
+  if (buf == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  for (int i=0; i < nframes * width * height; i++) {
+    buf[i] = (i / (width * height) + 1) * 100 + generation;
+  }
+
+  dims[0] = nframes;
+  dims[1] = height;
+  dims[2] = width;
+
+  file  = H5Fcreate(fn, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+  lcpl  = H5Pcreate(H5P_LINK_CREATE);
+  H5Pset_create_intermediate_group(lcpl, 1);
+  space = H5Screate_simple(3, dims, NULL);
+  dset  = H5Dcreate2(file, "/entry/data/data", H5T_NATIVE_UINT16, space, lcpl, H5P_DEFAULT, H5P_DEFAULT);
+  err   = H5Dwrite(dset, H5T_NATIVE_UINT16, H5S_ALL, H5S_ALL, H5P_DEFAULT, buf) < 0;
+
+  aspace = H5Screate(H5S_SCALAR);
+  frame_nr = 1;
+  attr = H5Acreate2(dset, "image_nr_low", H5T_NATIVE_INT, aspace, H5P_DEFAULT, H5P_DEFAULT);
+  err |= H5Awrite(attr, H5T_NATIVE_INT, &frame_nr) < 0;
+  H5Aclose(attr);
+  frame_nr = nframes;
+  attr = H5Acreate2(dset, "image_nr_high", H5T_NATIVE_INT, aspace, H5P_DEFAULT, H5P_DEFAULT);
+  err |= H5Awrite(attr, H5T_NATIVE_INT, &frame_nr) < 0;
+  H5Aclose(attr);
+
+  H5Sclose(aspace);
+  H5Dclose(dset);
+  H5Sclose(space);
+  H5Pclose(lcpl);
+  H5Fclose(file);
+  free(buf);
+  return err;
+}
+
+/**
+ * Write a made up master file: a bad pixel map with nothing bad and
+ * an external link to /entry/data/data in data_fn.
+ *
+ * Returns 0 on success.
+ */
+int write_h5_master(const char *fn, const char *data_fn, int width, int height) {
+  hsize_t dims[2];
+  uint32_t *map;
+  hid_t file, lcpl, space, dset;
+  int err;
+
+  map = calloc((size_t)width * height, sizeof(uint32_t));
+  if (map == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  dims[0] = height;
+  dims[1] = width;
+
+  file  = H5Fcreate(fn, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+  lcpl  = H5Pcreate(H5P_LINK_CREATE);
+  H5Pset_create_intermediate_group(lcpl, 1);
+  space = H5Screate_simple(2, dims, NULL);
+  dset  = H5Dcreate2(file, "/entry/instrument/detector/detectorSpecific/pixel_mask", H5T_NATIVE_UINT32, space, lcpl, H5P_DEFAULT, H5P_DEFAULT);
+  err   = H5Dwrite(dset, H5T_NATIVE_UINT32, H5S_ALL, H5S_ALL, H5P_DEFAULT, map) < 0;
+  err  |= H5Lcreate_external(data_fn, "/entry/data/data", file, "/entry/data/data_000001", lcpl, H5P_DEFAULT) < 0;
+
+  H5Dclose(dset);
+  H5Sclose(space);
+  H5Pclose(lcpl);
+  H5Fclose(file);
+  free(map);
+  return err;
+}
+
+/**
+ * Read one frame with isH5GetData and check that every pixel is
+ * what write_h5_data wrote for this generation.
+ *
+ * Returns the number of pixels that differ (or -1 if the read failed).
+ */
+int read_h5_frame(isWorkerContext_t *wctx, char *fn, int frame, int generation) {
+  isImageBufType imb;
+  isImageBufType *imbp;
+  int diffs;
+
+  memset(&imb, 0, sizeof(imb));
+  imb.key   = fn;
+  imb.frame = frame;
+  imb.meta  = json_object();
+  imbp = &imb;
+
+  diffs = -1;
+  if (isH5GetData(wctx, fn, &imbp) == 0 && imb.buf_depth == 2) {
+    diffs = 0;
+    for (int i=0; i < imb.buf_width * imb.buf_height; i++) {
+      diffs += ((uint16_t *)imb.buf)[i] != frame * 100 + generation;
+    }
+  }
+
+  if (imb.destroy_extra != NULL) {
+    imb.destroy_extra(imb.extra);
+  }
+  isMaskRelease(imb.mask);
+  json_decref(imb.meta);
+  free(imb.buf);
+  return diffs;
+}
+
+/**
+ * Read a frame through a master file, replace its data file (as a
+ * new file renamed over the old one) without touching the master
+ * file, and read the frame again.  The master file is still cached
+ * but the data set must be reopened on the new data file.
+ *
+ * Returns the number of failures.
+ */
+int test_h5_replace(isWorkerContext_t *wctx) {
+  char dir[] = "/tmp/isConvertTest-XXXXXX";
+  char master_fn[64];
+  char data_fn[64];
+  char new_fn[64];
+  H5E_auto2_t old_func;
+  void *old_data;
+  int failed;
+  int diffs;
+
+  // Our master file has none of the detector's meta data: don't report each missing property
+  H5Eget_auto2(H5E_DEFAULT, &old_func, &old_data);
+  H5Eset_auto2(H5E_DEFAULT, NULL, NULL);
+
+  if (mkdtemp(dir) == NULL) {
+    H5Eset_auto2(H5E_DEFAULT, old_func, old_data);
+    printf("FAILED: could not make a directory for the HDF5 test files\n");
+    return 1;
+  }
+  snprintf(master_fn, sizeof(master_fn), "%s/test_master.h5", dir);
+  snprintf(data_fn,   sizeof(data_fn),   "%s/test_data_000001.h5", dir);
+  snprintf(new_fn,    sizeof(new_fn),    "%s/test_data_000001.h5.new", dir);
+
+  failed = 0;
+  if (write_h5_data(data_fn, 40, 30, 2, 1) != 0 || write_h5_master(master_fn, "test_data_000001.h5", 40, 30) != 0) {
+    printf("FAILED: could not write the HDF5 test files\n");
+    failed++;
+  } else {
+    diffs = read_h5_frame(wctx, master_fn, 2, 1);
+    printf("%s: read frame 2 from an HDF5 data file\n", diffs ? "FAILED" : "ok");
+    failed += diffs != 0;
+
+    if (write_h5_data(new_fn, 40, 30, 2, 7) != 0 || rename(new_fn, data_fn) != 0) {
+      printf("FAILED: could not replace the HDF5 data file\n");
+      failed++;
+    } else {
+      diffs = read_h5_frame(wctx, master_fn, 2, 7);
+      printf("%s: read frame 2 again from a replaced HDF5 data file\n", diffs ? "FAILED" : "ok");
+      failed += diffs != 0;
+    }
+  }
+
+  isH5FileCacheDestroy(wctx);
+  isMaskCacheDestroy(wctx);
+  unlink(new_fn);
+  unlink(data_fn);
+  unlink(master_fn);
+  rmdir(dir);
+  H5Eset_auto2(H5E_DEFAULT, old_func, old_data);
+  return failed;
+}
+
+/**
+ * Encode a made up image for redis, decode it again, and compare.
+ * A truncated DATA field must be turned down.  No redis server is
+ * needed.
+ *
+ * Returns the number of failures.
+ */
+int test_redis(isWorkerContext_t *wctx, int depth) {
+  isImageBufType imb;
+  isImageBufType out;
+  char *vals[IS_REDIS_N_FIELDS];
+  size_t lens[IS_REDIS_N_FIELDS];
+  const char *diff;
+  int failed;
+
+  make_test_image(&imb, 300, 200, depth, 0);
+  imb.key = "isConvertTest";
+
+  failed = 0;
+  if (isRedisEncode(wctx, &imb, vals, lens) != 0) {
+    printf("FAILED: redis encode %d bit\n", depth * 8);
+    failed++;
+  } else {
+    memset(&out, 0, sizeof(out));
+    out.key = imb.key;
+    if (isRedisDecode(wctx, &out, vals, lens) != 0) {
+      diff = "could not decode";
+    } else {
+      diff = compare_images(&imb, &out);
+      json_decref(out.meta);
+      free(out.buf);
+    }
+    printf("%s: redis round trip %d bit%s%s\n", diff ? "FAILED" : "ok", depth * 8, diff ? ": " : "", diff ? diff : "");
+    failed += diff != NULL;
+
+    memset(&out, 0, sizeof(out));
+    out.key = imb.key;
+    lens[IS_REDIS_N_FIELDS-1]--;
+    if (isRedisDecode(wctx, &out, vals, lens) == 0) {
+      printf("FAILED: redis decode %d bit accepted truncated data\n", depth * 8);
+      json_decref(out.meta);
+      free(out.buf);
+      failed++;
+    } else {
+      printf("ok: redis decode %d bit turns down truncated data\n", depth * 8);
+    }
+
+    for (int i=0; i < IS_REDIS_N_FIELDS; i++) {
+      free(vals[i]);
+    }
+  }
+
+  json_decref(imb.meta);
+  free(imb.buf);
+  return failed;
+}
+
+//
+// A redis server just big enough for isRedisGet, isRedisPut, and
+// isRedisNotify (see test_redis_lease).  Everything is kept in memory
+// under one mutex and expiry times are ignored.
+//
+
+//! Most keys the fake redis server holds at once
+#define FAKE_REDIS_KEYS 16
+
+//! Most hash fields or list items under one key of the fake redis server
+#define FAKE_REDIS_ITEMS 16
+
+//! What the fake redis server holds under one key (a string, a hash, or a list)
+typedef struct fakeRedisKeyStruct {
+  char *key;                            //!< The key (NULL for an unused slot)
+  int n;                                //!< Hash fields or list items held
+  char *names[FAKE_REDIS_ITEMS];        //!< Hash field names
+  char *vals[FAKE_REDIS_ITEMS];         //!< String value (vals[0]), hash values, or list items (newest first)
+  size_t lens[FAKE_REDIS_ITEMS];        //!< Lengths of vals
+} fakeRedisKey_t;
+
+//! The fake redis server
+static struct {
+  pthread_mutex_t mutex;                //!< Protects everything here
+  pthread_cond_t cond;                  //!< Signaled when a list is pushed or a connection ends
+  fakeRedisKey_t keys[FAKE_REDIS_KEYS]; //!< The data
+  int listener;                         //!< Listening socket
+  int connections;                      //!< Connections being served
+  pthread_t accepter;                   //!< Thread accepting connections
+} fakeRedis = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/**
+ * Find a key (or, when create is set, an unused slot for it).  Call
+ * with the fake redis mutex held.
+ */
+fakeRedisKey_t *fake_redis_key(const char *key, int create) {
+  fakeRedisKey_t *unused;
+
+  unused = NULL;
+  for (int i=0; i < FAKE_REDIS_KEYS; i++) {
+    if (fakeRedis.keys[i].key == NULL) {
+      unused = unused ? unused : &fakeRedis.keys[i];
+    } else if (strcmp(fakeRedis.keys[i].key, key) == 0) {
+      return &fakeRedis.keys[i];
+    }
+  }
+  if (!create || unused == NULL) {
+    return NULL;
+  }
+  unused->key = strdup(key);
+  unused->n   = 0;
+  return unused;
+}
+
+/**
+ * Throw out a key and everything under it.  Call with the fake redis
+ * mutex held.
+ */
+void fake_redis_del(fakeRedisKey_t *k) {
+  for (int i=0; i < k->n; i++) {
+    free(k->names[i]);
+    free(k->vals[i]);
+  }
+  free(k->key);
+  memset(k, 0, sizeof(*k));
+}
+
+/**
+ * Set the string value of a key.  Call with the fake redis mutex
+ * held.
+ */
+void fake_redis_set(const char *key, const char *val, size_t len) {
+  fakeRedisKey_t *k;
+
+  k = fake_redis_key(key, 1);
+  if (k == NULL) {
+    return;
+  }
+  free(k->vals[0]);
+  k->n       = 1;
+  k->vals[0] = malloc(len + 1);
+  memcpy(k->vals[0], val, len);
+  k->vals[0][len] = 0;
+  k->lens[0] = len;
+}
+
+/**
+ * The number held as the string value of a key (0 if there is none)
+ */
+int fake_redis_get_int(const char *key) {
+  fakeRedisKey_t *k;
+  int rtn;
+
+  pthread_mutex_lock(&fakeRedis.mutex);
+  k = fake_redis_key(key, 0);
+  rtn = k != NULL && k->n > 0 ? atoi(k->vals[0]) : 0;
+  pthread_mutex_unlock(&fakeRedis.mutex);
+  return rtn;
+}
+
+/**
+ * Send a reply: printf style for the fixed part and then, unless
+ * bulk is NULL, a bulk string
+ */
+void fake_redis_reply(int fd, const char *bulk, size_t len, const char *fmt, ...) {
+  char head[256];
+  va_list ap;
+  int n;
+
+  va_start(ap, fmt);
+  n = vsnprintf(head, sizeof(head), fmt, ap);
+  va_end(ap);
+  if (bulk != NULL) {
+    n += snprintf(head + n, sizeof(head) - n, "$%zu\r\n", len);
+  }
+  if (write(fd, head, n) != n) {
+    return;
+  }
+  if (bulk != NULL && (write(fd, bulk, len) != (ssize_t)len || write(fd, "\r\n", 2) != 2)) {
+    return;
+  }
+}
+
+/**
+ * Carry out one command.  argv holds argc NUL terminated arguments
+ * (lens gives their lengths).
+ */
+void fake_redis_command(int fd, int argc, char **argv, size_t *lens) {
+  struct timespec until;
+  fakeRedisKey_t *k;
+  char num[32];
+  int n;
+
+  pthread_mutex_lock(&fakeRedis.mutex);
+  k = argc > 1 ? fake_redis_key(argv[1], 0) : NULL;
+
+  if (strcasecmp(argv[0], "HMGET") == 0) {
+    fake_redis_reply(fd, NULL, 0, "*%d\r\n", argc - 2);
+    for (int i=2; i < argc; i++) {
+      int j;
+      for (j=0; k != NULL && j < k->n && (k->names[j] == NULL || strcmp(k->names[j], argv[i]) != 0); j++);
+      if (k != NULL && j < k->n) {
+        fake_redis_reply(fd, k->vals[j], k->lens[j], "");
+      } else {
+        fake_redis_reply(fd, NULL, 0, "$-1\r\n");
+      }
+    }
+  } else if (strcasecmp(argv[0], "HSET") == 0) {
+    k = k != NULL ? k : fake_redis_key(argv[1], 1);
+    n = 0;
+    for (int i=2; k != NULL && i+1 < argc; i += 2) {
+      int j;
+      for (j=0; j < k->n && strcmp(k->names[j], argv[i]) != 0; j++);
+      if (j == k->n) {
+        if (j == FAKE_REDIS_ITEMS) {
+          break;
+        }
+        k->names[j] = strdup(argv[i]);
+        k->vals[j]  = NULL;
+        k->n++;
+        n++;
+      }
+      free(k->vals[j]);
+      k->vals[j] = malloc(lens[i+1] + 1);
+      memcpy(k->vals[j], argv[i+1], lens[i+1] + 1);
+      k->lens[j] = lens[i+1];
+    }
+    fake_redis_reply(fd, NULL, 0, ":%d\r\n", n);
+  } else if (strcasecmp(argv[0], "SET") == 0) {
+    int nx = 0;
+    for (int i=3; i < argc; i++) {
+      nx |= strcasecmp(argv[i], "NX") == 0;
+    }
+    if (nx && k != NULL) {
+      fake_redis_reply(fd, NULL, 0, "$-1\r\n");
+    } else {
+      fake_redis_set(argv[1], argv[2], lens[2]);
+      fake_redis_reply(fd, NULL, 0, "+OK\r\n");
+    }
+  } else if (strcasecmp(argv[0], "GET") == 0) {
+    if (k != NULL && k->n > 0) {
+      fake_redis_reply(fd, k->vals[0], k->lens[0], "");
+    } else {
+      fake_redis_reply(fd, NULL, 0, "$-1\r\n");
+    }
+  } else if (strcasecmp(argv[0], "INCR") == 0 || strcasecmp(argv[0], "DECR") == 0) {
+    n = (k != NULL && k->n > 0 ? atoi(k->vals[0]) : 0) + (strcasecmp(argv[0], "INCR") == 0 ? 1 : -1);
+    snprintf(num, sizeof(num), "%d", n);
+    fake_redis_set(argv[1], num, strlen(num));
+    fake_redis_reply(fd, NULL, 0, ":%d\r\n", n);
+  } else if (strcasecmp(argv[0], "EXPIRE") == 0 || strcasecmp(argv[0], "PEXPIRE") == 0) {
+    fake_redis_reply(fd, NULL, 0, ":%d\r\n", k != NULL);
+  } else if (strcasecmp(argv[0], "DEL") == 0) {
+    if (k != NULL) {
+      fake_redis_del(k);
+    }
+    fake_redis_reply(fd, NULL, 0, ":%d\r\n", k != NULL);
+  } else if (strcasecmp(argv[0], "EVAL") == 0 && argc == 5) {
+    // The only script we know: delete KEYS[1] if it holds ARGV[1]
+    k = fake_redis_key(argv[3], 0);
+    n = k != NULL && k->n > 0 && strcmp(k->vals[0], argv[4]) == 0;
+    if (n) {
+      fake_redis_del(k);
+    }
+    fake_redis_reply(fd, NULL, 0, ":%d\r\n", n);
+  } else if (strcasecmp(argv[0], "LPUSH") == 0) {
+    k = k != NULL ? k : fake_redis_key(argv[1], 1);
+    for (int i=2; k != NULL && i < argc && k->n < FAKE_REDIS_ITEMS; i++) {
+      memmove(&k->vals[1], &k->vals[0], k->n * sizeof(k->vals[0]));
+      memmove(&k->lens[1], &k->lens[0], k->n * sizeof(k->lens[0]));
+      k->vals[0] = strdup(argv[i]);
+      k->lens[0] = lens[i];
+      k->names[k->n] = NULL;
+      k->n++;
+    }
+    pthread_cond_broadcast(&fakeRedis.cond);
+    fake_redis_reply(fd, NULL, 0, ":%d\r\n", k != NULL ? k->n : 0);
+  } else if (strcasecmp(argv[0], "BLPOP") == 0 && argc == 3) {
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += atoi(argv[2]);
+    while ((k = fake_redis_key(argv[1], 0)) == NULL || k->n == 0) {
+      if (pthread_cond_timedwait(&fakeRedis.cond, &fakeRedis.mutex, &until) != 0) {
+        break;
+      }
+    }
+    if (k != NULL && k->n > 0) {
+      fake_redis_reply(fd, NULL, 0, "*2\r\n");
+      fake_redis_reply(fd, argv[1], lens[1], "");
+      fake_redis_reply(fd, k->vals[0], k->lens[0], "");
+      free(k->vals[0]);
+      k->n--;
+      memmove(&k->vals[0], &k->vals[1], k->n * sizeof(k->vals[0]));
+      memmove(&k->lens[0], &k->lens[1], k->n * sizeof(k->lens[0]));
+      if (k->n == 0) {
+        fake_redis_del(k);
+      }
+    } else {
+      fake_redis_reply(fd, NULL, 0, "*-1\r\n");
+    }
+  } else {
+    fake_redis_reply(fd, NULL, 0, "-ERR unknown command '%s'\r\n", argv[0]);
+  }
+  pthread_mutex_unlock(&fakeRedis.mutex);
+}
+
+/**
+ * Serve one connection until the client hangs up
+ */
+void *fake_redis_connection(void *arg) {
+  char *argv[2 + 2*IS_REDIS_N_FIELDS + 2];
+  size_t lens[2 + 2*IS_REDIS_N_FIELDS + 2];
+  char line[64];
+  FILE *in;
+  int argc;
+  int fd;
+
+  fd = (int)(intptr_t)arg;
+  in = fdopen(dup(fd), "r");
+
+  while (in != NULL && fgets(line, sizeof(line), in) != NULL && line[0] == '*') {
+    argc = atoi(line + 1);
+    if (argc < 1 || argc > sizeof(argv)/sizeof(argv[0])) {
+      break;
+    }
+    memset(argv, 0, sizeof(argv));
+    for (int i=0; i < argc; i++) {
+      if (fgets(line, sizeof(line), in) == NULL || line[0] != '$') {
+        argc = i;
+        break;
+      }
+      lens[i] = strtoul(line + 1, NULL, 10);
+      argv[i] = malloc(lens[i] + 2);
+      if (argv[i] == NULL || fread(argv[i], 1, lens[i] + 2, in) != lens[i] + 2) {
+        argc = i;
+        break;
+      }
+      argv[i][lens[i]] = 0;
+    }
+    if (argc > 0 && argv[argc-1] != NULL) {
+      fake_redis_command(fd, argc, argv, lens);
+    }
+    for (int i=0; i < sizeof(argv)/sizeof(argv[0]); i++) {
+      free(argv[i]);
+    }
+  }
+
+  if (in != NULL) {
+    fclose(in);
+  }
+  close(fd);
+
+  pthread_mutex_lock(&fakeRedis.mutex);
+  fakeRedis.connections--;
+  pthread_cond_broadcast(&fakeRedis.cond);
+  pthread_mutex_unlock(&fakeRedis.mutex);
+  return NULL;
+}
+
+/**
+ * Take connections (each served by a thread of its own) until the
+ * listening socket is shut down
+ */
+void *fake_redis_accept(void *arg) {
+  pthread_t thread;
+  int fd;
+
+  while ((fd = accept(fakeRedis.listener, NULL, NULL)) >= 0) {
+    pthread_mutex_lock(&fakeRedis.mutex);
+    fakeRedis.connections++;
+    pthread_mutex_unlock(&fakeRedis.mutex);
+    pthread_create(&thread, NULL, fake_redis_connection, (void *)(intptr_t)fd);
+    pthread_detach(thread);
+  }
+  return NULL;
+}
+
+/**
+ * Start the fake redis server on a port of the kernel's choosing
+ *
+ * Returns the port, or -1 if we could not listen.
+ */
+int fake_redis_start() {
+  struct sockaddr_in addr;
+  socklen_t addr_len;
+
+  fakeRedis.listener = socket(AF_INET, SOCK_STREAM, 0);
+  if (fakeRedis.listener < 0) {
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family      = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port        = 0;
+  addr_len             = sizeof(addr);
+  if (bind(fakeRedis.listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fakeRedis.listener, 8) != 0 ||
+      getsockname(fakeRedis.listener, (struct sockaddr *)&addr, &addr_len) != 0) {
+    close(fakeRedis.listener);
+    return -1;
+  }
+
+  pthread_create(&fakeRedis.accepter, NULL, fake_redis_accept, NULL);
+  return ntohs(addr.sin_port);
+}
+
+/**
+ * Stop the fake redis server once every client has hung up and
+ * forget everything it held
+ */
+void fake_redis_stop() {
+  shutdown(fakeRedis.listener, SHUT_RDWR);
+  close(fakeRedis.listener);
+  pthread_join(fakeRedis.accepter, NULL);
+
+  pthread_mutex_lock(&fakeRedis.mutex);
+  while (fakeRedis.connections > 0) {
+    pthread_cond_wait(&fakeRedis.cond, &fakeRedis.mutex);
+  }
+  for (int i=0; i < FAKE_REDIS_KEYS; i++) {
+    if (fakeRedis.keys[i].key != NULL) {
+      fake_redis_del(&fakeRedis.keys[i]);
+    }
+  }
+  pthread_mutex_unlock(&fakeRedis.mutex);
+}
+
+//! One of the processes asking redis for the same reduced image (see test_redis_lease)
+typedef struct leaseFetcherStruct {
+  isWorkerContext_t *wctx;              //!< This "process"'s context
+  int port;                             //!< Where the fake redis server listens
+  char *key;                            //!< Reduced image we want
+  isImageBufType *expected;             //!< What the image should hold
+  int *disk_reads;                      //!< Fetchers that had to make the image themselves
+  int read;                             //!< Non-zero if this one made the image
+  int waiters;                          //!< Waiters counted in redis while this one made the image
+  const char *wrong;                    //!< NULL if we got the right image, otherwise what went wrong
+} leaseFetcher_t;
+
+/**
+ * Get the image as isReduceImage would.  Whoever ends up with the
+ * lease "reads from disk": it waits (up to 5 seconds) for the other
+ * fetcher to be counted as waiting in redis before filling the buffer
+ * with a copy of the expected image and putting it in redis.
+ */
+void *lease_fetcher(void *arg) {
+  leaseFetcher_t *lf;
+  isImageBufType *imb;
+  redisContext *rc;
+  char waiters[128];
+  const char *diff;
+
+  lf = arg;
+  rc = redisConnect("127.0.0.1", lf->port);
+  if (rc == NULL || rc->err) {
+    lf->wrong = "could not connect";
+    if (rc != NULL) {
+      redisFree(rc);
+    }
+    return NULL;
+  }
+
+  imb = isGetImageBufFromKey(lf->wctx, rc, lf->key, REDUCED_IMAGE_BUFFER);
+  if (!imb->ready) {
+    lf->read = 1;
+    __atomic_add_fetch(lf->disk_reads, 1, __ATOMIC_SEQ_CST);
+    if (!imb->redis_lease) {
+      lf->wrong = "made the image without the lease";
+    }
+
+    snprintf(waiters, sizeof(waiters), "%s-WAITERS", lf->key);
+    for (int i=0; i < 500 && (lf->waiters = fake_redis_get_int(waiters)) < 1; i++) {
+      usleep(10000);
+    }
+
+    imb->buf_width  = lf->expected->buf_width;
+    imb->buf_height = lf->expected->buf_height;
+    imb->buf_depth  = lf->expected->buf_depth;
+    imb->buf_size   = lf->expected->buf_size;
+    imb->buf        = malloc(imb->buf_size);
+    memcpy(imb->buf, lf->expected->buf, imb->buf_size);
+    imb->meta       = json_deep_copy(lf->expected->meta);
+
+    isRedisPut(lf->wctx, rc, imb);
+    isPublishImageBuf(lf->wctx, imb);
+  }
+
+  diff = compare_images(lf->expected, imb);
+  if (diff != NULL && lf->wrong == NULL) {
+    lf->wrong = diff;
+  }
+
+  isReleaseImageBuf(lf->wctx, imb);
+  redisFree(rc);
+  return NULL;
+}
+
+/**
+ * Two processes (contexts with no shared cache between them) ask
+ * redis for the same reduced image, the second while the first is
+ * still making it.  Only the first may make the image; the second
+ * must wait for it to be published and then get the very same
+ * image.  Uses a fake redis server in this process.
+ *
+ * Returns the number of failures.
+ */
+int test_redis_lease() {
+  isImageBufType expected;
+  leaseFetcher_t lfs[2];
+  pthread_t threads[2];
+  char shm_name[64];
+  char key[64];
+  int disk_reads;
+  int failed;
+  int port;
+
+  port = fake_redis_start();
+  if (port < 0) {
+    printf("skipped: could not start a fake redis server\n");
+    return 0;
+  }
+
+  make_test_image(&expected, 300, 200, 2, 0);
+  snprintf(key, sizeof(key), "isConvertTest-%d-lease", (int)getpid());
+  disk_reads = 0;
+
+  memset(lfs, 0, sizeof(lfs));
+  for (int i=0; i < 2; i++) {
+    snprintf(shm_name, sizeof(shm_name), "/isConvertTest-%d-lease-%d", (int)getpid(), i);
+    lfs[i].wctx = isDataInit(key, shm_name);
+    isShmUnlink(lfs[i].wctx->shm);
+    isShmDestroy(lfs[i].wctx->shm);
+    lfs[i].wctx->shm = NULL;
+
+    lfs[i].port       = port;
+    lfs[i].key        = key;
+    lfs[i].expected   = &expected;
+    lfs[i].disk_reads = &disk_reads;
+  }
+
+  // The second fetcher comes along once the first has the lease
+  pthread_create(&threads[0], NULL, lease_fetcher, &lfs[0]);
+  for (int i=0; i < 500 && __atomic_load_n(&disk_reads, __ATOMIC_SEQ_CST) == 0; i++) {
+    usleep(10000);
+  }
+  pthread_create(&threads[1], NULL, lease_fetcher, &lfs[1]);
+  pthread_join(threads[0], NULL);
+  pthread_join(threads[1], NULL);
+
+  failed = 0;
+  printf("%s: redis lease lets one of two fetchers make an image (%d did)\n", disk_reads == 1 && lfs[0].read ? "ok" : "FAILED", disk_reads);
+  failed += disk_reads != 1 || !lfs[0].read;
+  printf("%s: redis lease holder sees the other fetcher waiting (%d waiting)\n", lfs[0].waiters == 1 ? "ok" : "FAILED", lfs[0].waiters);
+  failed += lfs[0].waiters != 1;
+  for (int i=0; i < 2; i++) {
+    printf("%s: redis lease fetcher %d gets the image%s%s\n", lfs[i].wrong ? "FAILED" : "ok", i + 1, lfs[i].wrong ? ": " : "", lfs[i].wrong ? lfs[i].wrong : "");
+    failed += lfs[i].wrong != NULL;
+  }
+
+  isDataDestroy(lfs[0].wctx);
+  isDataDestroy(lfs[1].wctx);
+  fake_redis_stop();
+  json_decref(expected.meta);
+  free(expected.buf);
+  return failed;
+}
+
+/**
+ * Encode a made up image each way a raw job can ask for, then undo
+ * the LZ4 compression and the delta encoding as a client would and
+ * compare with the original pixels (which must be left alone).
+ *
+ * Returns the number of failures.
+ */
+int test_raw(int depth) {
+  isImageBufType imb;
+  isImageBufType orig;
+  char *data;
+  char *pixels;
+  int data_len;
+  int failed;
+  int wrong;
+  int n;
+
+  make_test_image(&imb, 300, 200, depth, 0);
+  orig = imb;
+  orig.buf = malloc(imb.buf_size);
+  pixels   = malloc(imb.buf_size);
+  if (orig.buf == NULL || pixels == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  memcpy(orig.buf, imb.buf, imb.buf_size);
+
+  failed = 0;
+  for (int delta=0; delta < 2; delta++) {
+    for (int use_lz4=0; use_lz4 < 2; use_lz4++) {
+      data = isRawEncode(&imb, delta, use_lz4, &data_len);
+      if (data == NULL) {
+        printf("FAILED: raw %d bit%s%s could not encode\n", depth * 8, delta ? " delta" : "", use_lz4 ? " lz4" : "");
+        failed++;
+        continue;
+      }
+
+      wrong = memcmp(imb.buf, orig.buf, imb.buf_size) != 0;
+      if (use_lz4) {
+        n = LZ4_decompress_safe(data, pixels, data_len, imb.buf_size);
+        wrong += n != imb.buf_size;
+      } else {
+        wrong += data_len != imb.buf_size;
+        memcpy(pixels, data, imb.buf_size);
+      }
+      wrong += delta && memcmp(pixels, orig.buf, imb.buf_size) == 0;
+
+      if (delta) {
+        for (int row=0; row < imb.buf_height; row++) {
+          for (int col=1; col < imb.buf_width; col++) {
+            int i = row * imb.buf_width + col;
+            if (depth == 2) {
+              ((uint16_t *)pixels)[i] += ((uint16_t *)pixels)[i-1];
+            } else {
+              ((uint32_t *)pixels)[i] += ((uint32_t *)pixels)[i-1];
+            }
+          }
+        }
+      }
+      wrong += memcmp(pixels, orig.buf, imb.buf_size) != 0;
+
+      printf("%s: raw %d bit%s%s decodes to the reduced image (%d bytes)\n", wrong ? "FAILED" : "ok", depth * 8,
+             delta ? " delta" : "", use_lz4 ? " lz4" : "", data_len);
+      failed += wrong != 0;
+      isBufPut(data);
+    }
+  }
+
+  free(pixels);
+  free(orig.buf);
+  json_decref(imb.meta);
+  free(imb.buf);
+  return failed;
+}
+
+/**
+ * Share a made up image through our private shared cache, get it
+ * back as another process would, and compare.  The buffer is left in
+ * the index (unreferenced) until self_test removes the index.
+ *
+ * Returns the number of failures.
+ */
+int test_shm(isWorkerContext_t *wctx, int depth, int with_mask) {
+  isImageBufType imb;
+  isImageBufType out;
+  void *pixels;
+  const char *diff;
+  char key[128];
+
+  if (wctx->shm == NULL) {
+    printf("skipped: shm round trip %d bit%s (no shared cache)\n", depth * 8, with_mask ? " masked" : "");
+    return 0;
+  }
+
+  make_test_image(&imb, 300, 200, depth, with_mask);
+  snprintf(key, sizeof(key), "isConvertTest-%d-%d-%d", (int)getpid(), depth, with_mask);
+  imb.key       = key;
+  imb.hash      = depth * 2 + with_mask;
+  imb.buf_class = REDUCED_IMAGE_BUFFER;
+  imb.frame     = 7;
+
+  // isShmPut trades imb.buf for the shared copy
+  pixels = malloc(imb.buf_size);
+  if (pixels == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  memcpy(pixels, imb.buf, imb.buf_size);
+
+  memset(&out, 0, sizeof(out));
+  out.key  = imb.key;
+  out.hash = imb.hash;
+
+  isShmPut(wctx, &imb);
+  if (imb.shm_map == NULL) {
+    diff = "not shared";
+  } else if (isShmGet(wctx, &out) != 0) {
+    diff = "not found";
+  } else if ((diff = compare_images(&imb, &out)) != NULL) {
+    // diff says what
+  } else if (memcmp(out.buf, pixels, out.buf_size) != 0) {
+    diff = "pixels changed";
+  } else if (((uintptr_t)out.buf % 64) != 0) {
+    diff = "pixels not aligned";
+  } else if (out.frame != imb.frame) {
+    diff = "frame";
+  } else if ((out.mask == NULL) != (imb.mask == NULL) ||
+	     (out.mask && memcmp(out.mask->bits, imb.mask->bits, sizeof(uint64_t) * imb.mask->words * imb.mask->height) != 0)) {
+    diff = "mask";
+  }
+  printf("%s: shm round trip %d bit%s%s%s\n", diff ? "FAILED" : "ok", depth * 8, with_mask ? " masked" : "", diff ? ": " : "", diff ? diff : "");
+
+  if (out.shm_map != NULL) {
+    munmap(out.shm_map, out.shm_map_size);
+    isShmRelease(wctx, out.shm_slot, out.shm_generation);
+  }
+  if (imb.shm_map != NULL) {
+    munmap(imb.shm_map, imb.shm_map_size);
+    isShmRelease(wctx, imb.shm_slot, imb.shm_generation);
+  } else {
+    free(imb.buf);
+  }
+  isMaskRelease(out.mask);
+  isMaskRelease(imb.mask);
+  json_decref(out.meta);
+  json_decref(imb.meta);
+  free(pixels);
+  return diff != NULL;
+}
+
+/**
+ * Compress a made up image bigger than IS_JPEG_STRIP_PIXELS in strips
+ * and in one go, and check that both decompress to the same pixels.
+ * Strips with tables or restart markers of their own (TJ_OPTIMIZE or
+ * TJ_RESTART in the environment) must be turned down.
+ *
+ * Returns the number of failures.
+ */
+int test_jpeg_strips(isWorkerContext_t *wctx, int gray) {
+  static const char *envs[] = {"TJ_OPTIMIZE", "TJ_RESTART"};
+  unsigned char *pixels;
+  int width;
+  int height;
+  int ps;
+  int failed;
+  int diffs;
+
+  width  = 1250;
+  height = 1000;
+  ps     = gray ? 1 : 3;
+  pixels = malloc((size_t)width * height * ps);
+  if (pixels == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  srand(width + gray);
+  for (int i=0; i < width * height * ps; i++) {
+    pixels[i] = ((i / ps) % width + (i / ps) / width) / 9 + rand() % 32;
+  }
+
+  for (int e=0; e < sizeof(envs)/sizeof(envs[0]); e++) {
+    unsetenv(envs[e]);
+  }
+
+  failed = 0;
+  for (int n=2; n <= 7; n += 5) {
+    diffs = isJpegCheck(wctx, pixels, width, height, gray, TJSAMP_420, n);
+    printf("%s: jpeg %dx%d %s in %d strips %s\n", diffs ? "FAILED" : "ok", width, height, gray ? "gray" : "color", n,
+           diffs < 0 ? "was turned down" : diffs ? "differs from one go" : "matches one go");
+    failed += diffs != 0;
+  }
+
+  for (int e=0; e < sizeof(envs)/sizeof(envs[0]); e++) {
+    setenv(envs[e], "1", 1);
+    diffs = isJpegCheck(wctx, pixels, width, height, gray, TJSAMP_420, 4);
+    unsetenv(envs[e]);
+    printf("%s: jpeg %s strips with %s=1 %s\n", diffs < 0 ? "ok" : "FAILED", gray ? "gray" : "color", envs[e],
+           diffs < 0 ? "are turned down" : "were stitched together");
+    failed += diffs >= 0;
+  }
+
+  free(pixels);
+  return failed;
+}
+
+/**
+ * Map a made up image to gray levels through isJpegMap's lookup table
+ * (the image is big enough) and again a pixel at a time (each pixel
+ * on its own is too small for the table).  Every 16 bit value, the
+ * saturated one included, turns up.  32 bit images get values all
+ * over, below wval and above bval, and some saturated ones.
+ *
+ * Returns 1 if the gray levels differ by more than maxdiff, 0 otherwise.
+ */
+int test_jpeg_map(int depth, uint32_t wval, uint32_t bval, int maxdiff) {
+  isImageBufType imb;
+  isImageBufType pxl;
+  unsigned char *lut_gray;
+  unsigned char gray;
+  int saturated;
+  int pxl_saturated;
+  int worst;
+  int npixels;
+  int i;
+
+  memset(&imb, 0, sizeof(imb));
+  imb.buf_width  = 512;
+  imb.buf_height = IS_JPEG_LUT_RATIO * 65536 / 512;
+  imb.buf_depth  = depth;
+  npixels        = imb.buf_width * imb.buf_height;
+  imb.buf        = malloc(npixels * depth);
+  lut_gray       = malloc(npixels);
+  if (imb.buf == NULL || lut_gray == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+
+  srand(depth + wval + bval);
+  for (i=0; i<npixels; i++) {
+    if (depth == 2) {
+      ((uint16_t *)imb.buf)[i] = i;
+    } else {
+      ((uint32_t *)imb.buf)[i] = i % 1000 == 0 ? 0xffffffff : ((uint32_t)rand() << 16) ^ rand();
+      if (i & 1) {
+        // Half of them near our range
+        ((uint32_t *)imb.buf)[i] = wval - 100 + ((uint64_t)(bval - wval + 200) * i) / npixels;
+      }
+    }
+  }
+
+  saturated = isJpegMap(&imb, wval, bval, lut_gray);
+
+  pxl = imb;
+  pxl.buf_width  = 1;
+  pxl.buf_height = 1;
+  pxl_saturated  = 0;
+  worst          = 0;
+  for (i=0; i<npixels; i++) {
+    pxl.buf = (char *)imb.buf + (size_t)i * depth;
+    pxl_saturated |= isJpegMap(&pxl, wval, bval, &gray);
+    worst = abs(gray - lut_gray[i]) > worst ? abs(gray - lut_gray[i]) : worst;
+  }
+
+  printf("%s: jpeg map %d bit from %u to %u through the table is off by %d gray level%s (%d allowed)%s\n",
+         worst > maxdiff || saturated != pxl_saturated ? "FAILED" : "ok", depth * 8, wval, bval, worst, worst == 1 ? "" : "s", maxdiff,
+         saturated != pxl_saturated ? " and saturation differs" : "");
+
+  free(lut_gray);
+  free(imb.buf);
+  return worst > maxdiff || saturated != pxl_saturated;
+}
+
+/**
+ * The histogram kept with a reduced image and the contrast picked
+ * from it.  First an image with the first and last value of every
+ * histogram bin (and a saturated pixel that must be left out): each
+ * bin must count exactly two.  Then images with known percentiles:
+ * isJpegContrast must pick the first value of the bins they fall in.
+ *
+ * Returns the number of failures.
+ */
+int test_histogram(isWorkerContext_t *wctx) {
+  //
+  // uniform:      0 to 999.  The 20th percentile (199) is in bin 192-199
+  //               and the 99.5th (994) in bin 992-1023.
+  // bright spots: 1000 to 1099 with 0.9% at 200000 and 0.1% saturated.
+  //               The 20th percentile (1020) is in bin 992-1023 and the
+  //               99.5th in bin 196608-204799.
+  //
+  static const struct {
+    const char *name;
+    int depth;
+    uint32_t wval;
+    uint32_t bval;
+  } cases[] = {
+    { "uniform",      2, 192,    992 },
+    { "bright spots", 4, 992, 196608 },
+  };
+  isImageBufType imb;
+  json_t *meta;
+  json_t *hist;
+  json_t *job;
+  int32_t wval, bval;
+  int failed;
+  int wrong;
+  int i;
+
+  failed = 0;
+
+  //
+  // Bin edges
+  //
+  memset(&imb, 0, sizeof(imb));
+  imb.buf_width  = 2 * IS_HIST_BINS + 1;
+  imb.buf_height = 1;
+  imb.buf_depth  = 4;
+  imb.buf        = malloc(imb.buf_width * sizeof(uint32_t));
+  if (imb.buf == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  for (i=0; i<IS_HIST_BINS; i++) {
+    ((uint32_t *)imb.buf)[2*i]   = isHistValue(i);
+    ((uint32_t *)imb.buf)[2*i+1] = i < IS_HIST_BINS-1 ? isHistValue(i+1) - 1 : 0xfffffffe;
+  }
+  ((uint32_t *)imb.buf)[2*IS_HIST_BINS] = 0xffffffff;
+
+  meta = isReduceStats(wctx, &imb, imb.buf_width, 1);
+  hist = json_object_get(meta, "histogram");
+  wrong = json_array_size(hist) != IS_HIST_BINS;
+  for (i=0; i<json_array_size(hist); i++) {
+    wrong += json_integer_value(json_array_get(hist, i)) != 2;
+  }
+  for (i=1; i<IS_HIST_BINS; i++) {
+    // Strictly increasing and never more than about 6% wide
+    wrong += isHistValue(i) <= isHistValue(i-1);
+    wrong += i > (1 << IS_HIST_SUB_BITS) && isHistValue(i) - isHistValue(i-1) > isHistValue(i-1) >> IS_HIST_SUB_BITS;
+  }
+  printf("%s: histogram bin edges\n", wrong ? "FAILED" : "ok");
+  failed += wrong != 0;
+  json_decref(meta);
+  free(imb.buf);
+
+  //
+  // Percentiles
+  //
+  job = json_object();
+  json_object_set_new(job, "wval", json_integer(-1));
+  for (int c=0; c < sizeof(cases)/sizeof(cases[0]); c++) {
+    memset(&imb, 0, sizeof(imb));
+    imb.buf_width  = 1000;
+    imb.buf_height = 1000;
+    imb.buf_depth  = cases[c].depth;
+    imb.buf        = malloc(imb.buf_width * imb.buf_height * imb.buf_depth);
+    if (imb.buf == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    for (i=0; i < imb.buf_width * imb.buf_height; i++) {
+      if (cases[c].depth == 2) {
+        ((uint16_t *)imb.buf)[i] = i % 1000;
+      } else {
+        ((uint32_t *)imb.buf)[i] = i % 1000 == 0 ? 0xffffffff : (i % 1000 < 10 ? 200000 : 1000 + i % 100);
+      }
+    }
+
+    meta = isReduceStats(wctx, &imb, imb.buf_width, imb.buf_height);
+    isJpegContrast(wctx, job, meta, &wval, &bval);
+    printf("%s: contrast of %s image from %d to %d (should be %u to %u)\n",
+           wval == cases[c].wval && bval == cases[c].bval ? "ok" : "FAILED", cases[c].name, wval, bval, cases[c].wval, cases[c].bval);
+    failed += wval != cases[c].wval || bval != cases[c].bval;
+    json_decref(meta);
+    free(imb.buf);
+  }
+  json_decref(job);
+
+  return failed;
+}
+
+//! Buffers the cache tests have filled and how many of them have been destroyed since
+static int cache_filled;
+static int cache_destroyed;
+
+/**
+ * destroy_extra of the buffers the cache tests fill: count them
+ */
+void cache_destroy(void *extra) {
+  __atomic_add_fetch(&cache_destroyed, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * destroy_extra of the one buffer test_cache holds on to: extra
+ * points to a flag to set
+ */
+void cache_destroy_held(void *extra) {
+  *(int *)extra = 1;
+  cache_destroy(extra);
+}
+
+/**
+ * Get buffer n of a class from the cache.  Fill it with size bytes
+ * (starting with n) and publish it if nobody has.
+ *
+ * Returns the buffer (release it) or NULL if it holds the wrong data.
+ */
+isImageBufType *cache_get(isWorkerContext_t *wctx, int n, image_buffer_class buf_class, size_t size) {
+  isImageBufType *imb;
+  char key[64];
+
+  snprintf(key, sizeof(key), "isConvertTest-%d-cache-%d-%d", (int)getpid(), buf_class, n);
+  imb = isGetImageBufFromKey(wctx, NULL, key, buf_class);
+  if (!__atomic_load_n(&imb->ready, __ATOMIC_ACQUIRE)) {
+    // Write locked and ours to fill
+    imb->buf = calloc(1, size);
+    if (imb->buf == NULL) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    *(int *)imb->buf   = n;
+    imb->buf_size      = size;
+    imb->destroy_extra = cache_destroy;
+    __atomic_add_fetch(&cache_filled, 1, __ATOMIC_SEQ_CST);
+    isPublishImageBuf(wctx, imb);
+  }
+
+  if (*(int *)imb->buf != n) {
+    isReleaseImageBuf(wctx, imb);
+    return NULL;
+  }
+  return imb;
+}
+
+/**
+ * Returns 1 if some shard has more of a class than its budget
+ */
+int cache_over_budget(isWorkerContext_t *wctx, image_buffer_class buf_class) {
+  for (int i=0; i < IS_CACHE_SHARDS; i++) {
+    if (wctx->shards[i].bytes[buf_class] > wctx->shard_budget[buf_class]) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Returns the number of buffers in the cache that someone still has a
+ * reference to
+ */
+int cache_referenced(isWorkerContext_t *wctx) {
+  isImageBufType *p;
+  int rtn;
+
+  rtn = 0;
+  for (int i=0; i < IS_CACHE_SHARDS; i++) {
+    for (unsigned int b=0; b < wctx->shards[i].table->n_buckets; b++) {
+      for (p=wctx->shards[i].table->buckets[b]; p != NULL; p=p->hnext) {
+        rtn += p->refs != 0;
+      }
+    }
+  }
+  return rtn;
+}
+
+//! What each cache_thread does
+typedef struct cacheThreadStruct {
+  isWorkerContext_t *wctx;
+  unsigned int seed;
+  int wrong;                            //!< buffers that held the wrong data
+} cacheThread_t;
+
+/**
+ * Get, check, and release random buffers from a small set that the
+ * other threads are using too.
+ */
+void *cache_thread(void *voidp) {
+  cacheThread_t *ct;
+  isImageBufType *imb;
+
+  ct = voidp;
+  for (int i=0; i < 5000; i++) {
+    imb = cache_get(ct->wctx, rand_r(&ct->seed) % 64, i & 1, 4096);
+    if (imb == NULL) {
+      ct->wrong++;
+      continue;
+    }
+    isReleaseImageBuf(ct->wctx, imb);
+  }
+  return NULL;
+}
+
+/**
+ * Run the image buffer cache with small budgets: eviction must keep
+ * each class within its budget without touching buffers in use,
+ * growing a shard must not lose anything, and threads sharing keys
+ * must leave no references behind.  Every buffer filled must be
+ * destroyed exactly once by the time isDataDestroy returns.
+ *
+ * Returns the number of failures.
+ */
+int test_cache() {
+  isWorkerContext_t *wctx;
+  isImageBufType *held;
+  isImageBufType *imb;
+  cacheThread_t cts[8];
+  pthread_t threads[8];
+  char shm_name[64];
+  char key[64];
+  int held_destroyed;
+  int destroyed;
+  int failed;
+  int wrong;
+  int over;
+  int n;
+
+  snprintf(key, sizeof(key), "isConvertTest-%d", (int)getpid());
+  cache_filled    = 0;
+  cache_destroyed = 0;
+
+  // No sharing with other processes: throw away our private index
+  snprintf(shm_name, sizeof(shm_name), "/isConvertTest-%d-cache", (int)getpid());
+  wctx = isDataInit(key, shm_name);
+  isShmUnlink(wctx->shm);
+  isShmDestroy(wctx->shm);
+  wctx->shm = NULL;
+
+  //
+  // Room for about four buffers of each class in each shard
+  //
+  wctx->shard_budget[RAW_IMAGE_BUFFER]     = 4 * (sizeof(isImageBufType) + 64 + 10000);
+  wctx->shard_budget[REDUCED_IMAGE_BUFFER] = 4 * (sizeof(isImageBufType) + 64 + 1000);
+
+  failed = 0;
+
+  // Fill the reduced class, then flood the raw class past its budget
+  for (n=0; n < 32; n++) {
+    isReleaseImageBuf(wctx, cache_get(wctx, n, REDUCED_IMAGE_BUFFER, 1000));
+  }
+  held_destroyed      = 0;
+  held                = cache_get(wctx, 1000, RAW_IMAGE_BUFFER, 10000);
+  held->extra         = &held_destroyed;
+  held->destroy_extra = cache_destroy_held;
+  over = 0;
+  for (n=0; n < 400; n++) {
+    isReleaseImageBuf(wctx, cache_get(wctx, n, RAW_IMAGE_BUFFER, 10000));
+    over += cache_over_budget(wctx, RAW_IMAGE_BUFFER) || cache_over_budget(wctx, REDUCED_IMAGE_BUFFER);
+  }
+  printf("%s: cache keeps each class within budget\n", over ? "FAILED" : "ok");
+  failed += over != 0;
+
+  if (held_destroyed || !held->cached || *(int *)held->buf != 1000) {
+    printf("FAILED: cache evicted a buffer in use\n");
+    failed++;
+  } else {
+    // Once we let go the next flood should take it
+    isReleaseImageBuf(wctx, held);
+    for (n=400; n < 800 && !held_destroyed; n++) {
+      isReleaseImageBuf(wctx, cache_get(wctx, n, RAW_IMAGE_BUFFER, 10000));
+    }
+    printf("%s: cache keeps a buffer in use and frees it once released\n", held_destroyed ? "ok" : "FAILED");
+    failed += !held_destroyed;
+  }
+
+  // An abandoned buffer goes with its last reference
+  destroyed = cache_destroyed;
+  snprintf(key, sizeof(key), "isConvertTest-%d-abandoned", (int)getpid());
+  imb = isGetImageBufFromKey(wctx, NULL, key, RAW_IMAGE_BUFFER);
+  imb->destroy_extra = cache_destroy;
+  cache_filled++;
+  isAbandonImageBuf(wctx, imb);
+  printf("%s: cache destroys an abandoned buffer on its last release\n", cache_destroyed == destroyed + 1 ? "ok" : "FAILED");
+  failed += cache_destroyed != destroyed + 1;
+
+  //
+  // Enough small buffers (with no budget to speak of) that every
+  // shard has to grow a few times
+  //
+  wctx->shard_budget[RAW_IMAGE_BUFFER] = (size_t)1 << 40;
+  n = cache_filled;
+  for (int i=0; i < 16 * IS_CACHE_SHARDS * IS_CACHE_INITIAL_BUCKETS; i++) {
+    isReleaseImageBuf(wctx, cache_get(wctx, 10000 + i, RAW_IMAGE_BUFFER, 16));
+  }
+  wrong = cache_filled - n != 16 * IS_CACHE_SHARDS * IS_CACHE_INITIAL_BUCKETS;
+  for (int i=0; i < 16 * IS_CACHE_SHARDS * IS_CACHE_INITIAL_BUCKETS; i++) {
+    imb = cache_get(wctx, 10000 + i, RAW_IMAGE_BUFFER, 16);
+    if (imb == NULL) {
+      wrong++;
+      continue;
+    }
+    isReleaseImageBuf(wctx, imb);
+  }
+  wrong += cache_filled - n != 16 * IS_CACHE_SHARDS * IS_CACHE_INITIAL_BUCKETS;
+  wrong += wctx->shards[0].table->n_buckets < 8 * IS_CACHE_INITIAL_BUCKETS;
+  printf("%s: cache finds every buffer after growing\n", wrong ? "FAILED" : "ok");
+  failed += wrong != 0;
+
+  //
+  // Threads sharing a few keys with budgets so small buffers keep
+  // getting thrown out under them
+  //
+  wctx->shard_budget[RAW_IMAGE_BUFFER]     = 2 * (sizeof(isImageBufType) + 64 + 4096);
+  wctx->shard_budget[REDUCED_IMAGE_BUFFER] = 2 * (sizeof(isImageBufType) + 64 + 4096);
+  for (int i=0; i < 8; i++) {
+    cts[i].wctx  = wctx;
+    cts[i].seed  = i + 1;
+    cts[i].wrong = 0;
+    pthread_create(&threads[i], NULL, cache_thread, &cts[i]);
+  }
+  wrong = 0;
+  for (int i=0; i < 8; i++) {
+    pthread_join(threads[i], NULL);
+    wrong += cts[i].wrong;
+  }
+  n = cache_referenced(wctx);
+  printf("%s: cache threads got the right buffers (%d wrong) and let them all go (%d still referenced)\n", wrong || n ? "FAILED" : "ok", wrong, n);
+  failed += wrong || n;
+
+  isDataDestroy(wctx);
+  printf("%s: cache destroyed %d of %d buffers\n", cache_destroyed == cache_filled ? "ok" : "FAILED", cache_destroyed, cache_filled);
+  failed += cache_destroyed != cache_filled;
+
+  return failed;
+}
+
+/**
+ * Number of epoch slots of a context that some thread holds
+ */
+int epoch_owned(isWorkerContext_t *wctx) {
+  int n;
+
+  n = 0;
+  for (int i=0; i < IS_EPOCH_SLOTS; i++) {
+    n += __atomic_load_n(&wctx->epoch_owned[i], __ATOMIC_ACQUIRE) != 0;
+  }
+  return n;
+}
+
+//! Two contexts used by one thread (see test_epoch)
+typedef struct epochThreadStruct {
+  isWorkerContext_t *wctx[2];           //!< The contexts
+  int owned[2];                         //!< Epoch slots each context had handed out while the thread was using both
+} epochThread_t;
+
+/**
+ * Look at the caches of two contexts in turn, then count the epoch
+ * slots each has handed out
+ */
+void *epoch_thread(void *arg) {
+  epochThread_t *et;
+  isImageBufType *imb;
+
+  et = arg;
+  for (int i=0; i < 8; i++) {
+    imb = cache_get(et->wctx[i & 1], i, REDUCED_IMAGE_BUFFER, 64);
+    if (imb != NULL) {
+      isReleaseImageBuf(et->wctx[i & 1], imb);
+    }
+  }
+  et->owned[0] = epoch_owned(et->wctx[0]);
+  et->owned[1] = epoch_owned(et->wctx[1]);
+  return NULL;
+}
+
+/**
+ * One thread using the caches of two contexts must hold an epoch
+ * slot in each (or reclamation in the other context would not see
+ * it looking) and give both back when it exits.
+ *
+ * Returns the number of failures.
+ */
+int test_epoch() {
+  epochThread_t et;
+  pthread_t thread;
+  char shm_name[64];
+  char key[64];
+  int failed;
+  int left;
+
+  for (int i=0; i < 2; i++) {
+    snprintf(key, sizeof(key), "isConvertTest-%d-epoch-%d", (int)getpid(), i);
+    snprintf(shm_name, sizeof(shm_name), "/isConvertTest-%d-epoch-%d", (int)getpid(), i);
+    et.wctx[i] = isDataInit(key, shm_name);
+    isShmUnlink(et.wctx[i]->shm);
+    isShmDestroy(et.wctx[i]->shm);
+    et.wctx[i]->shm = NULL;
+  }
+
+  pthread_create(&thread, NULL, epoch_thread, &et);
+  pthread_join(thread, NULL);
+  left = epoch_owned(et.wctx[0]) + epoch_owned(et.wctx[1]);
+
+  failed = 0;
+  printf("%s: a thread using two contexts holds an epoch slot in each (%d and %d)\n",
+         et.owned[0] == 1 && et.owned[1] == 1 ? "ok" : "FAILED", et.owned[0], et.owned[1]);
+  failed += et.owned[0] != 1 || et.owned[1] != 1;
+  printf("%s: a thread gives back its epoch slots in both contexts when it exits (%d left)\n", left ? "FAILED" : "ok", left);
+  failed += left != 0;
+
+  isDataDestroy(et.wctx[0]);
+  isDataDestroy(et.wctx[1]);
+  return failed;
+}
+
+/**
+ * Run the buffer pool: a buffer given back is handed out again for
+ * the same size, buffers are never more than an eighth bigger than
+ * asked for, a buffer cut down with isBufShrink is reused (and
+ * counted) at its new size, and the idle buffers stay within
+ * IS_BUF_POOL_BYTES.  The pool is drained before and after.
+ *
+ * Returns the number of failures.
+ */
+int test_buf_pool() {
+  static const size_t sizes[] = { 1, 4096, 4097, 5000, 65537, 100000, 1000000, 3000000 };
+  void *bufs[sizeof(sizes)/sizeof(sizes[0])];
+  void *a;
+  void *b;
+  size_t quarter;
+  size_t idle;
+  int failed;
+  int wrong;
+
+  isBufPoolDrain();
+  failed = 0;
+
+  // Reuse
+  a = isBufGet(100000);
+  isBufPut(a);
+  idle = isBufPoolIdleBytes();
+  b = isBufGet(100000);
+  wrong = a != b || idle < isBufSize(a) || isBufPoolIdleBytes() != 0;
+  printf("%s: buffer pool hands a buffer back out for the same size\n", wrong ? "FAILED" : "ok");
+  failed += wrong;
+
+  // Not for a bigger size class
+  isBufPut(b);
+  a = isBufGet(200000);
+  wrong = a == b;
+  isBufPut(a);
+  printf("%s: buffer pool does not hand out a buffer too small\n", wrong ? "FAILED" : "ok");
+  failed += wrong;
+
+  // Size classes
+  wrong = 0;
+  for (int i=0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+    bufs[i] = isBufGet(sizes[i]);
+    wrong += isBufSize(bufs[i]) < sizes[i] || isBufSize(bufs[i]) > (sizes[i] < 4096 ? 4096 : sizes[i] + sizes[i] / 8);
+  }
+  for (int i=0; i < sizeof(sizes)/sizeof(sizes[0]); i++) {
+    isBufPut(bufs[i]);
+  }
+  printf("%s: buffer pool buffers are at most an eighth bigger than asked for\n", wrong ? "FAILED" : "ok");
+  failed += wrong != 0;
+
+  // A shrunk buffer counts, and is handed out, at its new size
+  isBufPoolDrain();
+  a = isBufShrink(isBufGet(1024 * 1024), 300000);
+  wrong = isBufSize(a) != 300000;
+  isBufPut(a);
+  idle = isBufPoolIdleBytes();
+  wrong += idle < 300000 || idle > 300000 + 4096;
+  b = isBufGet(290000);
+  wrong += a != b;
+  isBufPut(b);
+  printf("%s: buffer pool reuses and counts a shrunk buffer at its new size\n", wrong ? "FAILED" : "ok");
+  failed += wrong != 0;
+
+  // Idle cap: only three of four quarters (with their headers) fit
+  isBufPoolDrain();
+  quarter = IS_BUF_POOL_BYTES / 4;
+  for (int i=0; i < 4; i++) {
+    bufs[i] = isBufGet(quarter);
+  }
+  for (int i=0; i < 4; i++) {
+    isBufPut(bufs[i]);
+  }
+  idle = isBufPoolIdleBytes();
+  wrong = idle > IS_BUF_POOL_BYTES || idle < 3 * quarter;
+  printf("%s: buffer pool keeps %zu bytes idle (at most %d)\n", wrong ? "FAILED" : "ok", idle, IS_BUF_POOL_BYTES);
+  failed += wrong;
+
+  isBufPoolDrain();
+  return failed;
+}
+
+/**
+ * Note a jpeg request for a frame (see test_prefetch) and check the
+ * frames then waiting to be prefetched.  want lists them, ending
+ * with 0.
+ *
+ * Returns 1 if the queue is not as expected, otherwise 0.
+ */
+int prefetch_step(isWorkerContext_t *wctx, json_t *meta, int frame, int xsize, const int *want) {
+  json_t *job;
+  int frames[IS_PREFETCH_MAX_QUEUED];
+  int wrong;
+  int n;
+
+  job = json_object();
+  json_object_set_new(job, "fn",    json_string("isConvertTest.h5"));
+  json_object_set_new(job, "frame", json_integer(frame));
+  json_object_set_new(job, "xsize", json_integer(xsize));
+  isPrefetchNote(wctx, job, meta);
+  json_decref(job);
+
+  n = isPrefetchQueued(wctx, frames, IS_PREFETCH_MAX_QUEUED);
+  wrong = 0;
+  for (int i=0; i <= n; i++) {
+    wrong += i == n ? want[i] != 0 : want[i] != frames[i];
+    if (want[i] == 0) {
+      break;
+    }
+  }
+  return wrong != 0;
+}
+
+/**
+ * Step through a data set as a user would, with a prefetch queue
+ * that nothing services, and check what gets queued: the next
+ * IS_PREFETCH_DEPTH frames in the direction of travel, continuing
+ * where the last step left off, never past the last frame, and
+ * nothing still wanted after a jump or a change of size.
+ *
+ * Returns the number of failures.
+ */
+int test_prefetch(isWorkerContext_t *wctx) {
+  static const int none[]      = { 0 };
+  static const int forward[]   = { 12, 13, 14, 15, 0 };
+  static const int more[]      = { 12, 13, 14, 15, 16, 0 };
+  static const int backwards[] = { 38, 37, 36, 35, 0 };
+  static const int end[]       = { 99, 100, 0 };
+  json_t *meta;
+  int failed;
+  int wrong;
+
+  meta = json_object();
+  json_object_set_new(meta, "first_frame", json_integer(1));
+  json_object_set_new(meta, "last_frame",  json_integer(100));
+  isPrefetchInit(wctx, 0);
+
+  failed = 0;
+  wrong  = prefetch_step(wctx, meta, 10, 512, none);
+  wrong += prefetch_step(wctx, meta, 11, 512, forward);
+  printf("%s: prefetch queues the next frames once a user steps forward\n", wrong ? "FAILED" : "ok");
+  failed += wrong != 0;
+
+  wrong = prefetch_step(wctx, meta, 12, 512, more);
+  printf("%s: prefetch carries on where the last step left off\n", wrong ? "FAILED" : "ok");
+  failed += wrong;
+
+  wrong = prefetch_step(wctx, meta, 40, 512, none);
+  printf("%s: prefetch drops the queued frames when a user jumps\n", wrong ? "FAILED" : "ok");
+  failed += wrong;
+
+  wrong  = prefetch_step(wctx, meta, 39, 512, backwards);
+  wrong += prefetch_step(wctx, meta, 39, 256, none);
+  printf("%s: prefetch steps backwards and drops the queue for a new size\n", wrong ? "FAILED" : "ok");
+  failed += wrong != 0;
+
+  wrong  = prefetch_step(wctx, meta, 97, 256, none);
+  wrong += prefetch_step(wctx, meta, 98, 256, end);
+  printf("%s: prefetch stops at the last frame\n", wrong ? "FAILED" : "ok");
+  failed += wrong != 0;
+
+  isPrefetchDestroy(wctx);
+  json_decref(meta);
+  return failed;
+}
+
+/**
+ * Make a socket pair to stand in for a worker thread's REP socket
+ * and the client it replies to
+ *
+ * Returns 0 on success.
+ */
+int reply_sockets(void *zctx, const char *endpoint, void **repp, void **clientp) {
+  *clientp = zmq_socket(zctx, ZMQ_PAIR);
+  *repp    = zmq_socket(zctx, ZMQ_PAIR);
+  if (*clientp == NULL || *repp == NULL || zmq_bind(*clientp, endpoint) != 0 || zmq_connect(*repp, endpoint) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Collect a reply sent to our stand in client.  The first max parts
+ * are kept as strings (free them).
+ *
+ * Returns the number of parts in the reply.
+ */
+int reply_recv(void *client, char **parts, int max) {
+  zmq_msg_t msg;
+  int more;
+  int n;
+
+  for (n=0; n < max; n++) {
+    parts[n] = NULL;
+  }
+
+  n = 0;
+  do {
+    zmq_msg_init(&msg);
+    if (zmq_msg_recv(&msg, client, ZMQ_DONTWAIT) == -1) {
+      zmq_msg_close(&msg);
+      break;
+    }
+    if (n < max) {
+      parts[n] = strndup(zmq_msg_data(&msg), zmq_msg_size(&msg));
+    }
+    more = zmq_msg_more(&msg);
+    zmq_msg_close(&msg);
+    n++;
+  } while (more);
+  return n;
+}
+
+/**
+ * Ask for a filmstrip that cannot be made and check that we get an
+ * error reply saying why, not a montage
+ *
+ * Returns 1 if the reply is not the error we expect, otherwise 0.
+ */
+int filmstrip_refused(isWorkerContext_t *wctx, isThreadContextType *tcp, void *client, int last, int cols, int xsize, const char *why) {
+  json_t *job;
+  char *parts[2];
+  int wrong;
+  int n;
+
+  job = json_object();
+  json_object_set_new(job, "type",  json_string("filmstrip"));
+  json_object_set_new(job, "fn",    json_string("isConvertTest.h5"));
+  json_object_set_new(job, "frame", json_integer(1));
+  json_object_set_new(job, "last",  json_integer(last));
+  json_object_set_new(job, "cols",  json_integer(cols));
+  json_object_set_new(job, "xsize", json_integer(xsize));
+  isFilmstrip(wctx, tcp, job);
+  json_decref(job);
+
+  n = reply_recv(client, parts, 2);
+  wrong = n != 1 || parts[0] == NULL || strstr(parts[0], why) == NULL;
+  printf("%s: filmstrip of %d frames %d across %d wide is turned down%s%s\n", wrong ? "FAILED" : "ok", last, cols, xsize,
+         wrong && parts[0] ? ": " : "", wrong && parts[0] ? parts[0] : "");
+  free(parts[0]);
+  free(parts[1]);
+  return wrong;
+}
+
+/**
+ * Filmstrips with too many frames, or too wide a montage for a jpeg,
+ * are turned down before any frame is read (there is no
+ * isConvertTest.h5 to read)
+ *
+ * Returns the number of failures.
+ */
+int test_filmstrip(isWorkerContext_t *wctx) {
+  isThreadContextType tc;
+  void *client;
+  void *zctx;
+  int failed;
+
+  zctx = zmq_ctx_new();
+  memset(&tc, 0, sizeof(tc));
+  if (zctx == NULL || reply_sockets(zctx, "inproc://isConvertTest-filmstrip", &tc.rep, &client) != 0) {
+    printf("FAILED: could not make zmq sockets for the filmstrip test\n");
+    return 1;
+  }
+
+  failed  = filmstrip_refused(wctx, &tc, client, IS_FILMSTRIP_MAX_FRAMES + 1, 0, 64, "Too many frames");
+  failed += filmstrip_refused(wctx, &tc, client, 100, 100, IS_FILMSTRIP_MAX_THUMB, "too big");
+  failed += filmstrip_refused(wctx, &tc, client, 64, 64, IS_JPEG_MAX_SIDE / 64 + 1, "too big");
+
+  zmq_close(tc.rep);
+  zmq_close(client);
+  zmq_ctx_term(zctx);
+  return failed;
+}
+
+/**
+ * Send a batch of jobs that may not be batched (and one that is not
+ * a job at all) and check that each gets an error reply in its
+ * place, in order, framed as the batch reply should be.  A batch of
+ * more than IS_BATCH_MAX_JOBS jobs gets a single error reply.
+ *
+ * Returns the number of failures.
+ */
+int test_batch(isWorkerContext_t *wctx) {
+  static const char *types[] = { "index", "filmstrip", NULL, "batch", "" };
+  const int n = sizeof(types)/sizeof(types[0]);
+  isThreadContextType tc;
+  char *parts[2 + 2 * sizeof(types)/sizeof(types[0]) + 1];
+  char header[64];
+  json_t *jobs;
+  json_t *job;
+  void *client;
+  int failed;
+  int wrong;
+  int got;
+
+  wctx->zctx = zmq_ctx_new();
+  memset(&tc, 0, sizeof(tc));
+  if (wctx->zctx == NULL || reply_sockets(wctx->zctx, "inproc://isConvertTest-batch", &tc.rep, &client) != 0) {
+    printf("FAILED: could not make zmq sockets for the batch test\n");
+    return 1;
+  }
+
+  jobs = json_array();
+  for (int i=0; i < n; i++) {
+    if (types[i] == NULL) {
+      json_array_append_new(jobs, json_integer(i));
+    } else {
+      json_array_append_new(jobs, json_object());
+      if (*types[i] != 0) {
+        json_object_set_new(json_array_get(jobs, i), "type", json_string(types[i]));
+      }
+    }
+  }
+  job = json_object();
+  json_object_set_new(job, "type", json_string("batch"));
+  json_object_set_new(job, "jobs", jobs);
+
+  isBatch(wctx, &tc, job);
+  got = reply_recv(client, parts, sizeof(parts)/sizeof(parts[0]));
+
+  wrong = got != 2 + 2 * n || parts[0] == NULL || *parts[0] != 0;
+  for (int i=0; !wrong && i < n; i++) {
+    snprintf(header, sizeof(header), "{\"index\":%d,\"parts\":1}", i);
+    wrong += strcmp(parts[2 + 2*i], header) != 0;
+    wrong += strstr(parts[3 + 2*i], types[i] == NULL ? "is not an object" : "may not be batched") == NULL;
+  }
+  printf("%s: batch replies with an error for each job that may not be batched (%d parts)\n", wrong ? "FAILED" : "ok", got);
+  failed = wrong != 0;
+  for (int i=0; i < sizeof(parts)/sizeof(parts[0]); i++) {
+    free(parts[i]);
+  }
+
+  // One too many
+  for (int i=n; i <= IS_BATCH_MAX_JOBS; i++) {
+    json_array_append_new(jobs, json_object());
+  }
+  isBatch(wctx, &tc, job);
+  got = reply_recv(client, parts, 1);
+  wrong = got != 1 || strstr(parts[0], "at most") == NULL;
+  printf("%s: batch of %d jobs is turned down\n", wrong ? "FAILED" : "ok", (int)json_array_size(jobs));
+  failed += wrong;
+  free(parts[0]);
+
+  json_decref(job);
+  zmq_close(tc.rep);
+  zmq_close(client);
+  zmq_ctx_term(wctx->zctx);
+  wctx->zctx = NULL;
+  return failed;
+}
+
+/**
+ * Self tests that need no data files (or redis)
+ *
+ * Returns the number of failures.
+ */
+int self_test() {
+  static const char *kernels[] = { "scalar", "sse4.1", "avx2" };
+  isWorkerContext_t *wctx;
+  const char *choice;
+  struct dirent *de;
+  char shm_name[64];
+  DIR *dir;
+  int leftovers;
+  int failed;
+  int diffs;
+  int fd;
+
+  isKernelsInit();
+
+  wctx = calloc(1, sizeof(*wctx));
+  if (wctx == NULL) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  pthread_mutex_init(&wctx->metaMutex, NULL);
+  pthread_mutex_init(&wctx->maskMutex, NULL);
+  pthread_mutex_init(&wctx->h5Mutex, NULL);
+  pthread_mutex_init(&wctx->geometryMutex, NULL);
+
+  // A shared cache of our own, not our group's
+  snprintf(shm_name, sizeof(shm_name), "/isConvertTest-%d", (int)getpid());
+  wctx->shm = isShmInit(shm_name);
+
+  failed = 0;
+  for (int depth=2; depth <= 4; depth += 2) {
+    failed += test_redis(wctx, depth);
+    failed += test_raw(depth);
+    failed += test_shm(wctx, depth, 0);
+    failed += test_shm(wctx, depth, 1);
+  }
+
+  failed += test_jpeg_strips(wctx, 1);
+  failed += test_jpeg_strips(wctx, 0);
+
+  failed += test_jpeg_map(2, 100, 5000, 0);
+  failed += test_jpeg_map(2, 0, 65534, 0);
+  failed += test_jpeg_map(4, 1000, 60000, 0);
+  failed += test_jpeg_map(4, 200, 200 + 65535, 0);
+  failed += test_jpeg_map(4, 50000, 50000 + 65536, 1);
+  failed += test_jpeg_map(4, 10, 4000000000u, 1);
+
+  failed += test_histogram(wctx);
+
+  failed += test_geometry(wctx);
+
+  failed += test_bin_tables(wctx);
+
+  failed += test_mask(wctx);
+
+  failed += test_cache();
+
+  failed += test_epoch();
+
+  failed += test_redis_lease();
+
+  failed += test_buf_pool();
+
+  failed += test_prefetch(wctx);
+
+  failed += test_filmstrip(wctx);
+
+  failed += test_batch(wctx);
+
+  failed += test_h5_replace(wctx);
+
+  for (int pass=0; pass < 2; pass++) {
+    // First without the compute pool, then with it
+    if (pass == 1) {
+      isPoolInit(wctx);
+    }
+    for (int k=0; k < sizeof(kernels)/sizeof(kernels[0]); k++) {
+      // Each set of kernels this CPU has, checked against scalar
+      setenv("IS_KERNELS", kernels[k], 1);
+      choice = isKernelsInit();
+      if (strcmp(choice, kernels[k]) != 0) {
+        printf("skipped: %s kernels are not supported here\n", kernels[k]);
+        continue;
+      }
+      if (pass == 0) {
+        diffs = isKernelsCheck();
+        printf("%s: %s kernels match scalar\n", diffs ? "FAILED" : "ok", kernels[k]);
+        failed += diffs != 0;
+      }
+      for (int depth=2; depth <= 4; depth += 2) {
+        failed += test_reduce(wctx, kernels[k], depth, 0);
+        failed += test_reduce(wctx, kernels[k], depth, 1);
+      }
+    }
+    for (int depth=2; depth <= 4; depth += 2) {
+      failed += test_pyramid(wctx, depth, 0);
+      failed += test_pyramid(wctx, depth, 1);
+      failed += test_stream(wctx, depth, 0);
+      failed += test_stream(wctx, depth, 1);
+    }
+  }
+  isPoolDestroy(wctx);
+  unsetenv("IS_KERNELS");
+  isKernelsInit();
+
+  if (wctx->shm != NULL) {
+    isShmUnlink(wctx->shm);
+    isShmDestroy(wctx->shm);
+    fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd != -1) {
+      close(fd);
+    }
+
+    // Nor any of its data objects (<name>-<generation>)
+    leftovers = 0;
+    dir = opendir("/dev/shm");
+    while (dir != NULL && (de = readdir(dir)) != NULL) {
+      leftovers += strncmp(de->d_name, shm_name + 1, strlen(shm_name + 1)) == 0;
+    }
+    if (dir != NULL) {
+      closedir(dir);
+    }
+    printf("%s: private shared cache %s removed%s\n", fd == -1 && leftovers == 0 ? "ok" : "FAILED", shm_name,
+           leftovers ? " (but not all its objects)" : "");
+    failed += fd != -1 || leftovers != 0;
+  }
+  pthread_mutex_destroy(&wctx->geometryMutex);
+  pthread_mutex_destroy(&wctx->h5Mutex);
+  pthread_mutex_destroy(&wctx->maskMutex);
+  pthread_mutex_destroy(&wctx->metaMutex);
+  free(wctx);
+
+  printf("\n%s: %d failure%s\n", failed ? "FAILED" : "PASSED", failed, failed == 1 ? "" : "s");
+  return failed;
 }
 
 /**
  * Usage: isConvertTest <h5_file>
+ *        isConvertTest -t          (self tests)
  */
 int main(int argc, char** argv) {
   if (argc != 2) {
@@ -18,6 +2399,10 @@ int main(int argc, char** argv) {
     return 1;
   }
 
+  if (strcmp(argv[1], "-t") == 0) {
+    return self_test() ? 1 : 0;
+  }
+
   //
   // Open up the master file
   //
@@ -6,9 +6,15 @@
  */
 #include "is.h"
 
+//! Tells each context from those made before it (see isEpochSlotFor)
+static uint64_t isDataSerial = 0;
+
+static void isEpochForget(isWorkerContext_t *wctx);
+
 /** Release image buffer contents
  * 
- * Call with the context in which this buffer was defined locked.
+ * Call after the buffer has been removed from the cache and is no
+ * longer in use.
  */
 void destroyImageBuffer(isWorkerContext_t *wctx, isImageBufType *p) {
   static const char *id = FILEID "destroyImageBuffer";
@@ -16,27 +22,31 @@ void destroyImageBuffer(isWorkerContext_t *wctx, isImageBufType *p) {
 
   isLogging_info("%s: destroying image buffer %s\n", id, p->key);
 
-  if (p->rr) {
-    // The buffer was from redis: buf and bad pixel map belong to
-    // p->rr
+  if (p->shm_map) {
+    // The buffer is shared with the other supervisors of our ESAF:
+    // buf points into our mapping
     //
-    freeReplyObject(p->rr);
-    p->rr  = NULL;
+    munmap(p->shm_map, p->shm_map_size);
+    isShmRelease(wctx, p->shm_slot, p->shm_generation);
+    p->shm_map = NULL;
     p->buf = NULL;
-    p->bad_pixel_map = NULL;
   } else {
-    // The buffer was from a file: buf and bad pixel map (if it
-    // exists) were malloc'ed
+    // The buffer was from a file: buf was malloc'ed
     //
     if (p->buf) {
       free(p->buf);
       p->buf = NULL;
     }
-    if (p->bad_pixel_map) {
-      free(p->bad_pixel_map);
-      p->bad_pixel_map = NULL;
-    }
   }
+  // The mask is shared with the other frames of our data set
+  isMaskRelease(p->mask);
+  p->mask = NULL;
+  if (p->destroy_extra) {
+    p->destroy_extra(p->extra);
+    p->extra = NULL;
+  }
+  isPyramidDestroy(p);
+  pthread_mutex_destroy(&p->pyramid_mutex);
   free((char *)p->key);
   pthread_rwlock_destroy(&p->buflock);
   if (p->meta) {
@@ -49,12 +59,60 @@ void destroyImageBuffer(isWorkerContext_t *wctx, isImageBufType *p) {
   isLogging_info("%s: done\n", id);
 }
 
+/** Allocate an empty hash table
+ */
+static isImageBufTable_t *isCacheNewTable(unsigned int n_buckets) {
+  static const char *id = FILEID "isCacheNewTable";
+  isImageBufTable_t *rtn;
+
+  rtn = calloc(1, sizeof(*rtn) + n_buckets * sizeof(rtn->buckets[0]));
+  if (rtn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  rtn->n_buckets = n_buckets;
+  return rtn;
+}
+
+/** Memory budget for one class of image buffers.
+ **
+ ** @param name   Environment variable that may override the default
+ **
+ ** @param dflt   Default budget in bytes
+ **
+ ** @returns Budget in bytes
+ */
+static size_t isCacheBudget(const char *name, size_t dflt) {
+  static const char *id = FILEID "isCacheBudget";
+  const char *s;
+  char *endp;
+  unsigned long long v;
+
+  s = getenv(name);
+  if (s == NULL || *s == 0) {
+    return dflt;
+  }
+
+  errno = 0;
+  v = strtoull(s, &endp, 0);
+  if (errno != 0 || *endp != 0 || v == 0) {
+    isLogging_err("%s: Ignoring bad value '%s' for %s\n", id, s, name);
+    return dflt;
+  }
+  return v;
+}
+
 /** Initialize an process's image buffer context
+ **
+ ** @param key       Names our zmq endpoints
+ **
+ ** @param shm_name  The shared buffer index to attach to (NULL for our group's, see isShmInit)
  */
-isWorkerContext_t  *isDataInit(const char *key) {
+isWorkerContext_t  *isDataInit(const char *key, const char *shm_name) {
   static const char *id = FILEID "isDataInit";
-  pthread_mutexattr_t matt;
   isWorkerContext_t *rtn;
+  isImageBufShard_t *shard;
+  int i;
   int err;
   char router_endpoint[128];
   char dealer_endpoint[128];
@@ -71,10 +129,30 @@ isWorkerContext_t  *isDataInit(const char *key) {
     isLogging_crit("%s: Out of memory\n", id);
     exit (-1);
   }
+  rtn->serial = __atomic_add_fetch(&isDataSerial, 1, __ATOMIC_RELAXED);
+
+  for (i=0; i<IS_CACHE_SHARDS; i++) {
+    shard = &rtn->shards[i];
+    pthread_mutex_init(&shard->mutex, NULL);
+    shard->table = isCacheNewTable(IS_CACHE_INITIAL_BUCKETS);
+  }
 
-  rtn->n_buffers   = 0;
-  rtn->max_buffers = 2 * N_IMAGE_BUFFERS;
-  rtn->first     = NULL;
+  //
+  // Epoch 0 means "not looking"
+  //
+  rtn->epoch = 1;
+  pthread_mutex_init(&rtn->retireMutex, NULL);
+  pthread_mutex_init(&rtn->geometryMutex, NULL);
+  pthread_mutex_init(&rtn->maskMutex, NULL);
+  pthread_mutex_init(&rtn->jpegMutex, NULL);
+  pthread_mutex_init(&rtn->h5Mutex, NULL);
+
+  //
+  // The budgets are for the whole process.  Each shard gets an equal
+  // share.
+  //
+  rtn->shard_budget[RAW_IMAGE_BUFFER]     = isCacheBudget("IS_RAW_CACHE_BYTES",     IS_RAW_CACHE_BYTES)     / IS_CACHE_SHARDS;
+  rtn->shard_budget[REDUCED_IMAGE_BUFFER] = isCacheBudget("IS_REDUCED_CACHE_BYTES", IS_REDUCED_CACHE_BYTES) / IS_CACHE_SHARDS;
 
   rtn->zctx = zmq_ctx_new();
   rtn->router = zmq_socket(rtn->zctx, ZMQ_ROUTER);
@@ -134,19 +212,9 @@ isWorkerContext_t  *isDataInit(const char *key) {
     exit (-1);
   }
   
-  pthread_mutexattr_init(&matt);
-  pthread_mutexattr_settype(&matt, PTHREAD_MUTEX_RECURSIVE);
-  pthread_mutexattr_setpshared(&matt, PTHREAD_PROCESS_SHARED);
-  pthread_mutex_init(&rtn->ctxMutex, &matt);
-  pthread_mutexattr_destroy(&matt);
-
   pthread_mutex_init(&rtn->metaMutex, NULL);
 
-  err = hcreate_r( 2*N_IMAGE_BUFFERS, &rtn->bufTable);
-  if (err == 0) {
-    isLogging_crit("%s: Failed to initialize hash table: %s\n", id, strerror(errno));
-    exit (-1);
-  }
+  rtn->shm = isShmInit(shm_name);
 
   return rtn;
 }
@@ -155,26 +223,58 @@ isWorkerContext_t  *isDataInit(const char *key) {
  */
 void isDataDestroy(isWorkerContext_t *c) {
   static const char *id = FILEID "isDataDestroy";
+  isImageBufShard_t *shard;
   isImageBufType *p, *next;
+  isRetired_t *rp;
+  unsigned int b;
+  int i;
   (void)id;
 
   isLogging_info("%s: start\n", id);
   //
   // We are called from isSupervisor after all the threads have been
   // joined: there is no danger of collision and, hence, no need to
-  // lock anything.
+  // lock anything.  Our own thread may still hold an epoch slot.
   //
+  isEpochForget(c);
+
+  for (i=0; i<IS_CACHE_SHARDS; i++) {
+    shard = &c->shards[i];
+    for (b=0; b<shard->table->n_buckets; b++) {
+      next = NULL;
+      for (p=shard->table->buckets[b]; p!=NULL; p=next) {
+        next = p->hnext;     // need to save next since p is going away.
+        destroyImageBuffer(c, p);
+      }
+    }
+    free(shard->table);
+    shard->table = NULL;
+    shard->n_buffers = 0;
+    pthread_mutex_destroy(&shard->mutex);
+  }
 
-  hdestroy_r(&c->bufTable);
-
-  next = NULL;
-  for (p=c->first; p!=NULL; p=next) {
-    next = p->next;     // need to save next since p is going away.
-    destroyImageBuffer(c, p);
+  while (c->retired != NULL) {
+    rp = c->retired;
+    c->retired = rp->next;
+    if (rp->imb) {
+      destroyImageBuffer(c, rp->imb);
+    } else {
+      free(rp->mem);
+    }
+    free(rp);
   }
-  c->n_buffers = 0;
-  c->first = NULL;
-  pthread_mutex_destroy(&c->ctxMutex);
+  pthread_mutex_destroy(&c->retireMutex);
+
+  isGeometryDestroy(c);
+  pthread_mutex_destroy(&c->geometryMutex);
+  isMaskCacheDestroy(c);
+  pthread_mutex_destroy(&c->maskMutex);
+  isJpegCacheDestroy(c);
+  pthread_mutex_destroy(&c->jpegMutex);
+  isH5FileCacheDestroy(c);
+  pthread_mutex_destroy(&c->h5Mutex);
+  isShmDestroy(c->shm);
+  c->shm = NULL;
   pthread_mutex_destroy(&c->metaMutex);
   free((char *)c->key);
   free(c);
@@ -275,6 +375,7 @@ image_file_type isFileType(const char *fn) {
   int fd;
   int nbytes;
   unsigned int buf4;
+  unsigned char sig[8];
 
   errno = 0;
   fd = open(fn, O_RDONLY);
@@ -283,12 +384,13 @@ image_file_type isFileType(const char *fn) {
     return UNKNOWN;
   }
 
-  nbytes = read(fd, (char *)&buf4, 4);
+  nbytes = read(fd, sig, sizeof(sig));
   close(fd);
-  if (nbytes != 4) {
+  if (nbytes < 4) {
     isLogging_crit("%s: Could not read 4 bytes from file '%s'\n", id, fn);
     return UNKNOWN;
   }
+  memcpy(&buf4, sig, 4);
 
   if (buf4 == 0x002a4949) {
     return RAYONIX;
@@ -299,8 +401,14 @@ image_file_type isFileType(const char *fn) {
   }
 
   //
-  // H5 is easy
+  // H5 is easy.  Most files start with the HDF5 signature so we need
+  // not have the library open the file just to tell us that.  Files
+  // with a user block have it further along.
   //
+  if (nbytes == sizeof(sig) && memcmp(sig, "\211HDF\r\n\032\n", sizeof(sig)) == 0) {
+    return HDF5;
+  }
+
   //
   // Turn off HDF5 error reporting.  The routines already return error codes 
   herr = H5Eset_auto2(H5E_DEFAULT, NULL, NULL);
@@ -323,508 +431,737 @@ image_file_type isFileType(const char *fn) {
   return UNKNOWN;
 }
 
-/** Create new buffer
- *
- * Call with wctx->ctxMutex locked
- *
- * Return with a brand new write locked image buffer and "in_use" set
- * to 1 to keep the buffer from being reclaimed when we give up our
- * write lock in favor of a read lock.
+/** Hash an image buffer key (FNV-1a).
  */
-isImageBufType *createNewImageBuf(isWorkerContext_t *wctx, const char *key) {
-  static const char *id = FILEID "createNewImageBuf";
-  ENTRY item;
-  ENTRY *return_item;
-  isImageBufType *rtn;
-  int i;
-  int err;
-  isImageBufType *p;
-  isImageBufType *last;
-  isImageBufType *next;
-  pthread_rwlockattr_t rwatt;
-
-  // call with ctxMutex locked
-  rtn = calloc(1, sizeof(*rtn));
-  if (rtn == NULL) {
-    isLogging_crit("%s: Out of memory\n", id);
-    exit (-1);
+static unsigned int isCacheHash(const char *key) {
+  unsigned int h;
+  const unsigned char *cp;
+
+  h = 2166136261u;
+  for (cp=(const unsigned char *)key; *cp; cp++) {
+    h ^= *cp;
+    h *= 16777619u;
   }
+  return h;
+}
 
-  rtn->key = strdup(key);
-  pthread_rwlockattr_init(&rwatt);
-  pthread_rwlockattr_setpshared(&rwatt, PTHREAD_PROCESS_SHARED);
-  pthread_rwlock_init(&rtn->buflock, &rwatt);
-  pthread_rwlockattr_destroy(&rwatt);
+/** The shard responsible for a given hash
+ */
+static isImageBufShard_t *isCacheShard(isWorkerContext_t *wctx, unsigned int hash) {
+  return &wctx->shards[hash % IS_CACHE_SHARDS];
+}
 
-  pthread_rwlock_wrlock(&rtn->buflock);
+/** The bucket in a table for a given hash.  The low bits select the
+ ** shard so we use the higher ones here.
+ */
+static unsigned int isCacheBucket(isImageBufTable_t *table, unsigned int hash) {
+  return (hash / IS_CACHE_SHARDS) & (table->n_buckets - 1);
+}
 
-  rtn->in_use = 1;      // in_use is protected by wctx->ctcMutex
+/** A thread's slot in one context's epoch_active
+ */
+typedef struct isEpochSlotStruct {
+  isWorkerContext_t *wctx;              //!< The context
+  uint64_t serial;                      //!< wctx->serial when we got the slot (a later context may have the same address)
+  int slot;                             //!< Our slot in wctx->epoch_active
+} isEpochSlot_t;
+
+/** Every slot a thread holds, one per context it has looked at the
+ ** cache of
+ */
+typedef struct isEpochSlotsStruct {
+  int n;                                //!< Slots we hold
+  isEpochSlot_t *slots;                 //!< The slots
+} isEpochSlots_t;
 
-  rtn->next = wctx->first;
-  wctx->first = rtn;
+//! Our thread's epoch slots (given back when the thread exits, see isEpochSlotFree)
+static __thread isEpochSlots_t *isEpochSlots = NULL;
 
-  item.key  = (char *)rtn->key;
-  item.data = rtn;
-  errno = 0;
-  err = hsearch_r(item, ENTER, &return_item, &wctx->bufTable);
-  //
-  // An error here means that we've somehow exceeded the maximum
-  // number of entries in the table.  We should have at least a factor
-  // of 2 head room so this is a serious programming error.
-  //
-  if (err == 0) {
-    isLogging_crit("%s: Failed to enter item %s: %s\n", id, rtn->key, strerror(errno));
-    exit (-1);
-  }
+//! The last slot our thread used, to skip the search when (as almost always) there is only one context
+static __thread isEpochSlot_t isEpochLast = { NULL, 0, -1 };
 
-  if (++wctx->n_buffers < wctx->max_buffers / 2) {
-    //
-    // We are done.
-    //
-    return rtn;
-  }
+//! Gives a thread's epoch slots back when the thread exits (see isEpochSlotFree)
+static pthread_key_t isEpochSlotKey;
 
-  // Time to rebuild the hash table
-  //
-  // Count number of buffers still in use
-  //
-  isLogging_info("%s: Rebuilding hash table\n", id);
+//! Makes isEpochSlotKey
+static pthread_once_t isEpochSlotOnce = PTHREAD_ONCE_INIT;
 
-  for(i=0, p=wctx->first; p != NULL; p=p->next) {
-    assert(p->in_use >= 0);
-    if (p->in_use > 0) {
-      i++;
-    }
+/** A thread that had epoch slots is exiting: let some other thread
+ ** have them.
+ **
+ ** @param voidp  The thread's isEpochSlots_t
+ */
+static void isEpochSlotFree(void *voidp) {
+  isEpochSlots_t *es;
+  int i;
+
+  es = voidp;
+  for (i=0; i<es->n; i++) {
+    __atomic_store_n(&es->slots[i].wctx->epoch_owned[es->slots[i].slot], 0, __ATOMIC_RELEASE);
   }
+  free(es->slots);
+  free(es);
+}
 
-  //
-  // Guess how many buffers we need and double that to make the hash table more efficient.
-  // TODO: Make a better guess by trying to understand what hcreate really needs.
-  //
-  wctx->max_buffers += 2 * (N_IMAGE_BUFFERS + i);
+/** Make the key that frees our threads' epoch slots (pthread_once callback)
+ */
+static void isEpochSlotKeyInit() {
+  pthread_key_create(&isEpochSlotKey, isEpochSlotFree);
+}
 
-  isLogging_info("%s: ************ Rebuilding hash table. i=%d, max_buffers=%d\n", id, i, wctx->max_buffers);
+/** Find our thread a free slot in wctx->epoch_active.  The slot is ours
+ ** until the thread exits (or isDataDestroy destroys wctx).
+ */
+static void isEpochClaimSlot(isWorkerContext_t *wctx) {
+  static const char *id = FILEID "isEpochClaimSlot";
+  isEpochSlot_t *esp;
+  int expected;
+  int n;
+  int i;
 
-  hdestroy_r(&wctx->bufTable);
-  errno = 0;
-  err = hcreate_r( wctx->max_buffers, &wctx->bufTable);
-  if (err == 0) {
-    isLogging_crit("%s: Failed to initialize hash table\n", id);
+  pthread_once(&isEpochSlotOnce, isEpochSlotKeyInit);
+
+  for (i=0; i<IS_EPOCH_SLOTS; i++) {
+    expected = 0;
+    if (__atomic_load_n(&wctx->epoch_owned[i], __ATOMIC_RELAXED) == 0 &&
+        __atomic_compare_exchange_n(&wctx->epoch_owned[i], &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+  if (i == IS_EPOCH_SLOTS) {
+    isLogging_crit("%s: Too many threads.  Increase IS_EPOCH_SLOTS\n", id);
     exit (-1);
   }
+
   //
-  // Reenter the hash table values.  Keep some (say half) of the
-  // most recent enties and all of the ones that are currently being
-  // used
+  // isEpochReclaim only looks at the slots that have been handed out
   //
+  n = __atomic_load_n(&wctx->n_epoch_slots, __ATOMIC_RELAXED);
+  while (n < i + 1 && !__atomic_compare_exchange_n(&wctx->n_epoch_slots, &n, i + 1, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
 
-  last = NULL;
-  next = NULL;
-  wctx->n_buffers = 0;
-  for(i=0, p=wctx->first; p != NULL; p=next) {
-    next = p->next;
+  if (isEpochSlots == NULL) {
+    isEpochSlots = calloc(1, sizeof(*isEpochSlots));
+    if (isEpochSlots == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+    pthread_setspecific(isEpochSlotKey, isEpochSlots);
+  }
 
-    assert(p->in_use >= 0);
+  esp = realloc(isEpochSlots->slots, (isEpochSlots->n + 1) * sizeof(*esp));
+  if (esp == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  isEpochSlots->slots = esp;
+  esp = &isEpochSlots->slots[isEpochSlots->n++];
+  esp->wctx   = wctx;
+  esp->serial = wctx->serial;
+  esp->slot   = i;
+}
 
-    if (i++ > wctx->max_buffers/4 && p->in_use <= 0) {
-      destroyImageBuffer(wctx, p);
-      continue;
-    }
+/** Our thread's slot in wctx->epoch_active, claimed the first time
+ ** we look at this context's cache.
+ */
+static int isEpochSlotFor(isWorkerContext_t *wctx) {
+  int i;
 
-    wctx->n_buffers++;
+  if (isEpochLast.wctx == wctx && isEpochLast.serial == wctx->serial) {
+    return isEpochLast.slot;
+  }
 
-    if (last != NULL) {
-      last->next = p;
-    }
-    item.key = (char *)p->key;
-    item.data = p;
-    last = p;
-    err = hsearch_r(item, ENTER, &return_item, &wctx->bufTable);
-    if (err == 0) {
-      isLogging_crit("%s: Failed to enter item %s\n", id, p->key);
-      exit (-1);
+  i = 0;
+  if (isEpochSlots != NULL) {
+    for (i=0; i<isEpochSlots->n; i++) {
+      if (isEpochSlots->slots[i].wctx == wctx && isEpochSlots->slots[i].serial == wctx->serial) {
+        break;
+      }
     }
-  }    
+  }
+  if (isEpochSlots == NULL || i == isEpochSlots->n) {
+    isEpochClaimSlot(wctx);
+  }
 
-  // remember that return value we calculated so long ago?
-  //isLogging_info("%s: returning after rebuilding table.  key: %s\n", id, rtn->key);
-  return rtn;
+  isEpochLast = isEpochSlots->slots[i];
+  return isEpochLast.slot;
 }
 
-/** Look to see if the data are already available to us from either
- * the image buffer hash table or from redis.  We will wait for the
- * data to appear if another process already is processing this.  In
- * this case we'll grab the data from redis when it's ready and
- * rerturn it.
- *
- *  When the data are availabe we'll return a read locked buffer.
- *  Otherwise, we'll returned with no data and a write locked buffer.
- *
- *  It is expected that if the caller has to go get the data
- *  themselves that they'll do the kindness of writing the data out to
- *  redis and add something to the list key-READY so that the
- *  processes can get back to work.
- *
+/** Forget our thread's slot in a context that is going away
  */
-isImageBufType *isGetImageBufFromKey(isWorkerContext_t *wctx, redisContext *rc, char *key) {
-  static const char *id = FILEID "isGetImageBufFromKey";
-  isImageBufType *rtn;          // This is our return value
-  redisReply *rr;               // our redis reply object pointer
-  redisReply *meta_rr;          // redis reply object perhaps with our metadata
-  redisReply *width_rr;
-  redisReply *height_rr;
-  redisReply *depth_rr;
-  redisReply *image_rr;         // redis reply object perhaps with our image data
-  redisReply *badpixels_rr;     // redis reply object perhaps with our bad pixel map
-  int need_to_read_data;        // non-zero when we are the first one asking for this data
-  ENTRY item;
-  ENTRY *return_item;
-  int err;
-  json_error_t jerr;
-
-  rtn = NULL;
+static void isEpochForget(isWorkerContext_t *wctx) {
+  int i;
 
-  pthread_mutex_lock(&wctx->ctxMutex);
+  if (isEpochLast.wctx == wctx) {
+    isEpochLast.wctx = NULL;
+  }
 
-  item.key  = key;
-  item.data = NULL;
-  errno = 0;
-  err = hsearch_r(item, FIND, &return_item, &wctx->bufTable);
-  if (err != 0) {
-    rtn = return_item->data;
+  for (i=0; isEpochSlots != NULL && i<isEpochSlots->n; i++) {
+    if (isEpochSlots->slots[i].wctx == wctx) {
+      isEpochSlots->slots[i] = isEpochSlots->slots[--isEpochSlots->n];
+      break;
+    }
   }
-  
-  if (rtn != NULL) {
+}
 
-    assert(rtn->in_use >= 0);
+/** Announce that we are about to look at the cache without a lock.
+ ** Nothing we can reach from here will be freed until we call
+ ** isEpochExit.
+ */
+static void isEpochEnter(isWorkerContext_t *wctx) {
+  __atomic_store_n(&wctx->epoch_active[isEpochSlotFor(wctx)], __atomic_load_n(&wctx->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/** Free whatever retired memory nobody can be looking at anymore.
+ **
+ ** Call with the retire mutex locked.
+ */
+static void isEpochReclaim(isWorkerContext_t *wctx) {
+  isRetired_t **rpp;
+  isRetired_t *rp;
+  uint64_t oldest;
+  uint64_t e;
+  int n;
+  int i;
 
-    rtn->in_use++;                              // flag to keep our buffer in scope while we need it
-    pthread_mutex_unlock(&wctx->ctxMutex);
-    pthread_rwlock_rdlock(&rtn->buflock);
-    return rtn;
-  }
-  
   //
-  // Create a new entry then read some data into it.  We still have
-  // bufMutex write locked: This is used to avoid contention with
-  // other writers as well as potential readers.  We'll grab the read
-  // lock on the buffer before releasing the context mutex.
+  // Find the oldest epoch anyone is still in
   //
-  rtn = createNewImageBuf(wctx, key);
-  // buffer is write locked and in_use = 1
+  oldest = UINT64_MAX;
+  n = __atomic_load_n(&wctx->n_epoch_slots, __ATOMIC_RELAXED);
+  n = n > IS_EPOCH_SLOTS ? IS_EPOCH_SLOTS : n;
+  for (i=0; i<n; i++) {
+    e = __atomic_load_n(&wctx->epoch_active[i], __ATOMIC_SEQ_CST);
+    if (e != 0 && e < oldest) {
+      oldest = e;
+    }
+  }
 
-  pthread_mutex_unlock(&wctx->ctxMutex);       // We can now allow access to the other buffers
+  rpp = &wctx->retired;
+  while (*rpp != NULL) {
+    rp = *rpp;
+    if (rp->epoch >= oldest) {
+      rpp = &rp->next;
+      continue;
+    }
+    *rpp = rp->next;
+    if (rp->imb) {
+      destroyImageBuffer(wctx, rp->imb);
+    } else {
+      free(rp->mem);
+    }
+    free(rp);
+  }
+}
 
-  #ifdef IS_IGNORE_REDIS_STORE
-  //
-  // Just return now if we have not found a buffer.  Our caller will
-  // fill.  Leave with buffer write locked and in_use non-zero
-  //
-  return rtn;
-  #endif
+/** Done looking.  Free anything retired while we were looking that
+ ** nobody else is still looking at (unless some other thread is
+ ** already doing that).
+ */
+static void isEpochExit(isWorkerContext_t *wctx) {
+  __atomic_store_n(&wctx->epoch_active[isEpochSlotFor(wctx)], 0, __ATOMIC_SEQ_CST);
 
   //
-  // Three redis queries follow:
-  //  1) increment properties 'USERS' in for our key
-  //  2) Set an expiration time for the key
-  //  3) read data and meta properties
-  //
-  //  When the first query returns '1' then we know that the key did
-  //  not exist before and that we'll need to find (or calculate) the
-  //  data and then return it to the hash.
-  //
-  //  When the first query returns something greater than 1 then we'll
-  //  run a blocking query to wait for the data to be written.
-  //
-  //  NB: Possibly one or more of our co-threads are already waiting
-  //  for us to drop the write lock on the buffer before they go
-  //  ahead.  All this magic here is to block other processes from
-  //  redundantly processing the same data in the same way.
+  // A peek without the lock: the worst we can do is miss something
+  // the next retire or exit will get
   //
+  if (__atomic_load_n(&wctx->retired, __ATOMIC_RELAXED) != NULL && pthread_mutex_trylock(&wctx->retireMutex) == 0) {
+    isEpochReclaim(wctx);
+    pthread_mutex_unlock(&wctx->retireMutex);
+  }
+}
 
-  redisAppendCommand(rc, "HINCRBY %s USERS 1", key);
-  redisAppendCommand(rc, "EXPIRE %s %d", key, IS_REDIS_TTL);
-  redisAppendCommand(rc, "HMGET %s META WIDTH HEIGHT DEPTH DATA BADPIXELS", key);
+/** Free an image buffer (if imb is not NULL) or some other memory
+ ** (mem) as soon as no thread that might have seen it is still
+ ** looking.
+ **
+ ** Call after the buffer (or memory) can no longer be reached from
+ ** the cache.
+ */
+static void isEpochRetire(isWorkerContext_t *wctx, isImageBufType *imb, void *mem) {
+  static const char *id = FILEID "isEpochRetire";
+  isRetired_t *rp;
 
-  //
-  // hincby reply: 1 means we are the first and should get the data,
-  // >1 means we should block until the data are first written by
-  // another process.
-  //
-  err = redisGetReply(rc, (void **)&rr);
-  if (err != REDIS_OK) {
-    isLogging_crit("%s: Redis failure (hincby): %s\n", id, rc->errstr);
+  rp = calloc(1, sizeof(*rp));
+  if (rp == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
     exit (-1);
   }
+  rp->imb = imb;
+  rp->mem = mem;
+
+  pthread_mutex_lock(&wctx->retireMutex);
+  rp->epoch = __atomic_fetch_add(&wctx->epoch, 1, __ATOMIC_SEQ_CST);
+  rp->next  = wctx->retired;
+  wctx->retired = rp;
+  isEpochReclaim(wctx);
+  pthread_mutex_unlock(&wctx->retireMutex);
+}
 
-  need_to_read_data = rr->integer == 1;
-  //isLogging_info("%s: users = %d  reply type: %d\n", id, (int)rr->integer, rr->type);
+/** Try to claim a reference to a buffer.  Fails if the buffer is on
+ ** its way out.
+ **
+ ** @returns 1 on success, 0 otherwise
+ */
+static int isImageBufRef(isImageBufType *p) {
+  int refs;
 
-  freeReplyObject(rr);
+  refs = __atomic_load_n(&p->refs, __ATOMIC_RELAXED);
+  while (refs >= 0) {
+    if (__atomic_compare_exchange_n(&p->refs, &refs, refs + 1, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      return 1;
+    }
+  }
+  return 0;
+}
 
-  //
-  // expire reply: we don't need to do anything with this  err = redisGetReply(rc, &rr);
-  //
-  err = redisGetReply(rc, (void **)&rr);
-  if (err != REDIS_OK) {
-    isLogging_crit("%s: Redis failure (expire): %s\n", id, rc->errstr);
-    exit (-1);
+/** Mark an unused buffer as dead so nobody else can get a reference to it.
+ **
+ ** @returns 1 if it is ours to destroy, 0 if someone is using it
+ */
+static int isImageBufKill(isImageBufType *p) {
+  int refs;
+
+  refs = 0;
+  return __atomic_compare_exchange_n(&p->refs, &refs, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+/** Look for key in a shard without taking any locks.
+ **
+ ** Call between isEpochEnter and isEpochExit (or with the shard mutex
+ ** locked).
+ **
+ ** @returns the buffer with a reference claimed or NULL
+ */
+static isImageBufType *isCacheLookup(isImageBufShard_t *shard, const char *key, unsigned int hash) {
+  isImageBufTable_t *table;
+  isImageBufType *p;
+
+  table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+  for (p = __atomic_load_n(&table->buckets[isCacheBucket(table, hash)], __ATOMIC_ACQUIRE); p != NULL; p = __atomic_load_n(&p->hnext, __ATOMIC_ACQUIRE)) {
+    if (p->hash == hash && strcmp(p->key, key) == 0) {
+      return isImageBufRef(p) ? p : NULL;
+    }
   }
-  freeReplyObject(rr);
+  return NULL;
+}
 
-  //
-  // Try to get the data.  If there is nothing to get then either get
-  // it block until someone else gets it.
-  //
-  err = redisGetReply(rc, (void **)&rr);
-  if (err != REDIS_OK) {
-    isLogging_crit("%s: Redis failure (hmget): %s\n", id, rc->errstr);
-    exit (-1);
+/** Remove a buffer from its clock list.
+ **
+ ** Call with the shard mutex locked.
+ */
+static void isCacheLruUnlink(isImageBufShard_t *shard, isImageBufType *p) {
+  if (p->lru_prev) {
+    p->lru_prev->lru_next = p->lru_next;
+  } else {
+    shard->lru_head[p->buf_class] = p->lru_next;
   }
-  
-  //
-  // Here the reply is an array.  element[0] is the meta data (if any)
-  // and element[1] is the image data (if any)
-  //
-  meta_rr      = rr->element[0];
-  width_rr     = rr->element[1];
-  height_rr    = rr->element[2];
-  depth_rr     = rr->element[3];
-  image_rr     = rr->element[4];
-  badpixels_rr = rr->element[5];
 
-  rtn->meta = NULL;
-  if (meta_rr->type == REDIS_REPLY_STRING) {
-    pthread_mutex_lock(&wctx->metaMutex);
-    rtn->meta = json_loads(meta_rr->str, 0, &jerr);
-    pthread_mutex_unlock(&wctx->metaMutex);
+  if (p->lru_next) {
+    p->lru_next->lru_prev = p->lru_prev;
+  } else {
+    shard->lru_tail[p->buf_class] = p->lru_prev;
   }
+  p->lru_prev = NULL;
+  p->lru_next = NULL;
+}
 
-  if (image_rr->type == REDIS_REPLY_STRING) {
-    //
-    // We're all set. We'll free the redis object after we are done
-    // with the image.  We'll also exchange our write lock for a read
-    // lock.
-    rtn->rr  = rr;
-    rtn->buf = image_rr->str;
-    rtn->buf_size = image_rr->len;
-
-    rtn->buf_width  = atoi(width_rr->str);
-    rtn->buf_height = atoi(height_rr->str);
-    rtn->buf_depth  = atoi(depth_rr->str);
-
-    rtn->bad_pixel_map = NULL;
-    if (badpixels_rr->type == REDIS_REPLY_STRING) {
-      rtn->bad_pixel_map = badpixels_rr->str;
+/** Put a buffer at the head of its clock list (the end furthest from
+ ** the eviction hand).
+ **
+ ** Call with the shard mutex locked.
+ */
+static void isCacheLruPushHead(isImageBufShard_t *shard, isImageBufType *p) {
+  p->lru_prev = NULL;
+  p->lru_next = shard->lru_head[p->buf_class];
+  if (p->lru_next) {
+    p->lru_next->lru_prev = p;
+  } else {
+    shard->lru_tail[p->buf_class] = p;
+  }
+  shard->lru_head[p->buf_class] = p;
+}
+
+/** Remove a buffer from the hash table, the clock list, and our
+ ** budget.  Threads already looking at the buffer may still find it
+ ** until they leave their epoch.
+ **
+ ** Call with the shard mutex locked.
+ */
+static void isCacheRemove(isImageBufShard_t *shard, isImageBufType *p) {
+  isImageBufType **pp;
+
+  for (pp = &shard->table->buckets[isCacheBucket(shard->table, p->hash)]; *pp != NULL; pp = &(*pp)->hnext) {
+    if (*pp == p) {
+      __atomic_store_n(pp, p->hnext, __ATOMIC_RELEASE);
+      break;
     }
+  }
+  isCacheLruUnlink(shard, p);
+  shard->bytes[p->buf_class] -= p->cost;
+  shard->n_buffers--;
+  p->cost = 0;
+  __atomic_store_n(&p->cached, 0, __ATOMIC_SEQ_CST);
+}
 
-    rtn->extra = NULL;
+/** Double the number of buckets in a shard.  Only the one shard is
+ ** held up while this happens.  Lock free readers that happen to be
+ ** walking a chain while we move things around may miss their buffer:
+ ** they'll find it when they try again with the shard mutex locked.
+ **
+ ** Call with the shard mutex locked.
+ */
+static void isCacheGrow(isWorkerContext_t *wctx, isImageBufShard_t *shard) {
+  isImageBufTable_t *old_table;
+  isImageBufTable_t *new_table;
+  isImageBufType *p, *next;
+  unsigned int b;
+  unsigned int nb;
+
+  old_table = shard->table;
+  new_table = isCacheNewTable(2 * old_table->n_buckets);
+
+  for (b=0; b<old_table->n_buckets; b++) {
+    for (p=old_table->buckets[b]; p != NULL; p=next) {
+      next = p->hnext;
+      nb = isCacheBucket(new_table, p->hash);
+      __atomic_store_n(&p->hnext, new_table->buckets[nb], __ATOMIC_RELEASE);
+      new_table->buckets[nb] = p;
+    }
+  }
+  __atomic_store_n(&shard->table, new_table, __ATOMIC_RELEASE);
+  isEpochRetire(wctx, NULL, old_table);
+}
 
-    if (rtn->buf_size != rtn->buf_width * rtn->buf_height * rtn->buf_depth) {
-      isLogging_crit("%s: Bad buffer size.  Width: %d  Height: %d  Depth: %d  Size: %d\n", id, rtn->buf_width, rtn->buf_height, rtn->buf_depth, rtn->buf_size);
-      exit (-1);
+/** Pick buffers to throw out of a shard until the given class is
+ ** within its budget.  This is the CLOCK (second chance)
+ ** approximation of LRU: buffers used since the hand last passed get
+ ** moved to the back of the line instead of thrown out.  Buffers that
+ ** are in use are skipped.  The victims are removed from the cache
+ ** and returned as a list (linked through lru_next) so that the
+ ** caller can retire them after the shard mutex has been released.
+ **
+ ** Call with the shard mutex locked.
+ */
+static isImageBufType *isCacheEvict(isWorkerContext_t *wctx, isImageBufShard_t *shard, image_buffer_class buf_class) {
+  isImageBufType *p;
+  isImageBufType *victims;
+  int n;
+
+  victims = NULL;
+  for (n = 2 * shard->n_buffers; n > 0 && shard->bytes[buf_class] > wctx->shard_budget[buf_class]; n--) {
+    p = shard->lru_tail[buf_class];
+    if (p == NULL) {
+      break;
     }
 
-    pthread_rwlock_unlock(&rtn->buflock);
-    pthread_rwlock_rdlock(&rtn->buflock);
+    isCacheLruUnlink(shard, p);
 
-    freeReplyObject(rr);
-    return rtn;
-  }
-  // OK, no data yet.
-  freeReplyObject(rr);
+    if (__atomic_exchange_n(&p->referenced, 0, __ATOMIC_RELAXED) || !isImageBufKill(p)) {
+      // Second chance (or in use)
+      isCacheLruPushHead(shard, p);
+      continue;
+    }
 
-  if (need_to_read_data) {
-    // Who ever called us will go ahead and fill the image data if we
-    // return a null buffer.
-    //
-    // In this case we hold on to the write lock (and a non-zero in_use)
-    //
-    return rtn;
+    isCacheLruPushHead(shard, p);       // so isCacheRemove has something to unlink
+    isCacheRemove(shard, p);
+    p->lru_next = victims;
+    victims = p;
   }
+  return victims;
+}
 
-  // Now we just wait for the data to magically appear
-  //
-  // TODO: evaluate and perhaps implement a timeout with error recovery
-  //
+/** Retire a list of buffers returned by isCacheEvict.
+ **
+ ** Call with the shard mutex unlocked.
+ */
+static void isCacheDestroyList(isWorkerContext_t *wctx, isImageBufType *victims) {
+  isImageBufType *p, *next;
 
-  rr = redisCommand(rc, "BRPOP %s-READY 0", key);
-  if (rr == NULL) {
-    isLogging_crit("%s: Redis error: %s\n", id, rc->errstr);
-    exit (-1);
+  for (p=victims; p != NULL; p=next) {
+    next = p->lru_next;
+    p->lru_next = NULL;
+    isEpochRetire(wctx, p, NULL);
   }
-  if (rr->type == REDIS_REPLY_STRING && strcmp(rr->str, "error")==0) {
-    //
-    // Something bad happened to whoever tried to read the data file.
+}
+
+/** Charge a freshly filled buffer against its memory budget and
+ ** throw out enough of the least recently used buffers to stay
+ ** within it.
+ **
+ ** Call with a reference to the buffer.  Calling again after the
+ ** buffer size changes (say, when a pyramid level is added) adjusts
+ ** the charge.
+ */
+void isCacheAccount(isWorkerContext_t *wctx, isImageBufType *imb) {
+  isImageBufShard_t *shard;
+  isImageBufType *victims;
+  size_t cost;
+
+  cost = sizeof(*imb) + strlen(imb->key) + 1;
+  if (imb->buf != NULL) {
+    cost += imb->buf_size;
+  }
+  // Our mask (if any) belongs to the whole data set: it is not charged to us
+  pthread_mutex_lock(&imb->pyramid_mutex);
+  cost += imb->pyramid_bytes;
+  pthread_mutex_unlock(&imb->pyramid_mutex);
+
+  shard = isCacheShard(wctx, imb->hash);
+
+  pthread_mutex_lock(&shard->mutex);
+  victims = NULL;
+  if (imb->cached) {
+    shard->bytes[imb->buf_class] -= imb->cost;
+    shard->bytes[imb->buf_class] += cost;
+    imb->cost = cost;
+    victims = isCacheEvict(wctx, shard, imb->buf_class);
+  }
+  pthread_mutex_unlock(&shard->mutex);
+
+  isCacheDestroyList(wctx, victims);
+}
+
+/** Make a buffer we just filled available to everyone else.
+ **
+ ** Call with the buffer write locked (as returned empty by
+ ** isGetImageBufFromKey).  Returns with the buffer unlocked but still
+ ** referenced: call isReleaseImageBuf when done with it.
+ */
+void isPublishImageBuf(isWorkerContext_t *wctx, isImageBufType *imb) {
+  isCacheAccount(wctx, imb);
+  __atomic_store_n(&imb->ready, 1, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&imb->buflock);
+}
+
+/** Give up our claim on a buffer obtained from isGetImageBufFromKey
+ ** (or any of the routines that call it).
+ **
+ ** The buffer may be destroyed once we return.
+ */
+void isReleaseImageBuf(isWorkerContext_t *wctx, isImageBufType *imb) {
+  int refs;
+
+  refs = __atomic_sub_fetch(&imb->refs, 1, __ATOMIC_SEQ_CST);
+  assert(refs >= 0);
+
+  if (refs == 0 && !__atomic_load_n(&imb->cached, __ATOMIC_SEQ_CST) && isImageBufKill(imb)) {
     //
-    // TODO: Pass the error condition on to whoever called us cause as
-    // it is they'll just try reading the file too.
+    // We were the last ones using a buffer that is no longer in the
+    // cache.
     //
-    freeReplyObject(rr);
-    return rtn;
+    isEpochRetire(wctx, imb, NULL);
   }
+}
 
-  freeReplyObject(rr);
+/** We could not fill the buffer returned to us write locked by
+ ** isGetImageBufFromKey.  Remove it from the cache so that the next
+ ** request tries again and release it.  Threads that are already
+ ** waiting for this buffer will find it empty and try again
+ ** themselves.
+ **
+ ** Call with the buffer write locked.
+ */
+void isAbandonImageBuf(isWorkerContext_t *wctx, isImageBufType *imb) {
+  isImageBufShard_t *shard;
+
+  shard = isCacheShard(wctx, imb->hash);
 
-  redisAppendCommand(rc, "EXPIRE %s %d", key, IS_REDIS_TTL);
-  redisAppendCommand(rc, "HMGET %s META WIDTH HEIGHT DEPTH DATA BADPIXELS", key); 
+  pthread_mutex_lock(&shard->mutex);
+  if (imb->cached) {
+    isCacheRemove(shard, imb);
+  }
+  pthread_mutex_unlock(&shard->mutex);
 
-  // Expire
-  err = redisGetReply(rc, (void **)&rr);
-  if (err != REDIS_OK) {
-    isLogging_crit("%s: Redis failure (expire): %s\n", id, rc->errstr);
+  pthread_rwlock_unlock(&imb->buflock);
+  isReleaseImageBuf(wctx, imb);
+}
+
+/** Create new buffer
+ *
+ * Call with the shard mutex locked
+ *
+ * Return with a brand new write locked image buffer with one
+ * reference (ours).
+ */
+static isImageBufType *createNewImageBuf(isWorkerContext_t *wctx, isImageBufShard_t *shard, const char *key, unsigned int hash, image_buffer_class buf_class) {
+  static const char *id = FILEID "createNewImageBuf";
+  isImageBufType *rtn;
+  unsigned int b;
+
+  rtn = calloc(1, sizeof(*rtn));
+  if (rtn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
     exit (-1);
   }
-  freeReplyObject(rr);
 
-  // Mget
-  err = redisGetReply(rc, (void **)&rr);
-  if (err != REDIS_OK) {
-    isLogging_crit("%s: Redis failure (mget): %s\n", id, rc->errstr);
+  rtn->key = strdup(key);
+  if (rtn->key == NULL) {
+    isLogging_crit("%s: Out of memory (key)\n", id);
     exit (-1);
   }
+  rtn->hash      = hash;
+  rtn->buf_class = buf_class;
+  rtn->shm_slot  = -1;
 
-  meta_rr      = rr->element[0];
-  width_rr     = rr->element[1];
-  height_rr    = rr->element[2];
-  depth_rr     = rr->element[3];
-  image_rr     = rr->element[4];
-  badpixels_rr = rr->element[5];
+  pthread_rwlock_init(&rtn->buflock, NULL);
+  pthread_rwlock_wrlock(&rtn->buflock);
 
-  rtn->meta = NULL;
-  if (meta_rr->type == REDIS_REPLY_STRING) {
-    pthread_mutex_lock(&wctx->metaMutex);
-    rtn->meta = json_loads(meta_rr->str, 0, &jerr);
-    pthread_mutex_unlock(&wctx->metaMutex);
-  }
+  pthread_mutex_init(&rtn->pyramid_mutex, NULL);
 
+  rtn->refs = 1;
 
-  if (image_rr->type != REDIS_REPLY_STRING) {
-    //
-    // Perhaps the other process had a problem.  We'll just return as
-    // we are and let our caller deal with it.
-    //
-    freeReplyObject(rr);
-    return rtn;
+  if (shard->n_buffers >= shard->table->n_buckets) {
+    isCacheGrow(wctx, shard);
   }
 
+  isCacheLruPushHead(shard, rtn);
+  rtn->cost = sizeof(*rtn);
+  shard->bytes[buf_class] += rtn->cost;
+  rtn->cached = 1;
+  shard->n_buffers++;
+
   //
-  // We're all set. We'll free the redis object after we are done
-  // with the image.  We'll also exchange our write lock for a read
-  // lock.
-  rtn->rr  = rr;
-  rtn->buf = image_rr->str;
-  rtn->buf_size = image_rr->len;
-  
-  rtn->buf_width  = atoi(width_rr->str);
-  rtn->buf_height = atoi(height_rr->str);
-  rtn->buf_depth  = atoi(depth_rr->str);
-  
-  rtn->bad_pixel_map = NULL;
-  if (badpixels_rr->type == REDIS_REPLY_STRING) {
-    rtn->bad_pixel_map = badpixels_rr->str;
-  }
-  
-  if (rtn->buf_size != rtn->buf_width * rtn->buf_height * rtn->buf_depth) {
-    isLogging_crit("%s: Bad buffer size.  Width: %d  Height: %d  Depth: %d  Size: %d\n", id, rtn->buf_width, rtn->buf_height, rtn->buf_depth, rtn->buf_size);
-    exit (-1);
-  }
-  pthread_rwlock_unlock(&rtn->buflock);
-  pthread_rwlock_rdlock(&rtn->buflock);
-  
+  // Publish: everything above must be visible before the lock free
+  // readers can find us.
+  //
+  b = isCacheBucket(shard->table, hash);
+  rtn->hnext = shard->table->buckets[b];
+  __atomic_store_n(&shard->table->buckets[b], rtn, __ATOMIC_RELEASE);
+
   return rtn;
 }
 
-/**  After we've read some data we'll place it in redis so that other
- *   processes can access it without having to read the original file
- *   and/or re-reduce it.
+/** Look to see if the data are already available to us from the
+ *  image buffer cache, from the buffers shared by the other
+ *  supervisors of our ESAF, or (for reduced buffers) from redis.  If
+ *  another process is already reducing this image we'll wait a
+ *  while for it to finish rather than doing the work twice.
+ *
+ *  Cache hits take no locks at all: the hash chains are walked inside
+ *  an epoch (see isEpochEnter) and the buffer is claimed with an
+ *  atomic reference count.  Only misses lock the shard.
+ *
+ *  When the data are availabe we'll return a filled, unlocked buffer.
+ *  Otherwise, we'll returned with no data and a write locked buffer:
+ *  fill it and call isPublishImageBuf.
+ *
+ *  Either way, call isReleaseImageBuf when done with the buffer (or
+ *  isAbandonImageBuf if you were supposed to fill it but could not).
+ *
+ *  It is expected that if the caller has to go get the data
+ *  themselves that they'll do the kindness of calling isRedisPut (or
+ *  isRedisAbandon on failure) so that the other processes can get
+ *  back to work.
+ *
  */
-void isWriteImageBufToRedis(isWorkerContext_t *wctx, isImageBufType *imb, redisContext *rc) {
-  static const char *id = FILEID "isWriteImageBufToRedis";
-  redisReply *rr;
-  char *meta_str;
-  int err;
-  int i;
-  int n;
-
-  pthread_mutex_lock(&wctx->metaMutex);
-  meta_str = json_dumps(imb->meta, JSON_COMPACT | JSON_INDENT(0) | JSON_SORT_KEYS);
-  pthread_mutex_unlock(&wctx->metaMutex);
+isImageBufType *isGetImageBufFromKey(isWorkerContext_t *wctx, redisContext *rc, char *key, image_buffer_class buf_class) {
+  isImageBufType *rtn;          // This is our return value
+  isImageBufShard_t *shard;     // where our key lives
+  unsigned int hash;            // hash of our key
+  int ready;
+
+  hash  = isCacheHash(key);
+  shard = isCacheShard(wctx, hash);
+
+  while (1) {
+    isEpochEnter(wctx);
+    rtn = isCacheLookup(shard, key, hash);
+    isEpochExit(wctx);
+
+    if (rtn == NULL) {
+      //
+      // Make sure with the shard locked
+      //
+      pthread_mutex_lock(&shard->mutex);
+      rtn = isCacheLookup(shard, key, hash);
+      if (rtn == NULL) {
+        break;
+      }
+      pthread_mutex_unlock(&shard->mutex);
+    }
 
-  redisAppendCommand(rc, "HMSET %s META %s WIDTH %d HEIGHT %d DEPTH %d", imb->key, meta_str, imb->buf_width, imb->buf_height, imb->buf_depth);
-  redisAppendCommand(rc, "HSET %s DATA %b", imb->key, imb->buf, imb->buf_size);
-  if (imb->bad_pixel_map) {
-    redisAppendCommand(rc, "HSET %s BADPIXELS %b", imb->key, imb->bad_pixel_map, sizeof(uint32_t) * imb->buf_width * imb->buf_height);
-  }
-  redisAppendCommand(rc, "EXPIRE %s %d", imb->key, IS_REDIS_TTL);
-  redisAppendCommand(rc, "HGET %s USERS", imb->key);
+    __atomic_store_n(&rtn->referenced, 1, __ATOMIC_RELAXED);
 
-  // meta reply
-  err = redisGetReply(rc, (void **)&rr);
-  if (err != REDIS_OK) {
-    isLogging_crit("%s: Redis failure (hset meta): %s\n", id, rc->errstr);
-    exit (-1);
-  }
-  freeReplyObject(rr);
+    if (__atomic_load_n(&rtn->ready, __ATOMIC_ACQUIRE)) {
+      return rtn;
+    }
 
-  // data reply
-  err = redisGetReply(rc, (void **)&rr);
-  if (err != REDIS_OK) {
-    isLogging_crit("%s: Redis failure (hset data): %s\n", id, rc->errstr);
-    exit (-1);
-  }
-  freeReplyObject(rr);
+    //
+    // Someone is still filling the buffer.  Wait for them to finish.
+    //
+    pthread_rwlock_rdlock(&rtn->buflock);
+    ready = __atomic_load_n(&rtn->ready, __ATOMIC_ACQUIRE);
+    pthread_rwlock_unlock(&rtn->buflock);
 
-  // badpixels reply
-  if (imb->bad_pixel_map != NULL) {
-    err = redisGetReply(rc, (void **)&rr);
-    if (err != REDIS_OK) {
-      isLogging_crit("%s: Redis failure (hset badpixels): %s\n", id, rc->errstr);
-      exit (-1);
+    if (ready) {
+      return rtn;
     }
-    freeReplyObject(rr);
-  }    
 
-  // expire reply
-  err = redisGetReply(rc, (void **)&rr);
-  if (err != REDIS_OK) {
-    isLogging_crit("%s: Redis failure (hset expire): %s\n", id, rc->errstr);
-    exit (-1);
+    //
+    // Whoever was filling this buffer gave up on it and took it out
+    // of the cache.  Try again: likely we'll be the one to fill it
+    // this time.
+    //
+    isReleaseImageBuf(wctx, rtn);
   }
-  freeReplyObject(rr);
 
-  // users reply
-  err = redisGetReply(rc, (void **)&rr);
-  if (err != REDIS_OK) {
-    isLogging_crit("%s: Redis failure (hget users): %s\n", id, rc->errstr);
-    exit (-1);
+  //
+  // Create a new entry then read some data into it.  We still have
+  // the shard mutex locked: This is used to avoid contention with
+  // other writers.
+  //
+  rtn = createNewImageBuf(wctx, shard, key, hash, buf_class);
+  // buffer is write locked and we hold a reference
+
+  pthread_mutex_unlock(&shard->mutex);       // We can now allow access to the other buffers
+
+  //
+  // Perhaps another supervisor in our ESAF has already done the work
+  //
+  if (isShmGet(wctx, rtn) == 0) {
+    isPublishImageBuf(wctx, rtn);
+    return rtn;
   }
-  n = rr->integer;
-  freeReplyObject(rr);
-  
+
   //
-  // tell the processes awaiting notification it's time to get back to work
+  // Reduced buffers may be waiting for us in redis.  If not we'll
+  // hold the lease while our caller fills the buffer.
   //
-  for (i=1; i<n; i++) {
-    rr = redisCommand(rc, "LPUSH %s-READY ok", imb->key);
-    freeReplyObject(rr);
+  if (buf_class == REDUCED_IMAGE_BUFFER && isRedisGet(wctx, rc, rtn) == 0) {
+    isShmPut(wctx, rtn);
+    isPublishImageBuf(wctx, rtn);
+    return rtn;
   }
+
+  //
+  // Our caller will fill.  Leave with buffer write locked and
+  // referenced.
+  //
+  return rtn;
 }
 
-/** Get the unreduced image
+/** Make the cache key of the unreduced image a job asks for
+ **
+ ** @param wctx    Our worker context
+ **
+ ** @param job     Request from user (we use fn and frame)
+ **
+ ** @param fnp     Set to the file name
+ **
+ ** @param framep  Set to the frame number
+ **
+ ** @returns the key (free it) or NULL if the job is no good
  */
-isImageBufType *isGetRawImageBuf(isWorkerContext_t *wctx, redisContext *rc, json_t *job) {
-  static const char *id = FILEID "isGetRawImageBuf";
+static char *isRawImageKey(isWorkerContext_t *wctx, json_t *job, const char **fnp, int *framep) {
+  static const char *id = FILEID "isRawImageKey";
   const char *fn;
   int frame;
   int frame_strlen;
-  isImageBufType *rtn;
   int gid;
   int gid_strlen;
   char *key;
   int key_strlen;
-  image_file_type ft;
-  int err;
 
   pthread_mutex_lock(&wctx->metaMutex);
   fn = json_string_value(json_object_get(job, "fn"));
@@ -859,20 +1196,41 @@ isImageBufType *isGetRawImageBuf(isWorkerContext_t *wctx, redisContext *rc, json
   snprintf(key, key_strlen, "%d:%s-%d", gid, fn, frame);
   key[key_strlen] = 0;
 
+  *fnp    = fn;
+  *framep = frame;
+  return key;
+}
+
+/** Get the unreduced image
+ */
+isImageBufType *isGetRawImageBuf(isWorkerContext_t *wctx, redisContext *rc, json_t *job) {
+  static const char *id = FILEID "isGetRawImageBuf";
+  const char *fn;
+  int frame;
+  isImageBufType *rtn;
+  char *key;
+  image_file_type ft;
+  int err;
+
+  key = isRawImageKey(wctx, job, &fn, &frame);
+  if (key == NULL) {
+    return NULL;
+  }
+
   // Get the buffer and fill it if it's in redis already
   //
-  // Buffer is read locked if it exists, write locked if it does not
+  // Buffer is filled if it exists, write locked if it does not
   //
   // isLogging_info("%s: about to get image buffer from key %s\n", id, key);
 
-  rtn = isGetImageBufFromKey(wctx, rc, key);
-  rtn->frame = frame;
+  rtn = isGetImageBufFromKey(wctx, rc, key, RAW_IMAGE_BUFFER);
   if (rtn->buf != NULL) {
-    isLogging_crit("%s: Found buffer for key %s\n", id, key);
+    isLogging_info("%s: Found buffer for key %s\n", id, key);
     free(key);
     return rtn;
   }
   free(key);
+  rtn->frame = frame;
 
   // I guess we didn't find our buffer in redis
   //
@@ -903,19 +1261,148 @@ isImageBufType *isGetRawImageBuf(isWorkerContext_t *wctx, redisContext *rc, json
     err = -1;
   }
 
-  #ifndef IS_IGNORE_REDIS_STORE
-  if (err == 0) {
-    isWriteImageBufToRedis(wctx, rtn, rc);
-  }
-  #endif
-
   if (err != 0) {
-    pthread_rwlock_unlock(&rtn->buflock);
+    isAbandonImageBuf(wctx, rtn);
     return NULL;
   }
 
-  pthread_rwlock_unlock(&rtn->buflock);
-  pthread_rwlock_rdlock(&rtn->buflock);
+  isShmPut(wctx, rtn);
+  isPublishImageBuf(wctx, rtn);
 
   return rtn;
 }
+
+/** Is there already a buffer for this key in our cache or in shared
+ ** memory?
+ */
+static int isImageBufCached(isWorkerContext_t *wctx, const char *key) {
+  isImageBufType *imb;
+  unsigned int hash;
+
+  hash = isCacheHash(key);
+
+  isEpochEnter(wctx);
+  imb = isCacheLookup(isCacheShard(wctx, hash), key, hash);
+  isEpochExit(wctx);
+
+  if (imb != NULL) {
+    isReleaseImageBuf(wctx, imb);
+    return 1;
+  }
+
+  return isShmHas(wctx, key, hash);
+}
+
+/** Get ready to read the unreduced image a block of rows at a time
+ ** instead of reading it into the cache.  This is for one off
+ ** reductions (say, the spot finder sweeping a data set) where the
+ ** raw frame would only push more useful buffers out of the cache.
+ **
+ ** Frames that are already cached (here or in shared memory) are
+ ** better off going through isGetRawImageBuf.  So are frames stored
+ ** as a single chunk: the whole chunk is decompressed for every block
+ ** of rows we'd read from it.
+ **
+ ** @param wctx  Our worker context
+ **
+ ** @param job   Request from user (we use fn and frame)
+ **
+ ** @param raw   Filled with the frame's key, meta, dimensions, and
+ **              mask (but no buffer).  Call isCloseRawRows when done.
+ **
+ ** @param rr    The reader for the frame's rows
+ **
+ ** @returns 0 when ready to read, 1 if the frame is better read
+ ** whole with isGetRawImageBuf (it is cached or is a single chunk),
+ ** or -1 on error
+ */
+int isOpenRawRows(isWorkerContext_t *wctx, json_t *job, isImageBufType *raw, isRowReader_t *rr) {
+  static const char *id = FILEID "isOpenRawRows";
+  const char *fn;
+  int frame;
+  char *key;
+  image_file_type ft;
+  int err;
+
+  memset(raw, 0, sizeof(*raw));
+  memset(rr, 0, sizeof(*rr));
+
+  key = isRawImageKey(wctx, job, &fn, &frame);
+  if (key == NULL) {
+    return -1;
+  }
+
+  if (isImageBufCached(wctx, key)) {
+    free(key);
+    return 1;
+  }
+
+  raw->key       = key;
+  raw->hash      = isCacheHash(key);
+  raw->buf_class = RAW_IMAGE_BUFFER;
+  raw->frame     = frame;
+
+  err = -1;
+  ft = isFileType(fn);
+  switch (ft) {
+  case HDF5:
+    raw->meta = isH5GetMeta(wctx, fn);
+    if (!raw->meta) {
+      break;
+    }
+    err = isH5OpenRows(wctx, fn, raw, rr);
+    break;
+
+  case RAYONIX:
+  case RAYONIX_BS:
+    raw->meta = isRayonixGetMeta(wctx, fn);
+    if (!raw->meta) {
+      break;
+    }
+    err = isRayonixOpenRows(wctx, fn, raw, rr);
+    break;
+
+  case UNKNOWN:
+  default:
+    isLogging_crit("%s: unknown file type '%d' for file %s\n", id, ft, fn);
+    err = -1;
+  }
+
+  if (err != 0) {
+    isCloseRawRows(wctx, raw, rr);
+    return -1;
+  }
+
+  if (rr->chunk_rows >= rr->height) {
+    isCloseRawRows(wctx, raw, rr);
+    return 1;
+  }
+  return 0;
+}
+
+/** Done with a frame from isOpenRawRows
+ */
+void isCloseRawRows(isWorkerContext_t *wctx, isImageBufType *raw, isRowReader_t *rr) {
+  if (rr->close) {
+    rr->close(rr);
+    rr->close = NULL;
+  }
+
+  if (raw->meta) {
+    pthread_mutex_lock(&wctx->metaMutex);
+    json_decref(raw->meta);
+    pthread_mutex_unlock(&wctx->metaMutex);
+    raw->meta = NULL;
+  }
+
+  isMaskRelease(raw->mask);
+  raw->mask = NULL;
+
+  if (raw->destroy_extra) {
+    raw->destroy_extra(raw->extra);
+    raw->extra = NULL;
+  }
+
+  free((char *)raw->key);
+  raw->key = NULL;
+}
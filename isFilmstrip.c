@@ -0,0 +1,323 @@
+/*! @file isFilmstrip.c
+ *  @copyright 2018 by Northwestern University All Rights Reserved
+ *  @author Keith Brister
+ *  @brief Render many frames of a data set as one sheet of thumbnails
+ *
+ *  Overview pages show thumbnails of a whole run.  Rather than one
+ *  jpeg request per frame, each with its own round trip, a
+ *  "filmstrip" job asks for a range of frames and gets back a single
+ *  jpeg with the thumbnails laid out in a grid, left to right and top
+ *  to bottom, and the statistics of each frame in the meta data.
+ *
+ *  The frames are fetched in parallel by the threads that may wait on
+ *  files and redis (see isPoolRunIO), each with its own redis
+ *  connection, and reduced with the help of the compute pool.  They are
+ *  streamed (see isOpenRawRows) since nobody is going to look at the
+ *  full size frames, and they share the data set's bad pixel mask and
+ *  reduction geometry through the usual caches.  The reduced
+ *  thumbnails are cached just as those of "jpeg" jobs are.
+ */
+#include "is.h"
+
+/** The frames of one filmstrip job
+ */
+typedef struct isFilmstripStruct {
+  isWorkerContext_t *wctx;              //!< Our worker context
+  pthread_t caller;                     //!< The worker thread that got the job
+  redisContext *rc;                     //!< The caller's redis connection
+  const char *fn;                       //!< The data set
+  const char *reduce;                   //!< Reduction mode (as the user gave it, maybe NULL)
+  int first;                            //!< First frame
+  int stride;                           //!< Frames between thumbnails
+  int thumb;                            //!< Thumbnail width
+  isImageBufType **imbs;                //!< Each frame's reduced image (NULL if we could not get it)
+} isFilmstrip_t;
+
+/** Reduce one frame (isPoolRunIO callback)
+ */
+static void isFilmstripFrame(void *voidp, int i) {
+  static const char *id = FILEID "isFilmstripFrame";
+  isFilmstrip_t *fs;
+  redisContext *rc;
+  json_t *job;
+
+  fs = voidp;
+  fs->imbs[i] = NULL;
+
+  // The caller lends a hand with its own connection
+  rc = pthread_equal(pthread_self(), fs->caller) ? fs->rc : isPoolRedis();
+  if (rc == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&fs->wctx->metaMutex);
+  job = json_object();
+  set_json_object_string(id, job, "fn", "%s", fs->fn);
+  set_json_object_integer(id, job, "frame", fs->first + i * fs->stride);
+  set_json_object_integer(id, job, "xsize", fs->thumb);
+  if (fs->reduce != NULL) {
+    set_json_object_string(id, job, "reduce", "%s", fs->reduce);
+  }
+  json_object_set_new(job, "stream", json_true());
+  pthread_mutex_unlock(&fs->wctx->metaMutex);
+
+  // when isReduceImage returns a buffer it is filled and ours to release
+  fs->imbs[i] = isReduceImage(fs->wctx, rc, job);
+
+  pthread_mutex_lock(&fs->wctx->metaMutex);
+  json_decref(job);
+  pthread_mutex_unlock(&fs->wctx->metaMutex);
+}
+
+/** Render thumbnails of a range of frames as one jpeg
+ **
+ ** @param wctx Worker context
+ **  @li @c wctx->shards  Our image buffer cache
+ **
+ ** @param tcp Thread data
+ **   @li @c tcp->rep  ZMQ Response socket into which the throw our response.
+ **
+ ** @param job             {Object}     - Description of what is requested
+ ** @param job.cols        {Integer}    - Thumbnails across (default: as near square as we can)
+ ** @param job.contrast    {Integer}    - Image data >= this are black (default: each frame's IS_AUTO_BLACK_PERCENTILE percentile)
+ ** @param job.fn          {String}     - file name
+ ** @param job.frame       {Integer}    - First frame (default 1)
+ ** @param job.last        {Integer}    - Last frame (default: just the first)
+ ** @param job.reduce      {String}     - "max" (default), "mean", "sum", or "median"
+ ** @param job.stride      {Integer}    - Frames from one thumbnail to the next (default 1)
+ ** @param job.tag         {String}     - ID for us to know what to do with the result
+ ** @param job.type        {String}     - "FILMSTRIP"
+ ** @param job.wval        {Integer}    - Image data <= this are white (negative for each frame's IS_AUTO_WHITE_PERCENTILE percentile)
+ ** @param job.xsize       {Integer}    - Width of each thumbnail (default IS_FILMSTRIP_THUMB)
+ **
+ ** The meta data we send has the grid (cols, rows, thumb_width,
+ ** thumb_height) and, in frames, each frame's number, statistics, and
+ ** the white and black levels used (or missing: true if we could not
+ ** get the frame).
+ **
+ ** Montages taller or wider than IS_JPEG_MAX_SIDE, or with more than
+ ** IS_FILMSTRIP_MAX_PIXELS pixels, are turned down before we allocate
+ ** them.
+ */
+void isFilmstrip(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
+  static const char *id = FILEID "isFilmstrip";
+  isFilmstrip_t fs;
+  isImageBufType *imb;
+  unsigned char *pixels;                // gray scale montage
+  unsigned char *rgb;                   // color montage when there are saturated pixels
+  unsigned char *gp;
+  unsigned char *cell;
+  json_t *meta;
+  json_t *frames;
+  json_t *fo;
+  int32_t wval, bval;
+  uint32_t sat;
+  uint32_t v;
+  size_t index;
+  int thumb_height;
+  int saturated;
+  int width;
+  int height;
+  int last;
+  int cols;
+  int rows;
+  int x0, y0;
+  int got;
+  int n;
+  int i;
+  int m;
+  int k;
+
+  memset(&fs, 0, sizeof(fs));
+  fs.wctx   = wctx;
+  fs.caller = pthread_self();
+  fs.rc     = tcp->rc;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  fs.fn     = json_string_value(json_object_get(job, "fn"));
+  fs.reduce = json_string_value(json_object_get(job, "reduce"));
+  fs.first  = json_integer_value(json_object_get(job, "frame"));
+  fs.stride = json_integer_value(json_object_get(job, "stride"));
+  fs.thumb  = json_integer_value(json_object_get(job, "xsize"));
+  last      = json_integer_value(json_object_get(job, "last"));
+  cols      = json_integer_value(json_object_get(job, "cols"));
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (fs.fn == NULL || *fs.fn == 0) {
+    isLogging_err("%s: Cannot find file name in job\n", id);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Cannot find file name in job", id);
+    return;
+  }
+
+  fs.first  = fs.first <= 0 ? 1 : fs.first;
+  fs.stride = fs.stride <= 0 ? 1 : fs.stride;
+  fs.thumb  = fs.thumb <= 0 ? IS_FILMSTRIP_THUMB : fs.thumb;
+  fs.thumb  = fs.thumb < 8 ? 8 : fs.thumb;
+  fs.thumb  = fs.thumb > IS_FILMSTRIP_MAX_THUMB ? IS_FILMSTRIP_MAX_THUMB : fs.thumb;
+  last      = last < fs.first ? fs.first : last;
+
+  n = (last - fs.first) / fs.stride + 1;
+  if (n > IS_FILMSTRIP_MAX_FRAMES) {
+    isLogging_err("%s: %d frames is too many for one filmstrip\n", id, n);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Too many frames (%d) for one filmstrip.  The limit is %d", id, n, IS_FILMSTRIP_MAX_FRAMES);
+    return;
+  }
+
+  if (cols <= 0) {
+    for (cols=1; cols * cols < n; cols++);
+  }
+  cols  = cols > n ? n : cols;
+  rows  = (n + cols - 1) / cols;
+  width = cols * fs.thumb;
+
+  //
+  // We know how wide the montage is now but not how tall until we
+  // have the thumbnails
+  //
+  if (width > IS_JPEG_MAX_SIDE || (size_t)width * rows > IS_FILMSTRIP_MAX_PIXELS) {
+    isLogging_err("%s: %d by %d thumbnails %d wide is too big for one filmstrip\n", id, cols, rows, fs.thumb);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Filmstrip too big (%d by %d thumbnails %d wide).  Ask for fewer columns, frames, or a smaller xsize", id, cols, rows, fs.thumb);
+    return;
+  }
+
+  fs.imbs = calloc(n, sizeof(*fs.imbs));
+  if (fs.imbs == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  isPoolRunIO(wctx, n, isFilmstripFrame, &fs);
+
+  //
+  // Lay out the grid.  Cells are as tall as the tallest thumbnail.
+  //
+  got = 0;
+  thumb_height = 0;
+  for (i=0; i<n; i++) {
+    if (fs.imbs[i] != NULL) {
+      got++;
+      thumb_height = fs.imbs[i]->buf_height > thumb_height ? fs.imbs[i]->buf_height : thumb_height;
+    }
+  }
+
+  height = rows * thumb_height;
+
+  if (got == 0) {
+    isLogging_err("%s: missing data for all %d frames of %s\n", id, n, fs.fn);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: missing data for %s", id, fs.fn);
+  } else if (height > IS_JPEG_MAX_SIDE || (size_t)width * height > IS_FILMSTRIP_MAX_PIXELS) {
+    isLogging_err("%s: %dx%d montage of %s is too big\n", id, width, height, fs.fn);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Filmstrip too big (%dx%d).  Ask for fewer frames or a smaller xsize", id, width, height);
+    got = 0;
+  }
+
+  if (got == 0) {
+    for (i=0; i<n; i++) {
+      if (fs.imbs[i] != NULL) {
+        isReleaseImageBuf(wctx, fs.imbs[i]);
+      }
+    }
+    free(fs.imbs);
+    return;
+  }
+
+  pixels = isBufGet((size_t)width * height);
+  memset(pixels, 0xf0, (size_t)width * height);
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  meta   = json_object();
+  frames = json_array();
+  set_json_object_integer(id, meta, "cols", cols);
+  set_json_object_integer(id, meta, "rows", rows);
+  set_json_object_integer(id, meta, "thumb_width", fs.thumb);
+  set_json_object_integer(id, meta, "thumb_height", thumb_height);
+  json_object_set_new(meta, "frames", frames);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  saturated = 0;
+  cell = isBufGet((size_t)fs.thumb * thumb_height);
+  for (i=0; i<n; i++) {
+    imb = fs.imbs[i];
+
+    pthread_mutex_lock(&wctx->metaMutex);
+    fo = json_object();
+    set_json_object_integer(id, fo, "frame", fs.first + i * fs.stride);
+    json_array_append_new(frames, fo);
+    if (imb == NULL) {
+      json_object_set_new(fo, "missing", json_true());
+    }
+    pthread_mutex_unlock(&wctx->metaMutex);
+
+    if (imb == NULL) {
+      continue;
+    }
+
+    isJpegContrast(wctx, job, imb->meta, &wval, &bval);
+    saturated |= isJpegMap(imb, wval, bval, cell);
+
+    x0 = (i % cols) * fs.thumb;
+    y0 = (i / cols) * thumb_height;
+    for (m=0; m<imb->buf_height; m++) {
+      memcpy(pixels + (size_t)(y0 + m) * width + x0, cell + (size_t)m * imb->buf_width, imb->buf_width < fs.thumb ? imb->buf_width : fs.thumb);
+    }
+
+    pthread_mutex_lock(&wctx->metaMutex);
+    set_json_object_real(id,    fo, "mean",   json_number_value(json_object_get(imb->meta, "mean")));
+    set_json_object_real(id,    fo, "stddev", json_number_value(json_object_get(imb->meta, "stddev")));
+    set_json_object_integer(id, fo, "min",    json_integer_value(json_object_get(imb->meta, "min")));
+    set_json_object_integer(id, fo, "max",    json_integer_value(json_object_get(imb->meta, "max")));
+    set_json_object_integer(id, fo, "wval_used", wval);
+    set_json_object_integer(id, fo, "bval_used", bval);
+    pthread_mutex_unlock(&wctx->metaMutex);
+  }
+  isBufPut(cell);
+
+  if (!saturated) {
+    isJpegSendImage(wctx, tcp, job, meta, pixels, width, height, 1);
+  } else {
+    //
+    // Paint the saturated pixels red
+    //
+    rgb = isBufGet((size_t)width * height * 3);
+    for (index=0; index < (size_t)width * height; index++) {
+      rgb[3*index] = rgb[3*index+1] = rgb[3*index+2] = pixels[index];
+    }
+
+    for (i=0; i<n; i++) {
+      imb = fs.imbs[i];
+      if (imb == NULL) {
+        continue;
+      }
+      sat = imb->buf_depth == 2 ? 0xffff : 0xffffffff;
+      x0  = (i % cols) * fs.thumb;
+      y0  = (i / cols) * thumb_height;
+      for (m=0; m<imb->buf_height; m++) {
+        gp = rgb + ((size_t)(y0 + m) * width + x0) * 3;
+        for (k=0; k<imb->buf_width && k<fs.thumb; k++) {
+          index = (size_t)m * imb->buf_width + k;
+          v = imb->buf_depth == 2 ? ((uint16_t *)imb->buf)[index] : ((uint32_t *)imb->buf)[index];
+          if (v == sat) {
+            gp[3*k]   = 0xff;
+            gp[3*k+1] = 0;
+            gp[3*k+2] = 0;
+          }
+        }
+      }
+    }
+
+    isJpegSendImage(wctx, tcp, job, meta, rgb, width, height, 0);
+    isBufPut(rgb);
+  }
+
+  isBufPut(pixels);
+  for (i=0; i<n; i++) {
+    if (fs.imbs[i] != NULL) {
+      isReleaseImageBuf(wctx, fs.imbs[i]);
+    }
+  }
+  free(fs.imbs);
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  json_decref(meta);
+  pthread_mutex_unlock(&wctx->metaMutex);
+}
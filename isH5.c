@@ -2,6 +2,21 @@
  *  @copyright 2017 by Northwestern University
  *  @author Keith Brister
  *  @brief Routines to support reading hdf5 files generated by the Dectris Eiger detector
+ *
+ *  Opening a master file, reading its meta data, and opening each of
+ *  its data files is a lot of metadata traffic for a network file
+ *  system, and every frame of a data set needs the very same handles.
+ *  We keep the IS_H5_FILE_CACHE_ENTRIES most recently used master
+ *  files open along with their meta data and the data sets we
+ *  discovered in them.  Entries are keyed by the master file's device,
+ *  inode, modification time, and size so a rewritten master file is
+ *  opened afresh; the stat that costs is much cheaper than the opens
+ *  it saves.  The data files get the same treatment: each data set
+ *  remembers the stat of its data file from when it was opened and is
+ *  reopened when a frame is fetched from a data file that has since
+ *  been replaced.  Frames hold a reference to their entry (as their
+ *  extra) so an entry leaving the cache stays open until they are
+ *  done.
  */
 #include "is.h"
 
@@ -12,6 +27,10 @@
  */
 typedef struct frame_discovery_struct {
   struct frame_discovery_struct *next;  //!< The index frame_discovery_struct in our list
+  pthread_rwlock_t lock;                //!< Read locked while the data set is used, write locked while it is reopened
+  char *name;                           //!< Path of the data set in the master file
+  char *data_fn;                        //!< Data file the data set is linked to (NULL when it is in the master file)
+  char *data_key;                       //!< Device, inode, mtime, and size of data_fn when we opened the data set
   hid_t data_set;                       //!< our h5 dataset
   hid_t file_space;                     //!< the file space
   hid_t file_type;                      //!< the file type, of course
@@ -20,12 +39,22 @@ typedef struct frame_discovery_struct {
   char *done_list;                      //!< List of frames we've processed already.  Not yet used in this project.
 } frame_discovery_t;
 
-/** Extra information. We need to keep track of so we don't have to
- ** recalculate it for the next query.
+/** An open master file.  Extra information we need to keep track of
+ ** so we don't have to recalculate it for the next query (or the next
+ ** frame).
  */
-typedef struct isH5extraStruct {
+struct isH5FileStruct {
+  struct isH5FileStruct *next;               //!< Next master file in our cache
+  isWorkerContext_t *wctx;                   //!< Whose cache we are in
+  char *fn;                                  //!< File name we were opened with
+  char *key;                                 //!< Device, inode, mtime, and size of the file (NULL until cached)
+  int refs;                                  //!< Number of frames (and caches) using us (use __atomic builtins)
+  hid_t master_file;                         //!< The master file, of course
+  json_t *meta;                              //!< The meta data (without fn)
+  uint32_t first_frame;                      //!< first frame referenced by master file
+  uint32_t last_frame;                       //!< last frame referenced by master file
   frame_discovery_t *frame_discovery_base;   //!< List of discovered frames
-} isH5extra_t;
+};
 
 /** h5 to json equivalencies.  We read HDF5 properties and convert
  ** them to json to use and/or transmit back to the user's browser.
@@ -311,9 +340,13 @@ json_t *get_json( const char *fn, hid_t master_file, h5_to_json_t *htj) {
   return rtn;
 }
 
-/** Read the meta data from a file.
+/** Read the meta data from a master file.
  **
- ** @param[in] fn Name of the master file to open
+ ** @param[in] wctx         Our worker context
+ **
+ ** @param[in] master_file  The open master file
+ **
+ ** @param[in] fn           Name of the master file (for our messages)
  **
  ** @returns JSON object contianing the metadata.  json_decref must be
  ** called when you are done with it.  Null is returned on an error
@@ -321,10 +354,8 @@ json_t *get_json( const char *fn, hid_t master_file, h5_to_json_t *htj) {
  **
  ** @remark Programming errors are fatal.
  */
-json_t *isH5GetMeta(isWorkerContext_t *wctx, const char *fn) {
-  static const char *id = FILEID "isH5Jpeg";
-  hid_t master_file;            // master file object
-  herr_t herr;                  // error from an h5 call
+static json_t *isH5ReadMeta(isWorkerContext_t *wctx, hid_t master_file, const char *fn) {
+  static const char *id = FILEID "isH5ReadMeta";
   json_t *meta;                 // our meta data return object
   json_t *tmp_obj;              // temporary json object used to create meta
   int i;                        // loop over json conversion array
@@ -334,27 +365,12 @@ json_t *isH5GetMeta(isWorkerContext_t *wctx, const char *fn) {
   const struct h5_json_property* properties = NULL;
   int n_properties = -1;
   
-  
-  //
-  // Open up the master file
-  //
-  master_file = H5Fopen(fn, H5F_ACC_RDONLY, H5P_DEFAULT);
-  if (master_file < 0) {
-    isLogging_err("%s: Could not open master file %s\n", id, fn);
-    return NULL;
-  }
-
   //
   // Find the meta data
   //
   meta = json_object();
   if (meta == NULL) {
     isLogging_err("%s: Could not create metadata object in file %s\n", id, fn);
-
-    herr = H5Fclose(master_file);
-    if (herr < 0) {
-      isLogging_err("%s: failed to close master file\n", id);
-    }
     return NULL;
   }
 
@@ -391,11 +407,6 @@ json_t *isH5GetMeta(isWorkerContext_t *wctx, const char *fn) {
     err = json_object_update(meta, tmp_obj);
     if (err != 0) {
       isLogging_err("%s: Could not update meta_obj\n", id);
-      
-      herr = H5Fclose(master_file);
-      if (herr < 0) {
-        isLogging_err("%s: failed to close master file\n", id);
-      }
       json_decref(meta);
       json_decref(tmp_obj);
       pthread_mutex_unlock(&wctx->metaMutex);
@@ -406,16 +417,182 @@ json_t *isH5GetMeta(isWorkerContext_t *wctx, const char *fn) {
 
   set_json_object_integer(id, meta, "image_depth",  json_integer_value(json_object_get(meta,"bit_depth_image"))/8);
 
-  herr = H5Fclose(master_file);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  return meta;
+}
+
+/** Device, inode, modification time, and size of a file: when any of
+ ** these change the file is not the one we opened
+ **
+ ** @param[in] fn  The file
+ **
+ ** @returns the key (free it) or NULL if we could not stat the file
+ */
+static char *isH5StatKey(const char *fn) {
+  static const char *id = FILEID "isH5StatKey";
+  struct stat sb;
+  char *key;
+
+  if (stat(fn, &sb) != 0) {
+    isLogging_err("%s: Could not stat %s: %s\n", id, fn, strerror(errno));
+    return NULL;
+  }
+
+  if (asprintf(&key, "%llu:%llu@%lld.%09ld:%lld", (unsigned long long)sb.st_dev, (unsigned long long)sb.st_ino,
+               (long long)sb.st_mtim.tv_sec, sb.st_mtim.tv_nsec, (long long)sb.st_size) < 0) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  return key;
+}
+
+/** The file an external link points to.  Relative names are relative
+ ** to the master file's directory, as the detector writes them.
+ **
+ ** @param[in] lid        Location the link name is relative to
+ **
+ ** @param[in] name       The link
+ **
+ ** @param[in] master_fn  Name of the master file
+ **
+ ** @returns the file name (free it) or NULL if name is not an external link
+ */
+static char *isH5LinkFile(hid_t lid, const char *name, const char *master_fn) {
+  static const char *id = FILEID "isH5LinkFile";
+  H5L_info_t info;
+  const char *fnp;                      // file name in the link value
+  const char *pp;                       // object path in the link value
+  const char *slash;
+  char *val;
+  char *rtn;
+
+  if (H5Lget_info(lid, name, &info, H5P_DEFAULT) < 0 || info.type != H5L_TYPE_EXTERNAL) {
+    return NULL;
+  }
+
+  val = malloc(info.u.val_size);
+  if (val == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  rtn = NULL;
+  if (H5Lget_val(lid, name, val, info.u.val_size, H5P_DEFAULT) >= 0 &&
+      H5Lunpack_elink_val(val, info.u.val_size, NULL, &fnp, &pp) >= 0) {
+    slash = strrchr(master_fn, '/');
+    if (fnp[0] == '/' || slash == NULL) {
+      rtn = strdup(fnp);
+    } else if (asprintf(&rtn, "%.*s/%s", (int)(slash - master_fn), master_fn, fnp) < 0) {
+      rtn = NULL;
+    }
+    if (rtn == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+  } else {
+    isLogging_err("%s: Could not get the file linked to by %s\n", id, name);
+  }
+
+  free(val);
+  return rtn;
+}
+
+/** Open a data set and find the frames it holds
+ **
+ ** @param[in]     lid   Location name is relative to
+ **
+ ** @param[in]     name  The data set
+ **
+ ** @param[in,out] fp    Filled with the data set, its type and space,
+ **                      and its first and last frame numbers.  Close
+ **                      them with isH5DataClose even on failure.
+ **
+ ** @returns 0 on success, -1 on failure
+ */
+static int isH5DataOpen(hid_t lid, const char *name, frame_discovery_t *fp) {
+  static const char *id = FILEID "isH5DataOpen";
+  herr_t herr;                          // h5 error code
+  hid_t image_nr_high;                  // largest frame number number in this file
+  hid_t image_nr_low;                   // smallest frame number in this file
+
+  //isLogging_debug("%s: calling H5Dopen2 for %s", id, name);
+  fp->data_set = H5Dopen2(lid, name, H5P_DEFAULT);
+  if (fp->data_set < 0) {
+    isLogging_err("%s: Failed to open dataset %s\n", id, name);
+    return -1;
+  }
+
+  //isLogging_debug("%s: calling H5Dget_type for %s", id, name);
+  fp->file_type = H5Dget_type(fp->data_set);
+  if (fp->file_type < 0) {
+    isLogging_err("%s: Could not get data_set type for %s\n", id, name);
+    return -1;
+  }
+
+  //isLogging_debug("%s: calling H5Dget_space for %s", id, name);
+  fp->file_space = H5Dget_space(fp->data_set);
+  if (fp->file_space < 0) {
+    isLogging_err("%s: Could not get data_set space for %s\n", id, name);
+    return -1;
+  }
+
+  image_nr_high = H5Aopen_by_name( lid, name, "image_nr_high", H5P_DEFAULT, H5P_DEFAULT);
+  if (image_nr_high < 0) {
+    isLogging_err("%s: Could not open attribute 'image_nr_high' in linked file %s\n", id, name);
+    return -1;
+  }
+
+  herr = H5Aread(image_nr_high, H5T_NATIVE_INT, &(fp->last_frame));
   if (herr < 0) {
-    isLogging_err("%s: failed to close master file\n", id);
+    isLogging_err("%s: Could not read value 'image_nr_high' in linked file %s\n", id, name);
+    H5Aclose(image_nr_high);
+    return -1;
   }
 
-  set_json_object_string(id, meta, "fn", fn);
+  herr = H5Aclose(image_nr_high);
+  if (herr < 0) {
+    isLogging_err("%s: Failed to close attribute image_nr_high\n", id);
+    return -1;
+  }
 
-  pthread_mutex_unlock(&wctx->metaMutex);
+  image_nr_low = H5Aopen_by_name( lid, name, "image_nr_low", H5P_DEFAULT, H5P_DEFAULT);
+  if (image_nr_low < 0) {
+    isLogging_err("%s: Could not open attribute 'image_nr_low' in linked file %s\n", id, name);
+    return -1;
+  }
 
-  return meta;
+  herr = H5Aread(image_nr_low, H5T_NATIVE_INT, &(fp->first_frame));
+  if (herr < 0) {
+    isLogging_err("%s: Could not read value 'image_nr_low' in linked file %s\n", id, name);
+    H5Aclose(image_nr_low);
+    return -1;
+  }
+
+  herr = H5Aclose(image_nr_low);
+  if (herr < 0) {
+    isLogging_err("%s: Failed to close attribute image_nr_low\n", id);
+    return -1;
+  }
+
+  return 0;
+}
+
+/** Close a data set opened by isH5DataOpen (as much of it as is open)
+ */
+static void isH5DataClose(frame_discovery_t *fp) {
+  if (fp->file_space > 0) {
+    H5Sclose(fp->file_space);
+  }
+  if (fp->file_type > 0) {
+    H5Tclose(fp->file_type);
+  }
+  if (fp->data_set > 0) {
+    H5Dclose(fp->data_set);
+  }
+  fp->file_space = 0;
+  fp->file_type  = 0;
+  fp->data_set   = 0;
 }
 
 /** Callback for H5Lvisit_by_name
@@ -434,27 +611,18 @@ json_t *isH5GetMeta(isWorkerContext_t *wctx, const char *fn) {
  */
 int discovery_cb(hid_t lid, const char *name, const H5L_info_t *info, void *op_data) {
   static const char *id = FILEID "discovery_cb";
-  isH5extra_t *extra;                   // cast op_data into something useful
-  /*
-  char s[256];                          // retrieve string from to parse file name and 
-  const char *fnp;                      // file name pointer
-  const char *pp;                       // path name pointer
-  */
-  herr_t herr;                          // h5 error code
-  hid_t image_nr_high;                  // largest frame number number in this file
-  hid_t image_nr_low;                   // smallest frame number in this file
+  isH5File_t *extra;                    // cast op_data into something useful
   frame_discovery_t *these_frames,      // current entry in our list for discovered frames
     *fp, *fpp;                          // used to walk the frame_discovery linked list
-  int failed;                           // 0 = AOK, 1 = success but don't go on, -1 = failed
 
   extra = op_data;
-  failed = 0;
 
   these_frames = calloc(sizeof(frame_discovery_t), 1);
   if (these_frames == NULL) {
     isLogging_crit("%s: Out of memory (these_frames)\n", id);
     exit (-1);
   }
+  pthread_rwlock_init(&these_frames->lock, NULL);
 
   //
   // setting member "next" is a bit of trouble since we want to keep
@@ -475,105 +643,416 @@ int discovery_cb(hid_t lid, const char *name, const H5L_info_t *info, void *op_d
     fpp->next = these_frames;
   }
 
+  // We reopen the data set by its full path when its data file changes
+  if (asprintf(&these_frames->name, "/entry/data/%s", name) < 0) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
   //
-  // Error Breakout Box: set failed to one and break to perform cleanup and return.
+  // Note the data file as it is before we open it: if it changes in
+  // between we just open it again next time
   //
-  do {
-    /*
-    if (info->type == H5L_TYPE_EXTERNAL) {
-      herr = H5Lget_val(lid, name, s, sizeof(s), H5P_DEFAULT);
-      if (herr < 0) {
-        isLogging_err("%s: Could not get link value %s\n", id, name);
-        failed = 1;
-        break;
-      }
+  if (info->type == H5L_TYPE_EXTERNAL) {
+    these_frames->data_fn = isH5LinkFile(lid, name, extra->fn);
+    these_frames->data_key = these_frames->data_fn ? isH5StatKey(these_frames->data_fn) : NULL;
+  }
 
-      herr = H5Lunpack_elink_val(s, sizeof(s), 0, &fnp, &pp);
-      if (herr < 0) {
-        isLogging_err("%s: Could not unpack link value for %s\n", id, name);
-        failed = 1;
-        break;
-      }    
-    }
-    */
-    //isLogging_debug("%s: calling H5Dopen2 for %s", id, name);
-    these_frames->data_set = H5Dopen2(lid, name, H5P_DEFAULT);
-    if (these_frames->data_set < 0) {
-      isLogging_err("%s: Failed to open dataset %s\n", id, name);
-      failed = 1;
+  if (isH5DataOpen(lid, name, these_frames) != 0) {
+    return -1;
+  }
+
+  these_frames->done_list = calloc( these_frames->last_frame - these_frames->first_frame + 1, 1);
+  if (these_frames->done_list == NULL) {
+    isLogging_crit("%s: Out of memory (done_list)\n", id);
+    return -1;
+  }
+  return 0;
+}
+
+/** Make sure a data set is open on the data file as it is now,
+ ** reopening it if the file has been replaced since we opened it
+ **
+ ** @param[in] f   The master file
+ **
+ ** @param[in] fp  The data set
+ **
+ ** @returns 0 with fp->lock held for reading (unlock it when done
+ ** with the data set) or -1 (without the lock) if we could not open it
+ */
+static int isH5DataCheck(isH5File_t *f, frame_discovery_t *fp) {
+  static const char *id = FILEID "isH5DataCheck";
+  char *key;
+  int err;
+
+  pthread_rwlock_rdlock(&fp->lock);
+  if (fp->data_fn == NULL) {
+    // In the master file, which isH5FileGet checks
+    return 0;
+  }
+
+  key = isH5StatKey(fp->data_fn);
+  if (key == NULL) {
+    pthread_rwlock_unlock(&fp->lock);
+    return -1;
+  }
+
+  if (fp->data_set > 0 && fp->data_key != NULL && strcmp(fp->data_key, key) == 0) {
+    free(key);
+    return 0;
+  }
+  pthread_rwlock_unlock(&fp->lock);
+
+  //
+  // Unless another thread beat us to it, reopen the data set.  Our
+  // readers are all done with the old one once we have the write lock.
+  //
+  err = 0;
+  pthread_rwlock_wrlock(&fp->lock);
+  if (fp->data_set <= 0 || fp->data_key == NULL || strcmp(fp->data_key, key) != 0) {
+    isLogging_info("%s: %s changed: reopening %s\n", id, fp->data_fn, fp->name);
+    isH5DataClose(fp);
+    free(fp->data_key);
+    fp->data_key = key;
+    key = NULL;
+    err = isH5DataOpen(f->master_file, fp->name, fp);
+  }
+  pthread_rwlock_unlock(&fp->lock);
+  free(key);
+
+  if (err != 0) {
+    return -1;
+  }
+
+  pthread_rwlock_rdlock(&fp->lock);
+  if (fp->data_set <= 0) {
+    // Another reopen failed in the meantime
+    pthread_rwlock_unlock(&fp->lock);
+    return -1;
+  }
+  return 0;
+}
+
+/** Give up a reference to an open master file, closing it and its
+ ** data sets if it was the last one
+ */
+static void isH5FileRelease(isH5File_t *f) {
+  frame_discovery_t *fp;
+  frame_discovery_t *next;
+
+  if (f == NULL) {
+    return;
+  }
+  if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+
+  for (fp = f->frame_discovery_base; fp != NULL; fp = next) {
+    next = fp->next;
+    isH5DataClose(fp);
+    pthread_rwlock_destroy(&fp->lock);
+    free(fp->name);
+    free(fp->data_fn);
+    free(fp->data_key);
+    free(fp->done_list);
+    free(fp);
+  }
+
+  if (f->master_file >= 0) {
+    H5Fclose(f->master_file);
+  }
+
+  if (f->meta != NULL) {
+    pthread_mutex_lock(&f->wctx->metaMutex);
+    json_decref(f->meta);
+    pthread_mutex_unlock(&f->wctx->metaMutex);
+  }
+
+  free(f->fn);
+  free(f->key);
+  free(f);
+}
+
+/** Open a master file, read its meta data, and find which frame is
+ ** where
+ **
+ ** @param[in] wctx  Our worker context
+ **
+ ** @param[in] fn    name of the master file
+ **
+ ** @returns the open file (with one reference) or NULL on an error
+ ** with the file
+ */
+static isH5File_t *isH5FileOpen(isWorkerContext_t *wctx, const char *fn) {
+  static const char *id = FILEID "isH5FileOpen";
+  isH5File_t *f;
+  frame_discovery_t *fp;        // used to loop through discovery list
+  herr_t herr;                  // h5 error code
+
+  f = calloc(1, sizeof(*f));
+  if (f == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  f->wctx = wctx;
+  f->refs = 1;
+  f->fn   = strdup(fn);
+  if (f->fn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  //
+  // Open up the master file
+  //
+  f->master_file = H5Fopen(fn, H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (f->master_file < 0) {
+    isLogging_err("%s: Could not open master file %s\n", id, fn);
+    isH5FileRelease(f);
+    return NULL;
+  }
+
+  f->meta = isH5ReadMeta(wctx, f->master_file, fn);
+  if (f->meta == NULL) {
+    isH5FileRelease(f);
+    return NULL;
+  }
+
+  //
+  // Find which frame is where
+  //
+  //isLogging_debug("%s: visiting file %s", id, fn);
+  herr = H5Lvisit_by_name(f->master_file, "/entry/data", H5_INDEX_NAME, H5_ITER_INC, discovery_cb, f, H5P_DEFAULT);
+  if (herr < 0) {
+    isLogging_err("%s: Could not discover which frame is where for file %s\n", id, fn);
+    isH5FileRelease(f);
+    return NULL;
+  }
+
+  f->first_frame = 0xffffffff;
+  f->last_frame  = 0;
+  for (fp = f->frame_discovery_base; fp != NULL; fp = fp->next) {
+    f->first_frame = f->first_frame < fp->first_frame ? f->first_frame : fp->first_frame;
+    f->last_frame  = f->last_frame  > fp->last_frame  ? f->last_frame  : fp->last_frame;
+  }
+
+  return f;
+}
+
+/** Get an open master file, from our cache if the file has not
+ ** changed since we opened it
+ **
+ ** @param[in] wctx  Our worker context
+ **
+ ** @param[in] fn    name of the master file
+ **
+ ** @returns a reference to the open file (release it when done) or
+ ** NULL on an error with the file
+ */
+static isH5File_t *isH5FileGet(isWorkerContext_t *wctx, const char *fn) {
+  isH5File_t **fpp;
+  isH5File_t *victim;
+  isH5File_t *f;
+  char *key;
+  int n;
+
+  key = isH5StatKey(fn);
+  if (key == NULL) {
+    return NULL;
+  }
+
+  f = NULL;
+  pthread_mutex_lock(&wctx->h5Mutex);
+  for (fpp = &wctx->h5files; *fpp != NULL; fpp = &(*fpp)->next) {
+    if (strcmp((*fpp)->key, key) == 0) {
+      // Move to the front of the line
+      f = *fpp;
+      *fpp = f->next;
+      f->next = wctx->h5files;
+      wctx->h5files = f;
+      __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
       break;
     }
+  }
+  pthread_mutex_unlock(&wctx->h5Mutex);
 
-    //isLogging_debug("%s: calling H5Dget_type for %s", id, name);
-    these_frames->file_type = H5Dget_type(these_frames->data_set);
-    if (these_frames->file_type < 0) {
-      isLogging_err("%s: Could not get data_set type for %s\n", id, name);
-      failed = 1;
-      break;
+  if (f != NULL) {
+    free(key);
+    return f;
+  }
+
+  f = isH5FileOpen(wctx, fn);
+  if (f == NULL) {
+    free(key);
+    return NULL;
+  }
+  f->key = key;
+
+  pthread_mutex_lock(&wctx->h5Mutex);
+  //
+  // Out with the old versions of this file (and with the copy
+  // another thread may have opened while we were)
+  //
+  fpp = &wctx->h5files;
+  while (*fpp != NULL) {
+    if (strcmp((*fpp)->key, key) == 0 || strcmp((*fpp)->fn, fn) == 0) {
+      victim = *fpp;
+      *fpp = victim->next;
+      victim->next = NULL;
+      isH5FileRelease(victim);
+    } else {
+      fpp = &(*fpp)->next;
     }
+  }
 
-    //isLogging_debug("%s: calling H5Dget_space for %s", id, name);
-    these_frames->file_space = H5Dget_space(these_frames->data_set);
-    if (these_frames->file_space < 0) {
-      isLogging_err("%s: Could not get data_set space for %s\n", id, name);
-      failed = 1;
+  __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+  f->next = wctx->h5files;
+  wctx->h5files = f;
+
+  n = 0;
+  for (fpp = &wctx->h5files; *fpp != NULL; fpp = &(*fpp)->next) {
+    if (++n > IS_H5_FILE_CACHE_ENTRIES) {
+      victim = *fpp;
+      *fpp = victim->next;
+      victim->next = NULL;
+      isH5FileRelease(victim);
       break;
     }
+  }
+  pthread_mutex_unlock(&wctx->h5Mutex);
 
-    image_nr_high = H5Aopen_by_name( lid, name, "image_nr_high", H5P_DEFAULT, H5P_DEFAULT);
-    if (image_nr_high < 0) {
-      isLogging_err("%s: Could not open attribute 'image_nr_high' in linked file %s\n", id, name);
-      failed = 1;
+  return f;
+}
+
+/** Close the master files we are keeping open.  Call when nobody is
+ ** using the cache.
+ */
+void isH5FileCacheDestroy(isWorkerContext_t *wctx) {
+  isH5File_t *f;
+  isH5File_t *next;
+
+  for (f=wctx->h5files; f != NULL; f=next) {
+    next = f->next;
+    f->next = NULL;
+    isH5FileRelease(f);
+  }
+  wctx->h5files = NULL;
+}
+
+/** Read the meta data from a file.
+ **
+ ** @param[in] fn Name of the master file to open
+ **
+ ** @returns JSON object contianing the metadata.  json_decref must be
+ ** called when you are done with it.  Null is returned on an error
+ ** with the file.
+ **
+ ** @remark Programming errors are fatal.
+ */
+json_t *isH5GetMeta(isWorkerContext_t *wctx, const char *fn) {
+  static const char *id = FILEID "isH5GetMeta";
+  isH5File_t *f;
+  json_t *meta;
+
+  f = isH5FileGet(wctx, fn);
+  if (f == NULL) {
+    return NULL;
+  }
+
+  // Our callers add to their meta data: they each get their own copy
+  pthread_mutex_lock(&wctx->metaMutex);
+  meta = json_deep_copy(f->meta);
+  if (meta == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  set_json_object_string(id, meta, "fn", "%s", fn);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  isH5FileRelease(f);
+
+  return meta;
+}
+
+/** Find the data set holding imb's frame, reopening it if its data
+ ** file has been replaced (see isH5DataCheck)
+ **
+ ** @param[in]  imb    Buffer for the frame (after discovery)
+ **
+ ** @param[out] file_dims  (number of frames) x H x W
+ **
+ ** @param[out] sizep  Bytes per pixel (2 or 4)
+ **
+ ** @returns the data set's entry in our discovery list, read locked
+ ** (unlock fp->lock when done with it), or NULL if we cannot use it
+ */
+static frame_discovery_t *isH5FindFrame(isImageBufType *imb, hsize_t file_dims[3], int *sizep) {
+  static const char *id = FILEID "isH5FindFrame";
+  isH5File_t *extra;            // where we stored our frame discovery results
+  frame_discovery_t *fp;        // Speaking of the devil
+  int rank;                     // number of data dimensions (it had better be three)
+  herr_t herr;                  // h5 error code
+  int data_element_size;        // 4 for 32 bit ints, 2 for 16
+
+  extra = imb->extra;
+
+  for (fp = extra->frame_discovery_base; fp != NULL; fp = fp->next) {
+    if (fp->first_frame <= imb->frame && fp->last_frame >= imb->frame) {
       break;
     }
-  
-    herr = H5Aread(image_nr_high, H5T_NATIVE_INT, &(these_frames->last_frame));
-    if (herr < 0) {
-      isLogging_err("%s: Could not read value 'image_nr_high' in linked file %s\n", id, name);
-      failed = 1;
+  }
+  if (fp == NULL) {
+    isLogging_err("%s: Could not find frame %d in file %s\n", id, imb->frame, imb->key);
+    return NULL;
+  }
+
+  if (isH5DataCheck(extra, fp) != 0) {
+    return NULL;
+  }
+
+  //
+  // Error Breakout Box: set fp to NULL and break to unlock and return
+  //
+  do {
+    if (fp->first_frame > imb->frame || fp->last_frame < imb->frame) {
+      isLogging_err("%s: Frame %d is no longer in %s\n", id, imb->frame, fp->data_fn);
       break;
     }
 
-    herr = H5Aclose(image_nr_high);
-    if (herr < 0) {
-      isLogging_err("%s: Failed to close attribute image_nr_high\n", id);
-      failed = 1;
+    rank = H5Sget_simple_extent_ndims(fp->file_space);
+    if (rank < 0) {
+      isLogging_err("%s: Failed to get rank of dataset for file %s\n", id, imb->key);
       break;
     }
 
-    image_nr_low = H5Aopen_by_name( lid, name, "image_nr_low", H5P_DEFAULT, H5P_DEFAULT);
-    if (image_nr_low < 0) {
-      isLogging_err("%s: Could not open attribute 'image_nr_low' in linked file %s\n", id, name);
-      failed = 1;
+    if (rank != 3) {
+      isLogging_err("%s: Unexpected value of data_set rank.  Got %d but should gotten 3\n", id, rank);
       break;
     }
-  
-    herr = H5Aread(image_nr_low, H5T_NATIVE_INT, &(these_frames->first_frame));
+
+    herr = H5Sget_simple_extent_dims( fp->file_space, file_dims, NULL);
     if (herr < 0) {
-      isLogging_err("%s: Could not read value 'image_nr_low' in linked file %s\n", id, name);
-      failed = 1;
-      break;
+      isLogging_err("Could not get dataset dimensions\n");
+      exit (-1);
     }
 
-    herr = H5Aclose(image_nr_low);
-    if (herr < 0) {
-      isLogging_err("%s: Failed to close attribute image_nr_low\n", id);
-      failed = 1;
+    data_element_size = H5Tget_size( fp->file_type);
+    if (data_element_size == 0) {
+      isLogging_err("%s: Could not get data_element_size\n", id);
       break;
     }
 
-    these_frames->done_list = calloc( these_frames->last_frame - these_frames->first_frame + 1, 1);
-    if (these_frames->done_list == NULL) {
-      isLogging_crit("%s: Out of memory (done_list)\n", id);
-      failed = 1;
+    if (data_element_size != 2 && data_element_size != 4) {
+      isLogging_err("%s: Bad data element size, received %d instead of 2 or 4\n", id, data_element_size);
       break;
     }
+
+    *sizep = data_element_size;
+    return fp;
   } while (0);
 
-  if (failed) {
-    return -1;
-  }
-  return 0;
+  pthread_rwlock_unlock(&fp->lock);
+  return NULL;
 }
 
 /** Find a single frame in the named file.
@@ -585,14 +1064,13 @@ int discovery_cb(hid_t lid, const char *name, const H5L_info_t *info, void *op_d
  */
 int get_one_frame(isImageBufType **imbp) {
   static const char *id = FILEID "get_one_frame";
-  isH5extra_t *extra;           // where we stored our frame discovery results
   frame_discovery_t *fp;        // Speaking of the devil
-  int rank;                     // number of data dimensions (it had better be three)
   herr_t herr;                  // h5 error code
-  hsize_t file_dims[3];         // size H x W x (number of frames)
+  hsize_t file_dims[3];         // (number of frames) x H x W
   int data_element_size;        // 4 for 32 bit ints, 2 for 16
   char *data_buffer;            // Where we'll put our data
   int   data_buffer_size;       // number of bytes to store a frame
+  hid_t file_space;             // our selection of the data set
   hid_t mem_space;              // where we'll put our data according to h5
   hsize_t mem_dims[2];          // size of our memory accrding to h5
   hsize_t start[3];             // our data slice that includes our frame
@@ -601,54 +1079,14 @@ int get_one_frame(isImageBufType **imbp) {
   hsize_t block[3];             // size of block to select (Spoiler alert: it's one frame)
   isImageBufType *imb;
 
-  imb   = *imbp;
-  extra = imb->extra;
+  imb = *imbp;
 
-  for (fp = extra->frame_discovery_base; fp != NULL; fp = fp->next) {
-    if (fp->first_frame <= imb->frame && fp->last_frame >= imb->frame) {
-      break;
-    }
-  }
+  fp = isH5FindFrame(imb, file_dims, &data_element_size);
   if (fp == NULL) {
-    isLogging_err("%s: Could not find frame %d in file %s\n", id, imb->frame, imb->key);
     return -1;
   }
 
-  rank = H5Sget_simple_extent_ndims(fp->file_space);
-  if (rank < 0) {
-    isLogging_err("%s: Failed to get rank of dataset for file %s\n", id, imb->key);
-    return -1;
-  }
-
-  if (rank != 3) {
-    isLogging_err("%s: Unexpected value of data_set rank.  Got %d but should gotten 3\n", id, rank);
-    return -1;
-  }
-
-  herr = H5Sget_simple_extent_dims( fp->file_space, file_dims, NULL);
-  if (herr < 0) {
-    isLogging_err("Could not get dataset dimensions\n");
-    exit (-1);
-  }
-
-  data_element_size = H5Tget_size( fp->file_type);
-  if (data_element_size == 0) {
-    isLogging_err("%s: Could not get data_element_size\n", id);
-    return -1;
-  }
-
-  switch(data_element_size) {
-  case 4:
-    data_buffer_size = file_dims[1] * file_dims[2] * sizeof(uint32_t);
-    break;
-  case 2:
-    data_buffer_size = file_dims[1] * file_dims[2] * sizeof(uint16_t);
-    break;
-
-  default:
-    isLogging_err("%s: Bad data element size, received %d instead of 2 or 4\n", id, data_element_size);
-    return -1;
-  }
+  data_buffer_size = file_dims[1] * file_dims[2] * data_element_size;
 
   data_buffer = calloc(data_buffer_size, 1);
   if (data_buffer == NULL) {
@@ -661,6 +1099,7 @@ int get_one_frame(isImageBufType **imbp) {
   mem_space = H5Screate_simple(2, mem_dims, mem_dims);
   if (mem_space < 0) {
     isLogging_err("%s: Could not create mem_space\n", id);
+    pthread_rwlock_unlock(&fp->lock);
     free(data_buffer);
     return -1;
   }
@@ -681,15 +1120,33 @@ int get_one_frame(isImageBufType **imbp) {
   block[1] = file_dims[1];
   block[2] = file_dims[2];
 
-  herr = H5Sselect_hyperslab(fp->file_space, H5S_SELECT_SET, start, stride, count, block);
+  // Other frames of the data set may be reading at the same time
+  file_space = H5Scopy(fp->file_space);
+  if (file_space < 0) {
+    isLogging_err("%s: Could not copy file_space\n", id);
+    pthread_rwlock_unlock(&fp->lock);
+    H5Sclose(mem_space);
+    free(data_buffer);
+    return -1;
+  }
+
+  herr = H5Sselect_hyperslab(file_space, H5S_SELECT_SET, start, stride, count, block);
   if (herr < 0) {
     isLogging_err("%s: Could not set hyperslab for frame %d\n", id, imb->frame);
+    pthread_rwlock_unlock(&fp->lock);
+    H5Sclose(file_space);
+    H5Sclose(mem_space);
+    free(data_buffer);
     return -1;
   }
     
-  herr = H5Dread(fp->data_set, fp->file_type, mem_space, fp->file_space, H5P_DEFAULT, data_buffer);
+  herr = H5Dread(fp->data_set, fp->file_type, mem_space, file_space, H5P_DEFAULT, data_buffer);
+  pthread_rwlock_unlock(&fp->lock);
+  H5Sclose(file_space);
+  H5Sclose(mem_space);
   if (herr < 0) {
     isLogging_err("%s: Could not read frame %d\n", id, imb->frame);
+    free(data_buffer);
     return -1;
   }
 
@@ -702,89 +1159,82 @@ int get_one_frame(isImageBufType **imbp) {
   return 0;
 }
 
-/** Return a single frame from the named file.
+/** Done with a frame's master file (our destroy_extra)
+ */
+static void isH5ExtraDestroy(void *voidp) {
+  isH5FileRelease(voidp);
+}
+
+/** Get the master file, find which frame is where, and get the bad
+ ** pixel mask
  **
- ** @param[in] fn  name of the file
+ ** @param[in]     wctx  Our worker context
  **
- ** @param[out] imb frame buffer to place our info in
+ ** @param[in]     fn    name of the master file
+ **
+ ** @param[in,out] imb   frame buffer (with meta and frame) to place our info in
  **
  ** @returns 0 on success
  */
-int isH5GetData(isWorkerContext_t *wctx, const char *fn, isImageBufType **imbp) {
-  static const char *id = FILEID "isH5GetData";
-  isH5extra_t *extra;           // pointer to frame discovery list
-  hid_t master_file;            // the master file, of course
-  herr_t herr;                  // h5 error code
+static int isH5Prepare(isWorkerContext_t *wctx, const char *fn, isImageBufType *imb) {
+  static const char *id = FILEID "isH5Prepare";
+  isH5File_t *extra;            // the open master file with its frame discovery list
   hid_t data_set;               // bad pixel map in h5 file
   hid_t data_space;             // h5 data space for bad pixel map
   hsize_t dims[2];              // dimensions of bad pixel map
   int rank;                     // number of pixel map dimensions (it had better be 2)
   int npoints;                  // number of entries in the bad pixel map
   int err;                      // error code from routines that return integer error codes
-  uint32_t first_frame;         // first frame referenced by master file
-  uint32_t last_frame;          // last frame referenced by master file
-  frame_discovery_t *fp;        // used to loop through discovery list
   int failed;                   // set to 1 before breaking out of the our box
-  isImageBufType *imb;
-  
-  imb = *imbp;
+  char *mask_key;               // where the bad pixel mask is cached
+  uint32_t *bpm;                // the bad pixel map as the detector wrote it
 
   failed = 0;
+  data_set = -1;
+  data_space = -1;
   extra = imb->extra;
 
   pthread_mutex_lock(&wctx->metaMutex);
   set_json_object_integer(id, imb->meta, "frame", imb->frame);
   pthread_mutex_unlock(&wctx->metaMutex);
 
-  //
-  // Open up the master file
-  //
-  master_file = H5Fopen(fn, H5F_ACC_RDONLY, H5P_DEFAULT);
-  if (master_file < 0) {
-    isLogging_err("%s: Could not open master file %s\n", id, fn);
-    return -1;
-  }
-
   if (extra == NULL) {
-    extra = calloc(1, sizeof(*(extra)));
-    if (extra == NULL) {
-      isLogging_err("%s: Out of memory (extra)\n", id);
-      exit(-1);
-    }
-    extra->frame_discovery_base = NULL;
-
-    imb->extra = extra;
     //
-    // Find which frame is where
+    // Usually the master file is still open from the last frame
     //
-    //isLogging_debug("%s: visiting file %s", id, fn);
-    herr = H5Lvisit_by_name(master_file, "/entry/data", H5_INDEX_NAME, H5_ITER_INC, discovery_cb, extra, H5P_DEFAULT);
-    if (herr < 0) {
-      isLogging_err("%s: Could not discover which frame is where for file %s\n", id, fn);
+    extra = isH5FileGet(wctx, fn);
+    if (extra == NULL) {
       return -1;
     }
-    
-    first_frame = 0xffffffff;
-    last_frame  = 0;
-    for (fp = extra->frame_discovery_base; fp != NULL; fp = fp->next) {
-      first_frame = first_frame < fp->first_frame ? first_frame : fp->first_frame;
-      last_frame  = last_frame  > fp->last_frame  ? last_frame  : fp->last_frame;
-    }
+
+    imb->extra = extra;
+    imb->destroy_extra = isH5ExtraDestroy;
 
     pthread_mutex_lock(&wctx->metaMutex);
-    set_json_object_integer(id, imb->meta, "first_frame", first_frame);
-    set_json_object_integer(id, imb->meta, "last_frame",  last_frame);
+    set_json_object_integer(id, imb->meta, "first_frame", extra->first_frame);
+    set_json_object_integer(id, imb->meta, "last_frame",  extra->last_frame);
     pthread_mutex_unlock(&wctx->metaMutex);
   
+    //
+    // Every frame of the data set shares the same bad pixel mask: we
+    // only need to decode it for the first one we see
+    //
+    mask_key = isMaskKey(fn);
+    imb->mask = mask_key ? isMaskCacheGet(wctx, mask_key) : NULL;
+
     //
     // Our error breakout box
     //
     do {
+      if (imb->mask != NULL) {
+        break;
+      }
+
       //
       // Get the bad pixel map
       //
       //isLogging_debug("%s: calling H5Dopen2 for pixel mask", id);
-      data_set = H5Dopen2(master_file, "/entry/instrument/detector/detectorSpecific/pixel_mask", H5P_DEFAULT);
+      data_set = H5Dopen2(extra->master_file, "/entry/instrument/detector/detectorSpecific/pixel_mask", H5P_DEFAULT);
       if (data_set < 0) {
         isLogging_err("%s: Could not open pixel mask data set\n", id);
         failed = 1;
@@ -825,29 +1275,31 @@ int isH5GetData(isWorkerContext_t *wctx, const char *fn, isImageBufType **imbp)
         break;
       }
       
-      imb->bad_pixel_map = calloc(npoints, sizeof(uint32_t));
-      if (imb->bad_pixel_map == NULL) {
+      bpm = calloc(npoints, sizeof(uint32_t));
+      if (bpm == NULL) {
         isLogging_err("%s: Could not allocate memory for the pixelmask\n", id);
         failed = 1;
         break;
       }
       
-      err = H5Dread(data_set, H5T_NATIVE_UINT, H5S_ALL, H5S_ALL, H5P_DEFAULT, imb->bad_pixel_map);
+      err = H5Dread(data_set, H5T_NATIVE_UINT, H5S_ALL, H5S_ALL, H5P_DEFAULT, bpm);
       if (err < 0) {
         isLogging_err("%s: Could not read pixelmask data\n", id);
-        free(imb->bad_pixel_map);
-        imb->bad_pixel_map = NULL;
+        free(bpm);
         failed = 1;
         break;
       }
+
+      imb->mask = isMaskFromMap(dims[1], dims[0], bpm);
+      free(bpm);
+
+      if (mask_key) {
+        imb->mask = isMaskCachePut(wctx, mask_key, imb->mask);
+      }
     } while(0);
+    free(mask_key);
   }
 
-  err = -1;
-  if (!failed) {
-    err = get_one_frame(imbp);
-  }
-  
   // These close routines return < 0 on error but we do not have
   // anything we are going to do about it so we will not even check.
   //
@@ -860,9 +1312,189 @@ int isH5GetData(isWorkerContext_t *wctx, const char *fn, isImageBufType **imbp)
     H5Dclose(data_set);
   }
 
-  if (master_file >= 0) {
-    H5Fclose(master_file);
+  if (failed) {
+    return -1;
   }
+  return 0;
+}
 
-  return err;
+/** Return a single frame from the named file.
+ **
+ ** @param[in] fn  name of the file
+ **
+ ** @param[out] imb frame buffer to place our info in
+ **
+ ** @returns 0 on success
+ */
+int isH5GetData(isWorkerContext_t *wctx, const char *fn, isImageBufType **imbp) {
+  if (isH5Prepare(wctx, fn, *imbp) != 0) {
+    return -1;
+  }
+
+  return get_one_frame(imbp);
+}
+
+/** What the row reader for one frame needs to know
+ */
+typedef struct isH5RowsStruct {
+  frame_discovery_t *fp;                //!< Data set holding our frame
+  hsize_t frame_index;                  //!< Our frame's index in the data set
+} isH5Rows_t;
+
+/** Read some rows of our frame (an isRowReader_t read)
+ */
+static int isH5ReadRows(isRowReader_t *rr, int row0, int row1, void *buf) {
+  static const char *id = FILEID "isH5ReadRows";
+  isH5Rows_t *h;
+  herr_t herr;                  // h5 error code
+  hid_t file_space;             // our selection of the data set
+  hid_t mem_space;              // where we'll put our data according to h5
+  hsize_t mem_dims[2];          // size of our memory accrding to h5
+  hsize_t start[3];             // the first of our rows
+  hsize_t stride[3];            // a single step
+  hsize_t count[3];             // number of blocks to select (one)
+  hsize_t block[3];             // our rows of our frame
+
+  h = rr->state;
+
+  mem_dims[0] = row1 - row0;
+  mem_dims[1] = rr->width;
+  mem_space = H5Screate_simple(2, mem_dims, mem_dims);
+  if (mem_space < 0) {
+    isLogging_err("%s: Could not create mem_space\n", id);
+    return -1;
+  }
+
+  start[0] = h->frame_index;
+  start[1] = row0;
+  start[2] = 0;
+
+  stride[0] = 1;
+  stride[1] = 1;
+  stride[2] = 1;
+
+  count[0] = 1;
+  count[1] = 1;
+  count[2] = 1;
+
+  block[0] = 1;
+  block[1] = row1 - row0;
+  block[2] = rr->width;
+
+  // Other frames of the data set may be reading at the same time
+  pthread_rwlock_rdlock(&h->fp->lock);
+  file_space = H5Scopy(h->fp->file_space);
+  if (file_space < 0) {
+    isLogging_err("%s: Could not copy file_space\n", id);
+    pthread_rwlock_unlock(&h->fp->lock);
+    H5Sclose(mem_space);
+    return -1;
+  }
+
+  herr = H5Sselect_hyperslab(file_space, H5S_SELECT_SET, start, stride, count, block);
+  if (herr >= 0) {
+    herr = H5Dread(h->fp->data_set, h->fp->file_type, mem_space, file_space, H5P_DEFAULT, buf);
+  }
+  pthread_rwlock_unlock(&h->fp->lock);
+  H5Sclose(file_space);
+  H5Sclose(mem_space);
+
+  if (herr < 0) {
+    isLogging_err("%s: Could not read rows %d through %d\n", id, row0, row1 - 1);
+    return -1;
+  }
+  return 0;
+}
+
+/** Done reading our frame (an isRowReader_t close)
+ */
+static void isH5CloseRows(isRowReader_t *rr) {
+  isH5Rows_t *h;
+
+  h = rr->state;
+  if (h == NULL) {
+    return;
+  }
+  free(h);
+  rr->state = NULL;
+}
+
+/** Number of rows in each chunk of a data set.  HDF5 decompresses
+ ** whole chunks so that's how many rows we should read at once.
+ **
+ ** @returns the rows per chunk or 0 if the data set is not chunked
+ */
+static int isH5ChunkRows(hid_t data_set) {
+  hid_t plist;
+  hsize_t chunk_dims[3];
+  int rtn;
+
+  plist = H5Dget_create_plist(data_set);
+  if (plist < 0) {
+    return 0;
+  }
+
+  rtn = 0;
+  if (H5Pget_layout(plist) == H5D_CHUNKED && H5Pget_chunk(plist, 3, chunk_dims) == 3) {
+    rtn = chunk_dims[1];
+  }
+  H5Pclose(plist);
+  return rtn;
+}
+
+/** Get ready to read a single frame from the named file a few rows
+ ** at a time rather than all at once (see isOpenRawRows).  Detectors
+ ** that write each frame as a single chunk would cost a whole frame
+ ** for each block of rows: isOpenRawRows reads those frames whole.
+ **
+ ** @param[in]     wctx  Our worker context
+ **
+ ** @param[in]     fn    name of the master file
+ **
+ ** @param[in,out] imb   frame buffer (with meta and frame).  We set
+ **                      the dimensions, mask, and extra but not buf.
+ **
+ ** @param[out]    rr    The reader for the frame's rows
+ **
+ ** @returns 0 on success
+ */
+int isH5OpenRows(isWorkerContext_t *wctx, const char *fn, isImageBufType *imb, isRowReader_t *rr) {
+  static const char *id = FILEID "isH5OpenRows";
+  frame_discovery_t *fp;        // data set holding our frame
+  hsize_t file_dims[3];         // (number of frames) x H x W
+  int data_element_size;        // 4 for 32 bit ints, 2 for 16
+  isH5Rows_t *h;
+
+  if (isH5Prepare(wctx, fn, imb) != 0) {
+    return -1;
+  }
+
+  fp = isH5FindFrame(imb, file_dims, &data_element_size);
+  if (fp == NULL) {
+    return -1;
+  }
+
+  h = calloc(1, sizeof(*h));
+  if (h == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  h->fp          = fp;
+  h->frame_index = imb->frame - fp->first_frame;
+
+  imb->buf_height = file_dims[1];
+  imb->buf_width  = file_dims[2];
+  imb->buf_depth  = data_element_size;
+
+  memset(rr, 0, sizeof(*rr));
+  rr->width      = imb->buf_width;
+  rr->height     = imb->buf_height;
+  rr->depth      = imb->buf_depth;
+  rr->chunk_rows = isH5ChunkRows(fp->data_set);
+  pthread_rwlock_unlock(&fp->lock);
+  rr->read       = isH5ReadRows;
+  rr->close      = isH5CloseRows;
+  rr->state      = h;
+
+  return 0;
 }
@@ -434,7 +434,7 @@ json_t *isIndexImages(redisContext *rrc, const char *progressPublisher, const ch
 /** Index diffraction pattern(s)
  **
  ** @param wctx Worker context
- **   @li @c wctx->ctxMutex Keeps worker threads from colliding
+ **   @li @c wctx->shards   Our image buffer cache
  **
  ** @param tcp Thread data
  **   @li @c tcp->rep ZMQ Response socket into return result or error
@@ -2,9 +2,359 @@
  *  @copyright 2017 by Northwestern University
  *  @author Keith Brister
  *  @brief Routines to output jpeg images for the LS-CAT Image Server Version 2
+ *
+ *  Images are rendered into one byte per pixel gray scale (three,
+ *  RGB, when there are saturated pixels to paint red) and compressed
+ *  in one go with tjCompress2.  The renderings and the worst case
+ *  compression buffer come from (and go back to) the buffer pool (see
+ *  isBufPool.c).  The compression buffer is cut down to the jpeg's
+ *  size and handed to zmq as it is: it goes back to the pool once the
+ *  response it belongs to is no longer cached or being sent.
+ *
+ *  The finished response (stringified meta data and jpeg) is kept in
+ *  a small cache keyed by the reduced image and everything else that
+ *  goes into the rendering, so users flipping through the same frames
+ *  with the same settings get the very same bytes without any work.
+ *  Responses are reference counted: the zmq messages sending one hold
+ *  references and give them up when zmq is done with the data.
  */
 #include "is.h"
 
+//! Our thread's compressor
+static __thread tjhandle isJpegHandle = NULL;
+
+/** A finished response
+ */
+struct isJpegOutStruct {
+  struct isJpegOutStruct *next;         //!< Next response in the jpeg cache
+  char *key;                            //!< Cache key (NULL when not cached)
+  int refs;                             //!< The cache and the messages sending us (use __atomic builtins)
+  char *meta_str;                       //!< Stringified meta data
+  size_t meta_len;                      //!< Length of meta_str
+  unsigned char *jpeg;                  //!< The jpeg (from isBufGet)
+  size_t jpeg_len;                      //!< Length of jpeg
+  size_t bytes;                         //!< Memory we use
+};
+
+/** Give up a reference to a response, freeing it if it was the last
+ ** one
+ */
+static void isJpegOutRelease(isJpegOut_t *jo) {
+  if (jo == NULL) {
+    return;
+  }
+  if (__atomic_sub_fetch(&jo->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(jo->key);
+    free(jo->meta_str);
+    isBufPut(jo->jpeg);
+    free(jo);
+  }
+}
+
+/** zmq is done sending part of a response
+ **
+ ** @param data   The meta data or jpeg
+ **
+ ** @param hint   The response
+ */
+static void isJpegOutFree(void *data, void *hint) {
+  isJpegOutRelease(hint);
+}
+
+/** Look for a response we've already made
+ **
+ ** @param wctx  Our worker context
+ **
+ ** @param key   The response's key
+ **
+ ** @returns a reference to the response (release it when done) or NULL
+ */
+static isJpegOut_t *isJpegCacheGet(isWorkerContext_t *wctx, const char *key) {
+  isJpegOut_t **jpp;
+  isJpegOut_t *jo;
+
+  jo = NULL;
+  pthread_mutex_lock(&wctx->jpegMutex);
+  for (jpp = &wctx->jpegs; *jpp != NULL; jpp = &(*jpp)->next) {
+    if (strcmp((*jpp)->key, key) == 0) {
+      // Move to the front of the line
+      jo = *jpp;
+      *jpp = jo->next;
+      jo->next = wctx->jpegs;
+      wctx->jpegs = jo;
+      __atomic_add_fetch(&jo->refs, 1, __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&wctx->jpegMutex);
+
+  return jo;
+}
+
+/** Remember a response.  The least recently used responses leave the
+ ** cache once it holds more than IS_JPEG_CACHE_BYTES.
+ **
+ ** @param wctx  Our worker context
+ **
+ ** Another thread may have made the same response while we were
+ ** making ours.  Then we keep theirs and leave jo alone.
+ **
+ ** @param key   The response's key.  We take it.
+ **
+ ** @param jo    The response.  The cache takes its own reference.
+ */
+static void isJpegCachePut(isWorkerContext_t *wctx, char *key, isJpegOut_t *jo) {
+  isJpegOut_t **jpp;
+  isJpegOut_t *victims;
+  isJpegOut_t *next;
+  size_t bytes;
+
+  victims = NULL;
+  pthread_mutex_lock(&wctx->jpegMutex);
+  for (jpp = &wctx->jpegs; *jpp != NULL; jpp = &(*jpp)->next) {
+    if (strcmp((*jpp)->key, key) == 0) {
+      pthread_mutex_unlock(&wctx->jpegMutex);
+      free(key);
+      return;
+    }
+  }
+
+  jo->key    = key;
+  jo->bytes += strlen(key) + 1;
+  __atomic_add_fetch(&jo->refs, 1, __ATOMIC_RELAXED);
+
+  jo->next = wctx->jpegs;
+  wctx->jpegs = jo;
+
+  bytes = 0;
+  for (jpp = &wctx->jpegs; *jpp != NULL; jpp = &(*jpp)->next) {
+    bytes += (*jpp)->bytes;
+    if (bytes > IS_JPEG_CACHE_BYTES && *jpp != jo) {
+      victims = *jpp;
+      *jpp = NULL;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&wctx->jpegMutex);
+
+  for (; victims != NULL; victims = next) {
+    next = victims->next;
+    isJpegOutRelease(victims);
+  }
+}
+
+/** Empty the jpeg cache.  Call when nobody is using it.  Responses
+ ** still being sent are freed when zmq is done with them.
+ */
+void isJpegCacheDestroy(isWorkerContext_t *wctx) {
+  isJpegOut_t *jo;
+  isJpegOut_t *next;
+
+  for (jo=wctx->jpegs; jo != NULL; jo=next) {
+    next = jo->next;
+    isJpegOutRelease(jo);
+  }
+  wctx->jpegs = NULL;
+}
+
+/** Read the compression options from a job
+ **
+ ** @param wctx      Our worker context
+ **
+ ** @param job       The job.  We use
+ **   @li @c job->quality  Jpeg quality, 1 to 100 (default IS_JPEG_QUALITY)
+ **   @li @c job->subsamp  Chroma subsampling of color images: "444" (default), "422", or "420"
+ **
+ ** @param qualityp  Set to the quality
+ **
+ ** @param subsampp  Set to the (TJSAMP) subsampling for color images
+ */
+static void isJpegOptions(isWorkerContext_t *wctx, json_t *job, int *qualityp, int *subsampp) {
+  const char *subsamp_name;
+  int quality;
+  int subsamp;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  quality      = json_integer_value(json_object_get(job, "quality"));
+  subsamp_name = json_string_value(json_object_get(job, "subsamp"));
+  subsamp = TJSAMP_444;
+  if (subsamp_name != NULL && strcmp(subsamp_name, "422") == 0) {
+    subsamp = TJSAMP_422;
+  } else if (subsamp_name != NULL && strcmp(subsamp_name, "420") == 0) {
+    subsamp = TJSAMP_420;
+  }
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  quality = quality <= 0 ? IS_JPEG_QUALITY : quality;
+  quality = quality > 100 ? 100 : quality;
+
+  *qualityp = quality;
+  *subsampp = subsamp;
+}
+
+/** Gray level of one pixel: data <= wval are white, >= bval are black
+ */
+static inline unsigned char isJpegGray(uint32_t v, uint32_t wval, uint32_t bval, double scale) {
+  if (v <= wval) {
+    return 0xff;
+  }
+  if (v >= bval) {
+    return 0;
+  }
+  return 255.0 - (double)(v - wval) * scale;
+}
+
+/** Map a reduced image to 8 bit gray scale.  Saturated pixels come
+ ** out black (they are painted red afterwards when there are any).
+ **
+ ** Big images are mapped through a lookup table.  16 bit pixels are
+ ** looked up in a table of all 65536 values.  32 bit pixels are
+ ** clamped to [wval, bval] and shifted right until the range fits
+ ** the same size table.  With a range wider than 65535 counts a pixel
+ ** may land one gray level from where it would have otherwise but the
+ ** table is still far finer than the 256 levels we end up with.
+ **
+ ** Filling the table costs about as much as mapping that many pixels
+ ** so images with fewer than IS_JPEG_LUT_RATIO pixels per table entry
+ ** are mapped a pixel at a time instead.
+ **
+ ** @param imb   The reduced image
+ **
+ ** @param wval  Data <= this are white
+ **
+ ** @param bval  Data >= this are black (bval > wval)
+ **
+ ** @param gp    Filled with one byte per pixel
+ **
+ ** @returns non-zero if there are saturated pixels
+ */
+int isJpegMap(isImageBufType *imb, uint32_t wval, uint32_t bval, unsigned char *gp) {
+  unsigned char lut[65536];
+  const uint16_t *p16;
+  const uint32_t *p32;
+  double scale;
+  uint32_t v;
+  int npixels;
+  int saturated;
+  int shift;
+  int i;
+
+  npixels   = imb->buf_width * imb->buf_height;
+  scale     = 255.0 / (double)(bval - wval);
+  saturated = 0;
+
+  if (imb->buf_depth == 2) {
+    p16 = imb->buf;
+    if (npixels < IS_JPEG_LUT_RATIO * 65536) {
+      for (i=0; i<npixels; i++) {
+        saturated |= p16[i] == 0xffff;
+        gp[i] = p16[i] == 0xffff ? 0 : isJpegGray(p16[i], wval, bval, scale);
+      }
+      return saturated;
+    }
+
+    for (i=0; i<0xffff; i++) {
+      lut[i] = isJpegGray(i, wval, bval, scale);
+    }
+    lut[0xffff] = 0;
+
+    for (i=0; i<npixels; i++) {
+      saturated |= p16[i] == 0xffff;
+      gp[i] = lut[p16[i]];
+    }
+    return saturated;
+  }
+
+  //
+  // Saturated pixels clamp to bval, which is black
+  //
+  for (shift=0; ((bval - wval) >> shift) > 0xffff; shift++);
+
+  p32 = imb->buf;
+  if (npixels < IS_JPEG_LUT_RATIO * (int)(((bval - wval) >> shift) + 1)) {
+    for (i=0; i<npixels; i++) {
+      saturated |= p32[i] == 0xffffffff;
+      gp[i] = isJpegGray(p32[i], wval, bval, scale);
+    }
+    return saturated;
+  }
+
+  for (i=0; i <= (int)((bval - wval) >> shift); i++) {
+    lut[i] = isJpegGray(wval + ((uint32_t)i << shift), wval, bval, scale);
+  }
+
+  for (i=0; i<npixels; i++) {
+    v = p32[i];
+    saturated |= v == 0xffffffff;
+    v = v < wval ? wval : v;
+    v = v > bval ? bval : v;
+    gp[i] = lut[(v - wval) >> shift];
+  }
+  return saturated;
+}
+
+/** Work out the white and black levels for an image
+ **
+ ** @param wctx   Worker context
+ **
+ ** @param job    The job.  We use
+ **   @li @c job->contrast  Image data >= this are black (default: the IS_AUTO_BLACK_PERCENTILE percentile)
+ **   @li @c job->wval      Image data <= this are white (negative for the IS_AUTO_WHITE_PERCENTILE percentile)
+ **
+ ** @param meta   The reduced image's meta data
+ **
+ ** @param wvalp  Set to the white level
+ **
+ ** @param bvalp  Set to the black level (always more than the white level)
+ */
+void isJpegContrast(isWorkerContext_t *wctx, json_t *job, json_t *meta, int32_t *wvalp, int32_t *bvalp) {
+  int32_t wval, bval;
+  double stddev;
+  uint32_t pv;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+
+  wval = json_integer_value(json_object_get(job,"wval"));
+  bval = json_integer_value(json_object_get(job, "contrast"));
+  
+  //
+  // Perhaps autoscale black values.  Percentiles from the reduced
+  // image's histogram leave the background near white and only the
+  // brightest spots black.  Images reduced before we kept histograms
+  // fall back on the mean and standard deviation.
+  //
+  stddev = json_number_value(json_object_get(meta, "stddev"));
+  if (stddev <= 0.0) {
+    stddev = json_number_value(json_object_get(meta, "rms"));
+  }
+  if (bval <= 0) {
+    if (isHistPercentile(meta, IS_AUTO_BLACK_PERCENTILE, &pv) == 0) {
+      bval = pv > INT32_MAX ? INT32_MAX : pv;
+    } else {
+      bval = json_number_value(json_object_get(meta, "mean")) + stddev;
+    }
+  }
+  
+  //
+  // Perhaps autoscale white values
+  //
+  if (wval < 0) {
+    if (isHistPercentile(meta, IS_AUTO_WHITE_PERCENTILE, &pv) == 0) {
+      wval = pv > INT32_MAX ? INT32_MAX : pv;
+    } else {
+      wval = json_number_value(json_object_get(meta, "mean")) - stddev;
+    }
+  }
+
+  wval = wval < 0 ? 0 : wval;
+  bval = bval <= wval ? wval+1 : bval;
+
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  *wvalp = wval;
+  *bvalp = bval;
+}
+
 /** Put a label on the image.
  **
  ** @param[in] label  pointer to the label text
@@ -13,37 +363,27 @@
  **
  ** @param[in] height  height of label in pixels
  **
- ** @param[in,out] cinfop  jpeg creation structure
+ ** @param[out] pixels  width x height gray scale pixels to draw the label in
  **
  ** @todo Select the correct font to best fit the label in the height and width constraints.
  **
  */
-void isJpegLabel(const char *label, int width, int height, struct jpeg_compress_struct *cinfop) {
-  static const char *id = FILEID "isJpegLabel";
+void isJpegLabel(const char *label, int width, int height, unsigned char *pixels) {
   const isBitmapFontType *bmp;  // Our chosen bitmap font
   uint16_t mask;                // used to find bit in font
   int sbc;                      // the "sub" byte in the font needed for font width > 8
   int bpc;                      // bytes per character.  ie, 1 for 6x13, 2 for 9x15
   int bmc;                      // the current byte in the font
   int cy;                       // current scan line within the bitmap font
-  int label_ymin;               // start scan line for the top of the text
   int label_ymax;               // bottom scan line for, well, the bottom of the text
   int label_xmax;               // RHS of text
   int ib;                       // index in bitmap of current char
   int ix;                       // x position in scan line of current char
-  unsigned char *red, *blue, *green;    // separate pointers to the pixel colors (all in row_buffer)
-  unsigned char *row_buffer;    // a single row of pixels
-  int i;                        // counter to be sure the label does not extend beyond its given height
+  unsigned char *row;           // the scan line we are drawing
   int ci;                       // index into label to select which character we are working on
-  size_t row_buffer_size;       // size of row_buffer, of course
 
-  row_buffer_size = width * sizeof(*row_buffer) * 3;
-
-  row_buffer = calloc(1, row_buffer_size);
-  if (row_buffer == NULL) {
-    isLogging_crit("%s: Out of memory (row_buffer)\n", id);
-    pthread_exit (NULL);
-  }
+  // White background
+  memset(pixels, 0xff, (size_t)width * height);
 
   // Write the label
   //
@@ -56,22 +396,16 @@ void isJpegLabel(const char *label, int width, int height, struct jpeg_compress_
   // string if the label is too long to fit since it's the end of the
   // string that distingushes one frame from another.
   //
-  label_ymin = 0;
   label_ymax = height > bmp->height ? bmp->height : height;
   label_xmax = width;
     
-  // i loops over scan lines
   // cy loops over character scan lines
   // ci loops over character columns
   //
     
-  for (cy=0, i=label_ymin; i<=label_ymax; cy++, i++) {
-    red   = row_buffer;
-    green = row_buffer + 1;
-    blue  = row_buffer + 2;
-    
-    memset( row_buffer, 0xff, row_buffer_size);
-    
+  for (cy=0; cy<label_ymax; cy++) {
+    row = pixels + (size_t)cy * width;
+
     for (ci=0; label[ci] != 0; ci++) {
       if (label[ci] < 32) {
         // Ignore control characters
@@ -86,14 +420,10 @@ void isJpegLabel(const char *label, int width, int height, struct jpeg_compress_
       mask = 0x80;
       for (ib=0; ib<bmp->width; ib++) {
         ix = ci * bmp->width + ib;
-        if (ix > label_xmax) {
+        if (ix >= label_xmax) {
           break;
         }
-        if (mask & bmc) {
-          *red = *green = *blue = 0;
-        } else {
-          *red = *green = *blue = 0xff;
-        }
+        row[ix] = (mask & bmc) ? 0 : 0xff;
         
         mask >>= 1;
         if (!mask) {
@@ -101,14 +431,9 @@ void isJpegLabel(const char *label, int width, int height, struct jpeg_compress_
           sbc++;
           bmc = bmp->bitmap[(bmp->height*(label[ci] - 32) + cy) * bpc + sbc];
         }
-        red   += 3;
-        green += 3;
-        blue  += 3;
       }
     }
-    jpeg_write_scanlines(cinfop, &row_buffer, 1);
   }
-  free(row_buffer);
 }
 
 
@@ -128,25 +453,20 @@ void isJpegLabel(const char *label, int width, int height, struct jpeg_compress_
  **
  ** @param[in] job   The JSON object sent from the client
  **
- ** @param[in] meta  The JSON object representing the meta data from our image
- **
- ** @param[in] out_buffer The jpeg image we are about to send
- **
- ** @param[in] jpeg_len The length of out_buffer
+ ** @param[in] jo    The meta data and jpeg we are about to send.  zmq takes its own references.
  **
 */
-void isJpegSend(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, json_t *meta, unsigned char *out_buffer, int jpeg_len) {
+static void isJpegSend(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, isJpegOut_t *jo) {
   static const char *id = FILEID "isJpegSend";
 
   char *job_str;                // stringified version of job
-  char *meta_str;               // stringified version of meta
   int err;                      // error code from routies that return integers
   zmq_msg_t err_msg;            // error message to send via zmq
   zmq_msg_t job_msg;            // the job message to send via zmq
   zmq_msg_t meta_msg;           // the metadata to send via zmq
   zmq_msg_t jpeg_msg;           // the jpeg as a zmq message
 
-  isLogging_info("%s: jpeg_len: %d\n", id, jpeg_len);
+  isLogging_info("%s: jpeg_len: %d\n", id, (int)jo->jpeg_len);
 
   // Compose messages
 
@@ -172,26 +492,17 @@ void isJpegSend(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job,
   }
 
   // Meta
-  meta_str = NULL;
-  if (meta != NULL) {
-    pthread_mutex_lock(&wctx->metaMutex);
-    meta_str = json_dumps(meta, JSON_SORT_KEYS | JSON_INDENT(0) | JSON_COMPACT);
-    pthread_mutex_unlock(&wctx->metaMutex);
-  }
-  if (meta_str == NULL) {
-    meta_str = strdup("");
-  }
-
-  err = zmq_msg_init_data(&meta_msg, meta_str, strlen(meta_str), is_zmq_free_fn, NULL);
+  __atomic_add_fetch(&jo->refs, 1, __ATOMIC_RELAXED);
+  err = zmq_msg_init_data(&meta_msg, jo->meta_str, jo->meta_len, isJpegOutFree, jo);
   if (err == -1) {
     isLogging_err("%s: zmq_msg_init failed (meta_str): %s\n", id, zmq_strerror(errno));
     is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (meta_str)", id);
     pthread_exit (NULL);
   }
 
-
   // JPEG
-  err = zmq_msg_init_data(&jpeg_msg, out_buffer, jpeg_len, is_zmq_free_fn, NULL);
+  __atomic_add_fetch(&jo->refs, 1, __ATOMIC_RELAXED);
+  err = zmq_msg_init_data(&jpeg_msg, jo->jpeg, jo->jpeg_len, isJpegOutFree, jo);
   if (err == -1) {
     isLogging_err("%s: zmq_msg_init failed (jpeg): %s\n", id, zmq_strerror(errno));
     is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (jpeg)", id);
@@ -228,6 +539,529 @@ void isJpegSend(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job,
       break;
     }
   } while (0);
+
+  //
+  // Parts we did not get to send still hold their references to jo
+  // (and the job string).  zmq leaves a sent message empty so closing
+  // it does nothing.
+  //
+  zmq_msg_close(&err_msg);
+  zmq_msg_close(&job_msg);
+  zmq_msg_close(&meta_msg);
+  zmq_msg_close(&jpeg_msg);
+}
+
+/** Our thread's compressor
+ **
+ ** @returns the compressor or NULL if we could not make one
+ */
+static tjhandle isJpegCompressor() {
+  static const char *id = FILEID "isJpegCompressor";
+
+  if (isJpegHandle == NULL) {
+    isJpegHandle = tjInitCompress();
+    if (isJpegHandle == NULL) {
+      isLogging_err("%s: Could not initialize the jpeg compressor\n", id);
+    }
+  }
+  return isJpegHandle;
+}
+
+/** Strips of one image being compressed at once
+ */
+typedef struct isJpegStripsStruct {
+  const unsigned char *pixels;          //!< The whole image
+  int width;                            //!< Image width
+  int height;                           //!< Image height
+  int gray;                             //!< Non-zero for gray scale pixels, RGB otherwise
+  int quality;                          //!< Jpeg quality
+  int subsamp;                          //!< TJSAMP subsampling
+  int strip_rows;                       //!< Rows in each strip but the last
+  unsigned char **out;                  //!< Each strip's jpeg (from isBufGet)
+  unsigned long *out_size;              //!< Length of each strip's jpeg
+  int *err;                             //!< Non-zero for strips that failed
+} isJpegStrips_t;
+
+/** Compress one strip (isPoolRun callback)
+ */
+static void isJpegStripRun(void *voidp, int i) {
+  static const char *id = FILEID "isJpegStripRun";
+  isJpegStrips_t *js;
+  tjhandle tj;
+  int row0;
+  int rows;
+
+  js = voidp;
+
+  row0 = i * js->strip_rows;
+  rows = js->height - row0 < js->strip_rows ? js->height - row0 : js->strip_rows;
+
+  js->out_size[i] = tjBufSize(js->width, rows, js->subsamp);
+  js->out[i]      = isBufGet(js->out_size[i]);
+
+  tj = isJpegCompressor();
+  if (tj == NULL) {
+    js->err[i] = 1;
+    return;
+  }
+
+  js->err[i] = tjCompress2(tj, js->pixels + (size_t)row0 * js->width * (js->gray ? 1 : 3), js->width, 0, rows,
+                           js->gray ? TJPF_GRAY : TJPF_RGB, &js->out[i], &js->out_size[i],
+                           js->subsamp, js->quality, TJFLAG_NOREALLOC | TJFLAG_FASTDCT);
+  if (js->err[i] != 0) {
+    isLogging_err("%s: jpeg compression error: %s\n", id, tjGetErrorStr2(tj));
+  }
+}
+
+/** Find the headers of a jpeg we just made
+ **
+ ** @param jpeg   The jpeg
+ **
+ ** @param len    Its length
+ **
+ ** @param sofp   Set to the offset of the start of frame marker
+ **
+ ** @param sosp   Set to the offset of the start of scan marker
+ **
+ ** @returns the offset of the entropy coded data (just past the start
+ ** of scan segment) or -1 if we don't understand the jpeg or it has
+ ** restart markers of its own (TJ_RESTART in the environment does that)
+ */
+static long isJpegHeaders(const unsigned char *jpeg, unsigned long len, unsigned long *sofp, unsigned long *sosp) {
+  unsigned long pos;
+  int marker;
+
+  *sofp = 0;
+  if (len < 4 || jpeg[0] != 0xff || jpeg[1] != 0xd8 || jpeg[len-2] != 0xff || jpeg[len-1] != 0xd9) {
+    return -1;
+  }
+
+  for (pos = 2; pos + 4 <= len && jpeg[pos] == 0xff; pos += 2 + (jpeg[pos+2] << 8 | jpeg[pos+3])) {
+    marker = jpeg[pos+1];
+    if (marker == 0xc0) {
+      *sofp = pos;
+    }
+    if (marker == 0xdd) {
+      return -1;
+    }
+    if (marker == 0xda) {
+      *sosp = pos;
+      pos += 2 + (jpeg[pos+2] << 8 | jpeg[pos+3]);
+      // Only baseline jpegs can be stitched together
+      return *sofp != 0 && pos + 2 <= len ? (long)pos : -1;
+    }
+  }
+  return -1;
+}
+
+/** Stitch jpegs of consecutive strips of an image together into one.
+ ** Every strip but the last is restart_interval MCUs long and all
+ ** must share the same tables: each strip's headers have to be the
+ ** same as the first strip's, height aside.  (They are not when
+ ** TJ_OPTIMIZE in the environment gives each strip Huffman tables of
+ ** its own.)  Each strip's entropy coded data becomes
+ ** one restart interval of the whole image: the first strip's
+ ** headers (with the height fixed and a restart interval added) are
+ ** followed by each strip's data with an RSTn marker in between.
+ **
+ ** @param out               The strips
+ **
+ ** @param out_size          Length of each strip
+ **
+ ** @param n                 Number of strips
+ **
+ ** @param height            Height of the whole image
+ **
+ ** @param restart_interval  MCUs in each strip but the last
+ **
+ ** @param lenp              Set to the length of the jpeg
+ **
+ ** @returns the jpeg (from isBufGet) or NULL if the strips aren't what we expected
+ */
+static unsigned char *isJpegStitch(unsigned char **out, unsigned long *out_size, int n, int height, int restart_interval, size_t *lenp) {
+  unsigned char *rtn;
+  unsigned char *p;
+  unsigned long sof;
+  unsigned long sos;
+  unsigned long sof0;
+  unsigned long sos0;
+  long data0;
+  long data;
+  size_t len;
+  int i;
+
+  data0 = isJpegHeaders(out[0], out_size[0], &sof0, &sos0);
+  if (data0 < 0) {
+    return NULL;
+  }
+
+  len = data0 + 6;                      // headers plus a DRI segment
+  for (i=0; i<n; i++) {
+    data = isJpegHeaders(out[i], out_size[i], &sof, &sos);
+    if (data != data0 || sof != sof0 || sos != sos0 ||
+        memcmp(out[i], out[0], sof0 + 5) != 0 ||
+        memcmp(out[i] + sof0 + 7, out[0] + sof0 + 7, data0 - sof0 - 7) != 0) {
+      return NULL;
+    }
+    len += out_size[i] - 2 - data + 2;  // entropy coded data plus an RSTn or EOI marker
+  }
+
+  rtn = isBufGet(len);
+
+  // Headers up to the start of scan
+  p = rtn;
+  memcpy(p, out[0], sos0);
+  p[sof0 + 5] = height >> 8;
+  p[sof0 + 6] = height & 0xff;
+  p += sos0;
+
+  // Define restart interval
+  *p++ = 0xff;
+  *p++ = 0xdd;
+  *p++ = 0;
+  *p++ = 4;
+  *p++ = restart_interval >> 8;
+  *p++ = restart_interval & 0xff;
+
+  // Start of scan
+  memcpy(p, out[0] + sos0, data0 - sos0);
+  p += data0 - sos0;
+
+  for (i=0; i<n; i++) {
+    data = isJpegHeaders(out[i], out_size[i], &sof, &sos);
+    if (i > 0) {
+      *p++ = 0xff;
+      *p++ = 0xd0 + ((i - 1) & 7);
+    }
+    memcpy(p, out[i] + data, out_size[i] - 2 - data);
+    p += out_size[i] - 2 - data;
+  }
+  *p++ = 0xff;
+  *p++ = 0xd9;
+
+  *lenp = p - rtn;
+  return isBufShrink(rtn, *lenp);
+}
+
+/** Compress a big image as strips, all at once, using the compute pool
+ **
+ ** See isJpegCompress for the other parameters
+ **
+ ** @param n      Number of strips to aim for (one per pool thread, usually)
+ **
+ ** @param lenp   Set to the length of the jpeg
+ **
+ ** @returns the jpeg (from isBufGet) or NULL if it did not work out
+ */
+static unsigned char *isJpegCompressStrips(isWorkerContext_t *wctx, const unsigned char *pixels, int width, int height, int gray, int quality, int subsamp, int n, size_t *lenp) {
+  static const char *id = FILEID "isJpegCompressStrips";
+  isJpegStrips_t js;
+  unsigned char *rtn;
+  int mcu_width;
+  int mcu_height;
+  int mcus_across;
+  int mcu_rows;
+  int i;
+
+  mcu_width   = tjMCUWidth[subsamp];
+  mcu_height  = tjMCUHeight[subsamp];
+  mcus_across = (width + mcu_width - 1) / mcu_width;
+
+  //
+  // Each strip a whole number of MCU rows and no more than a restart
+  // interval (16 bits) can count
+  //
+  mcu_rows = ((height + mcu_height - 1) / mcu_height + n - 1) / n;
+  mcu_rows = mcu_rows * mcus_across > 0xffff ? 0xffff / mcus_across : mcu_rows;
+  if (mcu_rows < 1) {
+    return NULL;
+  }
+
+  memset(&js, 0, sizeof(js));
+  js.pixels     = pixels;
+  js.width      = width;
+  js.height     = height;
+  js.gray       = gray;
+  js.quality    = quality;
+  js.subsamp    = subsamp;
+  js.strip_rows = mcu_rows * mcu_height;
+
+  n = (height + js.strip_rows - 1) / js.strip_rows;
+  if (n < 2) {
+    return NULL;
+  }
+
+  js.out      = calloc(n, sizeof(*js.out));
+  js.out_size = calloc(n, sizeof(*js.out_size));
+  js.err      = calloc(n, sizeof(*js.err));
+  if (js.out == NULL || js.out_size == NULL || js.err == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  isPoolRun(wctx, n, isJpegStripRun, &js);
+
+  rtn = NULL;
+  for (i=0; i<n && js.err[i] == 0; i++);
+  if (i == n) {
+    rtn = isJpegStitch(js.out, js.out_size, n, height, mcu_rows * mcus_across, lenp);
+    if (rtn == NULL) {
+      isLogging_err("%s: Could not stitch %d strips together\n", id, n);
+    }
+  }
+
+  for (i=0; i<n; i++) {
+    isBufPut(js.out[i]);
+  }
+  free(js.out);
+  free(js.out_size);
+  free(js.err);
+
+  return rtn;
+}
+
+/** Compress an image all at once on this thread
+ **
+ ** See isJpegCompress for the other parameters
+ **
+ ** @param lenp   Set to the length of the jpeg
+ **
+ ** @returns the jpeg (from isBufGet) or NULL on error
+ */
+static unsigned char *isJpegCompressOne(const unsigned char *pixels, int width, int height, int gray, int quality, int subsamp, size_t *lenp) {
+  static const char *id = FILEID "isJpegCompressOne";
+  unsigned char *out;
+  unsigned long out_size;
+  tjhandle tj;
+  int err;
+
+  tj = isJpegCompressor();
+  if (tj == NULL) {
+    return NULL;
+  }
+
+  //
+  // tjBufSize is the worst case so the compressor never needs to
+  // grow our buffer
+  //
+  out_size = tjBufSize(width, height, subsamp);
+  out      = isBufGet(out_size);
+
+  err = tjCompress2(tj, pixels, width, 0, height, gray ? TJPF_GRAY : TJPF_RGB, &out, &out_size, subsamp, quality, TJFLAG_NOREALLOC | TJFLAG_FASTDCT);
+  if (err != 0) {
+    isLogging_err("%s: jpeg compression error: %s\n", id, tjGetErrorStr2(tj));
+    isBufPut(out);
+    return NULL;
+  }
+
+  //
+  // The jpeg is far smaller than the worst case: give the rest back
+  // rather than have the response hold on to it
+  //
+  *lenp = out_size;
+  return isBufShrink(out, out_size);
+}
+
+/** Compress an image into a response
+ **
+ ** @param wctx     Worker context
+ **
+ ** @param meta     Meta data to send with the image (or NULL)
+ **
+ ** @param pixels   The image: one byte per pixel when gray, RGB otherwise
+ **
+ ** @param width    Image width
+ **
+ ** @param height   Image height
+ **
+ ** @param gray     Non-zero for gray scale pixels
+ **
+ ** @param quality  Jpeg quality (see isJpegOptions)
+ **
+ ** @param subsamp  Chroma subsampling of color images (see isJpegOptions)
+ **
+ ** @returns the response with one reference (ours) or NULL on error
+ */
+static isJpegOut_t *isJpegCompress(isWorkerContext_t *wctx, json_t *meta, const unsigned char *pixels, int width, int height, int gray, int quality, int subsamp) {
+  static const char *id = FILEID "isJpegCompress";
+  isJpegOut_t *rtn;
+  unsigned char *jpeg;
+  size_t jpeg_len;
+
+  subsamp = gray ? TJSAMP_GRAY : subsamp;
+
+  //
+  // Big images are compressed a strip per thread
+  //
+  jpeg = NULL;
+  if ((size_t)width * height >= IS_JPEG_STRIP_PIXELS && isPoolSize(wctx) > 1) {
+    jpeg = isJpegCompressStrips(wctx, pixels, width, height, gray, quality, subsamp, isPoolSize(wctx), &jpeg_len);
+  }
+
+  if (jpeg == NULL) {
+    jpeg = isJpegCompressOne(pixels, width, height, gray, quality, subsamp, &jpeg_len);
+    if (jpeg == NULL) {
+      return NULL;
+    }
+  }
+
+  rtn = calloc(1, sizeof(*rtn));
+  if (rtn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  rtn->refs     = 1;
+  rtn->jpeg     = jpeg;
+  rtn->jpeg_len = jpeg_len;
+
+  rtn->meta_str = NULL;
+  if (meta != NULL) {
+    pthread_mutex_lock(&wctx->metaMutex);
+    rtn->meta_str = json_dumps(meta, JSON_SORT_KEYS | JSON_INDENT(0) | JSON_COMPACT);
+    pthread_mutex_unlock(&wctx->metaMutex);
+  }
+  if (rtn->meta_str == NULL) {
+    rtn->meta_str = strdup("");
+  }
+  if (rtn->meta_str == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  rtn->meta_len = strlen(rtn->meta_str);
+
+  rtn->bytes = sizeof(*rtn) + rtn->meta_len + 1 + rtn->jpeg_len;
+  return rtn;
+}
+
+/** Decompress a jpeg we made
+ **
+ ** @returns the pixels (malloced) or NULL if the jpeg is not width by height or will not decompress
+ */
+static unsigned char *isJpegDecompress(const unsigned char *jpeg, size_t len, int width, int height, int gray) {
+  static const char *id = FILEID "isJpegDecompress";
+  unsigned char *rtn;
+  tjhandle tj;
+  int w, h;
+
+  tj = tjInitDecompress();
+  if (tj == NULL) {
+    isLogging_err("%s: Could not initialize the jpeg decompressor\n", id);
+    return NULL;
+  }
+
+  rtn = malloc((size_t)width * height * (gray ? 1 : 3));
+  if (rtn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  if (tjDecompressHeader3(tj, jpeg, len, &w, &h, NULL, NULL) != 0 || w != width || h != height ||
+      tjDecompress2(tj, jpeg, len, rtn, width, 0, height, gray ? TJPF_GRAY : TJPF_RGB, TJFLAG_FASTDCT) != 0) {
+    isLogging_err("%s: jpeg decompression error: %s\n", id, tjGetErrorStr2(tj));
+    free(rtn);
+    rtn = NULL;
+  }
+  tjDestroy(tj);
+  return rtn;
+}
+
+/** Compress an image in strips (isJpegCompressStrips) and in one
+ ** go, decompress both, and compare the pixels.  Used by
+ ** isConvertTest.
+ **
+ ** @param wctx     Our worker context (with or without a pool)
+ **
+ ** @param pixels   The image: one byte per pixel when gray, RGB otherwise
+ **
+ ** @param width    Image width
+ **
+ ** @param height   Image height
+ **
+ ** @param gray     Non-zero for gray scale pixels
+ **
+ ** @param subsamp  Chroma subsampling of color images
+ **
+ ** @param n        Number of strips to aim for
+ **
+ ** @returns the number of pixels that differ, or -1 if the strips were
+ ** turned down (see isJpegStitch) or either jpeg would not decompress
+ */
+int isJpegCheck(isWorkerContext_t *wctx, const unsigned char *pixels, int width, int height, int gray, int subsamp, int n) {
+  static const char *id = FILEID "isJpegCheck";
+  unsigned char *strips;
+  unsigned char *whole;
+  unsigned char *a;
+  unsigned char *b;
+  size_t strips_len;
+  size_t whole_len;
+  size_t i;
+  int ps;
+  int rtn;
+
+  subsamp = gray ? TJSAMP_GRAY : subsamp;
+  ps      = gray ? 1 : 3;
+
+  strips = isJpegCompressStrips(wctx, pixels, width, height, gray, IS_JPEG_QUALITY, subsamp, n, &strips_len);
+  whole  = isJpegCompressOne(pixels, width, height, gray, IS_JPEG_QUALITY, subsamp, &whole_len);
+  if (strips == NULL || whole == NULL) {
+    isBufPut(strips);
+    isBufPut(whole);
+    return -1;
+  }
+
+  a = isJpegDecompress(strips, strips_len, width, height, gray);
+  b = isJpegDecompress(whole, whole_len, width, height, gray);
+
+  rtn = a == NULL || b == NULL ? -1 : 0;
+  for (i=0; rtn >= 0 && i < (size_t)width * height; i++) {
+    if (memcmp(a + i * ps, b + i * ps, ps) != 0) {
+      if (rtn == 0) {
+        isLogging_err("%s: First difference at row %d col %d\n", id, (int)(i / width), (int)(i % width));
+      }
+      rtn++;
+    }
+  }
+
+  free(a);
+  free(b);
+  isBufPut(strips);
+  isBufPut(whole);
+  return rtn;
+}
+
+/** Compress an image and send it along (without caching it)
+ **
+ ** @param wctx    Worker context
+ **
+ ** @param tcp     Thread data
+ **
+ ** @param job     The job we are responding to (see isJpegOptions)
+ **
+ ** @param meta    Meta data to send with the image (or NULL)
+ **
+ ** @param pixels  The image: one byte per pixel when gray, RGB otherwise
+ **
+ ** @param width   Image width
+ **
+ ** @param height  Image height
+ **
+ ** @param gray    Non-zero for gray scale pixels
+ */
+void isJpegSendImage(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, json_t *meta, const unsigned char *pixels, int width, int height, int gray) {
+  static const char *id = FILEID "isJpegSendImage";
+  isJpegOut_t *jo;
+  int quality;
+  int subsamp;
+
+  isJpegOptions(wctx, job, &quality, &subsamp);
+  jo = isJpegCompress(wctx, meta, pixels, width, height, gray, quality, subsamp);
+  if (jo == NULL) {
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: jpeg compression error", id);
+    return;
+  }
+
+  isJpegSend(wctx, tcp, job, jo);
+  isJpegOutRelease(jo);
 }
 
 /** Send a blank image used as a placeholder.
@@ -240,23 +1074,11 @@ void isJpegSend(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job,
  **
  */
 void isJpegBlank(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
-  static const char *id = FILEID "isJpegBlank";
-  struct jpeg_compress_struct cinfo;            // jpeg context
-  int cinfoSetup;                               // flag so we only destroy cinfo if it had been set up
-  jmp_buf j_jumpHere;                           // Yeah, libjpeg likes long jumps.
-  struct jpeg_error_mgr jerr;                   // libjpeg error handline
-  struct jpeg_destination_mgr dmgr;             // support for libjpeg
-  unsigned char *row_buffer;                    // a single row of pixels
-  unsigned char *out_buffer;                    // a place to put the rows as they are completed
+  unsigned char *pixels;                        // the whole image, gray scale
   int labelHeight;                              // The height of the requested label (if any)
-  int col;                                      // loop over the width of the image
-  int row;                                      // loop over the height of the image
   int height;                                   // the image height
   int width;                                    // the image width
-  unsigned char *red, *blue, *green;            // pointers to the pixel color components
   const char *label;                            // a string version of our label (extracted from job)
-  size_t row_buffer_size;                       // the size of row_buffer
-  size_t out_buffer_size;                       // the size of out_buffer
 
   pthread_mutex_lock(&wctx->metaMutex);
   width = json_integer_value(json_object_get(job, "xsize"));
@@ -279,126 +1101,38 @@ void isJpegBlank(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job)
     labelHeight = labelHeight > 64 ?  0 : labelHeight;    // ignore requests for really big labels
   }
 
-  row_buffer_size = width * sizeof(*row_buffer) * 3;
-
-  row_buffer = calloc(1, row_buffer_size);
-  if (row_buffer == NULL) {
-    isLogging_crit("%s: Out of memory (row_buffer)\n", id);
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Out of memory (row_buffer)", id);
-    exit (-1);
-  }
-
-  out_buffer_size = width * (height + labelHeight) * sizeof(*out_buffer) * 3;
-  if (out_buffer_size < MIN_JPEG_BUFFER) {
-    out_buffer_size = MIN_JPEG_BUFFER;
-  }
-
-  out_buffer = calloc(1, out_buffer_size);
-  if (out_buffer == NULL) {
-    isLogging_crit("%s: Out of memory (out_buffer)\n", id);
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Out of memory (out_buffer)", id);
-    exit (-1);
-  }
-
-  //
-  // Setup the jpeg stuff
-  //
-  cinfoSetup = 0;
-
-  if( setjmp( j_jumpHere)) {
-    if( cinfoSetup) {
-      jpeg_destroy_compress( &cinfo);
-    }
-    free(row_buffer);
-    free(out_buffer);
-    isLogging_err("%s: jpeg compression error\n", id);
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Jpeg creation failed", id);
-    return;
-  }
-
-  void jerror_handler( j_common_ptr cp) {
-    longjmp( *(jmp_buf *)cp->client_data, 1);
-  }
-
-  void init_buffer(struct jpeg_compress_struct* cinfo) {}
-  int empty_buffer(struct jpeg_compress_struct* cinfo) {
-    return 1;
-  }
-  void term_buffer(struct jpeg_compress_struct* cinfo) {}
-
-  cinfo.err = jpeg_std_error(&jerr);
-  cinfo.err->error_exit = jerror_handler;
-  cinfo.client_data    = &j_jumpHere;
-  jpeg_create_compress(&cinfo);
-  cinfoSetup = 1;
-
-  
-  dmgr.init_destination    = init_buffer;
-  dmgr.empty_output_buffer = empty_buffer;
-  dmgr.term_destination    = term_buffer;
-  dmgr.next_output_byte    = out_buffer;
-  dmgr.free_in_buffer      = out_buffer_size;
-
-  cinfo.dest = &dmgr;
-  cinfo.image_width  = width;
-  cinfo.image_height = height + labelHeight;
-  cinfo.input_components = 3;		/* # of color components per pixel */
-  cinfo.in_color_space = JCS_RGB;	/* colorspace of input image */
-  jpeg_set_defaults(&cinfo);
-  jpeg_set_quality( &cinfo, 100, TRUE);
-  jpeg_start_compress(&cinfo, TRUE);
+  pixels = isBufGet((size_t)width * (height + labelHeight));
 
   if (labelHeight) {
-    isJpegLabel(label, width, labelHeight, &cinfo);
-  }
-
-  for (row=0; row<height; row++) {
-    red   = row_buffer;
-    green = row_buffer + 1;
-    blue  = row_buffer + 2;
-
-    for (col=0; col<width; col++) {
-      *red   = 0xf0;
-      *green = 0xf0;
-      *blue  = 0xf0;
-
-      red   += 3;
-      green += 3;
-      blue  += 3;
-    }
-    jpeg_write_scanlines(&cinfo, &row_buffer, 1);
+    isJpegLabel(label, width, labelHeight, pixels);
   }
-  jpeg_finish_compress(&cinfo);
+  memset(pixels + (size_t)width * labelHeight, 0xf0, (size_t)width * height);
 
-  isJpegSend(wctx, tcp, job, NULL, out_buffer, (int)(cinfo.dest->next_output_byte - out_buffer));
-  free(row_buffer);
-  //
-  //  out_buffer is freed by zmq whenever it is done with it
-  //
-  //  free(out_buffer);
-  return;
+  isJpegSendImage(wctx, tcp, job, NULL, pixels, width, height + labelHeight, 1);
+  isBufPut(pixels);
 }
 
 /** Create a jpeg rendering of a diffraction image
  **
  ** @param wctx Worker context
- **  @li @c wctx->ctxMutex  Keeps the worker theads in line
+ **  @li @c wctx->shards  Our image buffer cache
  **
  ** @param tcp Thread data
  **   @li @c tcp->rep  ZMQ Response socket into which the throw our response.
  **
  ** @param job             {Object}     - Description of what is requested
- ** @param job.contrast    {Integer}    - Image data >= this are black
+ ** @param job.contrast    {Integer}    - Image data >= this are black (default: the IS_AUTO_BLACK_PERCENTILE percentile)
  ** @param job.esaf        {Inteter}    - experiment id to which this image belongs
  ** @param job.fn          {String}     - file name
  ** @param job.frame       {Integer}    - Frame number to return
  ** @param job.label       {String}     - Text to add to the image perhaps identifying the image
  ** @param job.labelHeight {Integer}    - Height of the label in pixels
+ ** @param job.reduce      {String}     - How the pixels behind each jpeg pixel are pooled: "max" (default), "mean", "sum", or "median"
  ** @param job.segcol      {Float}      - Segment of image to return: x = segcol * image width / zoom
  ** @param job.segrow      {Float}      - Segment of image to return: y = segrow * image width / zoom
  ** @param job.tag         {String}     - ID for us to know what to do with the result
  ** @param job.type        {String}     - "JPEG"
- ** @param job.wval        {Integer}    - Image data <= this are white
+ ** @param job.wval        {Integer}    - Image data <= this are white (negative for the IS_AUTO_WHITE_PERCENTILE percentile)
  ** @param job.xsize       {Integer}    - Requested width of resulting jpeg (pixels)
  ** @param job.zoom        {Float}      - full image / zoom = size of original image to map to our jpeg
  */
@@ -406,23 +1140,6 @@ void isJpeg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
   static const char *id = FILEID "isJpeg";
   const char *fn;                       // file name from job.
   isImageBufType *imb;
-  unsigned char *row_buffer;
-  int labelHeight;
-  int row, col;
-  uint16_t *bp16, v16;
-  uint32_t *bp32, v32;
-  unsigned char *red, *blue, *green;
-  int32_t wval, bval;
-  struct jpeg_compress_struct cinfo;
-  int cinfoSetup;
-  jmp_buf j_jumpHere;
-  struct jpeg_error_mgr jerr;
-  struct jpeg_destination_mgr dmgr;
-  char label[64];
-  size_t row_buffer_size;
-  size_t out_buffer_size;
-  unsigned char *out_buffer;
-  double stddev;
 
   pthread_mutex_lock(&wctx->metaMutex);
   fn = json_string_value(json_object_get(job, "fn"));
@@ -433,7 +1150,7 @@ void isJpeg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
     return;
   }
 
-  // when isReduceImage returns a buffer it is read locked
+  // when isReduceImage returns a buffer it is filled and ours to release
   imb = isReduceImage(wctx, tcp->rc, job);
   if (imb == NULL) {
     char *tmps;
@@ -452,6 +1169,42 @@ void isJpeg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
     return;
   }
 
+  // Get started on the frames they'll want next
+  isPrefetchNote(wctx, job, imb->meta);
+
+  isJpegRender(wctx, tcp, job, imb);
+}
+
+/** Send a jpeg rendering of a reduced image
+ **
+ ** @param wctx Worker context
+ **
+ ** @param tcp Thread data
+ **   @li @c tcp->rep  ZMQ Response socket into which the throw our response.
+ **
+ ** @param job             {Object}     - Description of what is requested.  See isJpeg for the properties used here.
+ **
+ ** @param imb             Filled reduced image.  We release it.
+ */
+void isJpegRender(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, isImageBufType *imb) {
+  static const char *id = FILEID "isJpegRender";
+  unsigned char *pixels;        // gray scale rendering, label first
+  unsigned char *rgb;           // color rendering when there are saturated pixels
+  unsigned char *gp;
+  isJpegOut_t *jo;
+  char *gray_key;
+  char *color_key;
+  int labelHeight;
+  int npixels;
+  int saturated;
+  int quality;
+  int subsamp;
+  int i;
+  uint32_t v;
+  uint32_t sat;
+  int32_t wval, bval;
+  char label[64];
+
   pthread_mutex_lock(&wctx->metaMutex);
   labelHeight = json_integer_value(json_object_get(job, "labelHeight"));
   pthread_mutex_unlock(&wctx->metaMutex);
@@ -459,89 +1212,7 @@ void isJpeg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
   labelHeight = labelHeight < 0  ?  0 : labelHeight;    // labels can't have negative height
   labelHeight = labelHeight > 64 ?  0 : labelHeight;    // ignore requests for really big labels
 
-  row_buffer_size = imb->buf_width * sizeof(*row_buffer) * 3;
-
-  row_buffer = calloc(1, row_buffer_size);
-  if (row_buffer == NULL) {
-    isLogging_crit("%s: Out of memory (row_buffer)\n", id);
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Out of memory (row_buffer)", id);
-    pthread_exit (NULL);
-  }
-
-  out_buffer_size = imb->buf_width * (imb->buf_height + labelHeight) * sizeof(*out_buffer) * 3;
-  if (out_buffer_size < MIN_JPEG_BUFFER) {
-    out_buffer_size = MIN_JPEG_BUFFER;
-  }
-
-  out_buffer = calloc(1, out_buffer_size);
-  if (out_buffer == NULL) {
-    isLogging_crit("%s: Out of memory (out_buffer)\n", id);
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Out of memory (out_buffer)", id);
-    pthread_exit (NULL);
-  }
-
-  //
-  // Setup the jpeg stuff
-  //
-  cinfoSetup = 0;
-
-  if( setjmp( j_jumpHere)) {
-    if( cinfoSetup) {
-      jpeg_destroy_compress( &cinfo);
-    }
-    free(row_buffer);
-    free(out_buffer);
-
-    pthread_rwlock_unlock(&imb->buflock);
-
-    isLogging_err("%s: jpeg compression error\n", id);
-    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: jpeg compression error", id);
-
-    pthread_mutex_lock(&wctx->ctxMutex);
-    imb->in_use--;
-
-    assert(imb->in_use >= 0);
-
-    pthread_mutex_unlock(&wctx->ctxMutex);
-    return;
-  }
-
-  void jerror_handler( j_common_ptr cp) {
-    longjmp( *(jmp_buf *)cp->client_data, 1);
-  }
-
-  void init_buffer(struct jpeg_compress_struct* cinfop) {
-    cinfop->dest->next_output_byte = out_buffer;
-    cinfop->dest->free_in_buffer   = out_buffer_size;
-  }
-  int empty_buffer(struct jpeg_compress_struct* cinfop) {
-    return 1;
-  }
-  void term_buffer(struct jpeg_compress_struct* cinfop) {}
-
-  cinfo.err = jpeg_std_error(&jerr);
-  cinfo.err->error_exit = jerror_handler;
-  cinfo.client_data    = &j_jumpHere;
-  jpeg_create_compress(&cinfo);
-  cinfoSetup = 1;
-
-  
-  dmgr.init_destination    = init_buffer;
-  dmgr.empty_output_buffer = empty_buffer;
-  dmgr.term_destination    = term_buffer;
-
-  cinfo.dest = &dmgr;
-
-  cinfo.image_width  = imb->buf_width;
-  cinfo.image_height = imb->buf_height + labelHeight;
-
-  cinfo.input_components = 3;		/* # of color components per pixel */
-  cinfo.in_color_space = JCS_RGB;	/* colorspace of input image */
-
-  jpeg_set_defaults(&cinfo);
-  jpeg_set_quality( &cinfo, 100, TRUE);
-
-  jpeg_start_compress(&cinfo, TRUE);
+  npixels = imb->buf_width * imb->buf_height;
 
   //
   // TODO: Rayonix images already have the frame number in the label,
@@ -551,6 +1222,7 @@ void isJpeg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
   // to the label.
   //
 
+  label[0] = 0;
   if (labelHeight) {
     pthread_mutex_lock(&wctx->metaMutex);
 
@@ -566,121 +1238,96 @@ void isJpeg(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
     label[sizeof(label)-1] = 0;
 
     pthread_mutex_unlock(&wctx->metaMutex);
-
-    isJpegLabel(label, imb->buf_width, labelHeight, &cinfo);
   }
+  isJpegContrast(wctx, job, imb->meta, &wval, &bval);
 
   pthread_mutex_lock(&wctx->metaMutex);
+  set_json_object_integer(id, job, "wval_used", wval);
+  set_json_object_integer(id, job, "bval_used", bval);
+
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  isJpegOptions(wctx, job, &quality, &subsamp);
 
-  wval = json_integer_value(json_object_get(job,"wval"));
-  bval = json_integer_value(json_object_get(job, "contrast"));
-  
   //
-  // Perhaps autoscale black values
+  // Everything that goes into the rendering is in the key so a hit
+  // is byte for byte what we would have made.  Subsampling only
+  // matters for color jpegs but we don't know which we'll make until
+  // we've looked at the pixels: an image has one or the other, so
+  // try both.
   //
-  stddev = json_number_value(json_object_get(imb->meta, "stddev"));
-  if (stddev <= 0.0) {
-    //
-    // For some reason 32 bit images give 0 stddev
-    //
-    stddev = json_number_value(json_object_get(imb->meta, "rms"));
+  if (asprintf(&gray_key, "%s|%d|%d|%d|gray|%d|%s", imb->key, (int)wval, (int)bval, quality, labelHeight, label) < 0 ||
+      asprintf(&color_key, "%s|%d|%d|%d|%d|%d|%s", imb->key, (int)wval, (int)bval, quality, subsamp, labelHeight, label) < 0) {
+    isLogging_crit("%s: Out of memory (key)\n", id);
+    exit (-1);
   }
-  if (bval <= 0) {
-    bval = json_number_value(json_object_get(imb->meta, "mean")) + json_number_value(json_object_get(imb->meta, "stddev"));
+
+  jo = isJpegCacheGet(wctx, gray_key);
+  if (jo == NULL) {
+    jo = isJpegCacheGet(wctx, color_key);
   }
-  
-  //
-  // Perhaps autoscale white values
-  //
-  if (wval < 0) {
-    wval = json_number_value(json_object_get(imb->meta, "mean")) - json_number_value(json_object_get(imb->meta, "stddev"));
+  if (jo != NULL) {
+    free(gray_key);
+    free(color_key);
+    isJpegSend(wctx, tcp, job, jo);
+    isJpegOutRelease(jo);
+    isReleaseImageBuf(wctx, imb);
+    return;
   }
 
-  wval = wval < 0 ? 0 : wval;
-  bval = bval <= wval ? wval+1 : bval;  
+  pixels = isBufGet((size_t)imb->buf_width * (imb->buf_height + labelHeight));
 
-  set_json_object_integer(id, job, "wval_used", wval);
-  set_json_object_integer(id, job, "bval_used", bval);
+  if (labelHeight) {
+    isJpegLabel(label, imb->buf_width, labelHeight, pixels);
+  }
 
-  pthread_mutex_unlock(&wctx->metaMutex);
+  //
+  // Saturated pixels are painted red so we only need color when
+  // there are some.
+  //
+  sat       = imb->buf_depth == 2 ? 0xffff : 0xffffffff;
+  saturated = isJpegMap(imb, wval, bval, pixels + (size_t)imb->buf_width * labelHeight);
 
-  if (imb->buf_depth == 2) {
-    bp16 = imb->buf;
-    for (row=0; row<imb->buf_height; row++) {
-      red   = row_buffer;
-      green = row_buffer + 1;
-      blue  = row_buffer + 2;
-      for (col=0; col<imb->buf_width; col++) {
-        v16 = *(bp16 + imb->buf_width * row + col);
-        if (v16 == 0xffff) {
-          *red   = 0xff;
-          *green = 0;
-          *blue  = 0;
-        } else {
-          if (v16 <= wval) {
-            *red = *green = *blue = 0xff;
-          } else {
-            if (v16 >= bval) {
-              *red = *green = *blue = 0;
-            } else {
-              *red = *green = *blue = 255.0 - (double)(v16 - wval)/(double)(bval - wval) * 255.0;
-            }
-          }
-        }
-        red   += 3;
-        green += 3;
-        blue  += 3;
-      }
-      jpeg_write_scanlines(&cinfo, &row_buffer, 1);
+  rgb = NULL;
+  if (saturated) {
+    rgb = isBufGet((size_t)imb->buf_width * (imb->buf_height + labelHeight) * 3);
+
+    for (i=0; i<imb->buf_width * labelHeight; i++) {
+      rgb[3*i] = rgb[3*i+1] = rgb[3*i+2] = pixels[i];
     }
-  } else {
-    bp32 = imb->buf;
-    for (row=0; row<imb->buf_height; row++) {
-      red   = row_buffer;
-      green = row_buffer + 1;
-      blue  = row_buffer + 2;
-      for (col=0; col<imb->buf_width; col++) {
-        v32 = *(bp32 + imb->buf_width * row + col);
-        if (v32 == 0xffffffff) {
-          *red   = 0xff;
-          *green = 0;
-          *blue  = 0;
-        } else {
-          if (v32 <= wval) {
-            *red = *green = *blue = 0xff;
-          } else {
-            if (v32 >= bval) {
-              *red = *green = *blue = 0;
-            } else {
-              *red = *green = *blue = 255.0 - (double)(v32 - wval)/(double)(bval - wval) * 255.0;
-            }
-          }
-        }
-        red   += 3;
-        green += 3;
-        blue  += 3;
+
+    gp = rgb + (size_t)imb->buf_width * labelHeight * 3;
+    for (i=0; i<npixels; i++) {
+      v = imb->buf_depth == 2 ? ((uint16_t *)imb->buf)[i] : ((uint32_t *)imb->buf)[i];
+      if (v == sat) {
+        gp[3*i]   = 0xff;
+        gp[3*i+1] = 0;
+        gp[3*i+2] = 0;
+      } else {
+        gp[3*i] = gp[3*i+1] = gp[3*i+2] = pixels[(size_t)imb->buf_width * labelHeight + i];
       }
-      jpeg_write_scanlines(&cinfo, &row_buffer, 1);
     }
   }
 
-  jpeg_finish_compress(&cinfo);
-
-  isJpegSend(wctx, tcp, job, imb->meta, out_buffer, (int)(cinfo.dest->next_output_byte - out_buffer));
-
-  free(row_buffer);
-  //
-  // out_buffer is owned by zmq and will get freed whenever it is good and ready to do that.
-  //
-  //free(out_buffer);
-
-  pthread_rwlock_unlock(&imb->buflock);
+  jo = isJpegCompress(wctx, imb->meta, rgb ? rgb : pixels, imb->buf_width, imb->buf_height + labelHeight, rgb == NULL, quality, subsamp);
+  isBufPut(rgb);
+  isBufPut(pixels);
+  isReleaseImageBuf(wctx, imb);
 
-  pthread_mutex_lock(&wctx->ctxMutex);
-  imb->in_use--;
-
-  assert(imb->in_use >= 0);
+  if (jo == NULL) {
+    free(gray_key);
+    free(color_key);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: jpeg compression error", id);
+    return;
+  }
 
-  pthread_mutex_unlock(&wctx->ctxMutex);
-  return;
+  if (saturated) {
+    free(gray_key);
+    isJpegCachePut(wctx, color_key, jo);
+  } else {
+    free(color_key);
+    isJpegCachePut(wctx, gray_key, jo);
+  }
+  isJpegSend(wctx, tcp, job, jo);
+  isJpegOutRelease(jo);
 }
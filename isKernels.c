@@ -0,0 +1,835 @@
+/*! @file isKernels.c
+ *  @copyright 2018 by Northwestern University All Rights Reserved
+ *  @author Keith Brister
+ *  @brief Vectorized inner loops for image reduction
+ *
+ *  The row kernels find the maximum (isMaxRow) or the sum (isSumRow)
+ *  of each of a table of runs (spans) of pixels in one row of an
+ *  image, leaving out the pixels flagged in a bit packed bad pixel
+ *  mask, and count the saturated pixels they see.  Taking the whole
+ *  span table keeps the indirect call out of the per pixel loops: the
+ *  span kernels (isMaxSpan, isSumSpan) are called directly and can be
+ *  inlined.  isMedian9 finds the medians of many sets of nine
+ *  samples at once.  The scalar kernels are the reference: the SSE4.1
+ *  and AVX2 versions must give exactly the same answers (see
+ *  isKernelsCheck).  isKernelsInit picks the best version this CPU
+ *  supports.  Set the environment variable IS_KERNELS to "scalar",
+ *  "sse4.1", or "avx2" to override the choice.
+ *
+ *  The mask is an isMask_t bitset (see isMask.c): one bit per pixel
+ *  (set for bad pixels) with each row starting on a 64 bit word
+ *  boundary.
+ */
+#include "is.h"
+#include <immintrin.h>
+
+void (*isMaxRow16)(const uint16_t *row, const uint64_t *bits, const int *n0, const int *n1, int n, uint32_t *out, int *nsatp);
+void (*isMaxRow32)(const uint32_t *row, const uint64_t *bits, const int *n0, const int *n1, int n, uint32_t *out, int *nsatp);
+void (*isSumRow16)(const uint16_t *row, const uint64_t *bits, const int *n0, const int *n1, int n, uint64_t *sum, int *ngood, int *nsat);
+void (*isSumRow32)(const uint32_t *row, const uint64_t *bits, const int *n0, const int *n1, int n, uint64_t *sum, int *ngood, int *nsat);
+void (*isMedian9)(uint32_t *s, int stride, uint32_t *out, int n);
+
+/** Get count (up to 64) mask bits starting with bit n
+ */
+static inline uint64_t isKernelsBits(const uint64_t *bits, int n, int count) {
+  uint64_t v;
+  int w;
+  int s;
+
+  w = n >> 6;
+  s = n & 63;
+  v = bits[w] >> s;
+  if (s + count > 64) {
+    v |= bits[w+1] << (64 - s);
+  }
+  return count == 64 ? v : v & ((1ULL << count) - 1);
+}
+
+/** Number of bad pixels from n0 through n1-1
+ */
+static inline int isKernelsCount(const uint64_t *bits, int n0, int n1) {
+  int rtn;
+  int n;
+
+  rtn = 0;
+  if (bits) {
+    for (n=n0; n<n1; n += 64) {
+      rtn += __builtin_popcountll(isKernelsBits(bits, n, n1 - n < 64 ? n1 - n : 64));
+    }
+  }
+  return rtn;
+}
+
+/** Maximum of row[n0] through row[n1-1] (16 bit pixels)
+ **
+ ** @param row    Start of the image row
+ **
+ ** @param bits   Start of the bad pixel mask for this row (or NULL)
+ **
+ ** @param n0     First column
+ **
+ ** @param n1     One past the last column
+ **
+ ** @param nsatp  Incremented for each saturated (good) pixel
+ **
+ ** @returns the maximum good pixel value (0 if there are none)
+ */
+static uint32_t isMaxSpan16Scalar(const uint16_t *row, const uint64_t *bits, int n0, int n1, int *nsatp) {
+  uint32_t d;
+  int n;
+
+  d = 0;
+  for (n=n0; n<n1; n++) {
+    if (bits && (bits[n>>6] >> (n & 63)) & 1) {
+      continue;
+    }
+    if (row[n] == 0xffff) {
+      (*nsatp)++;
+    }
+    d = d > row[n] ? d : row[n];
+  }
+  return d;
+}
+
+/** Maximum of row[n0] through row[n1-1] (32 bit pixels)
+ **
+ ** See isMaxSpan16Scalar
+ */
+static uint32_t isMaxSpan32Scalar(const uint32_t *row, const uint64_t *bits, int n0, int n1, int *nsatp) {
+  uint32_t d;
+  int n;
+
+  d = 0;
+  for (n=n0; n<n1; n++) {
+    if (bits && (bits[n>>6] >> (n & 63)) & 1) {
+      continue;
+    }
+    if (row[n] == 0xffffffff) {
+      (*nsatp)++;
+    }
+    d = d > row[n] ? d : row[n];
+  }
+  return d;
+}
+
+//
+// In the vector kernels bad pixels are zeroed before taking the
+// maximum: zero never raises the maximum and is never saturated.
+// Mask bits are spread across the lanes by broadcasting them and
+// testing each lane's own bit.
+//
+
+/** SSE4.1 version of isMaxSpan16Scalar
+ */
+__attribute__((target("sse4.1")))
+static uint32_t isMaxSpan16SSE41(const uint16_t *row, const uint64_t *bits, int n0, int n1, int *nsatp) {
+  const __m128i lane_bits = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m128i sat = _mm_set1_epi16(-1);
+  __m128i vmax;
+  __m128i v;
+  __m128i bad;
+  uint32_t d, d1;
+  uint16_t lanes[8];
+  int nsat;
+  int n;
+  int i;
+
+  vmax = _mm_setzero_si128();
+  nsat = 0;
+  for (n=n0; n+8 <= n1; n += 8) {
+    v = _mm_loadu_si128((const __m128i *)(row + n));
+    if (bits) {
+      bad = _mm_set1_epi16(isKernelsBits(bits, n, 8));
+      bad = _mm_cmpeq_epi16(_mm_and_si128(bad, lane_bits), lane_bits);
+      v   = _mm_andnot_si128(bad, v);
+    }
+    nsat += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi16(v, sat))) / 2;
+    vmax = _mm_max_epu16(vmax, v);
+  }
+
+  _mm_storeu_si128((__m128i *)lanes, vmax);
+  d = 0;
+  for (i=0; i<8; i++) {
+    d = d > lanes[i] ? d : lanes[i];
+  }
+
+  *nsatp += nsat;
+  if (n < n1) {
+    d1 = isMaxSpan16Scalar(row, bits, n, n1, nsatp);
+    d = d > d1 ? d : d1;
+  }
+  return d;
+}
+
+/** SSE4.1 version of isMaxSpan32Scalar
+ */
+__attribute__((target("sse4.1")))
+static uint32_t isMaxSpan32SSE41(const uint32_t *row, const uint64_t *bits, int n0, int n1, int *nsatp) {
+  const __m128i lane_bits = _mm_setr_epi32(1, 2, 4, 8);
+  const __m128i sat = _mm_set1_epi32(-1);
+  __m128i vmax;
+  __m128i v;
+  __m128i bad;
+  uint32_t d, d1;
+  uint32_t lanes[4];
+  int nsat;
+  int n;
+  int i;
+
+  vmax = _mm_setzero_si128();
+  nsat = 0;
+  for (n=n0; n+4 <= n1; n += 4) {
+    v = _mm_loadu_si128((const __m128i *)(row + n));
+    if (bits) {
+      bad = _mm_set1_epi32(isKernelsBits(bits, n, 4));
+      bad = _mm_cmpeq_epi32(_mm_and_si128(bad, lane_bits), lane_bits);
+      v   = _mm_andnot_si128(bad, v);
+    }
+    nsat += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, sat))));
+    vmax = _mm_max_epu32(vmax, v);
+  }
+
+  _mm_storeu_si128((__m128i *)lanes, vmax);
+  d = 0;
+  for (i=0; i<4; i++) {
+    d = d > lanes[i] ? d : lanes[i];
+  }
+
+  *nsatp += nsat;
+  if (n < n1) {
+    d1 = isMaxSpan32Scalar(row, bits, n, n1, nsatp);
+    d = d > d1 ? d : d1;
+  }
+  return d;
+}
+
+/** AVX2 version of isMaxSpan16Scalar
+ */
+__attribute__((target("avx2")))
+static uint32_t isMaxSpan16AVX2(const uint16_t *row, const uint64_t *bits, int n0, int n1, int *nsatp) {
+  const __m256i lane_bits = _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, -32768);
+  const __m256i sat = _mm256_set1_epi16(-1);
+  __m256i vmax;
+  __m256i v;
+  __m256i bad;
+  uint32_t d, d1;
+  uint16_t lanes[16];
+  int nsat;
+  int n;
+  int i;
+
+  vmax = _mm256_setzero_si256();
+  nsat = 0;
+  for (n=n0; n+16 <= n1; n += 16) {
+    v = _mm256_loadu_si256((const __m256i *)(row + n));
+    if (bits) {
+      bad = _mm256_set1_epi16(isKernelsBits(bits, n, 16));
+      bad = _mm256_cmpeq_epi16(_mm256_and_si256(bad, lane_bits), lane_bits);
+      v   = _mm256_andnot_si256(bad, v);
+    }
+    nsat += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, sat))) / 2;
+    vmax = _mm256_max_epu16(vmax, v);
+  }
+
+  _mm256_storeu_si256((__m256i *)lanes, vmax);
+  d = 0;
+  for (i=0; i<16; i++) {
+    d = d > lanes[i] ? d : lanes[i];
+  }
+
+  *nsatp += nsat;
+  if (n < n1) {
+    d1 = isMaxSpan16Scalar(row, bits, n, n1, nsatp);
+    d = d > d1 ? d : d1;
+  }
+  return d;
+}
+
+/** AVX2 version of isMaxSpan32Scalar
+ */
+__attribute__((target("avx2")))
+static uint32_t isMaxSpan32AVX2(const uint32_t *row, const uint64_t *bits, int n0, int n1, int *nsatp) {
+  const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m256i sat = _mm256_set1_epi32(-1);
+  __m256i vmax;
+  __m256i v;
+  __m256i bad;
+  uint32_t d, d1;
+  uint32_t lanes[8];
+  int nsat;
+  int n;
+  int i;
+
+  vmax = _mm256_setzero_si256();
+  nsat = 0;
+  for (n=n0; n+8 <= n1; n += 8) {
+    v = _mm256_loadu_si256((const __m256i *)(row + n));
+    if (bits) {
+      bad = _mm256_set1_epi32(isKernelsBits(bits, n, 8));
+      bad = _mm256_cmpeq_epi32(_mm256_and_si256(bad, lane_bits), lane_bits);
+      v   = _mm256_andnot_si256(bad, v);
+    }
+    nsat += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, sat))));
+    vmax = _mm256_max_epu32(vmax, v);
+  }
+
+  _mm256_storeu_si256((__m256i *)lanes, vmax);
+  d = 0;
+  for (i=0; i<8; i++) {
+    d = d > lanes[i] ? d : lanes[i];
+  }
+
+  *nsatp += nsat;
+  if (n < n1) {
+    d1 = isMaxSpan32Scalar(row, bits, n, n1, nsatp);
+    d = d > d1 ? d : d1;
+  }
+  return d;
+}
+
+/** Sum of the good pixels from row[n0] through row[n1-1] (16 bit pixels)
+ **
+ ** @param row     Start of the image row
+ **
+ ** @param bits    Start of the bad pixel mask for this row (or NULL)
+ **
+ ** @param n0      First column
+ **
+ ** @param n1      One past the last column
+ **
+ ** @param ngoodp  Incremented for each good pixel
+ **
+ ** @param nsatp   Incremented for each saturated (good) pixel
+ **
+ ** @returns the sum
+ */
+static uint64_t isSumSpan16Scalar(const uint16_t *row, const uint64_t *bits, int n0, int n1, int *ngoodp, int *nsatp) {
+  uint64_t d;
+  int n;
+
+  d = 0;
+  for (n=n0; n<n1; n++) {
+    if (bits && (bits[n>>6] >> (n & 63)) & 1) {
+      continue;
+    }
+    if (row[n] == 0xffff) {
+      (*nsatp)++;
+    }
+    (*ngoodp)++;
+    d += row[n];
+  }
+  return d;
+}
+
+/** Sum of the good pixels from row[n0] through row[n1-1] (32 bit pixels)
+ **
+ ** See isSumSpan16Scalar
+ */
+static uint64_t isSumSpan32Scalar(const uint32_t *row, const uint64_t *bits, int n0, int n1, int *ngoodp, int *nsatp) {
+  uint64_t d;
+  int n;
+
+  d = 0;
+  for (n=n0; n<n1; n++) {
+    if (bits && (bits[n>>6] >> (n & 63)) & 1) {
+      continue;
+    }
+    if (row[n] == 0xffffffff) {
+      (*nsatp)++;
+    }
+    (*ngoodp)++;
+    d += row[n];
+  }
+  return d;
+}
+
+//
+// Median of nine with 19 compare and swaps (after Paeth and
+// Devillard).  MED9_SORT leaves the smaller of a and b in a.
+//
+#define MED9_NETWORK(MED9_SORT, p)                                    \
+  MED9_SORT(p[1], p[2]); MED9_SORT(p[4], p[5]); MED9_SORT(p[7], p[8]); \
+  MED9_SORT(p[0], p[1]); MED9_SORT(p[3], p[4]); MED9_SORT(p[6], p[7]); \
+  MED9_SORT(p[1], p[2]); MED9_SORT(p[4], p[5]); MED9_SORT(p[7], p[8]); \
+  MED9_SORT(p[0], p[3]); MED9_SORT(p[5], p[8]); MED9_SORT(p[4], p[7]); \
+  MED9_SORT(p[3], p[6]); MED9_SORT(p[1], p[4]); MED9_SORT(p[2], p[5]); \
+  MED9_SORT(p[4], p[7]); MED9_SORT(p[4], p[2]); MED9_SORT(p[6], p[4]); \
+  MED9_SORT(p[4], p[2])
+
+#define MED9_SORT_SCALAR(a, b) { uint32_t t = a < b ? a : b; b = a < b ? b : a; a = t; }
+
+/** Medians of nine samples
+ **
+ ** @param s       Nine planes of n samples each: sample k of set i is s[k*stride + i]
+ **
+ ** @param stride  Distance between the planes
+ **
+ ** @param out     The median of each set
+ **
+ ** @param n       Number of sets
+ */
+static void isMedian9Scalar(uint32_t *s, int stride, uint32_t *out, int n) {
+  uint32_t p[9];
+  int i;
+  int k;
+
+  for (i=0; i<n; i++) {
+    for (k=0; k<9; k++) {
+      p[k] = s[k*stride + i];
+    }
+    MED9_NETWORK(MED9_SORT_SCALAR, p);
+    out[i] = p[4];
+  }
+}
+
+/** SSE4.1 version of isSumSpan16Scalar
+ */
+__attribute__((target("sse4.1")))
+static uint64_t isSumSpan16SSE41(const uint16_t *row, const uint64_t *bits, int n0, int n1, int *ngoodp, int *nsatp) {
+  const __m128i lane_bits = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m128i sat = _mm_set1_epi16(-1);
+  __m128i vsum;
+  __m128i v;
+  __m128i bad;
+  uint64_t d;
+  uint32_t lanes[4];
+  int nsat;
+  int n;
+  int i;
+
+  //
+  // 32 bit lanes are good for rows of over 250,000 pixels
+  //
+  vsum = _mm_setzero_si128();
+  nsat = 0;
+  for (n=n0; n+8 <= n1; n += 8) {
+    v = _mm_loadu_si128((const __m128i *)(row + n));
+    if (bits) {
+      bad = _mm_set1_epi16(isKernelsBits(bits, n, 8));
+      bad = _mm_cmpeq_epi16(_mm_and_si128(bad, lane_bits), lane_bits);
+      v   = _mm_andnot_si128(bad, v);
+    }
+    nsat += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi16(v, sat))) / 2;
+    vsum = _mm_add_epi32(vsum, _mm_cvtepu16_epi32(v));
+    vsum = _mm_add_epi32(vsum, _mm_cvtepu16_epi32(_mm_srli_si128(v, 8)));
+  }
+
+  _mm_storeu_si128((__m128i *)lanes, vsum);
+  d = 0;
+  for (i=0; i<4; i++) {
+    d += lanes[i];
+  }
+
+  *nsatp  += nsat;
+  *ngoodp += (n - n0) - isKernelsCount(bits, n0, n);
+  if (n < n1) {
+    d += isSumSpan16Scalar(row, bits, n, n1, ngoodp, nsatp);
+  }
+  return d;
+}
+
+/** SSE4.1 version of isSumSpan32Scalar
+ */
+__attribute__((target("sse4.1")))
+static uint64_t isSumSpan32SSE41(const uint32_t *row, const uint64_t *bits, int n0, int n1, int *ngoodp, int *nsatp) {
+  const __m128i lane_bits = _mm_setr_epi32(1, 2, 4, 8);
+  const __m128i sat = _mm_set1_epi32(-1);
+  __m128i vsum;
+  __m128i v;
+  __m128i bad;
+  uint64_t d;
+  uint64_t lanes[2];
+  int nsat;
+  int n;
+
+  vsum = _mm_setzero_si128();
+  nsat = 0;
+  for (n=n0; n+4 <= n1; n += 4) {
+    v = _mm_loadu_si128((const __m128i *)(row + n));
+    if (bits) {
+      bad = _mm_set1_epi32(isKernelsBits(bits, n, 4));
+      bad = _mm_cmpeq_epi32(_mm_and_si128(bad, lane_bits), lane_bits);
+      v   = _mm_andnot_si128(bad, v);
+    }
+    nsat += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, sat))));
+    vsum = _mm_add_epi64(vsum, _mm_cvtepu32_epi64(v));
+    vsum = _mm_add_epi64(vsum, _mm_cvtepu32_epi64(_mm_srli_si128(v, 8)));
+  }
+
+  _mm_storeu_si128((__m128i *)lanes, vsum);
+  d = lanes[0] + lanes[1];
+
+  *nsatp  += nsat;
+  *ngoodp += (n - n0) - isKernelsCount(bits, n0, n);
+  if (n < n1) {
+    d += isSumSpan32Scalar(row, bits, n, n1, ngoodp, nsatp);
+  }
+  return d;
+}
+
+#define MED9_SORT_SSE41(a, b) { __m128i t = _mm_min_epu32(a, b); b = _mm_max_epu32(a, b); a = t; }
+
+/** SSE4.1 version of isMedian9Scalar
+ */
+__attribute__((target("sse4.1")))
+static void isMedian9SSE41(uint32_t *s, int stride, uint32_t *out, int n) {
+  __m128i p[9];
+  int i;
+  int k;
+
+  for (i=0; i+4 <= n; i += 4) {
+    for (k=0; k<9; k++) {
+      p[k] = _mm_loadu_si128((const __m128i *)(s + k*stride + i));
+    }
+    MED9_NETWORK(MED9_SORT_SSE41, p);
+    _mm_storeu_si128((__m128i *)(out + i), p[4]);
+  }
+
+  if (i < n) {
+    isMedian9Scalar(s + i, stride, out + i, n - i);
+  }
+}
+
+/** AVX2 version of isSumSpan16Scalar
+ */
+__attribute__((target("avx2")))
+static uint64_t isSumSpan16AVX2(const uint16_t *row, const uint64_t *bits, int n0, int n1, int *ngoodp, int *nsatp) {
+  const __m256i lane_bits = _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, -32768);
+  const __m256i sat = _mm256_set1_epi16(-1);
+  __m256i vsum;
+  __m256i v;
+  __m256i bad;
+  uint64_t d;
+  uint32_t lanes[8];
+  int nsat;
+  int n;
+  int i;
+
+  vsum = _mm256_setzero_si256();
+  nsat = 0;
+  for (n=n0; n+16 <= n1; n += 16) {
+    v = _mm256_loadu_si256((const __m256i *)(row + n));
+    if (bits) {
+      bad = _mm256_set1_epi16(isKernelsBits(bits, n, 16));
+      bad = _mm256_cmpeq_epi16(_mm256_and_si256(bad, lane_bits), lane_bits);
+      v   = _mm256_andnot_si256(bad, v);
+    }
+    nsat += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi16(v, sat))) / 2;
+    vsum = _mm256_add_epi32(vsum, _mm256_cvtepu16_epi32(_mm256_castsi256_si128(v)));
+    vsum = _mm256_add_epi32(vsum, _mm256_cvtepu16_epi32(_mm256_extracti128_si256(v, 1)));
+  }
+
+  _mm256_storeu_si256((__m256i *)lanes, vsum);
+  d = 0;
+  for (i=0; i<8; i++) {
+    d += lanes[i];
+  }
+
+  *nsatp  += nsat;
+  *ngoodp += (n - n0) - isKernelsCount(bits, n0, n);
+  if (n < n1) {
+    d += isSumSpan16Scalar(row, bits, n, n1, ngoodp, nsatp);
+  }
+  return d;
+}
+
+/** AVX2 version of isSumSpan32Scalar
+ */
+__attribute__((target("avx2")))
+static uint64_t isSumSpan32AVX2(const uint32_t *row, const uint64_t *bits, int n0, int n1, int *ngoodp, int *nsatp) {
+  const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m256i sat = _mm256_set1_epi32(-1);
+  __m256i vsum;
+  __m256i v;
+  __m256i bad;
+  uint64_t d;
+  uint64_t lanes[4];
+  int nsat;
+  int n;
+  int i;
+
+  vsum = _mm256_setzero_si256();
+  nsat = 0;
+  for (n=n0; n+8 <= n1; n += 8) {
+    v = _mm256_loadu_si256((const __m256i *)(row + n));
+    if (bits) {
+      bad = _mm256_set1_epi32(isKernelsBits(bits, n, 8));
+      bad = _mm256_cmpeq_epi32(_mm256_and_si256(bad, lane_bits), lane_bits);
+      v   = _mm256_andnot_si256(bad, v);
+    }
+    nsat += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, sat))));
+    vsum = _mm256_add_epi64(vsum, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(v)));
+    vsum = _mm256_add_epi64(vsum, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(v, 1)));
+  }
+
+  _mm256_storeu_si256((__m256i *)lanes, vsum);
+  d = 0;
+  for (i=0; i<4; i++) {
+    d += lanes[i];
+  }
+
+  *nsatp  += nsat;
+  *ngoodp += (n - n0) - isKernelsCount(bits, n0, n);
+  if (n < n1) {
+    d += isSumSpan32Scalar(row, bits, n, n1, ngoodp, nsatp);
+  }
+  return d;
+}
+
+#define MED9_SORT_AVX2(a, b) { __m256i t = _mm256_min_epu32(a, b); b = _mm256_max_epu32(a, b); a = t; }
+
+/** AVX2 version of isMedian9Scalar
+ */
+__attribute__((target("avx2")))
+static void isMedian9AVX2(uint32_t *s, int stride, uint32_t *out, int n) {
+  __m256i p[9];
+  int i;
+  int k;
+
+  for (i=0; i+8 <= n; i += 8) {
+    for (k=0; k<9; k++) {
+      p[k] = _mm256_loadu_si256((const __m256i *)(s + k*stride + i));
+    }
+    MED9_NETWORK(MED9_SORT_AVX2, p);
+    _mm256_storeu_si256((__m256i *)(out + i), p[4]);
+  }
+
+  if (i < n) {
+    isMedian9Scalar(s + i, stride, out + i, n - i);
+  }
+}
+
+//
+// The row kernels: one call per image row runs a span kernel over the
+// whole span table.  ATTR gives the wrapper the same target as its
+// span kernel so the span kernel can be inlined.
+//
+
+/** Max pool row[n0[i]] through row[n1[i]-1] into out[i] for i = 0 through n-1
+ **
+ ** @param row    Start of the image row
+ **
+ ** @param bits   Start of the bad pixel mask for this row (or NULL)
+ **
+ ** @param n0     First column of each span
+ **
+ ** @param n1     One past the last column of each span
+ **
+ ** @param n      Number of spans
+ **
+ ** @param out    Raised to the maximum good pixel of each span
+ **
+ ** @param nsatp  Incremented for each saturated (good) pixel
+ */
+#define IS_MAX_ROW(ATTR, NAME, SPAN, TYPE)                              \
+  ATTR static void NAME(const TYPE *row, const uint64_t *bits, const int *n0, const int *n1, int n, uint32_t *out, int *nsatp) { \
+    uint32_t d;                                                         \
+    int i;                                                              \
+                                                                        \
+    for (i=0; i<n; i++) {                                               \
+      d = SPAN(row, bits, n0[i], n1[i], nsatp);                         \
+      out[i] = out[i] > d ? out[i] : d;                                 \
+    }                                                                   \
+  }
+
+/** Add the good pixels of row[n0[i]] through row[n1[i]-1] to sum[i] for i = 0 through n-1
+ **
+ ** @param row    Start of the image row
+ **
+ ** @param bits   Start of the bad pixel mask for this row (or NULL)
+ **
+ ** @param n0     First column of each span
+ **
+ ** @param n1     One past the last column of each span
+ **
+ ** @param n      Number of spans
+ **
+ ** @param sum    Sum of each span
+ **
+ ** @param ngood  Incremented for each good pixel of each span
+ **
+ ** @param nsat   Incremented for each saturated (good) pixel of each span
+ */
+#define IS_SUM_ROW(ATTR, NAME, SPAN, TYPE)                              \
+  ATTR static void NAME(const TYPE *row, const uint64_t *bits, const int *n0, const int *n1, int n, uint64_t *sum, int *ngood, int *nsat) { \
+    int i;                                                              \
+                                                                        \
+    for (i=0; i<n; i++) {                                               \
+      sum[i] += SPAN(row, bits, n0[i], n1[i], &ngood[i], &nsat[i]);     \
+    }                                                                   \
+  }
+
+IS_MAX_ROW(, isMaxRow16Scalar, isMaxSpan16Scalar, uint16_t)
+IS_MAX_ROW(, isMaxRow32Scalar, isMaxSpan32Scalar, uint32_t)
+IS_SUM_ROW(, isSumRow16Scalar, isSumSpan16Scalar, uint16_t)
+IS_SUM_ROW(, isSumRow32Scalar, isSumSpan32Scalar, uint32_t)
+IS_MAX_ROW(__attribute__((target("sse4.1"))), isMaxRow16SSE41, isMaxSpan16SSE41, uint16_t)
+IS_MAX_ROW(__attribute__((target("sse4.1"))), isMaxRow32SSE41, isMaxSpan32SSE41, uint32_t)
+IS_SUM_ROW(__attribute__((target("sse4.1"))), isSumRow16SSE41, isSumSpan16SSE41, uint16_t)
+IS_SUM_ROW(__attribute__((target("sse4.1"))), isSumRow32SSE41, isSumSpan32SSE41, uint32_t)
+IS_MAX_ROW(__attribute__((target("avx2"))), isMaxRow16AVX2, isMaxSpan16AVX2, uint16_t)
+IS_MAX_ROW(__attribute__((target("avx2"))), isMaxRow32AVX2, isMaxSpan32AVX2, uint32_t)
+IS_SUM_ROW(__attribute__((target("avx2"))), isSumRow16AVX2, isSumSpan16AVX2, uint16_t)
+IS_SUM_ROW(__attribute__((target("avx2"))), isSumRow32AVX2, isSumSpan32AVX2, uint32_t)
+
+/** Run the kernels in use against the scalar kernels on made up rows
+ ** and masks, every start column and span length up to a few vectors
+ ** long (so every length of tail), 16 and 32 bit, with and without a
+ ** mask.  Used by isConvertTest.
+ **
+ ** @returns the number of spans (or sets of medians) that differ
+ */
+int isKernelsCheck() {
+  static const char *id = FILEID "isKernelsCheck";
+  uint16_t row16[256];
+  uint32_t row32[256];
+  uint64_t bits[5];
+  const uint64_t *b;
+  int n0[128], n1[128];
+  uint32_t s[9*64];
+  uint32_t out[128];
+  uint32_t ref[128];
+  uint64_t sum[128], ref_sum[128];
+  int ngood[128], ref_ngood[128];
+  int nsats[128], ref_nsats[128];
+  uint32_t seed;
+  int nsat, ref_nsat;
+  int diffs;
+  int start;
+  int with_mask;
+  int n;
+  int i;
+
+  seed = 12345;
+  for (i=0; i<256; i++) {
+    seed = seed * 1103515245 + 12345;
+    row16[i] = (seed >> 8) % 50 == 0 ? 0xffff : (seed >> 8) & 0xffff;
+    row32[i] = (seed >> 8) % 50 == 0 ? 0xffffffff : seed;
+  }
+  for (i=0; i<5; i++) {
+    seed = seed * 1103515245 + 12345;
+    bits[i] = (uint64_t)seed << 32 | (seed * 69069);
+    bits[i] &= bits[i] >> 3;        // about one in four pixels bad
+  }
+
+  diffs = 0;
+  for (with_mask=0; with_mask<2; with_mask++) {
+    b = with_mask ? bits : NULL;
+    for (start=0; start<64; start++) {
+      // Span i starts at start and is i pixels long
+      for (i=0; i<128; i++) {
+        n0[i] = start;
+        n1[i] = start + i;
+      }
+
+      //
+      // Outputs start out non-zero: the max kernels raise them and the
+      // sum kernels add to them
+      //
+      for (i=0; i<128; i++) {
+        out[i] = ref[i] = i * 1009;
+      }
+      nsat = ref_nsat = 0;
+      isMaxRow16(row16, b, n0, n1, 128, out, &nsat);
+      isMaxRow16Scalar(row16, b, n0, n1, 128, ref, &ref_nsat);
+      for (i=0; i<128; i++) {
+        diffs += out[i] != ref[i];
+      }
+      diffs += nsat != ref_nsat;
+
+      for (i=0; i<128; i++) {
+        out[i] = ref[i] = i * 1009;
+      }
+      nsat = ref_nsat = 0;
+      isMaxRow32(row32, b, n0, n1, 128, out, &nsat);
+      isMaxRow32Scalar(row32, b, n0, n1, 128, ref, &ref_nsat);
+      for (i=0; i<128; i++) {
+        diffs += out[i] != ref[i];
+      }
+      diffs += nsat != ref_nsat;
+
+      for (n=0; n<2; n++) {
+        for (i=0; i<128; i++) {
+          sum[i]   = ref_sum[i]   = i;
+          ngood[i] = ref_ngood[i] = i;
+          nsats[i] = ref_nsats[i] = 0;
+        }
+        if (n == 0) {
+          isSumRow16(row16, b, n0, n1, 128, sum, ngood, nsats);
+          isSumRow16Scalar(row16, b, n0, n1, 128, ref_sum, ref_ngood, ref_nsats);
+        } else {
+          isSumRow32(row32, b, n0, n1, 128, sum, ngood, nsats);
+          isSumRow32Scalar(row32, b, n0, n1, 128, ref_sum, ref_ngood, ref_nsats);
+        }
+        for (i=0; i<128; i++) {
+          diffs += sum[i] != ref_sum[i] || ngood[i] != ref_ngood[i] || nsats[i] != ref_nsats[i];
+        }
+      }
+    }
+  }
+
+  for (n=1; n<=64; n++) {
+    for (i=0; i<9*n; i++) {
+      // Plenty of ties and a few saturated samples
+      seed = seed * 1103515245 + 12345;
+      s[i] = (seed >> 8) % 20 == 0 ? 0xffffffff : (seed >> 8) % 8;
+    }
+    isMedian9(s, n, out, n);
+    isMedian9Scalar(s, n, ref, n);
+    diffs += memcmp(out, ref, n * sizeof(*out)) != 0;
+  }
+
+  if (diffs) {
+    isLogging_err("%s: %d differences from the scalar kernels\n", id, diffs);
+  }
+  return diffs;
+}
+
+/** Pick the kernels to use on this CPU.  Call once before any
+ ** threads start (or again, with no reductions running, to switch).
+ **
+ ** @returns the name of the kernels picked
+ */
+const char *isKernelsInit() {
+  static const char *id = FILEID "isKernelsInit";
+  const char *choice;
+
+  __builtin_cpu_init();
+
+  choice = getenv("IS_KERNELS");
+  if (choice == NULL || *choice == 0) {
+    if (__builtin_cpu_supports("avx2")) {
+      choice = "avx2";
+    } else if (__builtin_cpu_supports("sse4.1")) {
+      choice = "sse4.1";
+    } else {
+      choice = "scalar";
+    }
+  }
+
+  if (strcmp(choice, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    isMaxRow16 = isMaxRow16AVX2;
+    isMaxRow32 = isMaxRow32AVX2;
+    isSumRow16 = isSumRow16AVX2;
+    isSumRow32 = isSumRow32AVX2;
+    isMedian9  = isMedian9AVX2;
+  } else if (strcmp(choice, "sse4.1") == 0 && __builtin_cpu_supports("sse4.1")) {
+    isMaxRow16 = isMaxRow16SSE41;
+    isMaxRow32 = isMaxRow32SSE41;
+    isSumRow16 = isSumRow16SSE41;
+    isSumRow32 = isSumRow32SSE41;
+    isMedian9  = isMedian9SSE41;
+  } else {
+    if (strcmp(choice, "scalar") != 0) {
+      isLogging_err("%s: Kernels '%s' are not available here.  Using scalar kernels.\n", id, choice);
+    }
+    choice = "scalar";
+    isMaxRow16 = isMaxRow16Scalar;
+    isMaxRow32 = isMaxRow32Scalar;
+    isSumRow16 = isSumRow16Scalar;
+    isSumRow32 = isSumRow32Scalar;
+    isMedian9  = isMedian9Scalar;
+  }
+  isLogging_info("%s: Using %s kernels\n", id, choice);
+  return choice;
+}
@@ -69,9 +69,8 @@ int main(int argc, char **argv) {
   static void *router;                 // Router socket we recieve our commands on
   static void *err_dealer;             // Socket to read errors generated when a user process cannot be forked
   static void *err_rep;                // Socket to handle the above errors (We need the err sockets to keep all the code ZMQ protocol complaint)
-
-  zmq_pollitem_t *zpollitems;   // list of sockets we need to service
-  int n_zpollitems;             // number of said sockets
+  static zmq_pollitem_t *zpollitems;   // list of sockets we need to service
+  static int n_zpollitems;             // number of said sockets
 
   zmq_msg_t zmsg;               // Move messages between various socket when we service them
   int nreceived;                // Bytes received in a ZMQ messages (or -1 on error)
@@ -297,12 +296,6 @@ int main(int argc, char **argv) {
     exit (-1);
   }
 
-  //
-  // Restart any rsync processes that have been abandoned
-  //
-  isRsyncRecover();
-
-
   // No envelope messages to close yet
   //
   n_envelope_msgs = 0;
@@ -312,11 +305,6 @@ int main(int argc, char **argv) {
   //
   sigaction(SIGINT, &sa, NULL);
   while (1) {
-    //
-    // see if any restarted rsync processes have finished
-    //
-    isRsyncWaitpid();
-
     //
     // We are really just about servicing ZMQ sockets.  Similar to the
     // poll function for unix file descriptors we have a zmq poll
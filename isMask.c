@@ -0,0 +1,291 @@
+/*! @file isMask.c
+ *  @copyright 2018 by Northwestern University All Rights Reserved
+ *  @author Keith Brister
+ *  @brief Compact bad pixel masks shared by all the frames of a data set
+ *
+ *  Detectors flag their bad pixels with a uint32_t per pixel mask
+ *  (the Eiger pixel_mask).  We keep the mask as a bitset with one bit
+ *  per pixel (set for bad pixels, each row starting on a 64 bit word
+ *  boundary) plus a list of the runs of bad pixels in each row.  Rows
+ *  without any runs can skip the mask entirely.
+ *
+ *  Masks are reference counted.  Every frame of a data set holds a
+ *  reference to the same mask, which is decoded just once per master
+ *  file and kept in a small cache (keyed by the master file name and
+ *  modification time) for the frames still to come.
+ */
+#include "is.h"
+
+/** Work out the runs of bad pixels from the bitset
+ */
+static void isMaskFindRuns(isMask_t *m) {
+  static const char *id = FILEID "isMaskFindRuns";
+  uint64_t *bits;
+  int max_runs;
+  int row, col;
+  int start;
+
+  m->row_runs = calloc(m->height + 1, sizeof(int));
+  if (m->row_runs == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  max_runs = 0;
+  m->n_runs = 0;
+  m->runs = NULL;
+  for (row=0; row<m->height; row++) {
+    m->row_runs[row] = m->n_runs;
+    bits = m->bits + (size_t)row * m->words;
+
+    col = 0;
+    while (col < m->width) {
+      if (bits[col >> 6] == 0 && (col & 63) == 0) {
+        // Nothing bad in this word
+        col += 64;
+        continue;
+      }
+      if (((bits[col >> 6] >> (col & 63)) & 1) == 0) {
+        col++;
+        continue;
+      }
+
+      start = col;
+      while (col < m->width && ((bits[col >> 6] >> (col & 63)) & 1)) {
+        col++;
+      }
+
+      if (m->n_runs == max_runs) {
+        max_runs = max_runs == 0 ? 1024 : 2 * max_runs;
+        m->runs = realloc(m->runs, max_runs * sizeof(*m->runs));
+        if (m->runs == NULL) {
+          isLogging_crit("%s: Out of memory\n", id);
+          exit (-1);
+        }
+      }
+      m->runs[m->n_runs].col = start;
+      m->runs[m->n_runs].len = col - start;
+      m->n_runs++;
+    }
+  }
+  m->row_runs[m->height] = m->n_runs;
+
+  m->bytes = sizeof(*m) + sizeof(uint64_t) * m->words * m->height + sizeof(int) * (m->height + 1) + sizeof(*m->runs) * m->n_runs;
+}
+
+/** Make an empty mask
+ */
+static isMask_t *isMaskNew(int width, int height) {
+  static const char *id = FILEID "isMaskNew";
+  isMask_t *rtn;
+
+  rtn = calloc(1, sizeof(*rtn));
+  if (rtn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  rtn->refs   = 1;
+  rtn->width  = width;
+  rtn->height = height;
+  rtn->words  = (width + 63) / 64;
+  rtn->bits   = calloc((size_t)rtn->words * height, sizeof(uint64_t));
+  if (rtn->bits == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  return rtn;
+}
+
+/** Make a mask from a detector's uint32_t per pixel bad pixel map
+ **
+ ** @param width   Width of the image
+ **
+ ** @param height  Height of the image
+ **
+ ** @param map     Non-zero for bad pixels
+ **
+ ** @returns a mask with one reference (ours)
+ */
+isMask_t *isMaskFromMap(int width, int height, const uint32_t *map) {
+  isMask_t *rtn;
+  uint64_t *bits;
+  int row, col;
+
+  rtn = isMaskNew(width, height);
+  for (row=0; row<height; row++) {
+    bits = rtn->bits + (size_t)row * rtn->words;
+    for (col=0; col<width; col++) {
+      if (map[(size_t)row * width + col]) {
+        bits[col >> 6] |= 1ULL << (col & 63);
+      }
+    }
+  }
+  isMaskFindRuns(rtn);
+  return rtn;
+}
+
+/** Make a mask from a copy of another mask's bitset (say, one found in
+ ** shared memory)
+ **
+ ** @returns a mask with one reference (ours)
+ */
+isMask_t *isMaskFromBits(int width, int height, const uint64_t *bits) {
+  isMask_t *rtn;
+
+  rtn = isMaskNew(width, height);
+  memcpy(rtn->bits, bits, sizeof(uint64_t) * rtn->words * height);
+  isMaskFindRuns(rtn);
+  return rtn;
+}
+
+/** Take another reference to a mask
+ */
+isMask_t *isMaskRef(isMask_t *m) {
+  __atomic_add_fetch(&m->refs, 1, __ATOMIC_RELAXED);
+  return m;
+}
+
+/** Give up a reference to a mask, freeing it if it was the last one
+ */
+void isMaskRelease(isMask_t *m) {
+  if (m == NULL) {
+    return;
+  }
+  if (__atomic_sub_fetch(&m->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(m->key);
+    free(m->bits);
+    free(m->row_runs);
+    free(m->runs);
+    free(m);
+  }
+}
+
+/** Make the key we cache a master file's mask under
+ **
+ ** @returns the key (free it) or NULL if we cannot stat the file
+ */
+char *isMaskKey(const char *fn) {
+  static const char *id = FILEID "isMaskKey";
+  struct stat sb;
+  char *rtn;
+
+  if (stat(fn, &sb) != 0) {
+    return NULL;
+  }
+
+  if (asprintf(&rtn, "%s@%lld.%09ld", fn, (long long)sb.st_mtim.tv_sec, sb.st_mtim.tv_nsec) < 0) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  return rtn;
+}
+
+/** Look for a mask that we've already decoded
+ **
+ ** @param wctx  Our worker context
+ **
+ ** @param key   The mask's key (from isMaskKey)
+ **
+ ** @returns a reference to the mask (release it when done) or NULL
+ */
+isMask_t *isMaskCacheGet(isWorkerContext_t *wctx, const char *key) {
+  isMask_t **mpp;
+  isMask_t *m;
+
+  m = NULL;
+  pthread_mutex_lock(&wctx->maskMutex);
+  for (mpp = &wctx->masks; *mpp != NULL; mpp = &(*mpp)->next) {
+    if (strcmp((*mpp)->key, key) == 0) {
+      // Move to the front of the line
+      m = *mpp;
+      *mpp = m->next;
+      m->next = wctx->masks;
+      wctx->masks = m;
+      isMaskRef(m);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&wctx->maskMutex);
+
+  return m;
+}
+
+/** Remember a freshly decoded mask for the other frames of its data
+ ** set.  The least recently used mask leaves the cache when there
+ ** are more than IS_MASK_CACHE_ENTRIES (the frames using it keep
+ ** their references).
+ **
+ ** Another thread may have decoded and cached the same mask while we
+ ** were decoding ours.  Then we use theirs and give ours up.
+ **
+ ** @param wctx  Our worker context
+ **
+ ** @param key   The mask's key (from isMaskKey)
+ **
+ ** @param m     The mask.  We take the caller's reference.
+ **
+ ** @returns the cached mask (m or the one already there) with a reference for the caller
+ */
+isMask_t *isMaskCachePut(isWorkerContext_t *wctx, const char *key, isMask_t *m) {
+  static const char *id = FILEID "isMaskCachePut";
+  isMask_t **mpp;
+  isMask_t *victim;
+  isMask_t *rtn;
+  int n;
+
+  if (m->key != NULL) {
+    // Already cached
+    return m;
+  }
+
+  victim = NULL;
+  pthread_mutex_lock(&wctx->maskMutex);
+  for (rtn = wctx->masks; rtn != NULL; rtn = rtn->next) {
+    if (strcmp(rtn->key, key) == 0) {
+      isMaskRef(rtn);
+      break;
+    }
+  }
+
+  if (rtn == NULL) {
+    m->key = strdup(key);
+    if (m->key == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+    m->next = wctx->masks;
+    wctx->masks = isMaskRef(m);
+    rtn = m;
+    m = NULL;
+
+    n = 0;
+    for (mpp = &wctx->masks; *mpp != NULL; mpp = &(*mpp)->next) {
+      if (++n > IS_MASK_CACHE_ENTRIES) {
+        victim = *mpp;
+        *mpp = victim->next;
+        victim->next = NULL;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&wctx->maskMutex);
+
+  isMaskRelease(victim);
+  isMaskRelease(m);
+  return rtn;
+}
+
+/** Empty the mask cache.  Call when nobody is using it.
+ */
+void isMaskCacheDestroy(isWorkerContext_t *wctx) {
+  isMask_t *m;
+  isMask_t *next;
+
+  for (m=wctx->masks; m != NULL; m=next) {
+    next = m->next;
+    m->next = NULL;
+    isMaskRelease(m);
+  }
+  wctx->masks = NULL;
+}
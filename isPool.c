@@ -0,0 +1,345 @@
+/*! @file isPool.c
+ *  @copyright 2018 by Northwestern University All Rights Reserved
+ *  @author Keith Brister
+ *  @brief A pool of compute threads shared by a supervisor's workers
+ *
+ *  The worker threads spend most of their time waiting on files,
+ *  redis, or the user.  When one of them does have a big computation
+ *  (reducing a whole frame, say) it splits the work into pieces and
+ *  hands them to isPoolRun.  The pool threads and the caller work on
+ *  the pieces together, and isPoolRun returns when they are all done.
+ *  Several workers may be using the pool at once: their batches are
+ *  worked on in the order they were submitted.
+ *
+ *  Pool threads must never wait on files or redis: a reduction queued
+ *  behind them would wait too.  Work that does (fetching the frames of
+ *  a filmstrip, the jobs of a batch) goes to a second, smaller pool of
+ *  threads that are allowed to block (see isPoolRunIO).  The
+ *  computations inside that work still come back here.
+ */
+#include "is.h"
+
+/** Pieces of work submitted by one call to isPoolRun
+ */
+typedef struct isPoolBatchStruct {
+  struct isPoolBatchStruct *next;       //!< next batch in the queue
+  void (*fn)(void *, int);              //!< called as fn(arg, i) for each piece i
+  void *arg;                            //!< passed to fn
+  int n;                                //!< number of pieces
+  int next_piece;                       //!< next piece nobody has started yet
+  int n_done;                           //!< number of pieces finished
+} isPoolBatch_t;
+
+/** Our queue and the threads that service it
+ */
+struct isPoolStruct {
+  pthread_mutex_t mutex;                //!< protects everything here (and our batches)
+  pthread_cond_t work;                  //!< signaled when a batch is queued (or it's time to go)
+  pthread_cond_t done;                  //!< broadcast when a piece is finished
+  int running;                          //!< cleared to stop our threads
+  pthread_t *threads;                   //!< our threads
+  int n_threads;                        //!< number of threads we managed to start
+  isPoolBatch_t *head;                  //!< batch with pieces waiting to be started
+  isPoolBatch_t *tail;                  //!< last batch in the queue
+};
+
+/** Start the next piece of a batch.  Every batch in the queue has at
+ ** least one piece nobody has started.
+ **
+ ** Call with the pool mutex locked.  The mutex is unlocked while fn
+ ** runs.
+ **
+ ** @param pool  Our pool
+ **
+ ** @param b     The batch to work on.  NULL for the first one in the queue.
+ **
+ ** @returns 1 if we did a piece, 0 if there was nothing to start
+ */
+static int isPoolDoPiece(isPool_t *pool, isPoolBatch_t *b) {
+  isPoolBatch_t **bpp;
+  int i;
+
+  b = b == NULL ? pool->head : b;
+  if (b == NULL || b->next_piece >= b->n) {
+    return 0;
+  }
+
+  i = b->next_piece++;
+  if (b->next_piece == b->n) {
+    //
+    // Nothing left to start: take the batch out of the queue
+    //
+    pool->tail = NULL;
+    bpp = &pool->head;
+    while (*bpp != NULL) {
+      if (*bpp == b) {
+        *bpp = b->next;
+        continue;
+      }
+      pool->tail = *bpp;
+      bpp = &(*bpp)->next;
+    }
+  }
+
+  pthread_mutex_unlock(&pool->mutex);
+  b->fn(b->arg, i);
+  pthread_mutex_lock(&pool->mutex);
+
+  b->n_done++;
+  if (b->n_done == b->n) {
+    pthread_cond_broadcast(&pool->done);
+  }
+  return 1;
+}
+
+/** Pool thread
+ */
+static void *isPoolWorker(void *voidp) {
+  isPool_t *pool;
+
+  pool = voidp;
+
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->running) {
+    if (!isPoolDoPiece(pool, NULL)) {
+      pthread_cond_wait(&pool->work, &pool->mutex);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+//! Non-zero when this thread does its own pool work (see isPoolSetSerial)
+static __thread int isPoolSerial = 0;
+
+/** Have this thread's isPoolRun calls do all the pieces themselves.
+ ** Pool threads run at normal priority: a low priority thread (a
+ ** prefetcher, say) that handed them work would be taking CPU time
+ ** away from the interactive jobs at their priority.
+ **
+ ** @param serial  Non-zero to keep our work on this thread, 0 to use the pool again
+ */
+void isPoolSetSerial(int serial) {
+  isPoolSerial = serial;
+}
+
+/** Call fn(arg, i) for i = 0 to n-1 using the pool, returning when
+ ** they have all finished.  The pieces run in no particular order,
+ ** possibly all at once.  Runs them all here when there is no pool.
+ **
+ ** @param pool  The pool (or NULL)
+ **
+ ** @param n     Number of pieces
+ **
+ ** @param fn    Does one piece
+ **
+ ** @param arg   Passed to fn
+ */
+static void isPoolRunOn(isPool_t *pool, int n, void (*fn)(void *, int), void *arg) {
+  isPoolBatch_t batch;
+  int i;
+
+  if (pool == NULL || pool->n_threads == 0 || n <= 1) {
+    for (i=0; i<n; i++) {
+      fn(arg, i);
+    }
+    return;
+  }
+
+  memset(&batch, 0, sizeof(batch));
+  batch.fn  = fn;
+  batch.arg = arg;
+  batch.n   = n;
+
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->tail) {
+    pool->tail->next = &batch;
+  } else {
+    pool->head = &batch;
+  }
+  pool->tail = &batch;
+  pthread_cond_broadcast(&pool->work);
+
+  // Lend a hand with our own batch
+  while (isPoolDoPiece(pool, &batch));
+
+  while (batch.n_done < batch.n) {
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+/** Call fn(arg, i) for i = 0 to n-1 using the compute pool,
+ ** returning when they have all finished.  The pieces run in no
+ ** particular order, possibly all at once.  Runs them all here when
+ ** there is no pool (or this thread called isPoolSetSerial).
+ **
+ ** @param wctx  Our worker context
+ **
+ ** @param n     Number of pieces
+ **
+ ** @param fn    Does one piece
+ **
+ ** @param arg   Passed to fn
+ */
+void isPoolRun(isWorkerContext_t *wctx, int n, void (*fn)(void *, int), void *arg) {
+  int i;
+
+  if (isPoolSerial) {
+    for (i=0; i<n; i++) {
+      fn(arg, i);
+    }
+    return;
+  }
+  isPoolRunOn(wctx->pool, n, fn, arg);
+}
+
+/** Call fn(arg, i) for i = 0 to n-1 using the threads that may wait
+ ** on files and redis, returning when they have all finished.  As
+ ** with isPoolRun the pieces run in no particular order and the
+ ** caller does some of them.  Big computations inside fn should use
+ ** isPoolRun as usual.
+ **
+ ** @param wctx  Our worker context
+ **
+ ** @param n     Number of pieces
+ **
+ ** @param fn    Does one piece
+ **
+ ** @param arg   Passed to fn
+ */
+void isPoolRunIO(isWorkerContext_t *wctx, int n, void (*fn)(void *, int), void *arg) {
+  isPoolRunOn(wctx->ioPool, n, fn, arg);
+}
+
+//! This thread's connection to the local redis server (see isPoolRedis)
+static __thread redisContext *isPoolRc = NULL;
+
+/** A connection to the local redis server for pieces of work that
+ ** need one.  Each thread (pool thread or caller) gets its own,
+ ** opened the first time it is asked for and kept for next time.
+ **
+ ** @returns the connection or NULL if we could not make one
+ */
+redisContext *isPoolRedis() {
+  static const char *id = FILEID "isPoolRedis";
+
+  if (isPoolRc == NULL) {
+    isPoolRc = redisConnect("127.0.0.1", 6379);
+    if (isPoolRc == NULL || isPoolRc->err) {
+      if (isPoolRc != NULL) {
+        isLogging_err("%s: Failed to connect to redis: %s\n", id, isPoolRc->errstr);
+        redisFree(isPoolRc);
+      } else {
+        isLogging_err("%s: Failed to get redis context\n", id);
+      }
+      isPoolRc = NULL;
+    }
+  }
+  return isPoolRc;
+}
+
+/** Number of threads isPoolRun can count on (including the caller)
+ */
+int isPoolSize(isWorkerContext_t *wctx) {
+  return wctx->pool == NULL || isPoolSerial ? 1 : wctx->pool->n_threads + 1;
+}
+
+/** Start a pool
+ **
+ ** @param n  Number of threads to start
+ **
+ ** @returns the pool
+ */
+static isPool_t *isPoolStart(int n) {
+  static const char *id = FILEID "isPoolStart";
+  isPool_t *pool;
+  int err;
+  int i;
+
+  pool = calloc(1, sizeof(*pool));
+  if (pool == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  pool->threads = calloc(n > 0 ? n : 1, sizeof(*pool->threads));
+  if (pool->threads == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pool->running = 1;
+
+  for (i=0; i<n; i++) {
+    err = pthread_create(&pool->threads[i], NULL, isPoolWorker, pool);
+    if (err != 0) {
+      isLogging_err("%s: Could not start pool thread: %s\n", id, strerror(err));
+      break;
+    }
+    pool->n_threads++;
+  }
+  return pool;
+}
+
+/** Stop a pool and free it
+ **
+ ** @param pool  The pool (or NULL)
+ */
+static void isPoolStop(isPool_t *pool) {
+  int i;
+
+  if (pool == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->running = 0;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (i=0; i<pool->n_threads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool->threads);
+  free(pool);
+}
+
+/** Start the compute pool.  We'll use one thread per online CPU (less
+ ** one for the caller of isPoolRun) up to IS_POOL_MAX_THREADS.  Also
+ ** start IS_IO_POOL_THREADS threads for work that waits on files and
+ ** redis (see isPoolRunIO).
+ **
+ ** @param wctx  Our worker context
+ */
+void isPoolInit(isWorkerContext_t *wctx) {
+  long ncpus;
+  int n;
+
+  ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  n = ncpus > 1 ? ncpus - 1 : 0;
+  n = n > IS_POOL_MAX_THREADS ? IS_POOL_MAX_THREADS : n;
+
+  wctx->pool   = isPoolStart(n);
+  wctx->ioPool = isPoolStart(IS_IO_POOL_THREADS);
+}
+
+/** Stop both pools.  Call when nobody is using them any more.
+ **
+ ** @param wctx  Our worker context
+ */
+void isPoolDestroy(isWorkerContext_t *wctx) {
+  // The io pool's work may still be using the compute pool
+  isPoolStop(wctx->ioPool);
+  wctx->ioPool = NULL;
+
+  isPoolStop(wctx->pool);
+  wctx->pool = NULL;
+}
@@ -0,0 +1,473 @@
+/*! @file isPrefetch.c
+ *  @copyright 2018 by Northwestern University All Rights Reserved
+ *  @author Keith Brister
+ *  @brief Reduce the frames a user is likely to ask for next
+ *
+ *  People step through a data set one frame at a time.  When we see
+ *  a user ask for frame N right after N-1 (or N+1) of the same file
+ *  at the same zoom and size we queue up the next IS_PREFETCH_DEPTH
+ *  frames in that direction.  A few low priority threads reduce the
+ *  queued frames into the image buffer cache whenever no interactive
+ *  jobs are running.  They do their own work rather than hand it to
+ *  the (normal priority) compute pool.  Jumping to some other frame
+ *  (or changing the zoom or size) cancels whatever is still queued
+ *  for that file.
+ */
+#include "is.h"
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+/** What we know about how one file is being browsed
+ */
+typedef struct isPrefetchTrackerStruct {
+  char *fn;                             //!< the file being browsed (NULL if this tracker is free)
+  int frame;                            //!< last frame requested
+  int direction;                        //!< +1 stepping forward, -1 stepping backwards, 0 no idea
+  int steps;                            //!< number of consecutive steps in direction
+  int queued_through;                   //!< furthest frame queued so far in direction
+  unsigned int generation;              //!< incremented to cancel queued jobs
+  uint64_t tick;                        //!< when this tracker was last used (to pick one to recycle)
+  int xsize;                            //!< requested image width
+  double zoom;                          //!< requested zoom
+  double segcol;                        //!< requested segment column
+  double segrow;                        //!< requested segment row
+  reduce_mode_type reduce;              //!< requested reduction mode
+} isPrefetchTracker_t;
+
+/** A frame we'd like to have ready
+ */
+typedef struct isPrefetchItemStruct {
+  struct isPrefetchItemStruct *next;    //!< next item in the queue
+  json_t *job;                          //!< a copy of the user's job with the frame changed
+  isPrefetchTracker_t *tracker;         //!< the tracker that queued us
+  unsigned int generation;              //!< we're cancelled if this no longer matches the tracker's
+} isPrefetchItem_t;
+
+/** Our prefetch queue and the threads that service it
+ */
+struct isPrefetchStruct {
+  pthread_mutex_t mutex;                //!< protects everything here
+  pthread_cond_t cond;                  //!< signaled when there is something in the queue (or it's time to go)
+  int running;                          //!< cleared to stop our threads
+  pthread_t threads[IS_PREFETCH_THREADS];       //!< our threads
+  int n_threads;                        //!< number of threads we managed to start
+  isPrefetchItem_t *head;               //!< next item to prefetch
+  isPrefetchItem_t *tail;               //!< last item to prefetch
+  int n_queued;                         //!< number of items in the queue
+  uint64_t tick;                        //!< incremented on every note
+  isPrefetchTracker_t trackers[IS_PREFETCH_TRACKERS];   //!< files being browsed
+};
+
+/** Find the tracker for fn, recycling the least recently used one if
+ ** need be.
+ **
+ ** Call with the prefetch mutex locked.
+ */
+static isPrefetchTracker_t *isPrefetchTracker(isPrefetch_t *pf, const char *fn) {
+  static const char *id = FILEID "isPrefetchTracker";
+  isPrefetchTracker_t *t;
+  isPrefetchTracker_t *oldest;
+  int i;
+
+  oldest = NULL;
+  for (i=0; i<IS_PREFETCH_TRACKERS; i++) {
+    t = &pf->trackers[i];
+    if (t->fn != NULL && strcmp(t->fn, fn) == 0) {
+      return t;
+    }
+    if (oldest == NULL || t->fn == NULL || (oldest->fn != NULL && t->tick < oldest->tick)) {
+      oldest = t;
+    }
+  }
+
+  t = oldest;
+  if (t->fn != NULL) {
+    free(t->fn);
+  }
+  t->fn = strdup(fn);
+  if (t->fn == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  t->frame     = 0;
+  t->direction = 0;
+  t->steps     = 0;
+  t->generation++;      // cancel anything left over from the previous file
+  return t;
+}
+
+/** Queue one frame
+ **
+ ** Call with the prefetch mutex locked.
+ */
+static void isPrefetchQueue(isWorkerContext_t *wctx, isPrefetch_t *pf, isPrefetchTracker_t *t, json_t *job, int frame) {
+  static const char *id = FILEID "isPrefetchQueue";
+  isPrefetchItem_t *item;
+
+  item = calloc(1, sizeof(*item));
+  if (item == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  item->job = json_deep_copy(job);
+  pthread_mutex_unlock(&wctx->metaMutex);
+  if (item->job == NULL) {
+    isLogging_crit("%s: Out of memory (job)\n", id);
+    exit (-1);
+  }
+  pthread_mutex_lock(&wctx->metaMutex);
+  set_json_object_integer(id, item->job, "frame", frame);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  item->tracker    = t;
+  item->generation = t->generation;
+
+  if (pf->tail == NULL) {
+    pf->head = item;
+  } else {
+    pf->tail->next = item;
+  }
+  pf->tail = item;
+  pf->n_queued++;
+}
+
+/** Throw away a queue item
+ */
+static void isPrefetchFreeItem(isWorkerContext_t *wctx, isPrefetchItem_t *item) {
+  pthread_mutex_lock(&wctx->metaMutex);
+  json_decref(item->job);
+  pthread_mutex_unlock(&wctx->metaMutex);
+  free(item);
+}
+
+/** Note that a user asked for a frame and queue up the next few if
+ ** they seem to be stepping through the data set.
+ **
+ ** @param wctx  Our worker context
+ **
+ ** @param job   The user's jpeg job
+ **
+ ** @param meta  Meta data of the image we just served (for the frame range)
+ */
+void isPrefetchNote(isWorkerContext_t *wctx, json_t *job, json_t *meta) {
+  isPrefetch_t *pf;
+  isPrefetchTracker_t *t;
+  const char *fn;
+  int frame;
+  int first_frame;
+  int last_frame;
+  int xsize;
+  double zoom;
+  double segcol;
+  double segrow;
+  reduce_mode_type reduce;
+  int step;
+  int f;
+
+  pf = wctx->prefetch;
+  if (pf == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  fn          = json_string_value(json_object_get(job, "fn"));
+  frame       = json_integer_value(json_object_get(job, "frame"));
+  xsize       = json_integer_value(json_object_get(job, "xsize"));
+  zoom        = json_number_value(json_object_get(job, "zoom"));
+  segcol      = json_number_value(json_object_get(job, "segcol"));
+  segrow      = json_number_value(json_object_get(job, "segrow"));
+  reduce      = isReduceMode(json_string_value(json_object_get(job, "reduce")));
+  first_frame = json_integer_value(json_object_get(meta, "first_frame"));
+  last_frame  = json_integer_value(json_object_get(meta, "last_frame"));
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (fn == NULL || *fn == 0) {
+    return;
+  }
+  frame       = frame <= 0 ? 1 : frame;
+  first_frame = first_frame <= 0 ? 1 : first_frame;
+
+  pthread_mutex_lock(&pf->mutex);
+
+  t = isPrefetchTracker(pf, fn);
+  t->tick = ++pf->tick;
+
+  if (t->xsize != xsize || t->zoom != zoom || t->segcol != segcol || t->segrow != segrow || t->reduce != reduce) {
+    //
+    // Different view: whatever we queued is not what they'll want
+    //
+    t->xsize     = xsize;
+    t->zoom      = zoom;
+    t->segcol    = segcol;
+    t->segrow    = segrow;
+    t->reduce    = reduce;
+    t->direction = 0;
+    t->steps     = 0;
+    t->generation++;
+  } else {
+    step = frame - t->frame;
+    if (step == 0) {
+      // Just asking again
+      pthread_mutex_unlock(&pf->mutex);
+      return;
+    }
+
+    if ((step == 1 || step == -1) && step == t->direction) {
+      t->steps++;
+    } else if (step == 1 || step == -1) {
+      //
+      // Started stepping (or turned around)
+      //
+      t->direction      = step;
+      t->steps          = 1;
+      t->queued_through = frame;
+      t->generation++;
+    } else {
+      //
+      // Jumped elsewhere
+      //
+      t->direction = 0;
+      t->steps     = 0;
+      t->generation++;
+    }
+  }
+  t->frame = frame;
+
+  if (t->direction != 0 && t->steps >= IS_PREFETCH_MIN_STEPS) {
+    //
+    // Pick up where we left off last time
+    //
+    f = frame + t->direction;
+    if ((t->queued_through - frame) * t->direction > 0) {
+      f = t->queued_through + t->direction;
+    }
+
+    for (; (f - frame) * t->direction <= IS_PREFETCH_DEPTH; f += t->direction) {
+      if (f < first_frame || (last_frame > 0 && f > last_frame) || pf->n_queued >= IS_PREFETCH_MAX_QUEUED) {
+        break;
+      }
+      isPrefetchQueue(wctx, pf, t, job, f);
+      t->queued_through = f;
+    }
+    pthread_cond_broadcast(&pf->cond);
+  }
+
+  pthread_mutex_unlock(&pf->mutex);
+}
+
+/** Is this item still wanted?
+ **
+ ** Call with the prefetch mutex locked.
+ */
+static int isPrefetchWanted(isPrefetchItem_t *item) {
+  return item->generation == item->tracker->generation;
+}
+
+/** Service the prefetch queue
+ **
+ ** @param voidp  opaque pointer to our worker context
+ */
+static void *isPrefetchWorker(void *voidp) {
+  static const char *id = FILEID "isPrefetchWorker";
+  isWorkerContext_t *wctx;
+  isPrefetch_t *pf;
+  isPrefetchItem_t *item;
+  isImageBufType *imb;
+  redisContext *rc;
+  int wanted;
+
+  wctx = voidp;
+  pf   = wctx->prefetch;
+
+  //
+  // Linux lets us set the nice value of a single thread.  We want to
+  // take the CPU only when nobody else wants it.
+  //
+  if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), IS_PREFETCH_NICE) == -1) {
+    isLogging_err("%s: Could not lower our priority: %s\n", id, strerror(errno));
+  }
+
+  //
+  // The compute pool isn't niced: do our reductions (and jpegs) here
+  //
+  isPoolSetSerial(1);
+
+  rc = redisConnect("127.0.0.1", 6379);
+  if (rc == NULL || rc->err) {
+    if (rc != NULL) {
+      isLogging_err("%s: Failed to connect to redis: %s\n", id, rc->errstr);
+    } else {
+      isLogging_err("%s: Failed to get redis context\n", id);
+    }
+    fflush(stderr);
+    exit (-1);
+  }
+
+  pthread_mutex_lock(&pf->mutex);
+  while (1) {
+    while (pf->running && pf->head == NULL) {
+      pthread_cond_wait(&pf->cond, &pf->mutex);
+    }
+    if (!pf->running) {
+      break;
+    }
+
+    item = pf->head;
+    pf->head = item->next;
+    if (pf->head == NULL) {
+      pf->tail = NULL;
+    }
+    pf->n_queued--;
+
+    //
+    // Interactive jobs go first.  Check back every so often to see if
+    // they are done (or if we've been cancelled while waiting).
+    //
+    while (pf->running && isPrefetchWanted(item) && __atomic_load_n(&wctx->interactive, __ATOMIC_RELAXED) > 0) {
+      pthread_mutex_unlock(&pf->mutex);
+      usleep(IS_PREFETCH_IDLE_US);
+      pthread_mutex_lock(&pf->mutex);
+    }
+
+    wanted = pf->running && isPrefetchWanted(item);
+    pthread_mutex_unlock(&pf->mutex);
+
+    if (wanted) {
+      imb = isReduceImage(wctx, rc, item->job);
+      if (imb != NULL) {
+        isReleaseImageBuf(wctx, imb);
+      } else {
+        //
+        // Likely we've run off the end of the data set.  Don't bother
+        // with the rest of this run.
+        //
+        pthread_mutex_lock(&pf->mutex);
+        if (isPrefetchWanted(item)) {
+          item->tracker->generation++;
+        }
+        pthread_mutex_unlock(&pf->mutex);
+      }
+    }
+
+    isPrefetchFreeItem(wctx, item);
+    pthread_mutex_lock(&pf->mutex);
+  }
+  pthread_mutex_unlock(&pf->mutex);
+
+  redisFree(rc);
+  return NULL;
+}
+
+/** The frames still wanted, in the order they'll be prefetched.
+ ** Used by isConvertTest.
+ **
+ ** @param wctx    Our worker context
+ **
+ ** @param frames  Filled with up to max frame numbers
+ **
+ ** @param max     Room in frames
+ **
+ ** @returns the number of frames still wanted
+ */
+int isPrefetchQueued(isWorkerContext_t *wctx, int *frames, int max) {
+  isPrefetch_t *pf;
+  isPrefetchItem_t *item;
+  int n;
+
+  pf = wctx->prefetch;
+  if (pf == NULL) {
+    return 0;
+  }
+
+  n = 0;
+  pthread_mutex_lock(&pf->mutex);
+  for (item=pf->head; item != NULL; item=item->next) {
+    if (!isPrefetchWanted(item)) {
+      continue;
+    }
+    if (n < max) {
+      pthread_mutex_lock(&wctx->metaMutex);
+      frames[n] = json_integer_value(json_object_get(item->job, "frame"));
+      pthread_mutex_unlock(&wctx->metaMutex);
+    }
+    n++;
+  }
+  pthread_mutex_unlock(&pf->mutex);
+  return n;
+}
+
+/** Start our prefetch threads
+ **
+ ** @param wctx       Our worker context
+ **
+ ** @param n_threads  Number of threads to start (IS_PREFETCH_THREADS,
+ **                   or 0 for a queue that nothing services as in
+ **                   isConvertTest)
+ */
+void isPrefetchInit(isWorkerContext_t *wctx, int n_threads) {
+  static const char *id = FILEID "isPrefetchInit";
+  isPrefetch_t *pf;
+  int err;
+  int i;
+
+  pf = calloc(1, sizeof(*pf));
+  if (pf == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  pthread_mutex_init(&pf->mutex, NULL);
+  pthread_cond_init(&pf->cond, NULL);
+  pf->running = 1;
+  wctx->prefetch = pf;
+
+  for (i=0; i<n_threads && i<IS_PREFETCH_THREADS; i++) {
+    err = pthread_create(&pf->threads[i], NULL, isPrefetchWorker, wctx);
+    if (err != 0) {
+      isLogging_err("%s: Could not start prefetch thread: %s\n", id, strerror(err));
+      break;
+    }
+    pf->n_threads++;
+  }
+}
+
+/** Stop our prefetch threads and throw away the queue
+ **
+ ** @param wctx  Our worker context
+ */
+void isPrefetchDestroy(isWorkerContext_t *wctx) {
+  isPrefetch_t *pf;
+  isPrefetchItem_t *item;
+  isPrefetchItem_t *next;
+  int i;
+
+  pf = wctx->prefetch;
+  if (pf == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&pf->mutex);
+  pf->running = 0;
+  pthread_cond_broadcast(&pf->cond);
+  pthread_mutex_unlock(&pf->mutex);
+
+  for (i=0; i<pf->n_threads; i++) {
+    pthread_join(pf->threads[i], NULL);
+  }
+
+  for (item=pf->head; item != NULL; item=next) {
+    next = item->next;
+    isPrefetchFreeItem(wctx, item);
+  }
+
+  for (i=0; i<IS_PREFETCH_TRACKERS; i++) {
+    free(pf->trackers[i].fn);
+  }
+
+  pthread_cond_destroy(&pf->cond);
+  pthread_mutex_destroy(&pf->mutex);
+  free(pf);
+  wctx->prefetch = NULL;
+}
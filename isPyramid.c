@@ -0,0 +1,263 @@
+/*! @file isPyramid.c
+ *  @copyright 2018 by Northwestern University All Rights Reserved
+ *  @author Keith Brister
+ *  @brief Max pooled, power of two reductions of raw images
+ *
+ *  Level 0 is the raw image itself.  Each pixel of level n is the
+ *  maximum of the corresponding 2x2 block of level n-1 with bad
+ *  pixels (from the raw image's mask) left out of level 1.
+ *  Since no level has any bad pixels after that, reducing a
+ *  pyramid level with maxBox gives very nearly what reducing the raw
+ *  image would have but only needs to look at a fraction of the
+ *  pixels.
+ *
+ *  Levels are built as they are needed, a band of rows per compute
+ *  pool thread, and hang off the raw image buffer until it leaves
+ *  the cache.
+ */
+#include "is.h"
+
+/** One band of rows of a pyramid level being built
+ */
+typedef struct isPyramidBandStruct {
+  isMask_t *mask;                       //!< Bad pixels of src (or NULL)
+  void *src;                            //!< Level below the one we are building
+  int srcWidth;                         //!< Width of src
+  int srcHeight;                        //!< Height of src
+  int depth;                            //!< Bytes per pixel of both levels
+  void *dst;                            //!< Level we are building
+  const int *colStart;                  //!< First source column of each destination column
+  const int *colEnd;                    //!< One past the last source column of each destination column
+  int row0;                             //!< First destination row of our band
+  int row1;                             //!< One past the last destination row of our band
+} isPyramidBand_t;
+
+/** Max pool one band of a level.  Called by isPoolRun.
+ **
+ ** Each source row is max pooled across in one call of the row kernel
+ ** (isMaxRow16 or isMaxRow32) with two pixel spans.
+ **
+ ** @param arg  Our array of bands
+ **
+ ** @param i    The band to build
+ */
+static void isPyramidPoolBand(void *arg, int i) {
+  static const char *id = FILEID "isPyramidPoolBand";
+  isPyramidBand_t *bp;
+  uint64_t *bits;
+  uint32_t *out;
+  int dstWidth;
+  int row, col;
+  int nsat;
+  int m;
+
+  bp       = (isPyramidBand_t *)arg + i;
+  dstWidth = (bp->srcWidth + 1) / 2;
+
+  out = malloc(dstWidth * sizeof(uint32_t));
+  if (out == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  nsat = 0;
+  for (row=bp->row0; row<bp->row1; row++) {
+    memset(out, 0, dstWidth * sizeof(uint32_t));
+    for (m=2*row; m<2*row+2 && m<bp->srcHeight; m++) {
+      // Rows without any bad pixels can skip the mask
+      bits = bp->mask && bp->mask->row_runs[m+1] > bp->mask->row_runs[m] ? bp->mask->bits + (size_t)m * bp->mask->words : NULL;
+      if (bp->depth == 2) {
+        isMaxRow16((uint16_t *)bp->src + (size_t)m * bp->srcWidth, bits, bp->colStart, bp->colEnd, dstWidth, out, &nsat);
+      } else {
+        isMaxRow32((uint32_t *)bp->src + (size_t)m * bp->srcWidth, bits, bp->colStart, bp->colEnd, dstWidth, out, &nsat);
+      }
+    }
+
+    if (bp->depth == 2) {
+      for (col=0; col<dstWidth; col++) {
+        ((uint16_t *)bp->dst)[(size_t)row * dstWidth + col] = out[col];
+      }
+    } else {
+      memcpy((uint32_t *)bp->dst + (size_t)row * dstWidth, out, dstWidth * sizeof(uint32_t));
+    }
+  }
+
+  free(out);
+}
+
+/** Max pool each 2x2 block of src into dst.  The rows are split into
+ ** bands that are built at the same time on the compute pool.
+ **
+ ** @param wctx       Our worker context
+ **
+ ** @param mask       Bad pixels of src (or NULL)
+ **
+ ** @param src        Source image
+ **
+ ** @param srcWidth   Source width
+ **
+ ** @param srcHeight  Source height
+ **
+ ** @param depth      Bytes per pixel (2 or 4)
+ **
+ ** @param dst        Destination image (ceil(srcWidth/2) by ceil(srcHeight/2))
+ */
+static void isPyramidPool(isWorkerContext_t *wctx, isMask_t *mask, void *src, int srcWidth, int srcHeight, int depth, void *dst) {
+  static const char *id = FILEID "isPyramidPool";
+  isPyramidBand_t *bands;
+  int *spans;
+  int dstWidth;
+  int dstHeight;
+  int n_bands;
+  int i;
+
+  dstWidth  = (srcWidth  + 1) / 2;
+  dstHeight = (srcHeight + 1) / 2;
+
+  n_bands = isPoolSize(wctx);
+  if (n_bands > dstHeight / IS_REDUCE_BAND_ROWS) {
+    n_bands = dstHeight / IS_REDUCE_BAND_ROWS;
+  }
+  n_bands = n_bands < 1 ? 1 : n_bands;
+
+  spans = malloc(2 * dstWidth * sizeof(int));
+  bands = calloc(n_bands, sizeof(*bands));
+  if (spans == NULL || bands == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  for (i=0; i<dstWidth; i++) {
+    spans[i]            = 2*i;
+    spans[dstWidth + i] = 2*i + 2 > srcWidth ? srcWidth : 2*i + 2;
+  }
+
+  for (i=0; i<n_bands; i++) {
+    bands[i].mask      = mask;
+    bands[i].src       = src;
+    bands[i].srcWidth  = srcWidth;
+    bands[i].srcHeight = srcHeight;
+    bands[i].depth     = depth;
+    bands[i].dst       = dst;
+    bands[i].colStart  = spans;
+    bands[i].colEnd    = spans + dstWidth;
+    bands[i].row0      = (int)((int64_t)dstHeight * i / n_bands);
+    bands[i].row1      = (int)((int64_t)dstHeight * (i+1) / n_bands);
+  }
+
+  isPoolRun(wctx, n_bands, isPyramidPoolBand, bands);
+
+  free(bands);
+  free(spans);
+}
+
+/** Pick the pyramid level to reduce from.  This is the smallest level
+ ** that still has at least 2x2 pixels for each one we are asked for.
+ ** Any smaller and reduceSpans would sample single pixels rather than
+ ** max pool boxes, skipping whole blocks (and any spots in them).
+ **
+ ** @param xa  Number of source pixels across that go into each destination pixel
+ **
+ ** @param ya  Number of source pixels down that go into each destination pixel
+ **
+ ** @returns the level
+ */
+int isPyramidChooseLevel(int xa, int ya) {
+  int level;
+  int a;
+
+  a = xa < ya ? xa : ya;
+  for (level=0; level < IS_PYRAMID_LEVELS && (4 << level) <= a; level++);
+  return level;
+}
+
+/** Get a view of one level of a raw image's pyramid, building it
+ ** (and the levels below it) if need be.
+ **
+ ** @param wctx   Our worker context
+ **
+ ** @param raw    Filled raw image buffer (we hold a reference)
+ **
+ ** @param level  The level we want (1 to IS_PYRAMID_LEVELS)
+ **
+ ** @param view   Filled with a buffer that can stand in for raw when
+ **               reducing.  Only buf, meta, and the dimensions are
+ **               set.  Do not release or destroy it.
+ */
+void isPyramidGetLevel(isWorkerContext_t *wctx, isImageBufType *raw, int level, isImageBufType *view) {
+  static const char *id = FILEID "isPyramidGetLevel";
+  void *src;
+  int srcWidth;
+  int srcHeight;
+  int built;
+  int i;
+
+  assert(level > 0 && level <= IS_PYRAMID_LEVELS);
+
+  built = 0;
+  pthread_mutex_lock(&raw->pyramid_mutex);
+  for (i=1; i<=level; i++) {
+    if (raw->pyramid[i] != NULL) {
+      continue;
+    }
+
+    if (i == 1) {
+      src       = raw->buf;
+      srcWidth  = raw->buf_width;
+      srcHeight = raw->buf_height;
+    } else {
+      src       = raw->pyramid[i-1];
+      srcWidth  = raw->pyramid_width[i-1];
+      srcHeight = raw->pyramid_height[i-1];
+    }
+
+    raw->pyramid_width[i]  = (srcWidth  + 1) / 2;
+    raw->pyramid_height[i] = (srcHeight + 1) / 2;
+    raw->pyramid[i] = malloc(raw->pyramid_width[i] * raw->pyramid_height[i] * raw->buf_depth);
+    if (raw->pyramid[i] == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+
+    if (raw->buf_depth != 2 && raw->buf_depth != 4) {
+      isLogging_err("%s: Unusable image depth %d\n", id, raw->buf_depth);
+      exit (-1);
+    }
+    isPyramidPool(wctx, i == 1 ? raw->mask : NULL, src, srcWidth, srcHeight, raw->buf_depth, raw->pyramid[i]);
+
+    raw->pyramid_bytes += raw->pyramid_width[i] * raw->pyramid_height[i] * raw->buf_depth;
+    built = 1;
+  }
+
+  memset(view, 0, sizeof(*view));
+  view->key        = raw->key;
+  view->meta       = raw->meta;
+  view->frame      = raw->frame;
+  view->buf        = raw->pyramid[level];
+  view->buf_width  = raw->pyramid_width[level];
+  view->buf_height = raw->pyramid_height[level];
+  view->buf_depth  = raw->buf_depth;
+  view->buf_size   = view->buf_width * view->buf_height * view->buf_depth;
+  pthread_mutex_unlock(&raw->pyramid_mutex);
+
+  if (built) {
+    // We just got bigger
+    isCacheAccount(wctx, raw);
+  }
+}
+
+/** Free the pyramid
+ **
+ ** Call when nobody else is using the buffer
+ */
+void isPyramidDestroy(isImageBufType *imb) {
+  int i;
+
+  for (i=1; i<=IS_PYRAMID_LEVELS; i++) {
+    if (imb->pyramid[i] != NULL) {
+      free(imb->pyramid[i]);
+      imb->pyramid[i] = NULL;
+    }
+  }
+  imb->pyramid_bytes = 0;
+}
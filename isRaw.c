@@ -0,0 +1,329 @@
+/*! @file isRaw.c
+ *  @copyright 2018 by Northwestern University All Rights Reserved
+ *  @author Keith Brister
+ *  @brief Send reduced images as pixels rather than jpegs
+ *
+ *  A "raw" job gets the very same reduced image a "jpeg" (or, with a
+ *  level, a "tile") job would but sends the 16 or 32 bit pixels
+ *  themselves.  The meta data carries the histogram and statistics
+ *  so a client can do its own contrast and color maps: moving a
+ *  contrast slider then costs us nothing at all.
+ *
+ *  The pixels are little endian, row by row.  When asked they are
+ *  delta encoded (each pixel replaced by its difference, modulo 2^16
+ *  or 2^32, from the pixel to its left; the first pixel of each row is
+ *  left alone) which makes the mostly flat background compress much
+ *  better.  They are then LZ4 compressed (LZ4_compress_default block
+ *  format) unless asked not to be.  The job we send back says what
+ *  was done.
+ */
+#include "is.h"
+#include <lz4.h>
+
+/** Delta encode each row of an image in place
+ **
+ ** @param imb  The image
+ **
+ ** @param buf  Copy of the image's pixels
+ */
+static void isRawDelta(isImageBufType *imb, void *buf) {
+  uint16_t *p16;
+  uint32_t *p32;
+  int row;
+  int col;
+
+  for (row=0; row<imb->buf_height; row++) {
+    if (imb->buf_depth == 2) {
+      p16 = (uint16_t *)buf + (size_t)row * imb->buf_width;
+      for (col=imb->buf_width-1; col>0; col--) {
+        p16[col] -= p16[col-1];
+      }
+    } else {
+      p32 = (uint32_t *)buf + (size_t)row * imb->buf_width;
+      for (col=imb->buf_width-1; col>0; col--) {
+        p32[col] -= p32[col-1];
+      }
+    }
+  }
+}
+
+/** Delta encode and/or LZ4 compress a copy of an image's pixels as
+ ** a raw job asks.  Used by isRaw and isConvertTest.
+ **
+ ** @param imb      The image (its pixels are left alone)
+ **
+ ** @param delta    Delta encode the rows
+ **
+ ** @param use_lz4  LZ4 compress the result
+ **
+ ** @param lenp     Set to the length of what we return
+ **
+ ** @returns the encoded pixels (give them back with isBufPut or
+ ** isBufZmqFree) or NULL if the compression failed
+ */
+char *isRawEncode(isImageBufType *imb, int delta, int use_lz4, int *lenp) {
+  char *buf;
+  char *src;
+  char *rtn;
+  int len;
+
+  //
+  // The cached buffer is shared: delta encode a copy
+  //
+  src = imb->buf;
+  buf = NULL;
+  if (delta || !use_lz4) {
+    buf = isBufGet(imb->buf_size);
+    memcpy(buf, imb->buf, imb->buf_size);
+    if (delta) {
+      isRawDelta(imb, buf);
+    }
+    src = buf;
+  }
+
+  if (!use_lz4) {
+    *lenp = imb->buf_size;
+    return buf;
+  }
+
+  rtn = isBufGet(LZ4_compressBound(imb->buf_size));
+  len = LZ4_compress_default(src, rtn, imb->buf_size, LZ4_compressBound(imb->buf_size));
+  isBufPut(buf);
+  if (len <= 0) {
+    isBufPut(rtn);
+    return NULL;
+  }
+  *lenp = len;
+  return rtn;
+}
+
+/** A cached image whose pixels zmq is sending
+ */
+typedef struct isRawRefStruct {
+  isWorkerContext_t *wctx;              //!< Our worker context
+  isImageBufType *imb;                  //!< The image (we hold a reference)
+} isRawRef_t;
+
+/** zmq is done with an image's pixels: release the image
+ **
+ ** @param data  The pixels
+ **
+ ** @param hint  Our isRawRef_t
+ */
+static void isRawRefFree(void *data, void *hint) {
+  isRawRef_t *ref;
+
+  ref = hint;
+  isReleaseImageBuf(ref->wctx, ref->imb);
+  free(ref);
+}
+
+/** Send 4 messages to our zmq image server client: an empty error
+ ** message, the job, the meta data, and the pixels.
+ **
+ ** @param wctx      Worker context
+ **
+ ** @param tcp       Thread data
+ **
+ ** @param job       The job we are responding to
+ **
+ ** @param meta      The reduced image's meta data
+ **
+ ** @param data      The pixels
+ **
+ ** @param data_len  Length of data
+ **
+ ** @param ffn       Gives data back once zmq is done with it (isBufZmqFree for buffers from isBufGet)
+ **
+ ** @param hint      Passed to ffn
+ */
+static void isRawSend(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job, json_t *meta, void *data, int data_len, zmq_free_fn *ffn, void *hint) {
+  static const char *id = FILEID "isRawSend";
+  char *job_str;
+  char *meta_str;
+  zmq_msg_t err_msg;
+  zmq_msg_t job_msg;
+  zmq_msg_t meta_msg;
+  zmq_msg_t data_msg;
+  int err;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  job_str  = json_dumps(job,  JSON_SORT_KEYS | JSON_INDENT(0) | JSON_COMPACT);
+  meta_str = json_dumps(meta, JSON_SORT_KEYS | JSON_INDENT(0) | JSON_COMPACT);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  job_str  = job_str  == NULL ? strdup("") : job_str;
+  meta_str = meta_str == NULL ? strdup("") : meta_str;
+  if (job_str == NULL || meta_str == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  zmq_msg_init(&err_msg);
+
+  err = zmq_msg_init_data(&job_msg, job_str, strlen(job_str), is_zmq_free_fn, NULL);
+  if (err == -1) {
+    isLogging_err("%s: zmq_msg_init failed (job_str): %s\n", id, zmq_strerror(errno));
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (job_str)", id);
+    pthread_exit (NULL);
+  }
+
+  err = zmq_msg_init_data(&meta_msg, meta_str, strlen(meta_str), is_zmq_free_fn, NULL);
+  if (err == -1) {
+    isLogging_err("%s: zmq_msg_init failed (meta_str): %s\n", id, zmq_strerror(errno));
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (meta_str)", id);
+    pthread_exit (NULL);
+  }
+
+  err = zmq_msg_init_data(&data_msg, data, data_len, ffn, hint);
+  if (err == -1) {
+    isLogging_err("%s: zmq_msg_init failed (data): %s\n", id, zmq_strerror(errno));
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: Could not initialize reply message (data)", id);
+    pthread_exit (NULL);
+  }
+
+  do {
+    err = zmq_msg_send(&err_msg, tcp->rep, ZMQ_SNDMORE);
+    if (err == -1) {
+      isLogging_err("%s: Could not send empty error frame: %s\n", id, zmq_strerror(errno));
+      break;
+    }
+
+    err = zmq_msg_send(&job_msg, tcp->rep, ZMQ_SNDMORE);
+    if (err == -1) {
+      isLogging_err("%s: sending job_str failed: %s\n", id, zmq_strerror(errno));
+      break;
+    }
+
+    err = zmq_msg_send(&meta_msg, tcp->rep, ZMQ_SNDMORE);
+    if (err == -1) {
+      isLogging_err("%s: sending meta_str failed: %s\n", id, zmq_strerror(errno));
+      break;
+    }
+
+    err = zmq_msg_send(&data_msg, tcp->rep, 0);
+    if (err == -1) {
+      isLogging_err("%s: sending data failed: %s\n", id, zmq_strerror(errno));
+      break;
+    }
+  } while (0);
+  //
+  // Parts we did not get to send still hold the job and meta strings
+  // and the pixels (or our reference to the cached image).  zmq
+  // leaves a sent message empty so closing it does nothing.
+  //
+  zmq_msg_close(&err_msg);
+  zmq_msg_close(&job_msg);
+  zmq_msg_close(&meta_msg);
+  zmq_msg_close(&data_msg);
+}
+
+/** Send the pixels of a reduced image
+ **
+ ** @param wctx Worker context
+ **  @li @c wctx->shards  Our image buffer cache
+ **
+ ** @param tcp Thread data
+ **   @li @c tcp->rep  ZMQ Response socket into which the throw our response.
+ **
+ ** @param job             {Object}     - Description of what is requested.  The image is picked just as for a "jpeg" job (fn, frame, reduce, segcol, segrow, xsize, zoom) or, when level is given, a "tile" job (fn, frame, level, reduce, tx, ty).
+ ** @param job.compress    {String}     - "lz4" (default) or "none"
+ ** @param job.delta       {Boolean}    - Delta encode the rows before compressing (default true)
+ ** @param job.tag         {String}     - ID for us to know what to do with the result
+ ** @param job.type        {String}     - "RAW"
+ **
+ ** We add the following to the job we send back
+ **   @li @c job->width        Image width
+ **   @li @c job->height       Image height
+ **   @li @c job->depth        Bytes per pixel (2 or 4)
+ **   @li @c job->delta        True if the rows are delta encoded
+ **   @li @c job->compression  "lz4" or "none"
+ **   @li @c job->raw_bytes    Size of the pixels before compression
+ */
+void isRaw(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
+  static const char *id = FILEID "isRaw";
+  isImageBufType *imb;
+  isRawRef_t *ref;
+  const char *compress;
+  json_t *delta_obj;
+  json_t *meta;
+  char *tmps;
+  char *data;
+  int data_len;
+  int use_lz4;
+  int delta;
+  int tile;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  tile      = json_object_get(job, "level") != NULL;
+  compress  = json_string_value(json_object_get(job, "compress"));
+  delta_obj = json_object_get(job, "delta");
+  delta     = delta_obj == NULL || json_is_true(delta_obj);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  use_lz4 = compress == NULL || strcasecmp(compress, "none") != 0;
+
+  // when isTileImage or isReduceImage returns a buffer it is filled and ours to release
+  imb = tile ? isTileImage(wctx, tcp->rc, job) : isReduceImage(wctx, tcp->rc, job);
+  if (imb == NULL) {
+    pthread_mutex_lock(&wctx->metaMutex);
+    tmps = json_dumps(job, JSON_SORT_KEYS | JSON_COMPACT | JSON_INDENT(0));
+    pthread_mutex_unlock(&wctx->metaMutex);
+
+    isLogging_err("%s: missing data for job %s\n", id, tmps);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: missing data for job %s", id, tmps);
+    free(tmps);
+    return;
+  }
+
+  if (!tile) {
+    // Get started on the frames they'll want next
+    isPrefetchNote(wctx, job, imb->meta);
+  }
+
+  ref = NULL;
+  if (!delta && !use_lz4) {
+    //
+    // Send the cached pixels themselves.  We keep our reference to
+    // the image until zmq is done with them (see isRawRefFree).
+    //
+    ref = malloc(sizeof(*ref));
+    if (ref == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+    ref->wctx = wctx;
+    ref->imb  = imb;
+    data      = imb->buf;
+    data_len  = imb->buf_size;
+  } else {
+    data = isRawEncode(imb, delta, use_lz4, &data_len);
+    if (data == NULL) {
+      isLogging_err("%s: LZ4 compression failed\n", id);
+      isReleaseImageBuf(wctx, imb);
+      is_zmq_error_reply(NULL, 0, tcp->rep, "%s: compression error", id);
+      return;
+    }
+  }
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  set_json_object_integer(id, job, "width",     imb->buf_width);
+  set_json_object_integer(id, job, "height",    imb->buf_height);
+  set_json_object_integer(id, job, "depth",     imb->buf_depth);
+  set_json_object_integer(id, job, "raw_bytes", imb->buf_size);
+  json_object_set_new(job, "delta", delta ? json_true() : json_false());
+  set_json_object_string(id, job, "compression", "%s", use_lz4 ? "lz4" : "none");
+  meta = json_incref(imb->meta);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (ref == NULL) {
+    isReleaseImageBuf(wctx, imb);
+    isRawSend(wctx, tcp, job, meta, data, data_len, isBufZmqFree, NULL);
+  } else {
+    isRawSend(wctx, tcp, job, meta, data, data_len, isRawRefFree, ref);
+  }
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  json_decref(meta);
+  pthread_mutex_unlock(&wctx->metaMutex);
+}
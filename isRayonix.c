@@ -440,7 +440,7 @@ int isRayonixGetData( isWorkerContext_t *wctx, const char *fn, isImageBufType **
   int i;
   struct sigaction signew;
   struct sigaction sigold;
-  jmp_buf jmpenv;
+  static __thread jmp_buf jmpenv;       // static so sigbusHandler needs no trampoline (and an executable stack)
   unsigned int inHeight;
   unsigned int inWidth;
   unsigned short *buf;
@@ -507,3 +507,72 @@ int isRayonixGetData( isWorkerContext_t *wctx, const char *fn, isImageBufType **
   imb->buf = buf;
   return 0;
 }
+
+/** Read some rows of a Rayonix image (an isRowReader_t read)
+ */
+static int isRayonixReadRows(isRowReader_t *rr, int row0, int row1, void *buf) {
+  static const char *id = FILEID "isRayonixReadRows";
+  int i;
+
+  // Scan lines have to be read in order: we're only ever asked to read forward
+  for (i=row0; i<row1; i++) {
+    if (TIFFReadScanline(rr->state, (uint16_t *)buf + (size_t)(i - row0) * rr->width, i, 0) < 0) {
+      isLogging_err("%s: Could not read scan line %d\n", id, i);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Done reading a Rayonix image (an isRowReader_t close)
+ */
+static void isRayonixCloseRows(isRowReader_t *rr) {
+  if (rr->state != NULL) {
+    TIFFClose(rr->state);
+    rr->state = NULL;
+  }
+}
+
+/** Get ready to read the named file a few scan lines at a time rather
+ ** than all at once (see isOpenRawRows).
+ **
+ ** @param wctx  Our worker context
+ **
+ ** @param fn    The file
+ **
+ ** @param imb   Frame buffer (with meta).  We set the dimensions but not buf.
+ **
+ ** @param rr    The reader for the image's rows
+ **
+ ** @returns 0 on success
+ */
+int isRayonixOpenRows(isWorkerContext_t *wctx, const char *fn, isImageBufType *imb, isRowReader_t *rr) {
+  static const char *id = FILEID "isRayonixOpenRows";
+  TIFF *tf;
+  unsigned int inHeight;
+  unsigned int inWidth;
+
+  TIFFSetErrorHandler(is_tiff_error_handler);
+  TIFFSetWarningHandler(NULL);   // surpress annoying warning messages
+  tf = TIFFOpen( fn, "r");
+  if( tf == NULL) {
+    isLogging_err("%s: failed to open file '%s'\n", id, fn);
+    return -1;
+  }
+  TIFFGetField( tf, TIFFTAG_IMAGELENGTH,   &inHeight);
+  TIFFGetField( tf, TIFFTAG_IMAGEWIDTH,    &inWidth);
+
+  imb->buf_width  = inWidth;
+  imb->buf_height = inHeight;
+  imb->buf_depth  = 2;
+
+  memset(rr, 0, sizeof(*rr));
+  rr->width  = inWidth;
+  rr->height = inHeight;
+  rr->depth  = 2;
+  rr->read   = isRayonixReadRows;
+  rr->close  = isRayonixCloseRows;
+  rr->state  = tf;
+
+  return 0;
+}
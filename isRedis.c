@@ -0,0 +1,479 @@
+/*! @file isRedis.c
+ *  @copyright 2018 by Northwestern University All Rights Reserved
+ *  @author Keith Brister
+ *  @brief Second level cache of reduced image buffers in redis
+ *
+ *  Reduced buffers are stored LZ4 compressed in the redis hash named
+ *  by the buffer key:
+ *
+ *  @li @c META   json meta data
+ *  @li @c WIDTH  width of the buffer in pixels
+ *  @li @c HEIGHT height of the buffer in pixels
+ *  @li @c DEPTH  bytes per pixel
+ *  @li @c SIZE   uncompressed size of the buffer in bytes
+ *  @li @c DATA   LZ4 compressed pixels
+ *
+ *  Only one thread at a time reduces a given image.  That thread
+ *  holds the lease <key>-LEASE, whose value is the thread's token
+ *  (see isRedisToken) and which expires on its own after
+ *  IS_REDIS_LEASE_MS milliseconds should the process die.  The lease
+ *  is only ever deleted by its owner: should ours expire during a
+ *  slow reduction and someone else take it we leave theirs alone.
+ *  Everyone else increments <key>-WAITERS once and waits on the list
+ *  <key>-READY, decrementing the count when they stop waiting.  When
+ *  the buffer is written (or the producer gives up) a single LPUSH
+ *  with one token per waiter wakes them all up.  Waits are done in
+ *  slices of IS_REDIS_WAIT_SECONDS so that a lost token or an expired
+ *  lease costs us at most that long.  After IS_REDIS_MAX_WAIT_SECONDS
+ *  we stop waiting and do the work ourselves.
+ *
+ *  Redis is only a second level cache.  When it fails we log it,
+ *  reconnect, and carry on as though the buffer were not there (and
+ *  nobody had the lease): our caller reads the file itself.
+ */
+#include "is.h"
+#include <lz4.h>
+#include <sys/syscall.h>
+
+//! Delete a lease but only if it is still ours
+static const char *isRedisReleaseScript =
+  "if redis.call('get',KEYS[1])==ARGV[1] then return redis.call('del',KEYS[1]) end return 0";
+
+//! This thread's lease token
+static __thread char isRedisTokenBuf[128];
+
+/** The value we put in the leases we take.  Every thread of every
+ ** supervisor on every host gets its own.
+ */
+static const char *isRedisToken() {
+  char host[64];
+
+  if (isRedisTokenBuf[0] == 0) {
+    if (gethostname(host, sizeof(host)) != 0) {
+      strcpy(host, "localhost");
+    }
+    host[sizeof(host)-1] = 0;
+    snprintf(isRedisTokenBuf, sizeof(isRedisTokenBuf)-1, "%s:%d:%ld", host, getpid(), (long)syscall(SYS_gettid));
+    isRedisTokenBuf[sizeof(isRedisTokenBuf)-1] = 0;
+  }
+  return isRedisTokenBuf;
+}
+
+/** Get the next n pipelined replies
+ **
+ ** @param rc    Our thread's redis connection
+ **
+ ** @param what  What we were doing (for the log)
+ **
+ ** @param rrs   The replies (free them when done)
+ **
+ ** @param n     Number of replies we are waiting for
+ **
+ ** @returns 0 on success.  On failure we log it, free whatever
+ ** replies we got, reconnect (so the pipeline starts over empty), and
+ ** return -1.
+ */
+static int isRedisReplies(redisContext *rc, const char *what, redisReply **rrs, int n) {
+  static const char *id = FILEID "isRedisReplies";
+  int err;
+  int i;
+
+  for (i=0; i<n; i++) {
+    rrs[i] = NULL;
+    err = redisGetReply(rc, (void **)&rrs[i]);
+    if (err != REDIS_OK || rrs[i] == NULL) {
+      isLogging_err("%s: Redis failure (%s): %s\n", id, what, rc->errstr);
+      while (i-- > 0) {
+        freeReplyObject(rrs[i]);
+        rrs[i] = NULL;
+      }
+      if (redisReconnect(rc) != REDIS_OK) {
+        isLogging_err("%s: Could not reconnect to redis: %s\n", id, rc->errstr);
+      }
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Get and throw away the next n pipelined replies
+ **
+ ** @returns 0 on success, -1 on failure (see isRedisReplies)
+ */
+static int isRedisDiscard(redisContext *rc, const char *what, int n) {
+  redisReply *rrs[4];
+  int i;
+
+  if (isRedisReplies(rc, what, rrs, n) != 0) {
+    return -1;
+  }
+  for (i=0; i<n; i++) {
+    freeReplyObject(rrs[i]);
+  }
+  return 0;
+}
+
+//! The fields of a buffer's hash in the order isRedisEncode and isRedisDecode use
+static const char *isRedisFields[IS_REDIS_N_FIELDS] = {"META", "WIDTH", "HEIGHT", "DEPTH", "SIZE", "DATA"};
+
+/** Make the values of a buffer's hash fields (META, WIDTH, HEIGHT,
+ ** DEPTH, SIZE, and DATA in that order)
+ **
+ ** @param wctx  Our worker context
+ **
+ ** @param imb   A filled buffer
+ **
+ ** @param vals  Set to the IS_REDIS_N_FIELDS values (free each of them)
+ **
+ ** @param lens  Set to the lengths of the values
+ **
+ ** @returns 0 on success, -1 if the pixels could not be compressed (nothing to free)
+ */
+int isRedisEncode(isWorkerContext_t *wctx, isImageBufType *imb, char **vals, size_t *lens) {
+  static const char *id = FILEID "isRedisEncode";
+  int data_size;
+  int i;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  vals[0] = json_dumps(imb->meta, JSON_COMPACT | JSON_INDENT(0) | JSON_SORT_KEYS);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  vals[5] = malloc(LZ4_compressBound(imb->buf_size));
+  if (vals[0] == NULL || vals[5] == NULL ||
+      asprintf(&vals[1], "%d", imb->buf_width) < 0 ||
+      asprintf(&vals[2], "%d", imb->buf_height) < 0 ||
+      asprintf(&vals[3], "%d", imb->buf_depth) < 0 ||
+      asprintf(&vals[4], "%d", imb->buf_size) < 0) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  data_size = LZ4_compress_default(imb->buf, vals[5], imb->buf_size, LZ4_compressBound(imb->buf_size));
+  if (data_size <= 0) {
+    isLogging_err("%s: Could not compress %s\n", id, imb->key);
+    for (i=0; i<IS_REDIS_N_FIELDS; i++) {
+      free(vals[i]);
+    }
+    return -1;
+  }
+
+  for (i=0; i<IS_REDIS_N_FIELDS-1; i++) {
+    lens[i] = strlen(vals[i]);
+  }
+  lens[5] = data_size;
+
+  return 0;
+}
+
+/** Fill imb from the values of its hash fields (as made by isRedisEncode)
+ **
+ ** @param wctx  Our worker context
+ **
+ ** @param imb   Empty buffer
+ **
+ ** @param vals  The IS_REDIS_N_FIELDS values
+ **
+ ** @param lens  Their lengths
+ **
+ ** @returns 0 on success, -1 if the values do not hold a buffer
+ */
+int isRedisDecode(isWorkerContext_t *wctx, isImageBufType *imb, char **vals, size_t *lens) {
+  static const char *id = FILEID "isRedisDecode";
+  json_error_t jerr;
+  int width;
+  int height;
+  int depth;
+  int size;
+  int n;
+  char *buf;
+
+  width  = atoi(vals[1]);
+  height = atoi(vals[2]);
+  depth  = atoi(vals[3]);
+  size   = atoi(vals[4]);
+
+  if (width <= 0 || height <= 0 || (depth != 2 && depth != 4) || size != width * height * depth) {
+    isLogging_err("%s: Bad buffer %s.  Width: %d  Height: %d  Depth: %d  Size: %d\n", id, imb->key, width, height, depth, size);
+    return -1;
+  }
+
+  buf = malloc(size);
+  if (buf == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  n = LZ4_decompress_safe(vals[5], buf, lens[5], size);
+  if (n != size) {
+    isLogging_err("%s: Could not decompress %s (%d of %d bytes)\n", id, imb->key, n, size);
+    free(buf);
+    return -1;
+  }
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  imb->meta = json_loadb(vals[0], lens[0], 0, &jerr);
+  pthread_mutex_unlock(&wctx->metaMutex);
+  if (imb->meta == NULL) {
+    isLogging_err("%s: Bad meta data for %s: %s\n", id, imb->key, jerr.text);
+    free(buf);
+    return -1;
+  }
+
+  imb->buf           = buf;
+  imb->buf_size      = size;
+  imb->buf_width     = width;
+  imb->buf_height    = height;
+  imb->buf_depth     = depth;
+  imb->mask          = NULL;
+
+  return 0;
+}
+
+/** Fill imb from a HMGET reply
+ **
+ ** @returns 0 on success, -1 if the reply does not hold a buffer
+ */
+static int isRedisDecodeReply(isWorkerContext_t *wctx, isImageBufType *imb, redisReply *rr) {
+  char *vals[IS_REDIS_N_FIELDS];
+  size_t lens[IS_REDIS_N_FIELDS];
+  int i;
+
+  if (rr->type != REDIS_REPLY_ARRAY || rr->elements != IS_REDIS_N_FIELDS) {
+    return -1;
+  }
+
+  for (i=0; i<IS_REDIS_N_FIELDS; i++) {
+    if (rr->element[i]->type != REDIS_REPLY_STRING) {
+      return -1;
+    }
+    vals[i] = rr->element[i]->str;
+    lens[i] = rr->element[i]->len;
+  }
+
+  return isRedisDecode(wctx, imb, vals, lens);
+}
+
+/** Look for a reduced buffer in redis.  If nobody is working on it
+ ** we take the lease and leave it to our caller to fill the buffer
+ ** (and then call isRedisPut or isRedisAbandon).  Otherwise we wait
+ ** (a bounded time) for whoever has the lease to finish.
+ **
+ ** @param wctx  Our worker context
+ **
+ ** @param rc    Our thread's redis connection
+ **
+ ** @param imb   Write locked, empty buffer
+ **
+ ** @returns 0 when imb has been filled, -1 when the caller needs to fill it
+ */
+int isRedisGet(isWorkerContext_t *wctx, redisContext *rc, isImageBufType *imb) {
+  static const char *id = FILEID "isRedisGet";
+  redisReply *rrs[2];
+  struct timespec start;
+  struct timespec now;
+  int waiting;
+  int waited;
+  int rtn;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  imb->redis_lease = 0;
+  waiting = 0;
+  rtn     = -1;
+
+  if (rc == NULL) {
+    return -1;
+  }
+
+  while (1) {
+    //
+    // Look for the data and try for the lease in one round trip
+    //
+    redisAppendCommand(rc, "HMGET %s META WIDTH HEIGHT DEPTH SIZE DATA", imb->key);
+    redisAppendCommand(rc, "SET %s-LEASE %s NX PX %d", imb->key, isRedisToken(), IS_REDIS_LEASE_MS);
+    if (isRedisReplies(rc, "hmget", rrs, 2) != 0) {
+      break;
+    }
+
+    imb->redis_lease = rrs[1]->type == REDIS_REPLY_STATUS;
+    freeReplyObject(rrs[1]);
+
+    if (isRedisDecodeReply(wctx, imb, rrs[0]) == 0) {
+      freeReplyObject(rrs[0]);
+      //
+      // Keep popular buffers around a while longer.  Give back the
+      // lease if we happened to get it.
+      //
+      redisAppendCommand(rc, "EXPIRE %s %d", imb->key, IS_REDIS_TTL);
+      if (imb->redis_lease) {
+        redisAppendCommand(rc, "EVAL %s 1 %s-LEASE %s", isRedisReleaseScript, imb->key, isRedisToken());
+      }
+      isRedisDiscard(rc, "expire", imb->redis_lease ? 2 : 1);
+      imb->redis_lease = 0;
+      rtn = 0;
+      break;
+    }
+    freeReplyObject(rrs[0]);
+
+    if (imb->redis_lease) {
+      // Our turn to do the work
+      break;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    waited = now.tv_sec - start.tv_sec;
+    if (waited >= IS_REDIS_MAX_WAIT_SECONDS) {
+      isLogging_err("%s: Gave up waiting for %s after %d seconds\n", id, imb->key, waited);
+      break;
+    }
+
+    //
+    // Someone else is working on it.  Wait for them to tell us it's
+    // ready (or that they failed).  Either way we'll go round again
+    // to get the data or the lease.  We are counted as a waiter just
+    // once however many rounds it takes.
+    //
+    if (!waiting) {
+      redisAppendCommand(rc, "INCR %s-WAITERS", imb->key);
+    }
+    redisAppendCommand(rc, "PEXPIRE %s-WAITERS %d", imb->key, IS_REDIS_LEASE_MS + IS_REDIS_MAX_WAIT_SECONDS * 1000);
+    redisAppendCommand(rc, "BLPOP %s-READY %d", imb->key, IS_REDIS_WAIT_SECONDS);
+    if (isRedisDiscard(rc, "blpop", waiting ? 2 : 3) != 0) {
+      // The count went with the connection (or never went up)
+      waiting = 0;
+      break;
+    }
+    waiting = 1;
+  }
+
+  if (waiting) {
+    redisAppendCommand(rc, "DECR %s-WAITERS", imb->key);
+    isRedisDiscard(rc, "decr waiters", 1);
+  }
+
+  return rtn;
+}
+
+/** Give back our lease and wake up everyone waiting on key
+ **
+ ** One GET to learn the number of waiters followed by a single
+ ** pipeline that releases the lease (if it is still ours) and does
+ ** one LPUSH with a token for each waiter.  Waiters who come along in
+ ** between miss out on the token but will notice within
+ ** IS_REDIS_WAIT_SECONDS.
+ */
+static void isRedisNotify(redisContext *rc, const char *key, const char *token) {
+  static const char *id = FILEID "isRedisNotify";
+  redisReply *rr;
+  const char **argv;
+  size_t *argvlen;
+  char *list;
+  int n;
+  int i;
+
+  redisAppendCommand(rc, "GET %s-WAITERS", key);
+  if (isRedisReplies(rc, "get waiters", &rr, 1) != 0) {
+    return;
+  }
+  n = rr->type == REDIS_REPLY_STRING ? atoi(rr->str) : 0;
+  freeReplyObject(rr);
+
+  redisAppendCommand(rc, "EVAL %s 1 %s-LEASE %s", isRedisReleaseScript, key, isRedisToken());
+
+  if (n > 0) {
+    argv    = calloc(n + 2, sizeof(*argv));
+    argvlen = calloc(n + 2, sizeof(*argvlen));
+    list    = malloc(strlen(key) + sizeof("-READY"));
+    if (argv == NULL || argvlen == NULL || list == NULL) {
+      isLogging_crit("%s: Out of memory\n", id);
+      exit (-1);
+    }
+    sprintf(list, "%s-READY", key);
+
+    argv[0] = "LPUSH";
+    argv[1] = list;
+    for (i=2; i<n+2; i++) {
+      argv[i] = token;
+    }
+    for (i=0; i<n+2; i++) {
+      argvlen[i] = strlen(argv[i]);
+    }
+    redisAppendCommandArgv(rc, n+2, argv, argvlen);
+    redisAppendCommand(rc, "EXPIRE %s %d", list, IS_REDIS_WAIT_SECONDS + 1);
+
+    free(argv);
+    free(argvlen);
+    free(list);
+  }
+
+  isRedisDiscard(rc, "release lease", n > 0 ? 3 : 1);
+}
+
+/** Store a freshly reduced buffer in redis and wake up anyone waiting
+ ** for it.  Does nothing unless we hold the lease from isRedisGet.
+ **
+ ** @param wctx  Our worker context
+ **
+ ** @param rc    Our thread's redis connection
+ **
+ ** @param imb   Write locked buffer that we just filled
+ */
+void isRedisPut(isWorkerContext_t *wctx, redisContext *rc, isImageBufType *imb) {
+  const char *argv[2 + 2*IS_REDIS_N_FIELDS];
+  size_t argvlen[2 + 2*IS_REDIS_N_FIELDS];
+  char *vals[IS_REDIS_N_FIELDS];
+  size_t lens[IS_REDIS_N_FIELDS];
+  int i;
+
+  if (!imb->redis_lease) {
+    return;
+  }
+  imb->redis_lease = 0;
+
+  if (isRedisEncode(wctx, imb, vals, lens) != 0) {
+    isRedisNotify(rc, imb->key, "error");
+    return;
+  }
+
+  //
+  // HSET key META meta WIDTH width ...
+  //
+  argv[0]    = "HSET";
+  argvlen[0] = 4;
+  argv[1]    = imb->key;
+  argvlen[1] = strlen(imb->key);
+  for (i=0; i<IS_REDIS_N_FIELDS; i++) {
+    argv[2 + 2*i]    = isRedisFields[i];
+    argvlen[2 + 2*i] = strlen(isRedisFields[i]);
+    argv[3 + 2*i]    = vals[i];
+    argvlen[3 + 2*i] = lens[i];
+  }
+  redisAppendCommandArgv(rc, 2 + 2*IS_REDIS_N_FIELDS, argv, argvlen);
+  redisAppendCommand(rc, "EXPIRE %s %d", imb->key, IS_REDIS_TTL);
+
+  for (i=0; i<IS_REDIS_N_FIELDS; i++) {
+    free(vals[i]);
+  }
+
+  if (isRedisDiscard(rc, "hset", 2) != 0) {
+    // Let the waiters know on the new connection
+    isRedisNotify(rc, imb->key, "error");
+    return;
+  }
+
+  isRedisNotify(rc, imb->key, "ok");
+}
+
+/** We took the lease but could not fill the buffer.  Let the waiters
+ ** know so one of them can have a go.
+ */
+void isRedisAbandon(isWorkerContext_t *wctx, redisContext *rc, isImageBufType *imb) {
+  (void)wctx;
+
+  if (!imb->redis_lease) {
+    return;
+  }
+  imb->redis_lease = 0;
+
+  isRedisNotify(rc, imb->key, "error");
+}
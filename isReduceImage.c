@@ -94,7 +94,7 @@ void set_up_bins(isImageBufType *src, isImageBufType *dst, double winWidth, doub
   // the size of the bins array is OUTPUT_IMAGE_BINS + 1 with
   // bins[OUTPUT_IMAGE_BINS] reserved for ice ring statistics.  This
   // may be a bit of kludge but it keeps all this ice calculation
-  // stuff in get_bin_number.
+  // stuff in bin_from_dist2.
   //
 
   for (i=0; i<=IS_OUTPUT_IMAGE_BINS; i++) {
@@ -118,14 +118,19 @@ void set_up_bins(isImageBufType *src, isImageBufType *dst, double winWidth, doub
   }
 }
 
-int get_bin_number( isImageBufType *dst, int col, int row) {
+/** Bin of a pixel given its squared distance from the beam center
+ **
+ ** @param dst    Reduced image with its bins set up
+ **
+ ** @param scale  IS_OUTPUT_IMAGE_BINS / (dst->max_dist2 - dst->min_dist2)
+ **
+ ** @param dist2  Squared distance of the pixel from dst's beam center
+ */
+static inline int bin_from_dist2(isImageBufType *dst, double scale, double dist2) {
   ice_ring_list_t *irp;
   int rtn;
-  double dist2;
 
-  dist2 = ( col - dst->beam_center_x) * (col - dst->beam_center_x) + (row - dst->beam_center_y) * (row - dst->beam_center_y);
-  
-  rtn = (double)(IS_OUTPUT_IMAGE_BINS) / (dst->max_dist2 - dst->min_dist2) * (dist2 - dst->min_dist2);
+  rtn = scale * (dist2 - dst->min_dist2);
   
   if (rtn < 0) {
     rtn = 0;
@@ -145,34 +150,387 @@ int get_bin_number( isImageBufType *dst, int col, int row) {
   return rtn;
 }
 
+/** The bin of every pixel of a reduced image.  All the frames of a
+ ** data set (and all the users looking at them) share a detector
+ ** geometry so these are kept in a small cache rather than being
+ ** worked out for each reduction.
+ **
+ ** Bin IS_OUTPUT_IMAGE_BINS flags pixels on an ice ring.  The ice
+ ** rings come from set_up_bins (which doesn't set any yet): should it
+ ** start to, the rings will need to be part of the key.
+ */
+struct isGeometryStruct {
+  struct isGeometryStruct *next;        //!< Next (less recently used) geometry in the cache
+  double beam_center_x;                 //!< Beam center on the source image
+  double beam_center_y;                 //!< Beam center on the source image
+  int x;                                //!< Left edge of the source window
+  int y;                                //!< Top of the source window
+  int winWidth;                         //!< Width of the source window
+  int winHeight;                        //!< Height of the source window
+  int dstWidth;                         //!< Width of the reduced image
+  int dstHeight;                        //!< Height of the reduced image
+  int refs;                             //!< Number of reductions using us (protect with geometryMutex)
+  uint8_t *bins;                        //!< Bin of each reduced pixel
+};
+
+/** Make the bin table for a reduced image
+ **
+ ** @param dst  Reduced image with its bins set up
+ **
+ ** @param g    Geometry to fill in
+ */
+static void isGeometryFill(isImageBufType *dst, isGeometry_t *g) {
+  static const char *id = FILEID "isGeometryFill";
+  double *dx2;
+  double dy2;
+  double scale;
+  int row, col;
+
+  g->bins = malloc((size_t)g->dstWidth * g->dstHeight);
+  dx2 = malloc(g->dstWidth * sizeof(double));
+  if (g->bins == NULL || dx2 == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  for (col=0; col<g->dstWidth; col++) {
+    dx2[col] = (col - dst->beam_center_x) * (col - dst->beam_center_x);
+  }
+  scale = (double)(IS_OUTPUT_IMAGE_BINS) / (dst->max_dist2 - dst->min_dist2);
 
-void add_to_stats(isImageBufType *dst, int row, int col, uint32_t pix) {
-  static const char *id = FILEID "add_to_stats";
-  int bin;
+  for (row=0; row<g->dstHeight; row++) {
+    dy2 = (row - dst->beam_center_y) * (row - dst->beam_center_y);
+    for (col=0; col<g->dstWidth; col++) {
+      g->bins[(size_t)row*g->dstWidth + col] = bin_from_dist2(dst, scale, dx2[col] + dy2);
+    }
+  }
+  free(dx2);
+}
+
+/** Free a geometry
+ */
+static void isGeometryFree(isGeometry_t *g) {
+  free(g->bins);
+  free(g);
+}
+
+/** Is this the window of a tile (see isTile.c)?  Tiles are
+ ** IS_TILE_SIZE pixels square and cover IS_TILE_SIZE * 2^level raw
+ ** pixels on the tile grid.
+ */
+static int isGeometryIsTile(int x, int y, int winWidth, int winHeight, int dstWidth, int dstHeight) {
+  return dstWidth == IS_TILE_SIZE && dstHeight == IS_TILE_SIZE &&
+    winWidth == winHeight && winWidth >= IS_TILE_SIZE && winWidth % IS_TILE_SIZE == 0 &&
+    ((winWidth / IS_TILE_SIZE) & (winWidth / IS_TILE_SIZE - 1)) == 0 &&
+    x % winWidth == 0 && y % winHeight == 0;
+}
+
+/** Look for a geometry in a cache and, if found, take a reference
+ ** to it.  Call with geometryMutex locked.
+ **
+ ** @returns the geometry or NULL if it is not there
+ */
+static isGeometry_t *isGeometryFind(isGeometry_t **head, double beam_center_x, double beam_center_y, int x, int y, int winWidth, int winHeight, int dstWidth, int dstHeight) {
+  isGeometry_t **gpp;
+  isGeometry_t *g;
+
+  for (gpp = head; *gpp != NULL; gpp = &(*gpp)->next) {
+    g = *gpp;
+    if (g->beam_center_x == beam_center_x && g->beam_center_y == beam_center_y &&
+        g->x == x && g->y == y && g->winWidth == winWidth && g->winHeight == winHeight &&
+        g->dstWidth == dstWidth && g->dstHeight == dstHeight) {
+      // Move to the front of the line
+      *gpp = g->next;
+      g->next = *head;
+      *head = g;
+      g->refs++;
+      return g;
+    }
+  }
+  return NULL;
+}
+
+/** Find (or make) the bin table for a reduction
+ **
+ ** Tiles get a cache of their own, IS_TILE_GEOMETRY_CACHE_ENTRIES
+ ** long, as a screen full of them would otherwise push everything
+ ** else out of the (shorter) cache the other reductions share.
+ **
+ ** @param wctx       Our worker context
+ **
+ ** @param dst        Reduced image with its bins set up (by set_up_bins)
+ **
+ ** @param src        Image dst is being reduced from (for the beam center)
+ **
+ ** @param x          Left edge of the source window
+ **
+ ** @param y          Top of the source window
+ **
+ ** @param winWidth   Width of the source window
+ **
+ ** @param winHeight  Height of the source window
+ **
+ ** @param hitp       When not NULL set to 1 if the geometry was cached, 0 if we made it
+ **
+ ** @returns the geometry.  Give it back with isGeometryRelease.
+ */
+static isGeometry_t *isGeometryGet(isWorkerContext_t *wctx, isImageBufType *src, isImageBufType *dst, int x, int y, int winWidth, int winHeight, int *hitp) {
+  static const char *id = FILEID "isGeometryGet";
+  isGeometry_t **head;
+  isGeometry_t **gpp;
+  isGeometry_t *g;
+  isGeometry_t *found;
+  isGeometry_t *victim;
+  double beam_center_x;
+  double beam_center_y;
+  int entries;
+  int n;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  beam_center_x = get_double_from_json_object(id, src->meta, "beam_center_x");
+  beam_center_y = get_double_from_json_object(id, src->meta, "beam_center_y");
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (isGeometryIsTile(x, y, winWidth, winHeight, dst->buf_width, dst->buf_height)) {
+    head    = &wctx->tileGeometry;
+    entries = IS_TILE_GEOMETRY_CACHE_ENTRIES;
+  } else {
+    head    = &wctx->geometry;
+    entries = IS_GEOMETRY_CACHE_ENTRIES;
+  }
+
+  pthread_mutex_lock(&wctx->geometryMutex);
+  g = isGeometryFind(head, beam_center_x, beam_center_y, x, y, winWidth, winHeight, dst->buf_width, dst->buf_height);
+  pthread_mutex_unlock(&wctx->geometryMutex);
+  if (hitp != NULL) {
+    *hitp = g != NULL;
+  }
+  if (g != NULL) {
+    return g;
+  }
+
+  //
+  // Not found.  Make one.
+  //
+  g = calloc(1, sizeof(*g));
+  if (g == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  g->beam_center_x = beam_center_x;
+  g->beam_center_y = beam_center_y;
+  g->x             = x;
+  g->y             = y;
+  g->winWidth      = winWidth;
+  g->winHeight     = winHeight;
+  g->dstWidth      = dst->buf_width;
+  g->dstHeight     = dst->buf_height;
+  g->refs          = 1;
+  isGeometryFill(dst, g);
+
+  //
+  // Another thread may have made the same one while we were at it
+  // (the frames of a filmstrip all start at once): use theirs rather
+  // than fill the cache with copies
+  //
+  pthread_mutex_lock(&wctx->geometryMutex);
+  found = isGeometryFind(head, beam_center_x, beam_center_y, x, y, winWidth, winHeight, dst->buf_width, dst->buf_height);
+  if (found != NULL) {
+    pthread_mutex_unlock(&wctx->geometryMutex);
+    isGeometryFree(g);
+    return found;
+  }
+
+  g->next = *head;
+  *head = g;
+
+  //
+  // Throw out the least recently used geometry if we have too many
+  // (unless someone is using it, in which case the last one out does
+  // the honors).
+  //
+  n = 0;
+  for (gpp = head; *gpp != NULL; gpp = &(*gpp)->next) {
+    if (++n > entries) {
+      victim = *gpp;
+      *gpp = victim->next;
+      victim->next = NULL;
+      if (victim->refs == 0) {
+        isGeometryFree(victim);
+      } else {
+        victim->refs = -victim->refs;   // negative means no longer cached
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&wctx->geometryMutex);
+
+  return g;
+}
+
+/** Done with a geometry from isGeometryGet
+ */
+static void isGeometryRelease(isWorkerContext_t *wctx, isGeometry_t *g) {
+  pthread_mutex_lock(&wctx->geometryMutex);
+  if (g->refs > 0) {
+    g->refs--;
+  } else if (++g->refs == 0) {
+    // We were the last ones using a geometry that has left the cache
+    isGeometryFree(g);
+  }
+  pthread_mutex_unlock(&wctx->geometryMutex);
+}
+
+/** Empty the geometry caches.  Call when nobody is reducing anything.
+ */
+void isGeometryDestroy(isWorkerContext_t *wctx) {
+  isGeometry_t *g;
+  isGeometry_t *next;
+
+  for (g=wctx->geometry; g != NULL; g=next) {
+    next = g->next;
+    isGeometryFree(g);
+  }
+  wctx->geometry = NULL;
+
+  for (g=wctx->tileGeometry; g != NULL; g=next) {
+    next = g->next;
+    isGeometryFree(g);
+  }
+  wctx->tileGeometry = NULL;
+}
+
+/** Add a pixel to the statistics
+ **
+ ** @param bins  Statistics to add to: dst->bins or a partial copy of them
+ **
+ ** @param bin   The pixel's bin (from our geometry, see bin_from_dist2)
+ **
+ ** @param row   Row of the pixel
+ **
+ ** @param col   Column of the pixel
+ **
+ ** @param pix   The pixel value
+ */
+static inline void add_to_stats(bin_t *bins, int bin, int row, int col, uint32_t pix) {
+  bins[bin].n++;
+  bins[bin].sum += pix;
+  bins[bin].sum2 += (double)pix*pix;
+
+  if (pix < bins[bin].min) {
+    bins[bin].min = pix;
+    bins[bin].min_row = row;
+    bins[bin].min_col = col;
+  }
+
+  if (pix > bins[bin].max) {
+    bins[bin].max = pix;
+    bins[bin].max_row = row;
+    bins[bin].max_col = col;
+  }
+}
+
+/** Histogram bin of a pixel value.  Values below
+ ** 2^IS_HIST_SUB_BITS get a bin each.  Above that each power of two
+ ** is split into 2^IS_HIST_SUB_BITS bins so the bins are never more
+ ** than about 6% wide (for 4 bits) however bright the pixels get.
+ */
+static inline int hist_bin(uint32_t v) {
+  int e;
 
-  (void) id;
+  if (v < (1 << IS_HIST_SUB_BITS)) {
+    return v;
+  }
+  e = 31 - __builtin_clz(v);
+  return ((e - IS_HIST_SUB_BITS + 1) << IS_HIST_SUB_BITS) + ((v >> (e - IS_HIST_SUB_BITS)) & ((1 << IS_HIST_SUB_BITS) - 1));
+}
+
+/** Smallest pixel value that falls in a histogram bin (the inverse of
+ ** hist_bin)
+ */
+uint32_t isHistValue(int bin) {
+  int e;
+
+  if (bin < (1 << IS_HIST_SUB_BITS)) {
+    return bin;
+  }
+  e = (bin >> IS_HIST_SUB_BITS) + IS_HIST_SUB_BITS - 1;
+  return (uint32_t)((1 << IS_HIST_SUB_BITS) + (bin & ((1 << IS_HIST_SUB_BITS) - 1))) << (e - IS_HIST_SUB_BITS);
+}
+
+/** Find a percentile of a reduced image's pixel values from the
+ ** histogram in its meta data.  Call with wctx->metaMutex locked.
+ **
+ ** @param meta    The reduced image's meta data
+ **
+ ** @param pct     The percentile (0 to 100)
+ **
+ ** @param valuep  Set to the smallest value in the percentile's histogram bin
+ **
+ ** @returns 0 on success, -1 if there is no histogram
+ */
+int isHistPercentile(json_t *meta, double pct, uint32_t *valuep) {
+  json_t *hist;
+  double total;
+  double want;
+  double n;
+  int n_bins;
+  int i;
 
-  bin = get_bin_number(dst, col, row);
+  hist = json_object_get(meta, "histogram");
+  n_bins = json_array_size(hist);
 
-  dst->bins[bin].n++;
-  dst->bins[bin].sum += pix;
-  dst->bins[bin].sum2 += pix*pix;
+  total = 0.0;
+  for (i=0; i<n_bins; i++) {
+    total += json_integer_value(json_array_get(hist, i));
+  }
+  if (total <= 0.0) {
+    return -1;
+  }
 
-  if (pix < dst->bins[bin].min) {
-    dst->bins[bin].min = pix;
-    dst->bins[bin].min_row = row;
-    dst->bins[bin].min_col = col;
+  want = total * pct / 100.0;
+  n = 0.0;
+  for (i=0; i<n_bins-1; i++) {
+    n += json_integer_value(json_array_get(hist, i));
+    if (n >= want) {
+      break;
+    }
   }
 
-  if (pix > dst->bins[bin].max) {
-    dst->bins[bin].max = pix;
-    dst->bins[bin].max_row = row;
-    dst->bins[bin].max_col = col;
+  *valuep = isHistValue(i);
+  return 0;
+}
+
+/** Add partial statistics (from add_to_stats) to dst->bins.  Merging
+ ** partials in row order gives the same minimum and maximum positions
+ ** as adding the pixels one at a time would have.
+ */
+void merge_stats(isImageBufType *dst, bin_t *bins) {
+  int i;
+
+  for (i=0; i<=IS_OUTPUT_IMAGE_BINS; i++) {
+    dst->bins[i].n    += bins[i].n;
+    dst->bins[i].sum  += bins[i].sum;
+    dst->bins[i].sum2 += bins[i].sum2;
+
+    if (bins[i].min < dst->bins[i].min) {
+      dst->bins[i].min     = bins[i].min;
+      dst->bins[i].min_row = bins[i].min_row;
+      dst->bins[i].min_col = bins[i].min_col;
+    }
+
+    if (bins[i].max > dst->bins[i].max) {
+      dst->bins[i].max     = bins[i].max;
+      dst->bins[i].max_row = bins[i].max_row;
+      dst->bins[i].max_col = bins[i].max_col;
+    }
   }
 }
 
 void calc_stats(isImageBufType *dst) {
   static const char *id = FILEID "calc_stats";
+  json_t *hist;
+  int last;
   int i;
   int n;
   double mean;
@@ -237,11 +595,22 @@ void calc_stats(isImageBufType *dst) {
   set_json_object_integer(id, dst->meta, "max",    max);
   set_json_object_real(id, dst->meta,    "rms",    rms);
   set_json_object_real(id, dst->meta,    "stddev", sd);
+
+  //
+  // The histogram (up to its last non-empty bin) goes along for
+  // auto-contrast (see isHistPercentile)
+  //
+  for (last=IS_HIST_BINS-1; last > 0 && dst->hist[last] == 0; last--);
+  hist = json_array();
+  for (i=0; i<=last; i++) {
+    json_array_append_new(hist, json_integer(dst->hist[i]));
+  }
+  json_object_set_new(dst->meta, "histogram", hist);
 }
 
 /** For 16 bit images, this returns the maximum value of ha xa by ya box centered on (k,l).
  ** 
- ** @param badPixels     Our bad pixel map
+ ** @param mask          Bad pixels (or NULL)
  **
  ** @param buf           Buffer contianing our image
  **
@@ -263,7 +632,7 @@ void calc_stats(isImageBufType *dst) {
  **
  ** @returns Maximum value found in the box.  Bad pixels are ignored.
  */
-uint32_t maxBox16( uint32_t *badPixels, uint32_t *minp, int *nsatp, void *buf, int bufWidth, int bufHeight, double k, double l, int yal, int yau, int xal, int xau) {
+static uint32_t maxBox16( isMask_t *mask, uint32_t *minp, int *nsatp, void *buf, int bufWidth, int bufHeight, double k, double l, int yal, int yau, int xal, int xau) {
   static const char *id = FILEID "maxBox16";
   int m, n;
   uint32_t d, d1;
@@ -286,7 +655,7 @@ uint32_t maxBox16( uint32_t *badPixels, uint32_t *minp, int *nsatp, void *buf, i
         continue;
 
       // Check for known bad pixel
-      if ( badPixels && *(badPixels + m*bufWidth + n))
+      if (mask && (mask->bits[(size_t)m*mask->words + (n>>6)] >> (n & 63)) & 1)
         continue;
 
       d1 = *(bp + m*bufWidth + n);
@@ -310,7 +679,7 @@ uint32_t maxBox16( uint32_t *badPixels, uint32_t *minp, int *nsatp, void *buf, i
 
 /** For 32 bit images, this returns the maximum value of ha xa by ya box centered on (k,l).
  ** 
- ** @param badPixels     Our bad pixel map
+ ** @param mask          Bad pixels (or NULL)
  **
  ** @param buf           Buffer contianing our image
  **
@@ -332,7 +701,7 @@ uint32_t maxBox16( uint32_t *badPixels, uint32_t *minp, int *nsatp, void *buf, i
  **
  ** @returns Maximum value found in the box.  Bad pixels are ignored.
  */
-uint32_t maxBox32( uint32_t *badPixels, uint32_t *minp, int *nsatp, void *buf, int bufWidth, int bufHeight, double k, double l, int yal, int yau, int xal, int xau) {
+static uint32_t maxBox32( isMask_t *mask, uint32_t *minp, int *nsatp, void *buf, int bufWidth, int bufHeight, double k, double l, int yal, int yau, int xal, int xau) {
   static const char *id = FILEID "maxBox32";
   int m, n;
   uint32_t d, d1;
@@ -356,7 +725,7 @@ uint32_t maxBox32( uint32_t *badPixels, uint32_t *minp, int *nsatp, void *buf, i
         continue;
       
       // Check for a known bad pixel
-      if (badPixels && *(badPixels + m*bufWidth + n))
+      if (mask && (mask->bits[(size_t)m*mask->words + (n>>6)] >> (n & 63)) & 1)
         continue;
 
       d1 = *(bp + m*bufWidth + n);
@@ -381,7 +750,7 @@ uint32_t maxBox32( uint32_t *badPixels, uint32_t *minp, int *nsatp, void *buf, i
 
 /** For 16 bit images, this returns the nearest value to (k,l).
  ** 
- ** @param badPixels     Our bad pixel map
+ ** @param mask          Bad pixels (or NULL)
  **
  ** @param buf           Buffer contianing our image
  **
@@ -403,16 +772,25 @@ uint32_t maxBox32( uint32_t *badPixels, uint32_t *minp, int *nsatp, void *buf, i
  **
  ** @returns nearest value.  Bad pixels return 0
  */
-uint32_t nearest16( uint32_t *badPixels, uint32_t *minp, int *nsatp, void *buf, int bufWidth, int bufHeight, double k, double l, int yal, int yau, int xal, int xau) {
+static uint32_t nearest16( isMask_t *mask, uint32_t *minp, int *nsatp, void *buf, int bufWidth, int bufHeight, double k, double l, int yal, int yau, int xal, int xau) {
   static const char *id = FILEID "nearest16";
   uint16_t *bp = (uint16_t *)buf;
   uint32_t rtn;
   int index;
+  int m, n;
 
   (void)id;
 
-  index = (int)(k+0.5)*bufWidth + (int)(l+0.5);
-  if (badPixels && *(badPixels + index)) {
+  //
+  // Rounding can take us one past the last row or column
+  //
+  m = (int)(k+0.5);
+  n = (int)(l+0.5);
+  m = m >= bufHeight ? bufHeight - 1 : m;
+  n = n >= bufWidth  ? bufWidth  - 1 : n;
+
+  index = m*bufWidth + n;
+  if (mask && (mask->bits[(size_t)m*mask->words + (n>>6)] >> (n & 63)) & 1) {
     rtn = 0;
   } else {
     rtn = *(bp + index);
@@ -429,7 +807,7 @@ uint32_t nearest16( uint32_t *badPixels, uint32_t *minp, int *nsatp, void *buf,
 
 /** For 32 bit images, this returns the nearest value to (k,l).
  ** 
- ** @param badPixels     Our bad pixel map
+ ** @param mask          Bad pixels (or NULL)
  **
  ** @param buf           Buffer contianing our image
  **
@@ -451,16 +829,25 @@ uint32_t nearest16( uint32_t *badPixels, uint32_t *minp, int *nsatp, void *buf,
  **
  ** @returns nearest value.  Bad pixels return 0
  */
-uint32_t nearest32( uint32_t *badPixels, uint32_t *minp, int *nsatp, void *buf, int bufWidth, int bufHeight, double k, double l, int yal, int yau, int xal, int xau) {
+static uint32_t nearest32( isMask_t *mask, uint32_t *minp, int *nsatp, void *buf, int bufWidth, int bufHeight, double k, double l, int yal, int yau, int xal, int xau) {
   static const char *id = FILEID "nearest32";
   int index;
+  int m, n;
   uint32_t *bp = (uint32_t *)buf;
   uint32_t rtn;
 
   (void)id;
 
-  index = (int)(k+0.5)*bufWidth + (int)(l+0.5);
-  if (badPixels && *(badPixels + index)) {
+  //
+  // Rounding can take us one past the last row or column
+  //
+  m = (int)(k+0.5);
+  n = (int)(l+0.5);
+  m = m >= bufHeight ? bufHeight - 1 : m;
+  n = n >= bufWidth  ? bufWidth  - 1 : n;
+
+  index = m*bufWidth + n;
+  if (mask && (mask->bits[(size_t)m*mask->words + (n>>6)] >> (n & 63)) & 1) {
     rtn = 0;
   } else {
     rtn = *(bp + index);
@@ -476,272 +863,1456 @@ uint32_t nearest32( uint32_t *badPixels, uint32_t *minp, int *nsatp, void *buf,
   return rtn;
 }
 
-/** Reduce the given 16 bit image
+/** Pixel n of row m of a 2 or 4 byte deep image
+ */
+static inline uint32_t refPixel(void *buf, int depth, int bufWidth, int m, int n) {
+  return depth == 2 ? ((uint16_t *)buf)[(size_t)m*bufWidth + n] : ((uint32_t *)buf)[(size_t)m*bufWidth + n];
+}
+
+/** The sum (or mean) of the box centered on (k,l), a pixel at a time.
+ ** The reference for reduceRowSum (see isReduceCheck).
  **
- ** @param  src       Full sized source image
+ ** @param mask          Bad pixels (or NULL)
  **
- ** @param  dst       Reduced destination image
+ ** @param nsatp         Incremented for each saturated (good) pixel
  **
- ** @param  x         Left edge on source image
+ ** @param buf           Buffer containing our image
  **
- ** @param  y         Top of source image
+ ** @param depth         Bytes per pixel (2 or 4)
  **
- ** @param  winWidth  Width of portion of the source we want to look at
+ ** @param bufWidth      image width
  **
- ** @param  winHeight Height of the portion of the source we want to look at
+ ** @param bufHeight     image height
+ **
+ ** @param k             index along height around which to sum
+ **
+ ** @param l             index along width around which to sum
+ **
+ ** @param yal           box extends this distance above k
+ **
+ ** @param yau           box extends this distance below k
+ **
+ ** @param xal           box extends this distance to the left of l
+ **
+ ** @param xau           box extends this distance to the right of l
+ **
+ ** @param mean          Non-zero for the mean (rounded) of the good pixels
+ **
+ ** @returns 0xffffffff if there is a saturated pixel in the box,
+ ** otherwise the sum (clipped to one less than 32 bit saturation) or
+ ** mean.  Bad pixels are ignored.
  */
-void reduceImage16( isImageBufType *src, isImageBufType *dst, int x, int y, int winWidth, int winHeight) {
-  static const char *id = FILEID "reduceImage16";
-
-  uint32_t (*cvtFunc)(uint32_t *, uint32_t *, int *, void *, int, int, double, double, int, int, int, int);
-
-  int row=0, col=0;
-  int xa, ya;
-  int xal, yal, xau, yau;
-  uint32_t pxl;
-  double d_row, d_col;
-  uint16_t *srcBuf;
-  uint16_t *dstBuf;
-  int dstWidth;
-  int dstHeight;
-  int srcWidth;
-  int srcHeight;
+static uint32_t sumBox(isMask_t *mask, int *nsatp, void *buf, int depth, int bufWidth, int bufHeight, double k, double l, int yal, int yau, int xal, int xau, int mean) {
+  uint64_t sum;
+  uint32_t sat;
+  uint32_t d1;
+  int ngood;
   int nsat;
-  uint32_t min; 
-  int spots;
-  int bin;
-  int ice_spots;
-
-  (void)id;
-
-  srcBuf = src->buf;
-  dstBuf = dst->buf;
-
-  dstWidth  = dst->buf_width;
-  dstHeight = dst->buf_height;
-
-  srcWidth  = src->buf_width;
-  srcHeight = src->buf_height;
+  int m, n;
 
-  //
-  // size of rectangle to search for the maximum pixel value
-  // yal and xal are subtracted from ya and xa for the lower bound of the box and
-  // yau and xau are added to ya and xa for the upper bound of the box
-  //
-  xa = (winWidth)/(dstWidth);
-  xal = xau = xa/2;
-  if( (xal + xau) < xa)
-    xau++;
+  sat   = depth == 2 ? 0xffff : 0xffffffff;
+  sum   = 0;
+  ngood = 0;
+  nsat  = 0;
+  for (m=k-yal; m < k+yau; m++) {
+    if (m < 0 || m >= bufHeight)
+      continue;
+    for (n=l-xal; n<l+xau; n++) {
+      if (n < 0 || n >= bufWidth)
+        continue;
 
-  ya = (winHeight)/(dstHeight);
-  yal = yau = ya/2;
-  if ((yal + yau) < ya)
-    yau++;
+      if (mask && (mask->bits[(size_t)m*mask->words + (n>>6)] >> (n & 63)) & 1)
+        continue;
 
-  cvtFunc = NULL;
-  if (xa <= 1 || ya <= 1) {
-    cvtFunc = nearest16;
-  } else {
-    cvtFunc = maxBox16;
+      d1 = refPixel(buf, depth, bufWidth, m, n);
+      nsat += d1 == sat;
+      sum  += d1;
+      ngood++;
+    }
   }
 
-  nsat = 0;
-
-  for (row=0; row<dstHeight; row++) {
-    // "index" of vertical position on original image
-    d_row = row * winHeight/(double)(dstHeight) + y;
+  *nsatp += nsat;
+  if (nsat) {
+    return 0xffffffff;
+  }
+  if (mean) {
+    return ngood ? (sum + ngood/2) / ngood : 0;
+  }
+  return sum > 0xfffffffe ? 0xfffffffe : sum;
+}
 
-    for (col=0; col<dstWidth; col++) {
-      // "index" of the horizontal position on the original image
-      d_col = col * winWidth/(double)(dstWidth) + x;
+/** The median of nine samples spread evenly over the box centered on
+ ** (k,l), sorted the slow way.  Bad samples count as zero and full
+ ** scale in turn.  The reference for reduceRowMedian (see
+ ** isReduceCheck).
+ **
+ ** See sumBox for the parameters
+ **
+ ** @returns the median (0xffffffff when it is saturated)
+ */
+static uint32_t medianBox(isMask_t *mask, int *nsatp, void *buf, int depth, int bufWidth, int bufHeight, double k, double l, int yal, int yau, int xal, int xau) {
+  uint32_t samples[9];
+  uint32_t sat;
+  uint32_t t;
+  int r0, r1;
+  int c0, c1;
+  int nbad;
+  int i, j;
+  int m, n;
 
-      if (d_row < 0 || d_row >= src->buf_height || d_col < 0 || d_col >= src->buf_width) {
-        pxl = 0;
+  sat = depth == 2 ? 0xffff : 0xffffffff;
+
+  // The box, clipped to the image
+  r0 = k - yal;
+  r1 = ceil(k + yau);
+  c0 = l - xal;
+  c1 = ceil(l + xau);
+  r0 = r0 < 0 ? 0 : r0;
+  c0 = c0 < 0 ? 0 : c0;
+  r1 = r1 > bufHeight ? bufHeight : r1;
+  c1 = c1 > bufWidth  ? bufWidth  : c1;
+
+  nbad = 0;
+  for (i=0; i<3; i++) {
+    m = r0 + (2*i+1) * (r1 - r0) / 6;
+    for (j=0; j<3; j++) {
+      n = c0 + (2*j+1) * (c1 - c0) / 6;
+      if (mask && (mask->bits[(size_t)m*mask->words + (n>>6)] >> (n & 63)) & 1) {
+        samples[3*i+j] = (nbad++ & 1) ? sat : 0;
       } else {
-        pxl = cvtFunc( src->bad_pixel_map, &min, &nsat, srcBuf, srcWidth, srcHeight, d_row, d_col, yal, yau, xal, xau);
-      }
-
-      if (pxl != 0xffffffff) {
-        add_to_stats(dst, row, col, pxl);
+        samples[3*i+j] = refPixel(buf, depth, bufWidth, m, n);
+        *nsatp += samples[3*i+j] == sat;
       }
-      *(dstBuf + row*dstWidth + col) = pxl;
     }
   }
 
-  calc_stats(dst);
-
-  if (json_integer_value(json_object_get(src->meta,"n")) <= json_integer_value(json_object_get(dst->meta, "n"))) {
-    set_json_object_integer(id, src->meta, "n",          json_integer_value(json_object_get(dst->meta, "n")));
-    set_json_object_real(id,    src->meta, "mean",       json_real_value(json_object_get(dst->meta, "mean")));
-    set_json_object_real(id,    src->meta, "rms",        json_real_value(json_object_get(dst->meta, "rms")));
-    set_json_object_real(id,    src->meta, "stddev",     json_real_value(json_object_get(dst->meta, "stddev")));
-    set_json_object_integer(id, src->meta, "min",        json_integer_value(json_object_get(dst->meta, "min")));
-    set_json_object_integer(id, src->meta, "max",        json_integer_value(json_object_get(dst->meta, "max")));
-    set_json_object_integer(id, src->meta, "nSaturated", nsat);
-  }
-
-  // Count the spots
-  spots = 0;
-  ice_spots = 0;
-
-  for (row=0; row < dstHeight; row++) {
-    for (col=0; col<dstWidth; col++) {
-      pxl = *(dstBuf + row*dstWidth + col);
-      
-      bin = get_bin_number(dst, col, row);
-      
-      if ((pxl - dst->bins[bin].mean) > (IS_SPOT_SENSITIVITY * dst->bins[bin].rms)) {
-        if (bin < IS_OUTPUT_IMAGE_BINS) {
-          spots++;
-        } else {
-          ice_spots++;
-        }
-      }
+  for (i=1; i<9; i++) {
+    for (j=i; j>0 && samples[j-1] > samples[j]; j--) {
+      t            = samples[j];
+      samples[j]   = samples[j-1];
+      samples[j-1] = t;
     }
   }
-  if (dstHeight > 128) {
-    isLogging_info("%s: spots: %d   n: %d  mean: %f  rms: %f  stddev: %f\n",
-            id, spots,
-            (int)json_integer_value(json_object_get(dst->meta, "n")),
-            (double)json_real_value(json_object_get(dst->meta, "mean")),
-            (double)json_real_value(json_object_get(dst->meta, "rms")),
-            (double)json_real_value(json_object_get(dst->meta, "stddev")));
-  }
-
-  set_json_object_integer(id, dst->meta, "spots", spots);
+  return samples[4] == sat ? 0xffffffff : samples[4];
 }
 
-/** Reduce the given 32 bit image
+/** Work out which source pixels go into each destination pixel along
+ ** one axis.  Destination pixel i takes source pixels start[i]
+ ** through end[i]-1.  Empty spans (off the edge of the source) give
+ ** a destination pixel of 0.
  **
- ** @param  src       Full sized source image
+ ** All the floating point work of a reduction is done here, once per
+ ** row and column rather than once per pixel.
  **
- ** @param  dst       Reduced destination image
+ ** @param  dstN     Number of destination pixels
  **
- ** @param  x         Left edge on source image
+ ** @param  win      Number of source pixels we are reducing to dstN
  **
- ** @param  y         Top of source image
+ ** @param  origin   Source pixel of destination pixel 0
  **
- ** @param  winWidth  Width of portion of the source we want to look at
+ ** @param  srcN     Number of source pixels
  **
- ** @param  winHeight Height of the portion of the source we want to look at
+ ** @param  al       Box extends this far before the source position
+ **
+ ** @param  au       Box extends this far after the source position
+ **
+ ** @param  nearest  Non-zero to take only the nearest source pixel (al and au are ignored)
+ **
+ ** @param  start    First source pixel of each destination pixel
+ **
+ ** @param  end      One past the last source pixel of each destination pixel
  */
-void reduceImage32( isImageBufType *src, isImageBufType *dst, int x, int y, int winWidth, int winHeight) {
-  static const char *id = FILEID "reduceImage32";
-  uint32_t (*cvtFunc)(uint32_t *, uint32_t *, int *, void *, int, int, double, double, int, int, int, int);
+static void reduceSpans(int dstN, int win, int origin, int srcN, int al, int au, int nearest, int *start, int *end) {
+  double d;
+  int i;
+  int n0, n1;
+
+  for (i=0; i<dstN; i++) {
+    d = i * (double)win/(double)dstN + origin;
+
+    if (d < 0 || d >= srcN) {
+      start[i] = end[i] = 0;
+      continue;
+    }
+
+    if (nearest) {
+      //
+      // Rounding can take us one past the last row or column
+      //
+      n0 = (int)(d + 0.5);
+      n0 = n0 >= srcN ? srcN - 1 : n0;
+      n1 = n0 + 1;
+    } else {
+      n0 = (int)(d - al);
+      n1 = (int)ceil(d + au);
+      n0 = n0 < 0 ? 0 : n0;
+      n1 = n1 > srcN ? srcN : n1;
+    }
+    start[i] = n0;
+    end[i]   = n1;
+  }
+}
+
+/** One horizontal band of a reduction
+ */
+typedef struct reduceBandStruct {
+  isImageBufType *src;                  //!< Image we are reducing (or the block of its rows we have)
+  int srcRow0;                          //!< Source row at the start of src->buf
+  isMask_t *mask;                       //!< Bad pixels of the whole source image (or NULL)
+  isImageBufType *dst;                  //!< Reduced image
+  int *colStart;                        //!< First source column of each output column
+  int *colEnd;                          //!< One past the last source column of each output column
+  int *rowStart;                        //!< First source row of each output row
+  int *rowEnd;                          //!< One past the last source row of each output row
+  int nearest;                          //!< Non-zero when the spans are single pixels
+  reduce_mode_type mode;                //!< How to pool each span
+  const uint8_t *binIndex;              //!< Bin of each output pixel (from our geometry)
+  int row0;                             //!< First output row of our band
+  int row1;                             //!< One past the last output row of our band
+  int nsat;                             //!< Saturated pixels we saw
+  bin_t bins[IS_OUTPUT_IMAGE_BINS+1];   //!< Our share of the statistics
+  uint32_t hist[IS_HIST_BINS];          //!< Our share of the histogram
+} reduceBand_t;
+
+/** Mask bits for one source row (NULL when the row has no bad pixels)
+ */
+static inline uint64_t *reduceMaskRow(isMask_t *mask, int m) {
+  return mask && mask->row_runs[m+1] > mask->row_runs[m] ? mask->bits + (size_t)m*mask->words : NULL;
+}
+
+/** Max pool one output row.  Each source row in the row's span is max
+ ** pooled across, every output pixel in one kernel call (isMaxRow16
+ ** or isMaxRow32), and the results are max pooled down.
+ **
+ ** @param bp   Our band
+ **
+ ** @param row  Output row
+ **
+ ** @param out  The output row (0xffffffff for saturated pixels)
+ */
+static void reduceRowMax(reduceBand_t *bp, int row, uint32_t *out) {
+  isImageBufType *src;
+  uint64_t *bits;
+  int dstWidth;
+  int col;
+  int m;
+
+  src      = bp->src;
+  dstWidth = bp->dst->buf_width;
+
+  memset(out, 0, dstWidth * sizeof(uint32_t));
+  for (m=bp->rowStart[row]; m<bp->rowEnd[row]; m++) {
+    bits = reduceMaskRow(bp->mask, m);
+    if (src->buf_depth == 2) {
+      isMaxRow16((uint16_t *)src->buf + (size_t)(m - bp->srcRow0)*src->buf_width, bits, bp->colStart, bp->colEnd, dstWidth, out, &bp->nsat);
+    } else {
+      isMaxRow32((uint32_t *)src->buf + (size_t)(m - bp->srcRow0)*src->buf_width, bits, bp->colStart, bp->colEnd, dstWidth, out, &bp->nsat);
+    }
+  }
+
+  if (src->buf_depth == 2 && !bp->nearest) {
+    for (col=0; col<dstWidth; col++) {
+      out[col] = out[col] == 0xffff ? 0xffffffff : out[col];
+    }
+  }
+}
+
+/** Sum (or average) one output row.  Each source row in the row's
+ ** span is summed across, every output pixel in one kernel call
+ ** (isSumRow16 or isSumRow32), and the sums are added down.  Spans
+ ** with a saturated pixel come out saturated.  Sums go into 32 bit
+ ** images whatever the source depth (see reduceRegionSetUp) and only
+ ** sums too big for 32 bits are clipped, just short of saturation.
+ **
+ ** @param bp       Our band
+ **
+ ** @param row      Output row
+ **
+ ** @param out      The output row (0xffffffff for saturated pixels)
+ **
+ ** @param scratch  Room for 16 bytes per output pixel
+ */
+static void reduceRowSum(reduceBand_t *bp, int row, uint32_t *out, void *scratch) {
+  isImageBufType *src;
+  uint64_t *bits;
+  uint64_t *sum;
+  int *ngood;
+  int *nsat;
+  int dstWidth;
+  int col;
+  int m;
+
+  src      = bp->src;
+  dstWidth = bp->dst->buf_width;
+
+  sum   = scratch;
+  ngood = (int *)(sum + dstWidth);
+  nsat  = ngood + dstWidth;
+  memset(scratch, 0, dstWidth * (sizeof(*sum) + sizeof(*ngood) + sizeof(*nsat)));
+
+  for (m=bp->rowStart[row]; m<bp->rowEnd[row]; m++) {
+    bits = reduceMaskRow(bp->mask, m);
+    if (src->buf_depth == 2) {
+      isSumRow16((uint16_t *)src->buf + (size_t)(m - bp->srcRow0)*src->buf_width, bits, bp->colStart, bp->colEnd, dstWidth, sum, ngood, nsat);
+    } else {
+      isSumRow32((uint32_t *)src->buf + (size_t)(m - bp->srcRow0)*src->buf_width, bits, bp->colStart, bp->colEnd, dstWidth, sum, ngood, nsat);
+    }
+  }
+
+  for (col=0; col<dstWidth; col++) {
+    bp->nsat += nsat[col];
+    if (nsat[col]) {
+      out[col] = 0xffffffff;
+      continue;
+    }
+    if (bp->mode == REDUCE_MEAN) {
+      out[col] = ngood[col] ? (sum[col] + ngood[col]/2) / ngood[col] : 0;
+    } else {
+      out[col] = sum[col] > 0xfffffffe ? 0xfffffffe : sum[col];
+    }
+  }
+}
+
+/** Approximate the median of one output row.  Each output pixel is
+ ** the median (isMedian9) of a 3x3 grid of samples spread evenly over
+ ** its box.  Bad samples are replaced by zero and full scale in turn
+ ** so that they tend to cancel out.
+ **
+ ** @param bp       Our band
+ **
+ ** @param row      Output row
+ **
+ ** @param out      The output row (0xffffffff for saturated pixels)
+ **
+ ** @param scratch  Room for 36 bytes per output pixel
+ */
+static void reduceRowMedian(reduceBand_t *bp, int row, uint32_t *out, void *scratch) {
+  isImageBufType *src;
+  uint64_t *bits;
+  uint32_t *samples;
+  uint32_t top;
+  uint32_t d1;
+  int dstWidth;
+  int col;
+  int m, n;
+  int j, k;
+  int nbad;
+
+  src      = bp->src;
+  dstWidth = bp->dst->buf_width;
+  samples  = scratch;
+  top      = src->buf_depth == 2 ? 0xffff : 0xffffffff;
+
+  if (bp->rowEnd[row] == bp->rowStart[row]) {
+    // Off the image
+    memset(out, 0, dstWidth * sizeof(uint32_t));
+    return;
+  }
+
+  for (col=0; col<dstWidth; col++) {
+    nbad = 0;
+    for (k=0; k<3; k++) {
+      m    = bp->rowStart[row] + (2*k+1) * (bp->rowEnd[row] - bp->rowStart[row]) / 6;
+      bits = reduceMaskRow(bp->mask, m);
+      for (j=0; j<3; j++) {
+        n = bp->colStart[col] + (2*j+1) * (bp->colEnd[col] - bp->colStart[col]) / 6;
+        if (bp->colEnd[col] == bp->colStart[col]) {
+          d1 = 0;
+        } else if (bits && (bits[n>>6] >> (n & 63)) & 1) {
+          d1 = (nbad++ & 1) ? top : 0;
+        } else {
+          d1 = src->buf_depth == 2 ? ((uint16_t *)src->buf)[(size_t)(m - bp->srcRow0)*src->buf_width + n] : ((uint32_t *)src->buf)[(size_t)(m - bp->srcRow0)*src->buf_width + n];
+          bp->nsat += d1 == top;
+        }
+        samples[(3*k + j)*dstWidth + col] = d1;
+      }
+    }
+  }
+
+  isMedian9(samples, dstWidth, out, dstWidth);
+
+  if (src->buf_depth == 2) {
+    for (col=0; col<dstWidth; col++) {
+      out[col] = out[col] == 0xffff ? 0xffffffff : out[col];
+    }
+  }
+}
+
+/** Reduce one band.  Called by isPoolRun.
+ **
+ ** Each output row is pooled by reduceRowMax, reduceRowSum, or
+ ** reduceRowMedian.  Each output pixel is then added to the
+ ** statistics of its bin (a table lookup).  Single pixel spans are
+ ** the same in every mode so they always use reduceRowMax.
+ **
+ ** @param arg  Our array of bands
+ **
+ ** @param i    The band to reduce
+ */
+static void reduceBand(void *arg, int i) {
+  static const char *id = FILEID "reduceBand";
+  reduceBand_t *bp;
+  isImageBufType *dst;
+  reduce_mode_type mode;
+  uint32_t *out;
+  void *scratch;
+  uint32_t pxl;
+  int dstWidth;
+  int row, col;
+  int bin;
+
+  bp  = (reduceBand_t *)arg + i;
+  dst = bp->dst;
+
+  dstWidth = dst->buf_width;
+  mode     = bp->nearest ? REDUCE_MAX : bp->mode;
+
+  out     = malloc(dstWidth * sizeof(uint32_t));
+  scratch = malloc(dstWidth * 9 * sizeof(uint32_t));
+  if (out == NULL || scratch == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  for (row=bp->row0; row<bp->row1; row++) {
+    switch (mode) {
+    case REDUCE_MEAN:
+    case REDUCE_SUM:
+      reduceRowSum(bp, row, out, scratch);
+      break;
+
+    case REDUCE_MEDIAN:
+      reduceRowMedian(bp, row, out, scratch);
+      break;
+
+    default:
+      reduceRowMax(bp, row, out);
+      break;
+    }
+
+    for (col=0; col<dstWidth; col++) {
+      pxl = out[col];
+      bin = bp->binIndex[row*dstWidth + col];
+
+      if (pxl != 0xffffffff) {
+        add_to_stats(bp->bins, bin, row, col, pxl);
+        bp->hist[hist_bin(pxl)]++;
+      }
+
+      if (dst->buf_depth == 2) {
+        *((uint16_t *)dst->buf + row*dstWidth + col) = pxl;
+      } else {
+        *((uint32_t *)dst->buf + row*dstWidth + col) = pxl;
+      }
+    }
+  }
+
+  free(scratch);
+  free(out);
+}
+
+/** Reduce output rows row0 through row1-1 on the compute pool.  The
+ ** rows are split evenly between the bands.
+ **
+ ** @param  wctx     Our worker context
+ **
+ ** @param  bands    Our bands
+ **
+ ** @param  n_bands  Number of bands to use
+ **
+ ** @param  src      Holds (at least) the source rows the output rows need
+ **
+ ** @param  srcRow0  Source row at the start of src->buf
+ **
+ ** @param  row0     First output row
+ **
+ ** @param  row1     One past the last output row
+ */
+static void reduceRunBands(isWorkerContext_t *wctx, reduceBand_t *bands, int n_bands, isImageBufType *src, int srcRow0, int row0, int row1) {
+  int i;
+
+  for (i=0; i<n_bands; i++) {
+    bands[i].src     = src;
+    bands[i].srcRow0 = srcRow0;
+    bands[i].row0    = row0 + (int)((int64_t)(row1 - row0) * i / n_bands);
+    bands[i].row1    = row0 + (int)((int64_t)(row1 - row0) * (i+1) / n_bands);
+  }
+
+  isPoolRun(wctx, n_bands, reduceBand, bands);
+}
+
+/** Reduce the source a block of rows at a time as rr reads them.  No
+ ** more than IS_STREAM_BLOCK_BYTES worth of rows (or the rows behind
+ ** one output row, or one of the reader's chunks, if those are
+ ** bigger) are held at once.  Each block covers whole output rows.
+ ** Rows shared by neighbouring blocks are kept rather than read again
+ ** so rr only ever reads forward.
+ **
+ ** @param  wctx     Our worker context
+ **
+ ** @param  bands    Our bands (with the spans set up)
+ **
+ ** @param  n_bands  Number of bands we have
+ **
+ ** @param  src      Source image: dimensions, meta, and mask but no buffer
+ **
+ ** @param  rr       Reads the source
+ **
+ ** @returns 0 on success, -1 if a read failed
+ */
+static int reduceStreamBands(isWorkerContext_t *wctx, reduceBand_t *bands, int n_bands, isImageBufType *src, isRowReader_t *rr) {
+  static const char *id = FILEID "reduceStreamBands";
+  isImageBufType block;                 // the source rows we have
+  size_t row_bytes;
+  int budget;                           // most rows we'd like to hold
+  int have0, have1;                     // we hold source rows have0 through have1-1
+  int cap;                              // rows block.buf has room for
+  int lo, hi;                           // source rows the next output rows need
+  int row0, row1;                       // the next output rows
+  int n;
+  int err;
+
+  row_bytes = (size_t)src->buf_width * src->buf_depth;
+  budget = IS_STREAM_BLOCK_BYTES / row_bytes;
+  budget = budget < 1 ? 1 : budget;
+  budget = budget < rr->chunk_rows ? rr->chunk_rows : budget;
+
+  block = *src;
+  block.buf = NULL;
+  cap   = 0;
+  have0 = have1 = 0;
+  err   = 0;
+
+  for (row0=0; row0<bands[0].dst->buf_height && err == 0; row0=row1) {
+    //
+    // Take as many output rows as fit our budget (but at least one)
+    //
+    lo = hi = -1;
+    for (row1=row0; row1<bands[0].dst->buf_height; row1++) {
+      if (bands[0].rowEnd[row1] == bands[0].rowStart[row1]) {
+        // Off the image: needs no rows
+        continue;
+      }
+      if (lo >= 0 && bands[0].rowEnd[row1] - lo > budget) {
+        break;
+      }
+      lo = lo < 0 ? bands[0].rowStart[row1] : lo;
+      hi = hi > bands[0].rowEnd[row1] ? hi : bands[0].rowEnd[row1];
+    }
+
+    if (lo >= 0) {
+      //
+      // Read whole chunks
+      //
+      if (rr->chunk_rows > 1) {
+        hi = (hi + rr->chunk_rows - 1) / rr->chunk_rows * rr->chunk_rows;
+        hi = hi > src->buf_height ? src->buf_height : hi;
+      }
+      hi = hi > have1 ? hi : have1;
+
+      //
+      // Keep the rows we already have that are still needed
+      //
+      if (have0 < lo) {
+        n = have1 > lo ? have1 - lo : 0;
+        if (n > 0) {
+          memmove(block.buf, (char *)block.buf + (size_t)(lo - have0) * row_bytes, n * row_bytes);
+        }
+        have0 = lo;
+        have1 = lo + n;
+      }
+
+      if (hi - have0 > cap) {
+        cap = hi - have0;
+        block.buf = realloc(block.buf, cap * row_bytes);
+        if (block.buf == NULL) {
+          isLogging_crit("%s: Out of memory\n", id);
+          exit (-1);
+        }
+      }
+
+      if (hi > have1) {
+        err = rr->read(rr, have1, hi, (char *)block.buf + (size_t)(have1 - have0) * row_bytes);
+        if (err != 0) {
+          isLogging_err("%s: Could not read rows %d through %d of %s\n", id, have1, hi - 1, src->key);
+          break;
+        }
+        have1 = hi;
+      }
+    }
+
+    n = row1 - row0 < n_bands ? row1 - row0 : n_bands;
+    reduceRunBands(wctx, bands, n, &block, have0, row0, row1);
+  }
+
+  free(block.buf);
+  return err == 0 ? 0 : -1;
+}
+
+/** Reduce (part of) src into dst.  The output rows are split into
+ ** bands that are reduced at the same time on the compute pool.  Each
+ ** band keeps its own statistics and histogram which are merged into
+ ** dst->bins and dst->hist when they are all done.
+ **
+ ** The spans of source pixels that go into each output pixel are
+ ** integer tables made once by reduceSpans so there is no floating
+ ** point work in the pixel loops.
+ **
+ ** @param  wctx      Our worker context
+ **
+ ** @param  src       Full sized source image
+ **
+ ** @param  rr        When not NULL src has no buffer: read its rows
+ **                   with rr a block at a time (see reduceStreamBands)
+ **
+ ** @param  mask      Bad pixels of src (or NULL)
+ **
+ ** @param  dst       Reduced destination image.  dst->bins must be set up.
+ **
+ ** @param  x         Left edge on source image
+ **
+ ** @param  y         Top of source image
+ **
+ ** @param  winWidth  Width of portion of the source we want to look at
+ **
+ ** @param  winHeight Height of the portion of the source we want to look at
+ **
+ ** @param  binIndex  Bin of each output pixel
+ **
+ ** @param  mode      How to pool the pixels of each box
+ **
+ ** @param  nsatp     Set to the number of saturated pixels seen
+ **
+ ** @returns 0 on success, -1 if we could not read the source
+ */
+static int reduceBands(isWorkerContext_t *wctx, isImageBufType *src, isRowReader_t *rr, isMask_t *mask, isImageBufType *dst, int x, int y, int winWidth, int winHeight, const uint8_t *binIndex, reduce_mode_type mode, int *nsatp) {
+  static const char *id = FILEID "reduceBands";
+  reduceBand_t *bands;
+  int n_bands;
+  int xa, ya;
+  int xal, yal, xau, yau;
+  int nearest;
+  int *spans;
+  int dstWidth;
+  int dstHeight;
+  int err;
+  int i, j;
+
+  dstWidth  = dst->buf_width;
+  dstHeight = dst->buf_height;
+
+  //
+  // size of rectangle to search for the maximum pixel value
+  // yal and xal are subtracted from ya and xa for the lower bound of the box and
+  // yau and xau are added to ya and xa for the upper bound of the box
+  //
+  xa = (winWidth)/(dstWidth);
+  xal = xau = xa/2;
+  if( (xal + xau) < xa)
+    xau++;
+
+  ya = (winHeight)/(dstHeight);
+  yal = yau = ya/2;
+  if ((yal + yau) < ya)
+    yau++;
+
+  nearest = xa <= 1 || ya <= 1;
+
+  //
+  // Blocks of streamed rows are split as finely as the pool allows
+  //
+  n_bands = isPoolSize(wctx);
+  if (rr == NULL && n_bands > dstHeight / IS_REDUCE_BAND_ROWS) {
+    n_bands = dstHeight / IS_REDUCE_BAND_ROWS;
+  }
+  n_bands = n_bands < 1 ? 1 : n_bands;
+
+  spans = malloc(2 * (dstWidth + dstHeight) * sizeof(int));
+  bands = calloc(n_bands, sizeof(*bands));
+  if (spans == NULL || bands == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  bands[0].colStart = spans;
+  bands[0].colEnd   = bands[0].colStart + dstWidth;
+  bands[0].rowStart = bands[0].colEnd   + dstWidth;
+  bands[0].rowEnd   = bands[0].rowStart + dstHeight;
+
+  reduceSpans(dstWidth,  winWidth,  x, src->buf_width,  xal, xau, nearest, bands[0].colStart, bands[0].colEnd);
+  reduceSpans(dstHeight, winHeight, y, src->buf_height, yal, yau, nearest, bands[0].rowStart, bands[0].rowEnd);
+
+  for (i=0; i<n_bands; i++) {
+    bands[i].mask     = mask;
+    bands[i].dst      = dst;
+    bands[i].colStart = bands[0].colStart;
+    bands[i].colEnd   = bands[0].colEnd;
+    bands[i].rowStart = bands[0].rowStart;
+    bands[i].rowEnd   = bands[0].rowEnd;
+    bands[i].nearest  = nearest;
+    bands[i].mode     = mode;
+    bands[i].binIndex = binIndex;
+    memcpy(bands[i].bins, dst->bins, sizeof(bands[i].bins));
+  }
+
+  err = 0;
+  if (rr == NULL) {
+    reduceRunBands(wctx, bands, n_bands, src, 0, 0, dstHeight);
+  } else {
+    err = reduceStreamBands(wctx, bands, n_bands, src, rr);
+  }
+
+  *nsatp = 0;
+  memset(dst->hist, 0, sizeof(dst->hist));
+  for (i=0; i<n_bands; i++) {
+    merge_stats(dst, bands[i].bins);
+    *nsatp += bands[i].nsat;
+    for (j=0; j<IS_HIST_BINS; j++) {
+      dst->hist[j] += bands[i].hist[j];
+    }
+  }
+
+  free(bands);
+  free(spans);
+
+  return err;
+}
+
+/** Reduce the given image
+ **
+ ** One sweep (reduceBands) reduces the image and gathers the
+ ** statistics.  The spot counter then makes a quick pass over the
+ ** (small) reduced image.  Both look up the bin of each pixel in the
+ ** table from our geometry (see isGeometryGet).
+ **
+ ** maxBox16, maxBox32, sumBox, medianBox, nearest16, and nearest32
+ ** are the (much slower) reference for what this does (see
+ ** isReduceCheck).
+ **
+ ** @param  wctx      Our worker context
+ **
+ ** @param  src       Full sized source image
+ **
+ ** @param  rr        Reads src a block of rows at a time (NULL when src->buf holds the whole image)
+ **
+ ** @param  mask      Bad pixels of src (or NULL)
+ **
+ ** @param  dst       Reduced destination image (2 or 4 bytes deep)
+ **
+ ** @param  geometry  Bin of each pixel of dst
+ **
+ ** @param  x         Left edge on source image
+ **
+ ** @param  y         Top of source image
+ **
+ ** @param  winWidth  Width of portion of the source we want to look at
+ **
+ ** @param  winHeight Height of the portion of the source we want to look at
+ **
+ ** @param  mode      How to pool the pixels of each box
+ **
+ ** @param  level     Pyramid level src is (0 for the raw image itself).
+ **                   Statistics of max pooled pixels would skew the raw
+ **                   image's so only level 0 reductions update them.
+ **
+ ** @returns 0 on success, -1 if we could not read the source
+ */
+int reduceImage( isWorkerContext_t *wctx, isImageBufType *src, isRowReader_t *rr, isMask_t *mask, isImageBufType *dst, isGeometry_t *geometry, int x, int y, int winWidth, int winHeight, reduce_mode_type mode, int level) {
+  static const char *id = FILEID "reduceImage";
+  const uint8_t *binIndex;
+  uint32_t pxl;
+  int npixels;
+  int nsat;
+  int spots;
+  int bin;
+  int ice_spots;
+  int i;
+
+  npixels  = dst->buf_width * dst->buf_height;
+  binIndex = geometry->bins;
+
+  if (reduceBands(wctx, src, rr, mask, dst, x, y, winWidth, winHeight, binIndex, mode, &nsat) != 0) {
+    return -1;
+  }
+
+  calc_stats(dst);
+
+  // src->meta is the raw image's, shared with our other threads
+  pthread_mutex_lock(&wctx->metaMutex);
+  if (level == 0 && json_integer_value(json_object_get(src->meta,"n")) <= json_integer_value(json_object_get(dst->meta, "n"))) {
+    set_json_object_integer(id, src->meta, "n",          json_integer_value(json_object_get(dst->meta, "n")));
+    set_json_object_real(id,    src->meta, "mean",       json_real_value(json_object_get(dst->meta, "mean")));
+    set_json_object_real(id,    src->meta, "rms",        json_real_value(json_object_get(dst->meta, "rms")));
+    set_json_object_real(id,    src->meta, "stddev",     json_real_value(json_object_get(dst->meta, "stddev")));
+    set_json_object_integer(id, src->meta, "min",        json_integer_value(json_object_get(dst->meta, "min")));
+    set_json_object_integer(id, src->meta, "max",        json_integer_value(json_object_get(dst->meta, "max")));
+    set_json_object_integer(id, src->meta, "nSaturated", nsat);
+  }
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  // Count the spots
+  spots = 0;
+  ice_spots = 0;
+
+  for (i=0; i<npixels; i++) {
+    pxl = dst->buf_depth == 2 ? ((uint16_t *)dst->buf)[i] : ((uint32_t *)dst->buf)[i];
+    bin = binIndex[i];
+
+    if ((pxl - dst->bins[bin].mean) > (IS_SPOT_SENSITIVITY * dst->bins[bin].rms)) {
+      if (bin < IS_OUTPUT_IMAGE_BINS) {
+        spots++;
+      } else {
+        ice_spots++;
+      }
+    }
+  }
+
+  if (dst->buf_height > 128) {
+    isLogging_info("%s: spots: %d   n: %d  mean: %f  rms: %f  stddev: %f\n",
+            id, spots,
+            (int)json_integer_value(json_object_get(dst->meta, "n")),
+            (double)json_real_value(json_object_get(dst->meta, "mean")),
+            (double)json_real_value(json_object_get(dst->meta, "rms")),
+            (double)json_real_value(json_object_get(dst->meta, "stddev")));
+  }
+
+  set_json_object_integer(id, dst->meta, "spots", spots);
+  return 0;
+}
+
+/** Reduce src with reduceBands and again, a pixel at a time, with the
+ ** reference kernels (maxBox16, maxBox32, sumBox, or medianBox, or
+ ** nearest16 or nearest32 when the boxes are single pixels).  Used by
+ ** isConvertTest.
+ **
+ ** @param  wctx      Our worker context (with or without a pool)
+ **
+ ** @param  src       Full sized source image (2 or 4 bytes deep)
+ **
+ ** @param  mask      Bad pixels of src (or NULL)
+ **
+ ** @param  x         Left edge on source image
+ **
+ ** @param  y         Top of source image
+ **
+ ** @param  winWidth  Width of portion of the source we want to look at
+ **
+ ** @param  winHeight Height of the portion of the source we want to look at
+ **
+ ** @param  dstWidth  Width of the reduced image
+ **
+ ** @param  dstHeight Height of the reduced image
+ **
+ ** @param  mode      How to pool each box
+ **
+ ** @returns the number of output pixels that differ, plus one if the
+ ** saturated pixel counts differ
+ */
+int isReduceCheck(isWorkerContext_t *wctx, isImageBufType *src, isMask_t *mask, int x, int y, int winWidth, int winHeight, int dstWidth, int dstHeight, reduce_mode_type mode) {
+  static const char *id = FILEID "isReduceCheck";
+  uint32_t (*cvtFunc)(isMask_t *, uint32_t *, int *, void *, int, int, double, double, int, int, int, int);
+  isImageBufType dst;
+  uint8_t *binIndex;
+  uint32_t pxl;
+  uint32_t min;
+  double d_row, d_col;
+  int xa, ya;
+  int xal, yal, xau, yau;
+  int nsat, ref_nsat;
+  int row, col;
+  int rtn;
+
+  memset(&dst, 0, sizeof(dst));
+  dst.buf_width  = dstWidth;
+  dst.buf_height = dstHeight;
+  dst.buf_depth  = 4;
+  dst.buf_size   = dstWidth * dstHeight * sizeof(uint32_t);
+  dst.buf        = malloc(dst.buf_size);
+  binIndex       = calloc((size_t)dstWidth * dstHeight, 1);
+  if (dst.buf == NULL || binIndex == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  reduceBands(wctx, src, NULL, mask, &dst, x, y, winWidth, winHeight, binIndex, mode, &nsat);
+
+  //
+  // The same box sizes reduceBands uses
+  //
+  xa = (winWidth)/(dstWidth);
+  xal = xau = xa/2;
+  if( (xal + xau) < xa)
+    xau++;
+
+  ya = (winHeight)/(dstHeight);
+  yal = yau = ya/2;
+  if ((yal + yau) < ya)
+    yau++;
+
+  if (xa <= 1 || ya <= 1) {
+    // Single pixels are the same in every mode
+    cvtFunc = src->buf_depth == 2 ? nearest16 : nearest32;
+    mode    = REDUCE_MAX;
+  } else {
+    cvtFunc = src->buf_depth == 2 ? maxBox16 : maxBox32;
+  }
+
+  rtn      = 0;
+  ref_nsat = 0;
+  min      = 0xffffffff;
+  for (row=0; row<dstHeight; row++) {
+    d_row = row * winHeight/(double)(dstHeight) + y;
+    for (col=0; col<dstWidth; col++) {
+      d_col = col * winWidth/(double)(dstWidth) + x;
+
+      if (d_row < 0 || d_row >= src->buf_height || d_col < 0 || d_col >= src->buf_width) {
+        pxl = 0;
+      } else if (mode == REDUCE_MEAN || mode == REDUCE_SUM) {
+        pxl = sumBox(mask, &ref_nsat, src->buf, src->buf_depth, src->buf_width, src->buf_height, d_row, d_col, yal, yau, xal, xau, mode == REDUCE_MEAN);
+      } else if (mode == REDUCE_MEDIAN) {
+        pxl = medianBox(mask, &ref_nsat, src->buf, src->buf_depth, src->buf_width, src->buf_height, d_row, d_col, yal, yau, xal, xau);
+      } else {
+        pxl = cvtFunc(mask, &min, &ref_nsat, src->buf, src->buf_width, src->buf_height, d_row, d_col, yal, yau, xal, xau);
+      }
+
+      if (pxl != ((uint32_t *)dst.buf)[row*dstWidth + col]) {
+        if (rtn == 0) {
+          isLogging_err("%s: First difference at row %d col %d: %u should be %u\n", id, row, col, ((uint32_t *)dst.buf)[row*dstWidth + col], pxl);
+        }
+        rtn++;
+      }
+    }
+  }
+
+  if (nsat != ref_nsat) {
+    isLogging_err("%s: Saw %d saturated pixels but there should be %d\n", id, nsat, ref_nsat);
+    rtn++;
+  }
+
+  free(binIndex);
+  free(dst.buf);
+  return rtn;
+}
+
+/** Read rows of an image that is all in memory (an isRowReader_t
+ ** read for isStreamCheck)
+ */
+static int streamCheckRead(isRowReader_t *rr, int row0, int row1, void *buf) {
+  isImageBufType *src;
+  size_t row_bytes;
+
+  src = rr->state;
+  row_bytes = (size_t)rr->width * rr->depth;
+  memcpy(buf, (char *)src->buf + row0 * row_bytes, (row1 - row0) * row_bytes);
+  return 0;
+}
+
+/** Reduce src with reduceBands from the full buffer and again
+ ** streamed, a block of rows at a time, through a row reader with
+ ** chunks of chunk_rows rows.  Used by isConvertTest.
+ **
+ ** @param  wctx       Our worker context (with or without a pool)
+ **
+ ** @param  src        Full sized source image (2 or 4 bytes deep)
+ **
+ ** @param  mask       Bad pixels of src (or NULL)
+ **
+ ** @param  x          Left edge on source image
+ **
+ ** @param  y          Top of source image
+ **
+ ** @param  winWidth   Width of portion of the source we want to look at
+ **
+ ** @param  winHeight  Height of the portion of the source we want to look at
+ **
+ ** @param  dstWidth   Width of the reduced image
+ **
+ ** @param  dstHeight  Height of the reduced image
+ **
+ ** @param  mode       How to pool each box
+ **
+ ** @param  chunk_rows Rows the reader would rather be asked for together (0 if it does not matter)
+ **
+ ** @returns the number of output pixels that differ, plus one each if
+ ** the saturated pixel counts, statistics, or histograms differ
+ */
+int isStreamCheck(isWorkerContext_t *wctx, isImageBufType *src, isMask_t *mask, int x, int y, int winWidth, int winHeight, int dstWidth, int dstHeight, reduce_mode_type mode, int chunk_rows) {
+  static const char *id = FILEID "isStreamCheck";
+  isImageBufType dst, ref;
+  isImageBufType rows;
+  isRowReader_t rr;
+  uint8_t *binIndex;
+  int nsat, ref_nsat;
+  int i;
+  int rtn;
+
+  memset(&dst, 0, sizeof(dst));
+  dst.buf_width  = dstWidth;
+  dst.buf_height = dstHeight;
+  dst.buf_depth  = 4;
+  dst.buf_size   = dstWidth * dstHeight * sizeof(uint32_t);
+  for (i=0; i<=IS_OUTPUT_IMAGE_BINS; i++) {
+    dst.bins[i].min = 0xffffffff;
+  }
+  ref            = dst;
+  dst.buf        = malloc(dst.buf_size);
+  ref.buf        = malloc(ref.buf_size);
+  binIndex       = calloc((size_t)dstWidth * dstHeight, 1);
+  if (dst.buf == NULL || ref.buf == NULL || binIndex == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+
+  reduceBands(wctx, src, NULL, mask, &ref, x, y, winWidth, winHeight, binIndex, mode, &ref_nsat);
+
+  rows     = *src;
+  rows.buf = NULL;
+  memset(&rr, 0, sizeof(rr));
+  rr.width      = src->buf_width;
+  rr.height     = src->buf_height;
+  rr.depth      = src->buf_depth;
+  rr.chunk_rows = chunk_rows;
+  rr.read       = streamCheckRead;
+  rr.state      = src;
+
+  rtn = reduceBands(wctx, &rows, &rr, mask, &dst, x, y, winWidth, winHeight, binIndex, mode, &nsat) != 0;
+
+  for (i=0; i<dstWidth*dstHeight; i++) {
+    if (((uint32_t *)dst.buf)[i] != ((uint32_t *)ref.buf)[i]) {
+      if (rtn == 0) {
+        isLogging_err("%s: First difference at row %d col %d: %u should be %u\n", id, i / dstWidth, i % dstWidth, ((uint32_t *)dst.buf)[i], ((uint32_t *)ref.buf)[i]);
+      }
+      rtn++;
+    }
+  }
+
+  if (nsat != ref_nsat) {
+    isLogging_err("%s: Saw %d saturated pixels but there should be %d\n", id, nsat, ref_nsat);
+    rtn++;
+  }
+
+  // Integer sums: the order the bands are merged in makes no difference
+  if (dst.bins[0].n != ref.bins[0].n || dst.bins[0].sum != ref.bins[0].sum || dst.bins[0].min != ref.bins[0].min || dst.bins[0].max != ref.bins[0].max) {
+    isLogging_err("%s: Statistics differ\n", id);
+    rtn++;
+  }
+
+  if (memcmp(dst.hist, ref.hist, sizeof(dst.hist)) != 0) {
+    isLogging_err("%s: Histograms differ\n", id);
+    rtn++;
+  }
+
+  free(binIndex);
+  free(ref.buf);
+  free(dst.buf);
+  return rtn;
+}
+
+/** Pick the image to reduce a window of raw from: the smallest
+ ** pyramid level that still has the resolution we need (see
+ ** isPyramidChooseLevel).  Level 0 is the raw image itself.  The
+ ** pyramid is max pooled so the other modes need the raw image.
+ **
+ ** @param wctx        Our worker context
+ **
+ ** @param raw         Filled raw image (we hold a reference)
+ **
+ ** @param mode        How the pixels will be pooled
+ **
+ ** @param xp          Left edge of the window.  Returned on the chosen level.
+ **
+ ** @param yp          Top of the window.  Returned on the chosen level.
+ **
+ ** @param winWidthp   Width of the window.  Returned on the chosen level.
+ **
+ ** @param winHeightp  Height of the window.  Returned on the chosen level.
+ **
+ ** @param dstWidth    Width of the reduced image
+ **
+ ** @param dstHeight   Height of the reduced image
+ **
+ ** @param view        Filled in when we pick a pyramid level (see isPyramidGetLevel)
+ **
+ ** @param levelp      Set to the level picked
+ **
+ ** @returns raw or view
+ */
+static isImageBufType *reducePyramidSource(isWorkerContext_t *wctx, isImageBufType *raw, reduce_mode_type mode, int *xp, int *yp, int *winWidthp, int *winHeightp, int dstWidth, int dstHeight, isImageBufType *view, int *levelp) {
+  int level;
 
-  int row=0, col=0;
-  int xa, ya;
-  int xal, yal, xau, yau;
-  uint32_t pxl;
-  double d_row, d_col;
-  uint32_t *srcBuf;
-  uint32_t *dstBuf;
-  int dstWidth;
-  int dstHeight;
-  int srcWidth;
-  int srcHeight;
+  level = mode == REDUCE_MAX ? isPyramidChooseLevel(*winWidthp / dstWidth, *winHeightp / dstHeight) : 0;
+  *levelp = level;
+  if (level == 0) {
+    return raw;
+  }
+
+  isPyramidGetLevel(wctx, raw, level, view);
+
+  *xp         >>= level;
+  *yp         >>= level;
+  *winWidthp  >>= level;
+  *winHeightp >>= level;
+  return view;
+}
+
+/** Reduce a window of src in REDUCE_MAX mode from the pyramid level
+ ** isReduceRegion would use and again directly from src.  Used by
+ ** isConvertTest.
+ **
+ ** @param  wctx      Our worker context (with or without a pool)
+ **
+ ** @param  src       Full sized source image (2 or 4 bytes deep) with
+ **                   a key and an initialized pyramid_mutex.  Call
+ **                   isPyramidDestroy when done with it.
+ **
+ ** @param  x         Left edge on source image
+ **
+ ** @param  y         Top of source image
+ **
+ ** @param  winWidth  Width of portion of the source we want to look at
+ **
+ ** @param  winHeight Height of the portion of the source we want to look at
+ **
+ ** @param  dstWidth  Width of the reduced image
+ **
+ ** @param  dstHeight Height of the reduced image
+ **
+ ** @param  levelp    Set to the pyramid level used
+ **
+ ** @returns the number of output pixels that differ
+ */
+int isPyramidCheck(isWorkerContext_t *wctx, isImageBufType *src, int x, int y, int winWidth, int winHeight, int dstWidth, int dstHeight, int *levelp) {
+  static const char *id = FILEID "isPyramidCheck";
+  isImageBufType dst, ref;
+  isImageBufType view;
+  isImageBufType *lsrc;
+  uint8_t *binIndex;
   int nsat;
-  uint32_t min;
-  int spots;
-  int bin;
-  int ice_spots;
+  int i;
+  int rtn;
 
-  srcBuf = src->buf;
-  dstBuf = dst->buf;
+  memset(&dst, 0, sizeof(dst));
+  dst.buf_width  = dstWidth;
+  dst.buf_height = dstHeight;
+  dst.buf_depth  = 4;
+  dst.buf_size   = dstWidth * dstHeight * sizeof(uint32_t);
+  dst.buf        = malloc(dst.buf_size);
+  ref            = dst;
+  ref.buf        = malloc(ref.buf_size);
+  binIndex       = calloc((size_t)dstWidth * dstHeight, 1);
+  if (dst.buf == NULL || ref.buf == NULL || binIndex == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
 
-  dstWidth  = dst->buf_width;
-  dstHeight = dst->buf_height;
+  reduceBands(wctx, src, NULL, src->mask, &ref, x, y, winWidth, winHeight, binIndex, REDUCE_MAX, &nsat);
 
-  srcWidth  = src->buf_width;
-  srcHeight = src->buf_height;
+  lsrc = reducePyramidSource(wctx, src, REDUCE_MAX, &x, &y, &winWidth, &winHeight, dstWidth, dstHeight, &view, levelp);
+  reduceBands(wctx, lsrc, NULL, lsrc->mask, &dst, x, y, winWidth, winHeight, binIndex, REDUCE_MAX, &nsat);
 
-  //
-  // size of rectangle to search for the maximum pixel value
-  // yal and xal are subtracted from ya and xa for the lower bound of the box and
-  // yau and xau are added to ya and xa for the upper bound of the box
-  //
-  xa = (winWidth)/(dstWidth);
-  xal = xau = xa/2;
-  if( (xal + xau) < xa)
-    xau++;
+  rtn = 0;
+  for (i=0; i<dstWidth*dstHeight; i++) {
+    if (((uint32_t *)dst.buf)[i] != ((uint32_t *)ref.buf)[i]) {
+      if (rtn == 0) {
+        isLogging_err("%s: First difference at row %d col %d: %u should be %u\n", id, i / dstWidth, i % dstWidth, ((uint32_t *)dst.buf)[i], ((uint32_t *)ref.buf)[i]);
+      }
+      rtn++;
+    }
+  }
 
-  ya = (winHeight)/(dstHeight);
-  yal = yau = ya/2;
-  if ((yal + yau) < ya)
-    yau++;
+  free(binIndex);
+  free(ref.buf);
+  free(dst.buf);
+  return rtn;
+}
 
-  cvtFunc = NULL;
-  if (xa <= 1 || ya <= 1) {
-    cvtFunc = nearest32;
-  } else {
-    cvtFunc = maxBox32;
+/** Get the bin table for a reduction from the geometry cache (see
+ ** isGeometryGet) and compare it with one made from scratch.  Used
+ ** by isConvertTest.
+ **
+ ** @param  wctx      Our worker context
+ **
+ ** @param  src       Source image with a beam center in its meta data
+ **
+ ** @param  x         Left edge on source image
+ **
+ ** @param  y         Top of source image
+ **
+ ** @param  winWidth  Width of portion of the source we want to look at
+ **
+ ** @param  winHeight Height of the portion of the source we want to look at
+ **
+ ** @param  dstWidth  Width of the reduced image
+ **
+ ** @param  dstHeight Height of the reduced image
+ **
+ ** @param  hitp      Set to 1 if the geometry came from the cache, 0 if it was made
+ **
+ ** @returns the number of pixels whose bins differ
+ */
+int isGeometryCheck(isWorkerContext_t *wctx, isImageBufType *src, int x, int y, int winWidth, int winHeight, int dstWidth, int dstHeight, int *hitp) {
+  isImageBufType dst;
+  isGeometry_t fresh;
+  isGeometry_t *g;
+  int i;
+  int rtn;
+
+  memset(&dst, 0, sizeof(dst));
+  dst.buf_width  = dstWidth;
+  dst.buf_height = dstHeight;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  set_up_bins(src, &dst, winWidth, winHeight, x, y);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  g = isGeometryGet(wctx, src, &dst, x, y, winWidth, winHeight, hitp);
+
+  memset(&fresh, 0, sizeof(fresh));
+  fresh.dstWidth  = dstWidth;
+  fresh.dstHeight = dstHeight;
+  isGeometryFill(&dst, &fresh);
+
+  rtn = 0;
+  for (i=0; i<dstWidth*dstHeight; i++) {
+    rtn += g->bins[i] != fresh.bins[i];
   }
 
-  nsat = 0;
-  min  = 0xffffffff;
-  for (row=0; row<dstHeight; row++) {
-    // "index" of vertical position on original image
-    d_row = row * (double)winHeight/(double)(dstHeight) + y;
+  free(fresh.bins);
+  isGeometryRelease(wctx, g);
+  return rtn;
+}
 
-    for (col=0; col<dstWidth; col++) {
-      // "index" of the horizontal position on the original image
-      d_col = col * (double)winWidth/(double)(dstWidth) + x;
+/** Reduce all of src (in REDUCE_MAX mode) and work out the statistics
+ ** and histogram of the result the way reduceImage does, but without
+ ** the cache or a detector geometry: every pixel goes in the first
+ ** bin.  Used by isConvertTest.
+ **
+ ** @param  wctx      Our worker context (with or without a pool)
+ **
+ ** @param  src       Full sized source image (2 or 4 bytes deep)
+ **
+ ** @param  dstWidth  Width of the reduced image
+ **
+ ** @param  dstHeight Height of the reduced image
+ **
+ ** @returns the reduced image's meta data (json_decref it)
+ */
+json_t *isReduceStats(isWorkerContext_t *wctx, isImageBufType *src, int dstWidth, int dstHeight) {
+  static const char *id = FILEID "isReduceStats";
+  isImageBufType dst;
+  uint8_t *binIndex;
+  int nsat;
+  int i;
+
+  memset(&dst, 0, sizeof(dst));
+  dst.buf_width  = dstWidth;
+  dst.buf_height = dstHeight;
+  dst.buf_depth  = 4;
+  dst.buf_size   = dstWidth * dstHeight * sizeof(uint32_t);
+  dst.buf        = malloc(dst.buf_size);
+  dst.meta       = json_object();
+  binIndex       = calloc((size_t)dstWidth * dstHeight, 1);
+  if (dst.buf == NULL || dst.meta == NULL || binIndex == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
+  }
+  for (i=0; i<=IS_OUTPUT_IMAGE_BINS; i++) {
+    dst.bins[i].min = 0xffffffff;
+  }
 
-      pxl = cvtFunc( src->bad_pixel_map, &min, &nsat, srcBuf, srcWidth, srcHeight, d_row, d_col, yal, yau, xal, xau);
+  reduceBands(wctx, src, NULL, NULL, &dst, 0, 0, src->buf_width, src->buf_height, binIndex, REDUCE_MAX, &nsat);
+  calc_stats(&dst);
+  set_json_object_integer(id, dst.meta, "nSaturated", nsat);
 
-      if (pxl != 0xffffffff) {
-        add_to_stats(dst, row, col, pxl);
-      }
+  free(binIndex);
+  free(dst.buf);
+  return dst.meta;
+}
+
+//! Names of the reduction modes (the "reduce" job parameter)
+static const char *reduce_mode_names[N_REDUCE_MODES] = {"max", "mean", "sum", "median"};
+
+/** Look up a reduction mode by name
+ **
+ ** @param name  One of "max", "mean", "sum", or "median".  NULL or
+ **              empty for the default (max).
+ **
+ ** @returns the mode (REDUCE_MAX when we do not recognize the name)
+ */
+reduce_mode_type isReduceMode(const char *name) {
+  static const char *id = FILEID "isReduceMode";
+  int i;
+
+  if (name == NULL || *name == 0) {
+    return REDUCE_MAX;
+  }
 
-      *(dstBuf + row*dstWidth + col) = pxl;
+  for (i=0; i<N_REDUCE_MODES; i++) {
+    if (strcmp(name, reduce_mode_names[i]) == 0) {
+      return i;
     }
   }
-  
-  calc_stats(dst);
 
-  if (json_integer_value(json_object_get(src->meta,"n")) <= json_integer_value(json_object_get(dst->meta, "n"))) {
-    set_json_object_integer(id, src->meta, "n",          json_integer_value(json_object_get(dst->meta, "n")));
-    set_json_object_real(id,    src->meta, "mean",       json_real_value(json_object_get(dst->meta, "mean")));
-    set_json_object_real(id,    src->meta, "rms",        json_real_value(json_object_get(dst->meta, "rms")));
-    set_json_object_real(id,    src->meta, "stddev",     json_real_value(json_object_get(dst->meta, "stddev")));
-    set_json_object_integer(id, src->meta, "min",        json_integer_value(json_object_get(dst->meta, "min")));
-    set_json_object_integer(id, src->meta, "max",        json_integer_value(json_object_get(dst->meta, "max")));
-    set_json_object_integer(id, src->meta, "nSaturated", nsat);
+  isLogging_err("%s: Unknown reduction mode '%s'.  Using max.\n", id, name);
+  return REDUCE_MAX;
+}
+
+/** Name of a reduction mode (as used in our cache keys)
+ */
+const char *isReduceModeName(reduce_mode_type mode) {
+  return mode >= 0 && mode < N_REDUCE_MODES ? reduce_mode_names[mode] : reduce_mode_names[REDUCE_MAX];
+}
+
+/** Set up an empty reduced image buffer to be filled from (a
+ ** rectangle of) a raw image: allocate it, give it the raw image's
+ ** meta data, and set up its bins.  The reduced image is as deep as
+ ** the raw image except that sums are always 32 bit: a box of 16 bit
+ ** pixels soon adds up to more than 16 bits.
+ **
+ ** @returns the bin of each pixel of rtn (call isGeometryRelease)
+ */
+static isGeometry_t *reduceRegionSetUp(isImageBufType *raw, isImageBufType *rtn, isWorkerContext_t *wctx, int x, int y, int winWidth, int winHeight, int dstWidth, int dstHeight, reduce_mode_type mode) {
+  static const char *id = FILEID "reduceRegionSetUp";
+  int image_depth;
+  int depth;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  image_depth = json_integer_value(json_object_get(raw->meta, "image_depth"));
+  pthread_mutex_unlock(&wctx->metaMutex);
+  if (image_depth != 2 && image_depth != 4) {
+    isLogging_err("%s: bad image depth %d.  Likely this is a serious error somewhere\n", id, image_depth);
+    exit (-1);
   }
 
-  // Now for the spot counter
-  spots = 0;
-  ice_spots = 0;
+  depth = mode == REDUCE_SUM ? 4 : image_depth;
 
-  for (row=0; row < dstHeight; row++) {
-    for (col=0; col<dstWidth; col++) {
-      pxl = *(dstBuf + row*dstWidth + col);
-      
-      bin = get_bin_number(dst, col, row);
-      
-      if ((pxl - dst->bins[bin].mean) > (IS_SPOT_SENSITIVITY * dst->bins[bin].rms)) {
-        if (bin < IS_OUTPUT_IMAGE_BINS) {
-          spots++;
-        } else {
-          ice_spots++;
-        }
-      }
-    }
+  rtn->buf_size = dstWidth * dstHeight * depth;
+  rtn->buf = calloc(1, rtn->buf_size);
+  if (rtn->buf == NULL) {
+    isLogging_crit("%s: Out of memory\n", id);
+    exit (-1);
   }
 
-  if (dstHeight > 128) {
-    isLogging_info("%s: spots: %d   n: %d  mean: %f  rms: %f  stddev: %f\n",
-            id, spots,
-            (int)json_integer_value(json_object_get(dst->meta, "n")),
-            (double)json_real_value(json_object_get(dst->meta, "mean")),
-            (double)json_real_value(json_object_get(dst->meta, "rms")),
-            (double)json_real_value(json_object_get(dst->meta, "stddev")));
+  rtn->buf_width  = dstWidth;
+  rtn->buf_height = dstHeight;
+  rtn->buf_depth  = depth;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  rtn->meta = json_copy(raw->meta);
+  json_incref(rtn->meta);
+  set_json_object_string(id, rtn->meta, "reduce", "%s", isReduceModeName(mode));
+  set_json_object_integer(id, rtn->meta, "image_depth", depth);
+
+  set_up_bins(raw, rtn, winWidth, winHeight, x, y);
+  pthread_mutex_unlock(&wctx->metaMutex);
+  return isGeometryGet(wctx, raw, rtn, x, y, winWidth, winHeight, NULL);
+}
+
+/** Fill a reduced image buffer from (a rectangle of) a raw image
+ **
+ ** @param wctx       Our worker context
+ **
+ ** @param rc         Open redis context to local redis server
+ **
+ ** @param raw        Filled raw image.  We release it.
+ **
+ ** @param rtn        Write locked, empty, reduced image buffer.  Returns filled and unlocked (but still ours to release).
+ **
+ ** @param x          Left edge of the rectangle on the raw image
+ **
+ ** @param y          Top of the rectangle on the raw image
+ **
+ ** @param winWidth   Width of the rectangle
+ **
+ ** @param winHeight  Height of the rectangle
+ **
+ ** @param dstWidth   Width of the reduced image
+ **
+ ** @param dstHeight  Height of the reduced image
+ **
+ ** @param mode       How to pool the pixels that go into each reduced pixel
+ */
+void isReduceRegion(isWorkerContext_t *wctx, redisContext *rc, isImageBufType *raw, isImageBufType *rtn, int x, int y, int winWidth, int winHeight, int dstWidth, int dstHeight, reduce_mode_type mode) {
+  isImageBufType *src;                                                  // raw or one of its pyramid levels
+  isImageBufType view;                                                  // stands in for raw when we use a pyramid level
+  int level;                                                            // pyramid level we are reducing from
+  isGeometry_t *geometry;                                               // bin of each pixel of rtn
+
+  geometry = reduceRegionSetUp(raw, rtn, wctx, x, y, winWidth, winHeight, dstWidth, dstHeight, mode);
+
+  src = reducePyramidSource(wctx, raw, mode, &x, &y, &winWidth, &winHeight, dstWidth, dstHeight, &view, &level);
+
+  // Pyramid levels have no bad pixels
+  reduceImage(wctx, src, NULL, src->mask, rtn, geometry, x, y, winWidth, winHeight, mode, level);
+  isGeometryRelease(wctx, geometry);
+
+  // We don't need the raw buffer anymore
+  isReleaseImageBuf(wctx, raw);
+
+  //
+  // Let the other processes have it too.
+  //
+  isRedisPut(wctx, rc, rtn);
+  isShmPut(wctx, rtn);
+
+  //
+  // Let our other threads get to work.
+  //
+  isPublishImageBuf(wctx, rtn);
+}
+
+/** Fill a reduced image buffer from (a rectangle of) a raw image
+ ** that we read a block of rows at a time and never hold all at once
+ ** (see isOpenRawRows).  This is for reductions that are unlikely to
+ ** be followed by others of the same frame: caching the raw image
+ ** would only push more useful images out of the cache.
+ **
+ ** @param wctx       Our worker context
+ **
+ ** @param rc         Open redis context to local redis server
+ **
+ ** @param raw        Raw image meta data, dimensions, and mask (but no buffer)
+ **
+ ** @param rr         Reads the rows of raw
+ **
+ ** @param rtn        Write locked, empty, reduced image buffer.  Returns filled and unlocked (but still ours to release).
+ **
+ ** @param x          Left edge of the rectangle on the raw image
+ **
+ ** @param y          Top of the rectangle on the raw image
+ **
+ ** @param winWidth   Width of the rectangle
+ **
+ ** @param winHeight  Height of the rectangle
+ **
+ ** @param dstWidth   Width of the reduced image
+ **
+ ** @param dstHeight  Height of the reduced image
+ **
+ ** @param mode       How to pool the pixels that go into each reduced pixel
+ **
+ ** @returns 0 on success.  On failure rtn is emptied (but still write locked and ours) and we return -1.
+ */
+int isReduceRegionStream(isWorkerContext_t *wctx, redisContext *rc, isImageBufType *raw, isRowReader_t *rr, isImageBufType *rtn, int x, int y, int winWidth, int winHeight, int dstWidth, int dstHeight, reduce_mode_type mode) {
+  isGeometry_t *geometry;                                               // bin of each pixel of rtn
+  int err;
+
+  geometry = reduceRegionSetUp(raw, rtn, wctx, x, y, winWidth, winHeight, dstWidth, dstHeight, mode);
+  err = reduceImage(wctx, raw, rr, raw->mask, rtn, geometry, x, y, winWidth, winHeight, mode, 0);
+  isGeometryRelease(wctx, geometry);
+
+  if (err != 0) {
+    free(rtn->buf);
+    rtn->buf = NULL;
+    return -1;
   }
 
-  set_json_object_integer(id, dst->meta, "spots", spots);
+  isRedisPut(wctx, rc, rtn);
+  isShmPut(wctx, rtn);
+  isPublishImageBuf(wctx, rtn);
+  return 0;
 }
 
-            
 /** Image reduction is defined by a "zoom" and a "sector".
  **
  **  The width and height of the original image are divided by "zoom"
@@ -757,7 +2328,7 @@ void reduceImage32( isImageBufType *src, isImageBufType *dst, int x, int y, int
  **  Call with
  **
  **    @param wctx        Our worker contex:
- **      @li @c wctx->ctxMutex  Keep our parallel worlds from colliding
+ **      @li @c wctx->shards  Our image buffer cache
  **
  **    @param rc          Open redis context to local redis server
  **
@@ -769,31 +2340,34 @@ void reduceImage32( isImageBufType *src, isImageBufType *dst, int x, int y, int
  **      @li @c job->segrow See above for discussion of col/row/zoom
  **      @li @c job->xsize  Width of output image in pixels
  **      @li @c job->ysize  Height of output image in pixels
+ **      @li @c job->reduce "max" (default), "mean", "sum", or "median": how the pixels of each box are pooled
+ **      @li @c job->stream True when we'd rather not cache the raw frame: it is read a block of rows at a time unless it is cached or a single chunk (see isOpenRawRows)
  **
  **
  **  Return with
  **
- **    read locked buffer
+ **    filled buffer (call isReleaseImageBuf when done)
  */
 isImageBufType *isReduceImage(isWorkerContext_t *wctx, redisContext *rc, json_t *job) {
   static const char *id = FILEID "isReducedImage";
   isImageBufType *rtn;
   isImageBufType *raw;
+  isImageBufType rows;                  // raw frame without a buffer when streaming
+  isRowReader_t rr;
+  int err;
   double zoom;
   double segcol;
   double segrow;
   //  double seglen;
   const char *fn;
   int frame;
+  reduce_mode_type mode;
   char *reducedKey;
   int gid;
   int reducedKeyStrlen;
 
   int srcWidth;
   int srcHeight;
-  int image_depth;
-  int x;
-  int y;
   int winWidth;                                                         // width of input image to map to output image
   int winHeight;                                                        // height of input image to map to output image
   int dstWidth  = json_integer_value(json_object_get(job, "xsize"));    // width, in pixels, of output image
@@ -805,6 +2379,7 @@ isImageBufType *isReduceImage(isWorkerContext_t *wctx, redisContext *rc, json_t
   zoom   = json_number_value(json_object_get(job, "zoom"));
   segcol = json_number_value(json_object_get(job, "segcol"));
   segrow = json_number_value(json_object_get(job, "segrow"));
+  mode   = isReduceMode(json_string_value(json_object_get(job, "reduce")));
   
   //
   // Reality check on zoom
@@ -867,26 +2442,55 @@ isImageBufType *isReduceImage(isWorkerContext_t *wctx, redisContext *rc, json_t
     isLogging_crit("%s: Out of memory (reducedKey)\n", id);
     exit (-1);
   }
-  snprintf(reducedKey, reducedKeyStrlen, "%d:%s-%d-%0.1f-%0.3f-%0.3f-%d",
-           getegid(), fn, frame, zoom, segcol, segrow, dstWidth);
+  snprintf(reducedKey, reducedKeyStrlen, "%d:%s-%d-%0.1f-%0.3f-%0.3f-%d-%s",
+           getegid(), fn, frame, zoom, segcol, segrow, dstWidth, isReduceModeName(mode));
   reducedKey[reducedKeyStrlen] = 0;
  
-  rtn = isGetImageBufFromKey(wctx, rc, reducedKey);
+  rtn = isGetImageBufFromKey(wctx, rc, reducedKey, REDUCED_IMAGE_BUFFER);
 
   if (rtn == NULL || rtn->buf != NULL) {
     //
     // We either failed completely or succeeded without really trying.
-    // Either way we are done here.  When rtn is not null the buffer
-    // is read locked and in_use incremented.  Don't forget to release it.
+    // Either way we are done here.  When rtn is not null we hold a
+    // reference to the buffer.  Don't forget to release it with
+    // isReleaseImageBuf.
     //
     free(reducedKey);
     return rtn;
   }
 
   //
-  // Here we have a write locked buffer (with in_use = 1) with nothing in it.
+  // Here we have a write locked buffer (with a reference for us) with nothing in it.
   //
-  
+
+  //
+  // Stream frames that nobody has cached when asked to
+  //
+  if (json_is_true(json_object_get(job, "stream")) && isOpenRawRows(wctx, job, &rows, &rr) == 0) {
+    srcWidth  = json_integer_value(json_object_get(rows.meta, "x_pixels_in_detector"));
+    srcHeight = json_integer_value(json_object_get(rows.meta, "y_pixels_in_detector"));
+
+    dstHeight = (double)srcHeight * (double)dstWidth / (double)srcHeight;
+
+    winWidth  = srcWidth / zoom;
+    winHeight = srcHeight / zoom;
+
+    set_json_object_integer(id, rows.meta, "frame", frame);
+
+    err = isReduceRegionStream(wctx, rc, &rows, &rr, rtn, winWidth * segcol, winHeight * segrow, winWidth, winHeight, dstWidth, dstHeight, mode);
+    isCloseRawRows(wctx, &rows, &rr);
+
+    if (err != 0) {
+      isLogging_err("%s: Failed to stream raw data for %s\n", id, rtn->key);
+      isRedisAbandon(wctx, rc, rtn);
+      isAbandonImageBuf(wctx, rtn);
+      rtn = NULL;
+    }
+
+    free(reducedKey);
+    return rtn;
+  }
+
   // Get the unreduced file
   raw = isGetRawImageBuf(wctx, rc, job);
   if (raw == NULL) {
@@ -896,11 +2500,8 @@ isImageBufType *isReduceImage(isWorkerContext_t *wctx, redisContext *rc, json_t
     // of hell.  Presumably isGetRawImageBuf complained to the
     // authorities.
     //
-    pthread_rwlock_unlock(&rtn->buflock);
-    pthread_mutex_lock(&wctx->ctxMutex);
-    rtn->in_use--;
-    assert(rtn->in_use >= 0);
-    pthread_mutex_unlock(&wctx->ctxMutex);
+    isRedisAbandon(wctx, rc, rtn);
+    isAbandonImageBuf(wctx, rtn);
 
     free(reducedKey);
     return NULL;
@@ -909,73 +2510,20 @@ isImageBufType *isReduceImage(isWorkerContext_t *wctx, redisContext *rc, json_t
   // raw is the the raw data we'll be reducing.  rtn is the reduced
   // buffer we'll be filling.
   // 
-  // Here raw is read locked and rtn is write locked.
+  // Here raw is filled and rtn is write locked.
   //
+  pthread_mutex_lock(&wctx->metaMutex);
   srcWidth  = json_integer_value(json_object_get(raw->meta, "x_pixels_in_detector"));       // width, in pixels, of full input image
   srcHeight = json_integer_value(json_object_get(raw->meta, "y_pixels_in_detector"));       // height, in pixels, of full input image
+  set_json_object_integer(id, raw->meta, "frame", frame);
+  pthread_mutex_unlock(&wctx->metaMutex);
   
   dstHeight = (double)srcHeight * (double)dstWidth / (double)srcHeight;
 
-  image_depth = json_integer_value(json_object_get(raw->meta, "image_depth"));
-  if (image_depth != 2 && image_depth != 4) {
-    isLogging_err("%s: bad image depth %d.  Likely this is a serious error somewhere\n", id, image_depth);
-    exit (-1);
-  }
-
   winWidth  = srcWidth / zoom;
   winHeight = srcHeight / zoom;
 
-  rtn->buf_size = dstWidth * dstHeight * image_depth;
-  rtn->buf = calloc(1, rtn->buf_size);
-  if (rtn->buf == NULL) {
-    isLogging_crit("%s: Out of memory\n", id);
-    exit (-1);
-  }
-
-  rtn->buf_width  = dstWidth;
-  rtn->buf_height = dstHeight;
-  rtn->buf_depth  = image_depth;
-
-  set_json_object_integer(id, raw->meta, "frame", frame);
-
-  rtn->meta = json_copy(raw->meta);
-  json_incref(rtn->meta);
-
-  x = winWidth  * segcol;
-  y = winHeight * segrow;
-
-  set_up_bins(raw, rtn, winWidth, winHeight, x, y);
-
-  switch (image_depth) {
-  case 2:
-    reduceImage16(raw, rtn, x, y, winWidth, winHeight);
-    break;
-
-  case 4:
-    reduceImage32(raw, rtn, x, y, winWidth, winHeight);
-    break;
-
-  default:
-    isLogging_err("%s: Unusable image depth %d\n", id, image_depth);
-    exit (-1);
-  }
-
-  pthread_rwlock_unlock(&raw->buflock);
-
-  // We don't need the raw buffer anymore  pthread_mutex_lock(&wctx->ctxMutex);
-  raw->in_use--;
-  assert(raw->in_use >= 0);
-  pthread_mutex_unlock(&wctx->ctxMutex);
-
-  //
-  // Exchange our write lock for a read lock to let our other threads get to work.
-  //
-  pthread_rwlock_unlock(&rtn->buflock);
-  pthread_rwlock_rdlock(&rtn->buflock);
-  //
-  // Let the other processes get started on this one too.
-  //
-  //isWriteImageBufToRedis(rtn, rc);
+  isReduceRegion(wctx, rc, raw, rtn, winWidth * segcol, winHeight * segrow, winWidth, winHeight, dstWidth, dstHeight, mode);
 
   free(reducedKey);
   return rtn;
@@ -0,0 +1,670 @@
+/*! @file isShm.c
+ *  @copyright 2018 by Northwestern University All Rights Reserved
+ *  @author Keith Brister
+ *  @brief Image buffers shared by all the supervisors running for an ESAF
+ *
+ *  Each user/esaf combination gets its own supervisor process and,
+ *  hence, its own image buffer cache.  When several people from one
+ *  group look at the same data we'd end up reading and reducing the
+ *  same frames several times.  To avoid this the supervisors running
+ *  with a given gid share a POSIX shared memory segment
+ *  (/dev/shm/is-cache-v<IS_SHM_VERSION>-<gid>) that holds an index
+ *  of buffers.  The pixels for each buffer live in their own shared
+ *  memory object (/dev/shm/is-cache-v<IS_SHM_VERSION>-<gid>-<generation>)
+ *  that readers map read only.  An index given some other name (see
+ *  isShmInit) names its objects after itself the same way.
+ *
+ *  Removing a buffer from the index unlinks its object but does not
+ *  pull the rug out from under processes that still have it mapped:
+ *  the memory goes away when the last of them unmaps it.  The
+ *  reference counts in the index are used to keep buffers that are
+ *  being looked at from being chosen for eviction.
+ */
+#include "is.h"
+
+//! Change this when the layout of the index changes
+#define IS_SHM_VERSION 4
+
+//! Room for the name of an index (and so the prefix of its data objects)
+#define IS_SHM_NAME_LENGTH 64
+
+//! Identifies an initialized index
+#define IS_SHM_MAGIC 0x69734348
+
+//! Slot states
+#define IS_SHM_EMPTY   0        //!< Never used: ends a probe sequence
+#define IS_SHM_READY   1        //!< Holds a buffer
+#define IS_SHM_DELETED 2        //!< Used to hold a buffer: keep probing
+
+//! The pixels start on a boundary of this many bytes in the data object
+#define IS_SHM_BUF_ALIGN 64
+
+//! The mask bits start on a boundary of this many bytes in the data object
+#define IS_SHM_MASK_ALIGN 8
+
+//! Round n up to a multiple of a (a power of two)
+#define IS_SHM_ROUND_UP(n, a) (((n) + (a) - 1) & ~((size_t)(a) - 1))
+
+/** Description of one shared buffer.  The buffer data object holds
+ ** the meta data (as a JSON string) followed by the pixels (at
+ ** buf_offset) followed by the bad pixel mask bits (if any, at
+ ** mask_offset) and the mask's cache key (if any).  The offsets are
+ ** padded so the pixels and the mask bits are properly aligned.
+ */
+typedef struct isShmSlotStruct {
+  int state;                            //!< One of the IS_SHM_ states above
+  unsigned int hash;                    //!< hash of key
+  unsigned int generation;              //!< Names the data object
+  int refs;                             //!< Number of processes that have this buffer mapped
+  uint64_t tick;                        //!< When this buffer was last used (for LRU eviction)
+  time_t touched;                       //!< Wall clock time of last use (to recover from processes that died holding a reference)
+  image_buffer_class buf_class;         //!< raw or reduced
+  size_t size;                          //!< size of the data object
+  int meta_len;                         //!< length of the meta data string
+  int buf_offset;                       //!< where the pixels start (meta_len rounded up to IS_SHM_BUF_ALIGN)
+  int buf_size;                         //!< size of the pixel data
+  int mask_offset;                      //!< where the mask bits start (buf_offset + buf_size rounded up to IS_SHM_MASK_ALIGN)
+  int buf_width;                        //!< width in pixels
+  int buf_height;                       //!< height in pixels
+  int buf_depth;                        //!< bytes per pixel
+  int frame;                            //!< frame number
+  int mask_size;                        //!< size of the bad pixel mask bits (0 if none)
+  int mask_key_len;                     //!< size of the mask's cache key, including the terminating nul (0 if none)
+  char key[IS_SHM_KEY_LENGTH];          //!< our image buffer key
+} isShmSlot_t;
+
+/** The shared index
+ */
+struct isShmIndexStruct {
+  uint32_t magic;                       //!< IS_SHM_MAGIC once initialized
+  uint32_t version;                     //!< IS_SHM_VERSION
+  pthread_mutex_t mutex;                //!< Process shared, robust mutex protecting everything here
+  size_t budget;                        //!< Maximum number of bytes in data objects
+  size_t bytes;                         //!< Current number of bytes in data objects
+  uint64_t tick;                        //!< Incremented every time a buffer is used
+  unsigned int generation;              //!< Last data object generation handed out
+  int gid;                              //!< The group we belong to
+  char name[IS_SHM_NAME_LENGTH];        //!< Our shared memory object name: the data objects are <name>-<generation>
+  isShmSlot_t slots[IS_SHM_SLOTS];      //!< Our buffers
+};
+
+/** Lock the index.  Recover from a process that died holding the lock.
+ */
+static void isShmLock(isShmIndex_t *shm) {
+  static const char *id = FILEID "isShmLock";
+  int err;
+
+  err = pthread_mutex_lock(&shm->mutex);
+  if (err == EOWNERDEAD) {
+    //
+    // Whoever had this died.  The worst that can have happened is a
+    // slot with an inconsistent reference count or a data object
+    // that never made it into the index: nothing to lose sleep over.
+    //
+    isLogging_warning("%s: Previous owner of the shared cache lock died\n", id);
+    pthread_mutex_consistent(&shm->mutex);
+  } else if (err != 0) {
+    isLogging_crit("%s: Could not lock shared cache: %s\n", id, strerror(err));
+    exit (-1);
+  }
+}
+
+/** Name of the shared memory object for a given generation
+ */
+static void isShmDataName(isShmIndex_t *shm, unsigned int generation, char *name, int name_size) {
+  snprintf(name, name_size-1, "%s-%u", shm->name, generation);
+  name[name_size-1] = 0;
+}
+
+/** Find the slot holding key.
+ **
+ ** Call with the index locked.
+ **
+ ** @returns slot index or -1 if key is not there
+ */
+static int isShmFind(isShmIndex_t *shm, unsigned int hash, const char *key) {
+  int i;
+  int n;
+  isShmSlot_t *sp;
+
+  for (n=0, i=hash % IS_SHM_SLOTS; n<IS_SHM_SLOTS; n++, i=(i+1) % IS_SHM_SLOTS) {
+    sp = &shm->slots[i];
+    if (sp->state == IS_SHM_EMPTY) {
+      break;
+    }
+    if (sp->state == IS_SHM_READY && sp->hash == hash && strcmp(sp->key, key) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/** Throw out a buffer
+ **
+ ** Call with the index locked
+ */
+static void isShmRemove(isShmIndex_t *shm, int i) {
+  isShmSlot_t *sp;
+  char name[128];
+
+  sp = &shm->slots[i];
+  isShmDataName(shm, sp->generation, name, sizeof(name));
+  shm_unlink(name);
+  shm->bytes -= sp->size;
+  sp->state = IS_SHM_DELETED;
+  sp->refs  = 0;
+
+  //
+  // No probe sequence goes past an empty slot.  So when the next
+  // slot is empty nobody needs this one (or the deleted slots just
+  // before it) to keep probing: make them empty too so misses stay
+  // short.
+  //
+  if (shm->slots[(i+1) % IS_SHM_SLOTS].state == IS_SHM_EMPTY) {
+    while (shm->slots[i].state == IS_SHM_DELETED) {
+      shm->slots[i].state = IS_SHM_EMPTY;
+      i = (i + IS_SHM_SLOTS - 1) % IS_SHM_SLOTS;
+    }
+  }
+}
+
+/** Make room for need bytes by throwing out the least recently used
+ ** buffers that nobody is looking at.  Buffers whose users seem to
+ ** have died are fair game too.
+ **
+ ** Call with the index locked.
+ **
+ ** @returns 0 when there is room, -1 otherwise
+ */
+static int isShmEvict(isShmIndex_t *shm, size_t need) {
+  isShmSlot_t *sp;
+  int i;
+  int victim;
+  uint64_t oldest;
+  time_t now;
+
+  if (need > shm->budget) {
+    return -1;
+  }
+
+  now = time(NULL);
+  while (shm->bytes + need > shm->budget) {
+    victim = -1;
+    oldest = 0;
+    for (i=0; i<IS_SHM_SLOTS; i++) {
+      sp = &shm->slots[i];
+      if (sp->state != IS_SHM_READY) {
+        continue;
+      }
+      if (sp->refs > 0 && now - sp->touched < IS_SHM_STALE_SECONDS) {
+        continue;
+      }
+      if (victim == -1 || sp->tick < oldest) {
+        victim = i;
+        oldest = sp->tick;
+      }
+    }
+    if (victim == -1) {
+      return -1;
+    }
+    isShmRemove(shm, victim);
+  }
+  return 0;
+}
+
+/** Attach to (creating if need be) a shared buffer index
+ **
+ ** @param index_name  Shared memory object name of the index, NULL
+ **                    for our group's (/is-cache-v<IS_SHM_VERSION>-<gid>)
+ **
+ ** @returns the index or NULL if sharing is not possible.  We can
+ ** live without it.
+ */
+isShmIndex_t *isShmInit(const char *index_name) {
+  static const char *id = FILEID "isShmInit";
+  isShmIndex_t *rtn;
+  pthread_mutexattr_t matt;
+  char name[128];
+  char *budget_str;
+  char *endp;
+  struct stat sbuf;
+  int created;
+  int fd;
+  int i;
+  int err;
+
+  if (index_name == NULL) {
+    snprintf(name, sizeof(name)-1, "/is-cache-v%d-%d", IS_SHM_VERSION, (int)getegid());
+    name[sizeof(name)-1] = 0;
+  } else if (strlen(index_name) < IS_SHM_NAME_LENGTH) {
+    strcpy(name, index_name);
+  } else {
+    isLogging_err("%s: Shared cache name %s is too long\n", id, index_name);
+    return NULL;
+  }
+
+  created = 1;
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0660);
+  if (fd == -1 && errno == EEXIST) {
+    created = 0;
+    fd = shm_open(name, O_RDWR, 0660);
+  }
+  if (fd == -1) {
+    isLogging_err("%s: Could not open shared cache %s: %s\n", id, name, strerror(errno));
+    return NULL;
+  }
+
+  if (created) {
+    //
+    // Our umask may have been more restrictive than we'd like.  Every
+    // member of the group needs to get at this.
+    //
+    fchmod(fd, 0660);
+    err = ftruncate(fd, sizeof(*rtn));
+    if (err == -1) {
+      isLogging_err("%s: Could not size shared cache %s: %s\n", id, name, strerror(errno));
+      close(fd);
+      shm_unlink(name);
+      return NULL;
+    }
+  } else {
+    //
+    // Give whoever created the segment a moment to size it
+    //
+    for (i=0; i<100; i++) {
+      if (fstat(fd, &sbuf) == 0 && sbuf.st_size == sizeof(*rtn)) {
+        break;
+      }
+      usleep(10000);
+    }
+    if (i == 100) {
+      isLogging_err("%s: Shared cache %s has the wrong size\n", id, name);
+      close(fd);
+      return NULL;
+    }
+  }
+
+  rtn = mmap(NULL, sizeof(*rtn), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (rtn == MAP_FAILED) {
+    isLogging_err("%s: Could not map shared cache %s: %s\n", id, name, strerror(errno));
+    return NULL;
+  }
+
+  if (created) {
+    pthread_mutexattr_init(&matt);
+    pthread_mutexattr_setpshared(&matt, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&matt, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&rtn->mutex, &matt);
+    pthread_mutexattr_destroy(&matt);
+
+    rtn->budget = IS_SHM_CACHE_BYTES;
+    budget_str = getenv("IS_SHM_CACHE_BYTES");
+    if (budget_str != NULL && *budget_str) {
+      rtn->budget = strtoull(budget_str, &endp, 0);
+      if (*endp != 0 || rtn->budget == 0) {
+        isLogging_err("%s: Ignoring bad value '%s' for IS_SHM_CACHE_BYTES\n", id, budget_str);
+        rtn->budget = IS_SHM_CACHE_BYTES;
+      }
+    }
+    rtn->gid     = getegid();
+    rtn->version = IS_SHM_VERSION;
+    strcpy(rtn->name, name);
+    __atomic_store_n(&rtn->magic, IS_SHM_MAGIC, __ATOMIC_RELEASE);
+  } else {
+    for (i=0; i<100 && __atomic_load_n(&rtn->magic, __ATOMIC_ACQUIRE) != IS_SHM_MAGIC; i++) {
+      usleep(10000);
+    }
+    if (i == 100 || rtn->version != IS_SHM_VERSION) {
+      isLogging_err("%s: Shared cache %s was never initialized\n", id, name);
+      munmap(rtn, sizeof(*rtn));
+      return NULL;
+    }
+  }
+
+  isLogging_info("%s: %s shared cache %s with a budget of %llu bytes\n", id, created ? "Created" : "Attached to", name, (unsigned long long)rtn->budget);
+  return rtn;
+}
+
+/** Detach from the shared index.  The index itself stays around for
+ ** the other supervisors in our group.
+ */
+void isShmDestroy(isShmIndex_t *shm) {
+  if (shm != NULL) {
+    munmap(shm, sizeof(*shm));
+  }
+}
+
+/** Throw out every buffer in the index and remove the index itself.
+ ** Processes still attached keep whatever they have mapped but nobody
+ ** new will find any of it.  Detach with isShmDestroy afterwards.
+ ** Used by isConvertTest to clean up its private index.
+ */
+void isShmUnlink(isShmIndex_t *shm) {
+  int i;
+
+  if (shm == NULL) {
+    return;
+  }
+
+  isShmLock(shm);
+  for (i=0; i<IS_SHM_SLOTS; i++) {
+    if (shm->slots[i].state == IS_SHM_READY) {
+      isShmRemove(shm, i);
+    }
+  }
+  shm_unlink(shm->name);
+  pthread_mutex_unlock(&shm->mutex);
+}
+
+/** Fill an empty image buffer from the shared cache.
+ **
+ ** @param wctx  Our worker context
+ **
+ ** @param imb   Write locked buffer, fresh from the cache, with no data
+ **
+ ** @returns 0 when imb now has data (mapped read only), -1 otherwise
+ */
+int isShmGet(isWorkerContext_t *wctx, isImageBufType *imb) {
+  static const char *id = FILEID "isShmGet";
+  isShmIndex_t *shm;
+  isShmSlot_t slot;
+  char name[128];
+  json_error_t jerr;
+  uint64_t *bits;
+  char *mask_key;
+  void *map;
+  int i;
+  int fd;
+
+  shm = wctx->shm;
+  if (shm == NULL || strlen(imb->key) >= IS_SHM_KEY_LENGTH) {
+    return -1;
+  }
+
+  isShmLock(shm);
+  i = isShmFind(shm, imb->hash, imb->key);
+  if (i < 0) {
+    pthread_mutex_unlock(&shm->mutex);
+    return -1;
+  }
+  shm->slots[i].refs++;
+  shm->slots[i].tick    = ++shm->tick;
+  shm->slots[i].touched = time(NULL);
+  slot = shm->slots[i];
+  pthread_mutex_unlock(&shm->mutex);
+
+  isShmDataName(shm, slot.generation, name, sizeof(name));
+
+  map = MAP_FAILED;
+  fd  = shm_open(name, O_RDONLY, 0);
+  if (fd != -1) {
+    map = mmap(NULL, slot.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+  }
+
+  if (map == MAP_FAILED) {
+    isLogging_err("%s: Could not map %s for %s: %s\n", id, name, imb->key, strerror(errno));
+    isShmRelease(wctx, i, slot.generation);
+    return -1;
+  }
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  imb->meta = json_loadb(map, slot.meta_len, 0, &jerr);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (imb->meta == NULL) {
+    isLogging_err("%s: Bad meta data for %s: %s\n", id, imb->key, jerr.text);
+    munmap(map, slot.size);
+    isShmRelease(wctx, i, slot.generation);
+    return -1;
+  }
+
+  imb->shm_map        = map;
+  imb->shm_map_size   = slot.size;
+  imb->shm_slot       = i;
+  imb->shm_generation = slot.generation;
+
+  imb->buf        = (char *)map + slot.buf_offset;
+  imb->buf_size   = slot.buf_size;
+  imb->buf_width  = slot.buf_width;
+  imb->buf_height = slot.buf_height;
+  imb->buf_depth  = slot.buf_depth;
+  imb->frame      = slot.frame;
+
+  //
+  // The other frames of this data set share our mask: only make our
+  // own copy if we haven't already seen it
+  //
+  imb->mask = NULL;
+  if (slot.mask_size > 0) {
+    bits     = (uint64_t *)((char *)map + slot.mask_offset);
+    mask_key = slot.mask_key_len > 0 ? (char *)bits + slot.mask_size : NULL;
+
+    imb->mask = mask_key ? isMaskCacheGet(wctx, mask_key) : NULL;
+    if (imb->mask == NULL) {
+      imb->mask = isMaskFromBits(slot.buf_width, slot.buf_height, bits);
+      if (mask_key) {
+        imb->mask = isMaskCachePut(wctx, mask_key, imb->mask);
+      }
+    }
+  }
+
+  return 0;
+}
+
+/** Is there a buffer for this key in shared memory?  (A quick check:
+ ** it may be gone by the time we look for it with isShmGet.)
+ **
+ ** @param wctx  Our worker context
+ **
+ ** @param key   The buffer's key
+ **
+ ** @param hash  The buffer's hash (as in isImageBufType)
+ **
+ ** @returns non-zero if it is there
+ */
+int isShmHas(isWorkerContext_t *wctx, const char *key, unsigned int hash) {
+  isShmIndex_t *shm;
+  int i;
+
+  shm = wctx->shm;
+  if (shm == NULL || strlen(key) >= IS_SHM_KEY_LENGTH) {
+    return 0;
+  }
+
+  isShmLock(shm);
+  i = isShmFind(shm, hash, key);
+  pthread_mutex_unlock(&shm->mutex);
+
+  return i >= 0;
+}
+
+/** Give up our reference to a shared buffer
+ **
+ ** @param wctx        Our worker context
+ **
+ ** @param slot        Index slot we got the buffer from
+ **
+ ** @param generation  Generation of the buffer (in case the slot has since been reused)
+ */
+void isShmRelease(isWorkerContext_t *wctx, int slot, unsigned int generation) {
+  isShmIndex_t *shm;
+  isShmSlot_t *sp;
+
+  shm = wctx->shm;
+  if (shm == NULL || slot < 0 || slot >= IS_SHM_SLOTS) {
+    return;
+  }
+
+  isShmLock(shm);
+  sp = &shm->slots[slot];
+  if (sp->state == IS_SHM_READY && sp->generation == generation && sp->refs > 0) {
+    sp->refs--;
+  }
+  pthread_mutex_unlock(&shm->mutex);
+}
+
+/** Share a freshly filled buffer with the other supervisors in our
+ ** group.  On success the private copy of the pixels is replaced by
+ ** the shared mapping so each group only pays for one copy.
+ **
+ ** @param wctx  Our worker context
+ **
+ ** @param imb   Write locked buffer that we just filled
+ */
+void isShmPut(isWorkerContext_t *wctx, isImageBufType *imb) {
+  static const char *id = FILEID "isShmPut";
+  isShmIndex_t *shm;
+  isShmSlot_t *sp;
+  char name[128];
+  char *meta_str;
+  char *map;
+  size_t meta_len;
+  size_t buf_offset;
+  size_t mask_offset;
+  size_t mask_size;
+  size_t mask_key_len;
+  size_t size;
+  unsigned int generation;
+  int slot;
+  int i;
+  int n;
+  int fd;
+  int err;
+
+  shm = wctx->shm;
+  if (shm == NULL || imb->buf == NULL || imb->shm_map != NULL || strlen(imb->key) >= IS_SHM_KEY_LENGTH) {
+    return;
+  }
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  meta_str = json_dumps(imb->meta, JSON_COMPACT | JSON_INDENT(0) | JSON_SORT_KEYS);
+  pthread_mutex_unlock(&wctx->metaMutex);
+  if (meta_str == NULL) {
+    return;
+  }
+
+  meta_len     = strlen(meta_str);
+  buf_offset   = IS_SHM_ROUND_UP(meta_len, IS_SHM_BUF_ALIGN);
+  mask_offset  = IS_SHM_ROUND_UP(buf_offset + imb->buf_size, IS_SHM_MASK_ALIGN);
+  mask_size    = imb->mask ? sizeof(uint64_t) * imb->mask->words * imb->mask->height : 0;
+  mask_key_len = imb->mask && imb->mask->key ? strlen(imb->mask->key) + 1 : 0;
+  size         = mask_offset + mask_size + mask_key_len;
+
+  //
+  // Reserve our space up front
+  //
+  isShmLock(shm);
+  if (isShmFind(shm, imb->hash, imb->key) >= 0 || isShmEvict(shm, size) != 0) {
+    //
+    // Someone beat us to it or there is no room at the inn
+    //
+    pthread_mutex_unlock(&shm->mutex);
+    free(meta_str);
+    return;
+  }
+  shm->bytes += size;
+  generation = ++shm->generation;
+  pthread_mutex_unlock(&shm->mutex);
+
+  isShmDataName(shm, generation, name, sizeof(name));
+
+  map = MAP_FAILED;
+  fd  = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0640);
+  if (fd != -1) {
+    fchmod(fd, 0640);
+    //
+    // Use fallocate rather than ftruncate so that a full /dev/shm
+    // gives us an error now rather than a SIGBUS later.
+    //
+    err = posix_fallocate(fd, 0, size);
+    if (err == 0) {
+      map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    } else {
+      errno = err;
+    }
+    close(fd);
+  }
+
+  if (map == MAP_FAILED) {
+    isLogging_err("%s: Could not create shared buffer %s for %s: %s\n", id, name, imb->key, strerror(errno));
+    shm_unlink(name);
+    isShmLock(shm);
+    shm->bytes -= size;
+    pthread_mutex_unlock(&shm->mutex);
+    free(meta_str);
+    return;
+  }
+
+  memcpy(map, meta_str, meta_len);
+  memcpy(map + buf_offset, imb->buf, imb->buf_size);
+  if (mask_size) {
+    memcpy(map + mask_offset, imb->mask->bits, mask_size);
+  }
+  if (mask_key_len) {
+    memcpy(map + mask_offset + mask_size, imb->mask->key, mask_key_len);
+  }
+  free(meta_str);
+  mprotect(map, size, PROT_READ);
+
+  isShmLock(shm);
+  //
+  // The first slot that isn't holding a buffer will do, whether it
+  // was never used or deleted
+  //
+  slot = -1;
+  if (isShmFind(shm, imb->hash, imb->key) < 0) {
+    for (n=0, i=imb->hash % IS_SHM_SLOTS; n<IS_SHM_SLOTS; n++, i=(i+1) % IS_SHM_SLOTS) {
+      if (shm->slots[i].state != IS_SHM_READY) {
+        slot = i;
+        break;
+      }
+    }
+  }
+
+  if (slot < 0) {
+    //
+    // Lost a race or the index is full.  Either way we keep our
+    // private copy.
+    //
+    shm->bytes -= size;
+    pthread_mutex_unlock(&shm->mutex);
+    shm_unlink(name);
+    munmap(map, size);
+    return;
+  }
+
+  sp = &shm->slots[slot];
+  sp->hash               = imb->hash;
+  sp->generation         = generation;
+  sp->refs               = 1;
+  sp->tick               = ++shm->tick;
+  sp->touched            = time(NULL);
+  sp->buf_class          = imb->buf_class;
+  sp->size               = size;
+  sp->meta_len           = meta_len;
+  sp->buf_offset         = buf_offset;
+  sp->buf_size           = imb->buf_size;
+  sp->mask_offset        = mask_offset;
+  sp->buf_width          = imb->buf_width;
+  sp->buf_height         = imb->buf_height;
+  sp->buf_depth          = imb->buf_depth;
+  sp->frame              = imb->frame;
+  sp->mask_size          = mask_size;
+  sp->mask_key_len       = mask_key_len;
+  strcpy(sp->key, imb->key);
+  sp->state              = IS_SHM_READY;
+  pthread_mutex_unlock(&shm->mutex);
+
+  //
+  // Trade our private copy for the shared one (we keep our reference
+  // to the mask)
+  //
+  free(imb->buf);
+  imb->shm_map        = map;
+  imb->shm_map_size   = size;
+  imb->shm_slot       = slot;
+  imb->shm_generation = generation;
+  imb->buf            = map + buf_offset;
+}
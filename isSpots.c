@@ -8,7 +8,7 @@
 /** Count the spots in an image
  **
  ** @param wctx Worker context
- **  @li @c wctx->ctxMutex  Keeps the worker theads in line
+ **  @li @c wctx->shards  Our image buffer cache
  **
  ** @param tcp Thread data
  **   @li @c tcp->rep  ZMQ Response socket into which to throw our response.
@@ -19,6 +19,7 @@
  ** @param rqstObj.esaf        {Inteter}    - experiment id to which this image belongs
  ** @param rqstObj.fn          {String}     - file name
  ** @param rqstObj.frame       {Integer}    - Frame number to return
+ ** @param rqstObj.stream      {Boolean}    - Set here: the raw frame is streamed rather than cached
  ** @param rqstObj.tag         {String}     - ID for us to know what to do with the result
  ** @param rqstObj.type        {String}     - "SPOTS"
  ** @param rqstObj.xsize       {Integer}    - Requested width of resulting jpeg (pixels)
@@ -67,7 +68,11 @@ void isSpots(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
   set_json_object_real(id, job, "segrow", 0.0);
   set_json_object_real(id, job, "zoom", 1.0);
 
-  // when isReduceImage returns a buffer it is read locked
+  // Spot finding sweeps through a data set once: reading each raw
+  // frame into the cache would only push out the ones being viewed
+  json_object_set_new(job, "stream", json_true());
+
+  // when isReduceImage returns a buffer it is filled and ours to release
   imb = isReduceImage(wctx, tcp->rc, job);
   if (imb == NULL) {
     char *tmps;
@@ -150,12 +155,5 @@ void isSpots(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
     }
   } while (0);
 
-  pthread_rwlock_unlock(&imb->buflock);
-
-  pthread_mutex_lock(&wctx->ctxMutex);
-  imb->in_use--;
-
-  assert(imb->in_use >= 0);
-
-  pthread_mutex_unlock(&wctx->ctxMutex);
+  isReleaseImageBuf(wctx, imb);
 }
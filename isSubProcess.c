@@ -23,15 +23,20 @@
  */
 void isSubProcess(const char *cid, isSubProcess_type *spt, pthread_mutex_t *mutex) {
   static const char *id = FILEID "isSubProcess";
-  redisAsyncContext *subac;  
-  redisAsyncContext *statac;
+  //
+  // The callbacks below use these.  They are static (one set per
+  // thread) so the callbacks need no trampolines and so no executable
+  // stack.
+  //
+  static __thread redisAsyncContext *subac;
+  static __thread redisAsyncContext *statac;
+  static __thread int c;        // process id of child process
+  static __thread int keep_on_truckin;  // flag to stay in the poll loop
   struct pollfd subfd;
   struct pollfd statfd;
-  int c;                 // process id of child process
   
   int max_fd;                   // largest file descriptor
   int err;                      // return value
-  int keep_on_truckin;          // flag to stay in the poll loop
   int pollstat;                 // result of poll command
   struct pollfd *polllist;      // list of fd's to send to poll
   int npoll;                    // number of active fd's in polllist
@@ -0,0 +1,165 @@
+/*! @file isTile.c
+ *  @copyright 2018 by Northwestern University All Rights Reserved
+ *  @author Keith Brister
+ *  @brief Render images as a grid of fixed size tiles
+ *
+ *  Rather than asking for an arbitrary zoom and segment of an image a
+ *  viewer may ask for IS_TILE_SIZE x IS_TILE_SIZE tiles on a fixed
+ *  grid.  Tiles at level n each cover IS_TILE_SIZE * 2^n raw pixels
+ *  on a side so level 0 is full resolution and each level up halves
+ *  it (just like the pyramid levels the tiles are reduced from).
+ *  Tile (tx, ty) at level n has its upper left hand corner at raw
+ *  pixel (tx * IS_TILE_SIZE * 2^n, ty * IS_TILE_SIZE * 2^n).
+ *
+ *  Each tile is cached on its own so panning only costs the tiles
+ *  that have just come into view.
+ */
+#include "is.h"
+
+/** Get the reduced image buffer for a tile.
+ **
+ ** @param wctx   Our worker context
+ **
+ ** @param rc     Open redis context to local redis server
+ **
+ ** @param job    Request from user.  We use the following properties here
+ **   @li @c job->fn     File name of the data we are interested in
+ **   @li @c job->frame  Requested frame.  Default is 1
+ **   @li @c job->level  Tile level (0 is full resolution)
+ **   @li @c job->tx     Tile column
+ **   @li @c job->ty     Tile row
+ **   @li @c job->reduce How to pool the pixels of each box (default "max")
+ **
+ ** @returns filled buffer (call isReleaseImageBuf) or NULL if there is no such tile
+ */
+isImageBufType *isTileImage(isWorkerContext_t *wctx, redisContext *rc, json_t *job) {
+  static const char *id = FILEID "isTileImage";
+  isImageBufType *rtn;
+  isImageBufType *raw;
+  const char *fn;
+  char *key;
+  int key_strlen;
+  int frame;
+  int level;
+  int tx;
+  int ty;
+  int span;
+  reduce_mode_type mode;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  fn    = json_string_value(json_object_get(job, "fn"));
+  frame = json_integer_value(json_object_get(job, "frame"));
+  level = json_integer_value(json_object_get(job, "level"));
+  tx    = json_integer_value(json_object_get(job, "tx"));
+  ty    = json_integer_value(json_object_get(job, "ty"));
+  mode  = isReduceMode(json_string_value(json_object_get(job, "reduce")));
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (fn == NULL || *fn == 0) {
+    isLogging_err("%s: Cannot find file name in job\n", id);
+    return NULL;
+  }
+
+  frame = frame <= 0 ? 1 : frame;
+
+  if (level < 0 || level > IS_PYRAMID_LEVELS || tx < 0 || ty < 0) {
+    isLogging_err("%s: Bad tile level %d or coordinates (%d, %d)\n", id, level, tx, ty);
+    return NULL;
+  }
+
+  span = IS_TILE_SIZE << level;         // raw pixels covered by one side of our tile
+
+  key_strlen = strlen(fn) + 128;
+  key = calloc(1, key_strlen + 1);
+  if (key == NULL) {
+    isLogging_crit("%s: Out of memory (key)\n", id);
+    exit (-1);
+  }
+  snprintf(key, key_strlen, "%d:%s-%d-tile-%d-%d-%d-%s", getegid(), fn, frame, level, tx, ty, isReduceModeName(mode));
+  key[key_strlen] = 0;
+
+  rtn = isGetImageBufFromKey(wctx, rc, key, REDUCED_IMAGE_BUFFER);
+  free(key);
+
+  if (rtn == NULL || rtn->buf != NULL) {
+    // Failed completely or found it: either way we're done
+    return rtn;
+  }
+
+  //
+  // Here we have a write locked buffer (with a reference for us) with nothing in it.
+  //
+  raw = isGetRawImageBuf(wctx, rc, job);
+  if (raw == NULL) {
+    isLogging_err("%s: Failed to get raw data for %s\n", id, rtn->key);
+    isRedisAbandon(wctx, rc, rtn);
+    isAbandonImageBuf(wctx, rtn);
+    return NULL;
+  }
+
+  if ((int64_t)tx * span >= raw->buf_width || (int64_t)ty * span >= raw->buf_height) {
+    isLogging_err("%s: Tile (%d, %d) at level %d is off the image\n", id, tx, ty, level);
+    isReleaseImageBuf(wctx, raw);
+    isRedisAbandon(wctx, rc, rtn);
+    isAbandonImageBuf(wctx, rtn);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  set_json_object_integer(id, raw->meta, "frame", frame);
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  isReduceRegion(wctx, rc, raw, rtn, tx * span, ty * span, span, span, IS_TILE_SIZE, IS_TILE_SIZE, mode);
+
+  return rtn;
+}
+
+/** Create a jpeg rendering of one tile of a diffraction image
+ **
+ ** @param wctx Worker context
+ **  @li @c wctx->shards  Our image buffer cache
+ **
+ ** @param tcp Thread data
+ **   @li @c tcp->rep  ZMQ Response socket into which the throw our response.
+ **
+ ** @param job             {Object}     - Description of what is requested
+ ** @param job.contrast    {Integer}    - Image data >= this are black (default: the IS_AUTO_BLACK_PERCENTILE percentile)
+ ** @param job.esaf        {Inteter}    - experiment id to which this image belongs
+ ** @param job.fn          {String}     - file name
+ ** @param job.frame       {Integer}    - Frame number to return
+ ** @param job.label       {String}     - Text to add to the image perhaps identifying the image
+ ** @param job.labelHeight {Integer}    - Height of the label in pixels
+ ** @param job.level       {Integer}    - Tile level: each tile covers IS_TILE_SIZE * 2^level raw pixels on a side
+ ** @param job.reduce      {String}     - "max" (default), "mean", "sum", or "median"
+ ** @param job.tag         {String}     - ID for us to know what to do with the result
+ ** @param job.tx          {Integer}    - Tile column (0 is the left edge)
+ ** @param job.ty          {Integer}    - Tile row (0 is the top edge)
+ ** @param job.type        {String}     - "TILE"
+ ** @param job.wval        {Integer}    - Image data <= this are white (negative for the IS_AUTO_WHITE_PERCENTILE percentile)
+ */
+void isTile(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
+  static const char *id = FILEID "isTile";
+  isImageBufType *imb;
+  char *tmps;
+
+  // when isTileImage returns a buffer it is filled and ours to release
+  imb = isTileImage(wctx, tcp->rc, job);
+  if (imb == NULL) {
+    pthread_mutex_lock(&wctx->metaMutex);
+    tmps = json_dumps(job, JSON_SORT_KEYS | JSON_COMPACT | JSON_INDENT(0));
+    pthread_mutex_unlock(&wctx->metaMutex);
+
+    isLogging_err("%s: missing data for job %s\n", id, tmps);
+    free(tmps);
+
+    // Blank tiles are tile sized
+    pthread_mutex_lock(&wctx->metaMutex);
+    set_json_object_integer(id, job, "xsize", IS_TILE_SIZE);
+    pthread_mutex_unlock(&wctx->metaMutex);
+
+    isJpegBlank(wctx, tcp, job);
+    return;
+  }
+
+  isJpegRender(wctx, tcp, job, imb);
+}
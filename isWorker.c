@@ -20,6 +20,67 @@ void signal_action(int sig, siginfo_t *si, void *dummy) {
   }
 }
 
+/** Do one job, sending the reply to tcp->rep
+ **
+ ** @param wctx  Our worker context
+ **
+ ** @param tcp   Our thread context
+ **
+ ** @param job   The job
+ */
+void isWorkerDispatch(isWorkerContext_t *wctx, isThreadContextType *tcp, json_t *job) {
+  static const char *id = FILEID "isWorkerDispatch";
+  char *jobstr;
+  const char *job_type;
+
+  pthread_mutex_lock(&wctx->metaMutex);
+  jobstr = json_dumps(job, JSON_INDENT(0) | JSON_COMPACT | JSON_SORT_KEYS);
+  job_type = json_string_value(json_object_get(job, "type"));
+  pthread_mutex_unlock(&wctx->metaMutex);
+
+  if (job_type == NULL) {
+    isLogging_err("%s: No type parameter in job %s\n", id, jobstr);
+    is_zmq_error_reply(NULL, 0, tcp->rep, "%s: No type parameter in job %s", id, jobstr);
+  } else {
+    // Cheapo command parser.  Probably the best way to go considering
+    // the small number of commands we'll likely have to service.
+    //
+    if (strcasecmp("jpeg", job_type) == 0) {
+      isJpeg(wctx, tcp, job);
+    } else if (strcasecmp("index", job_type) == 0) {
+      isIndex(wctx, tcp, job);
+    } else if (strcasecmp("spots", job_type) == 0) {
+      isSpots(wctx, tcp, job);
+    } else if (strcasecmp("tile", job_type) == 0) {
+      isTile(wctx, tcp, job);
+    } else if (strcasecmp("raw", job_type) == 0) {
+      isRaw(wctx, tcp, job);
+    } else if (strcasecmp("filmstrip", job_type) == 0) {
+      isFilmstrip(wctx, tcp, job);
+    } else if (strcasecmp("batch", job_type) == 0) {
+      isBatch(wctx, tcp, job);
+    } else if (strcasecmp("rsync_host_test", job_type) == 0 ||
+	       strcasecmp("rsync_connection_test", job_type) == 0 ||
+	       strcasecmp("local_dir_stats", job_type) == 0 ||
+	       strcasecmp("rsync_transfer", job_type) == 0) {
+      // Rsync-related jobs and any other discontinued message types are
+      // caught and handled here.
+      isLogging_err("%s: Obsolete job type '%s' in job '%s'\n",
+		    id, job_type, jobstr);
+      is_zmq_error_reply(NULL, 0, tcp->rep,
+			 "%s: Obsolete job type '%s' in job '%s'",
+			 id, job_type, jobstr);
+    } else {
+      isLogging_err("%s: Unknown job type '%s' in job '%s'\n",
+		    id, job_type, jobstr);
+      is_zmq_error_reply(NULL, 0, tcp->rep,
+			 "%s: Unknown job type '%s' in job '%s'",
+			 id, job_type, jobstr);
+    }
+  }
+  free(jobstr);
+}
+
 /** Dispatch jobs sent from the supervisor via zmq
  **
  ** @param voidp  opaque pointer to our worker context
@@ -30,8 +91,6 @@ void *isWorker(void *voidp) {
   isWorkerContext_t *wctx;
   json_t *job;
   json_error_t jerr;
-  char *jobstr;
-  const char *job_type;
   char dealer_endpoint[128];
   zmq_msg_t zmsg;
   int err;
@@ -117,43 +176,13 @@ void *isWorker(void *voidp) {
       continue;
     }
 
-    pthread_mutex_lock(&wctx->metaMutex);
-    jobstr = json_dumps(job, JSON_INDENT(0) | JSON_COMPACT | JSON_SORT_KEYS);
-    job_type = json_string_value(json_object_get(job, "type"));
-    pthread_mutex_unlock(&wctx->metaMutex);
+    //
+    // The prefetch threads stay out of our way while we are busy.
+    //
+    __atomic_add_fetch(&wctx->interactive, 1, __ATOMIC_RELAXED);
+    isWorkerDispatch(wctx, &tc, job);
+    __atomic_sub_fetch(&wctx->interactive, 1, __ATOMIC_RELAXED);
 
-    if (job_type == NULL) {
-      isLogging_err("%s: No type parameter in job %s\n", id, jobstr);
-      is_zmq_error_reply(NULL, 0, tc.rep, "%s: No type parameter in job %s", id, jobstr);
-    } else {
-      // Cheapo command parser.  Probably the best way to go considering
-      // the small number of commands we'll likely have to service.
-      if (strcasecmp("jpeg", job_type) == 0) {
-        isJpeg(wctx, &tc, job);
-      } else if (strcasecmp("index", job_type) == 0) {
-        isIndex(wctx, &tc, job);
-      } else if (strcasecmp("spots", job_type) == 0) {
-        isSpots(wctx, &tc, job);
-      } else if (strcasecmp("rsync_host_test", job_type) == 0 ||
-		 strcasecmp("rsync_connection_test", job_type) == 0 ||
-		 strcasecmp("local_dir_stats", job_type) == 0 ||
-		 strcasecmp("rsync_transfer", job_type) == 0) {
-	// Rsync-related jobs and any other discontinued message types are
-	// caught and handled here.
-	isLogging_err("%s: Obsolete job type '%s' in job '%s'\n",
-		      id, job_type, jobstr);
-        is_zmq_error_reply(NULL, 0, tc.rep,
-			   "%s: Obsolete job type '%s' in job '%s'",
-			   id, job_type, jobstr);
-      } else {
-        isLogging_err("%s: Unknown job type '%s' in job '%s'\n",
-		      id, job_type, jobstr);
-        is_zmq_error_reply(NULL, 0, tc.rep,
-			   "%s: Unknown job type '%s' in job '%s'",
-			   id, job_type, jobstr);
-      }
-    }
-    free(jobstr);
     pthread_mutex_lock(&wctx->metaMutex);
     json_decref(job);
     pthread_mutex_unlock(&wctx->metaMutex);
@@ -187,7 +216,11 @@ void isSupervisor(const char *key) {
   sigaction( SIGINT,  &si, NULL);
 
   running = 1;
-  wctx = isDataInit(key);
+  isKernelsInit();
+  wctx = isDataInit(key, NULL);
+
+  // Help for the workers with big computations
+  isPoolInit(wctx);
 
   // Start up some workers
   for (i=0; i<N_WORKER_THREADS; i++) {
@@ -200,6 +233,9 @@ void isSupervisor(const char *key) {
     }
   }
 
+  // And some help to get ahead of the users
+  isPrefetchInit(wctx, IS_PREFETCH_THREADS);
+
   zpollitems[0].socket = wctx->dealer;
   zpollitems[0].events = ZMQ_POLLIN;
 
@@ -243,6 +279,8 @@ void isSupervisor(const char *key) {
     }
   }
 
+  isPrefetchDestroy(wctx);
+
   // TODO: do we need to send a signal to the threads (pthreads_kill)?
 
   // Wait for the workers to stop
@@ -261,6 +299,8 @@ void isSupervisor(const char *key) {
     }
   }
 
+  isPoolDestroy(wctx);
+
   // free up the image buffers
   isDataDestroy(wctx);
   return;